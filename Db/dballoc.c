@@ -37,6 +37,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -65,6 +66,7 @@ static gint init_syn_vars(void* db);
 static gint init_extdb(void* db);
 static gint init_db_index_area_header(void* db);
 static gint init_logging(void* db);
+static gint init_cdc(void* db);
 static gint init_strhash_area(void* db, db_hash_area_header* areah);
 static gint init_hash_subarea(void* db, db_hash_area_header* areah, gint arraylength);
 static gint init_db_recptr_bitmap(void* db);
@@ -111,6 +113,10 @@ gint wg_init_db_memsegment(void* db, gint key, gint size) {
   dbh->initialadr=(gint)dbh; /* XXX: this assumes pointer size. Currently harmless
                              * because initialadr isn't used much. */
   dbh->key=key;  /* might be 0 if local memory used */
+  /* the start value is arbitrary: taking it from the clock makes it
+   * unlikely that a recreated database repeats the epochs of the old one */
+  dbh->epoch=(gint) (((size_t) time(NULL))<<8);
+  dbh->epochwatch=0;
 
 #ifdef CHECK
   if(((gint) dbh)%SUBAREA_ALIGNMENT_BYTES)
@@ -173,6 +179,7 @@ gint wg_init_db_memsegment(void* db, gint key, gint size) {
 
   /* index structures also user fixlen object storage:
    *   tnode area - contains index nodes
+   *   bnode area - contains B+tree index nodes
    *   index header area - contains index headers
    *   index template area - contains template headers
    *   index hash area - varlen storage for hash buckets
@@ -186,6 +193,13 @@ gint wg_init_db_memsegment(void* db, gint key, gint size) {
   tmp=make_subarea_freelist(db,&(dbh->tnode_area_header),0);
   if (tmp) {  show_dballoc_error(db," cannot initialize tnode area"); return -1; }
 
+  tmp=init_db_subarea(db,&(dbh->bnode_area_header),0,INITIAL_SUBAREA_SIZE);
+  if (tmp) {  show_dballoc_error(db," cannot create bnode area"); return -1; }
+  (dbh->bnode_area_header).fixedlength=1;
+  (dbh->bnode_area_header).objlength=sizeof(struct wg_bnode);
+  tmp=make_subarea_freelist(db,&(dbh->bnode_area_header),0);
+  if (tmp) {  show_dballoc_error(db," cannot initialize bnode area"); return -1; }
+
   tmp=init_db_subarea(db,&(dbh->indexhdr_area_header),0,MINIMAL_SUBAREA_SIZE);
   if (tmp) {  show_dballoc_error(db," cannot create index header area"); return -1; }
   (dbh->indexhdr_area_header).fixedlength=1;
@@ -243,6 +257,7 @@ gint wg_init_db_memsegment(void* db, gint key, gint size) {
 
 
   tmp=init_logging(db);
+  tmp=init_cdc(db);
  /* tmp=init_db_subarea(db,&(dbh->logging_area_header),0,INITIAL_SUBAREA_SIZE);
   if (tmp) {  show_dballoc_error(db," cannot create logging area"); return -1; }
   (dbh->logging_area_header).fixedlength=0;
@@ -406,6 +421,28 @@ static gint init_logging(void* db) {
   dbh->logging.dirty = 0;
   dbh->logging.serial = 1; /* non-zero, so that zero value in db handle
                             * indicates uninitialized state. */
+  dbh->logging.checkpoint = 0;
+  dbh->logging.checkpoint_limit = 0;
+  dbh->logging.replica_of = 0;
+  dbh->logging.replica_promote = 0;
+  dbh->logging.replica_pos = 0;
+  dbh->logging.replica_ino = 0;
+  return 0;
+}
+
+/** initializes change data capture area
+*  the ring is allocated when capturing is enabled
+*/
+static gint init_cdc(void* db) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  gint i;
+  dbh->cdc.active = 0;
+  dbh->cdc.ring = 0;
+  dbh->cdc.capacity = 0;
+  dbh->cdc.allocated = 0;
+  dbh->cdc.head = 1; /* zero cursor marks a free subscriber slot */
+  for(i=0; i<WG_CDC_MAX_SUBSCRIBERS; i++)
+    dbh->cdc.cursor[i] = 0;
   return 0;
 }
 
@@ -415,12 +452,24 @@ static gint init_logging(void* db) {
 static gint init_strhash_area(void* db, db_hash_area_header* areah) {
   db_memsegment_header* dbh = dbmemsegh(db);
   gint arraylength;
+  gint i;
 
   if(STRHASH_SIZE > 0.01 && STRHASH_SIZE < 50) {
     arraylength = (gint) ((dbh->size+1) * (STRHASH_SIZE/100.0)) / sizeof(gint);
   } else {
     arraylength = DEFAULT_STRHASH_LENGTH;
   }
+  /* the array is indexed by the low bits of the hash */
+  for(i=16; i*2<=arraylength; i*=2);
+  arraylength = i;
+
+  dbh->strhash_growth.count = 0;
+  dbh->strhash_growth.limit = arraylength * STRHASH_MAX_LOAD;
+  dbh->strhash_growth.arrayobject = 0;
+  dbh->strhash_growth.oldstart = 0;
+  dbh->strhash_growth.oldlength = 0;
+  dbh->strhash_growth.oldobject = 0;
+  dbh->strhash_growth.moved = 0;
   return init_hash_subarea(db, areah, arraylength);
 }
 
@@ -1394,6 +1443,17 @@ gint wg_create_hash(void *db, db_hash_area_header* areah, gint size) {
   return 0;
 }
 
+/** Allocate an array from the free area of the segment.
+*  The array is aligned to SUBAREA_ALIGNMENT_BYTES and is never released.
+*  returns the offset of the array, 0 if there is not enough space.
+*/
+gint wg_alloc_segment_array(void *db, gint size) {
+  gint segmentchunk=alloc_db_segmentchunk(db,size);
+  if (!segmentchunk)
+    show_dballoc_error(db," cannot allocate array from the segment");
+  return segmentchunk;
+}
+
 /********** Helper functions for accessing the header ********/
 
 /*
@@ -1415,6 +1475,37 @@ gint wg_database_size(void *db) {
   return dbh->size;
 }
 
+/*
+ * Return the write epoch. It changes whenever records are created,
+ * deleted or their fields are set, including the lock-free atomic
+ * updates and transaction rollbacks, so a result computed from the
+ * data is still valid if the epoch has the same value as before
+ * computing it. A write transaction changes it once, when it ends.
+ *
+ * Until the epoch is read for the first time, the writers do not
+ * maintain it.
+ */
+gint wg_database_epoch(void *db) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  if(!dbh->epochwatch)
+    wg_compare_and_swap(&(dbh->epochwatch), 0, 1);
+  return dbh->epoch;
+}
+
+/*
+ * Change the write epoch. Called after the data has been modified:
+ * a reader that saw the old value will see a different one.
+ */
+void wg_bump_epoch(void *db) {
+  volatile gint *epoch = &(dbmemsegh(db)->epoch);
+  gint old;
+  if(!dbmemsegh(db)->epochwatch)
+    return; /* nobody compares the epochs */
+  do {
+    old = *epoch;
+  } while(!wg_compare_and_swap(epoch, old, old+1));
+}
+
 
 /* --------------- error handling ------------------------------*/
 
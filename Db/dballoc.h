@@ -166,6 +166,7 @@ Varlen allocation follows the main ideas of the Doug Lea allocator:
 
 /* defaults, used when there is no user-supplied or computed value */
 #define DEFAULT_STRHASH_LENGTH 10000  /** length of the strhash array (nr of array elements) */
+#define STRHASH_MAX_LOAD 2  /** strings per strhash array element before the array is grown */
 #define DEFAULT_IDXHASH_LENGTH 10000  /** hash index hash size */
 
 #define ANONCONST_TABLE_SIZE 200 /** length of the table containing predefined anonconst uri ptrs */
@@ -262,6 +263,7 @@ gcell;
 #else
 #define WG_TNODE_ARRAY_SIZE 8
 #endif
+#define WG_BNODE_ARRAY_SIZE 20    /** B+tree node is 512 bytes with 64-bit gint */
 
 /* logging related */
 #define maxnumberoflogrows 10
@@ -340,6 +342,8 @@ typedef struct {
   gint max_nodes;   /** number of cells in queue node storage */
   gint freelist;    /** db offset to the top of the allocation stack */
 #endif
+  gint field_lock;  /** serializes atomic updates done without CAS */
+  volatile gint wreleases; /** count of write lock releases */
 } syn_var_area;
 
 
@@ -355,6 +359,24 @@ typedef struct _db_hash_area_header {
   gint arraylength;    /** nr of elements in the hash array */
 } db_hash_area_header;
 
+
+/** strhash growth state
+*
+* The strhash array is doubled when it gets too full. The strings
+* are moved to the new array a few elements at a time while the
+* strhash is being modified.
+*/
+
+typedef struct {
+  gint count;          /** nr of strings in the strhash */
+  gint limit;          /** grow the array when count exceeds this */
+  gint arrayobject;    /** longstr area object holding the array, 0 if none */
+  gint oldstart;       /** array being moved to the new one, 0 if none */
+  gint oldlength;      /** nr of elements in the old array */
+  gint oldobject;      /** longstr area object holding the old array, 0 if none */
+  gint moved;          /** nr of old array elements moved so far */
+} db_strhash_growth;
+
 /**
  * T-tree specific index header fields
  */
@@ -366,6 +388,15 @@ struct __wg_ttree_header {
 #endif
 };
 
+/**
+ * B+tree specific index header fields
+ */
+struct __wg_btree_header {
+  gint offset_root_node;
+  gint offset_min_node;     /** first leaf */
+  gint offset_max_node;     /** last leaf */
+};
+
 /**
  * Hash-specific index header fields
  */
@@ -383,6 +414,7 @@ typedef struct {
   gint rec_field_index[MAX_INDEX_FIELDS]; /** field numbers for this index */
   union {
     struct __wg_ttree_header t;
+    struct __wg_btree_header b;
     struct __wg_hashidx_header h;
   } ctl;                    /** shared fields for different index types */
   gint template_offset;     /** matchrec template, 0 if full index */
@@ -433,9 +465,32 @@ typedef struct {
   gint active;          /** logging mode on/off */
   gint dirty;           /** log file is clean/dirty */
   gint serial;          /** incremented when the log file is backed up */
+  gint checkpoint;      /** number of the latest checkpoint */
+  gint checkpoint_limit; /** journal size that triggers a checkpoint */
+  gint replica_of;      /** key of the primary, 0 if not a replica */
+  gint replica_promote; /** promotion requested from another process */
+  gint replica_pos;     /** position applied in the primary journal */
+  gint replica_ino;     /** identifies the primary journal file */
 } db_logging_area_header;
 
 
+/** change data capture ring
+*
+*/
+
+#define WG_CDC_MAX_SUBSCRIBERS 16
+
+typedef struct {
+  gint active;          /** changes are published to the ring */
+  gint ring;            /** offset of the event ring, 0 if not allocated */
+  gint capacity;        /** number of events in the ring (power of 2) */
+  gint allocated;       /** capacity of the allocated ring */
+  volatile gint head;   /** sequence number of the next event */
+  volatile gint cursor[WG_CDC_MAX_SUBSCRIBERS]; /** next event of each
+                                                  * subscriber, 0 if free */
+} db_cdc_area_header;
+
+
 /** bitmap area header
 *
 */
@@ -475,6 +530,8 @@ typedef struct _db_memsegment_header {
   gint free;       /** pointer to first free area in segment (aligned) */
   gint initialadr; /** initial segment address, only valid for creator */
   gint key;        /** global shared mem key */
+  volatile gint epoch; /** write epoch, changed by every data modification */
+  volatile gint epochwatch; /** the epoch has been read and must be kept */
   // areas
   db_area_header datarec_area_header;
   db_area_header longstr_area_header;
@@ -484,14 +541,18 @@ typedef struct _db_memsegment_header {
   db_area_header doubleword_area_header;
   // hash structures
   db_hash_area_header strhash_area_header;
+  db_strhash_growth strhash_growth;
   // index structures
   db_index_area_header index_control_area_header;
   db_area_header tnode_area_header;
+  db_area_header bnode_area_header;
   db_area_header indexhdr_area_header;
   db_area_header indextmpl_area_header;
   db_area_header indexhash_area_header;
   // logging structures
   db_logging_area_header logging;
+  // change data capture
+  db_cdc_area_header cdc;
   // recptr bitmap
   db_recptr_bitmap_header recptr_bitmap;
   // anonconst table
@@ -511,6 +572,18 @@ typedef struct _db_memsegment_header {
 typedef struct {
   db_memsegment_header *db; /** shared memory header */
   void *logdata;            /** log data structure in local memory */
+  void *undodata;           /** write transaction undo log */
+  int index_deferred;       /** T-tree indexes are rebuilt later */
+  int dump_format;          /** format of the dumps (see wg_dump_format()) */
+  int dump_threads;         /** threads used to compress the dumps */
+  gint mapsize;             /** size of the mapped dump file, 0 if not mapped */
+  int mapshared;            /** the mapping writes through to the file */
+  int mapfd;                /** descriptor of the shared dump file */
+  void *cdcdata;            /** change events of the write transaction */
+  volatile gint tinystrtab;   /** table of decoded tiny strings */
+  volatile gint tinystrnodes; /** storage of the decoded tiny strings */
+  volatile gint tinystrring;  /** decoded tiny strings not in the table */
+  volatile gint tinystrpos;   /** next position in tinystrring */
 } db_handle;
 #endif
 
@@ -590,9 +663,12 @@ void *wg_create_child_db(void* db, gint size);
 #endif
 gint wg_register_external_db(void *db, void *extdb);
 gint wg_create_hash(void *db, db_hash_area_header* areah, gint size);
+gint wg_alloc_segment_array(void *db, gint size);
 
 gint wg_database_freesize(void *db);
 gint wg_database_size(void *db);
+gint wg_database_epoch(void *db);
+void wg_bump_epoch(void *db);
 
 /* ------- testing ------------ */
 
@@ -66,6 +66,31 @@ extern "C" {
 /* Illegal encoded data indicator */
 #define WG_ILLEGAL 0xff
 
+/* Atomic field operations */
+#define WG_ATOMIC_ADD 0
+#define WG_ATOMIC_MIN 1
+#define WG_ATOMIC_MAX 2
+
+/* Dump formats */
+#define WG_DUMP_FORMAT_RAW 0
+#define WG_DUMP_FORMAT_CHUNKED 1
+#define WG_DUMP_FORMAT_LZ 2
+
+/* Dump file mapping modes */
+#define WG_DUMP_MAP_PRIVATE 0
+#define WG_DUMP_MAP_SHARED 1
+
+/* Journal sync modes */
+#define WG_JOURNAL_SYNC_NONE 0
+#define WG_JOURNAL_SYNC_COMMIT 1
+#define WG_JOURNAL_SYNC_INTERVAL 2
+
+/* Change event types */
+#define WG_CDC_CREATE 1
+#define WG_CDC_DELETE 2
+#define WG_CDC_SET 3
+#define WG_CDC_OVERFLOW -2
+
 /* Query "arglist" parameters */
 #define WG_COND_EQUAL       0x0001      /** = */
 #define WG_COND_NOT_EQUAL   0x0002      /** != */
@@ -78,6 +103,7 @@ extern "C" {
 #define WG_QTYPE_TTREE      0x01
 #define WG_QTYPE_HASH       0x02
 #define WG_QTYPE_SCAN       0x04
+#define WG_QTYPE_BTREE      0x08
 #define WG_QTYPE_PREFETCH   0x80
 
 /* Direct access to field */
@@ -119,6 +145,16 @@ typedef struct {
   wg_uint res_count;        /** number of rows in results */
 } wg_query;
 
+/** Change event */
+typedef struct {
+  volatile wg_int seq;  /** sequence number */
+  wg_int op;            /** WG_CDC_CREATE, WG_CDC_DELETE or WG_CDC_SET */
+  wg_int record;        /** encoded record */
+  wg_int column;        /** field number */
+  wg_int oldval;        /** encoded value before the change */
+  wg_int newval;        /** encoded value after the change */
+} wg_cdc_event;
+
 /* prototypes of wg database api functions
 
 */
@@ -137,11 +173,13 @@ int wg_delete_database(char* dbasename); // deletes a database: returns 0 if OK
 
 void* wg_attach_local_database(wg_int size);
 void wg_delete_local_database(void* dbase);
+void* wg_attach_mapped_dump(char* fileName, wg_int size, int mode); /* use a dump file as a local database */
 
 /* ------- functions to query database state ------ */
 
 wg_int wg_database_freesize(void *db);
 wg_int wg_database_size(void *db);
+wg_int wg_database_epoch(void *db); /* changes with every data modification */
 
 /* -------- creating and scanning records --------- */
 
@@ -171,6 +209,12 @@ wg_int wg_set_str_field(void* db, void* record, wg_int fieldnr, char* data);
 wg_int wg_update_atomic_field(void* db, void* record, wg_int fieldnr, wg_int data, wg_int old_data);
 wg_int wg_set_atomic_field(void* db, void* record, wg_int fieldnr, wg_int data);
 wg_int wg_add_int_atomic_field(void* db, void* record, wg_int fieldnr, int data);
+wg_int wg_fetch_op_int_atomic_field(void* db, void* record, wg_int fieldnr,
+  wg_int op, wg_int data, wg_int *prev);
+wg_int wg_fetch_op_double_atomic_field(void* db, void* record, wg_int fieldnr,
+  wg_int op, double data, double *prev);
+wg_int wg_update_atomic_field_pair(void* db, void* record, wg_int fieldnr,
+  wg_int data1, wg_int data2, wg_int old1, wg_int old2);
 
 wg_int wg_get_field(void* db, void* record, wg_int fieldnr);      // returns 0 when error
 wg_int wg_get_field_type(void* db, void* record, wg_int fieldnr); // returns 0 when error
@@ -302,17 +346,41 @@ wg_int wg_decode_var(void* db, wg_int data);
 
 wg_int wg_dump(void * db,char* fileName); // dump shared memory database to the disk
 wg_int wg_import_dump(void * db,char* fileName); // import database from the disk
+wg_int wg_snapshot(void *db, char *fileName); /* dump without blocking writers */
+wg_int wg_dump_delta(void *db, char *prevFile, char *fileName); /* dump changed pages */
+wg_int wg_import_dump_deltas(void *db, char *fileName, char **deltaFiles,
+  wg_int count); /* import a dump and apply delta dumps */
+wg_int wg_dump_format(void *db, wg_int format, wg_int threads); /* set dump format */
 wg_int wg_start_logging(void *db); /* activate journal logging globally */
 wg_int wg_stop_logging(void *db); /* deactivate journal logging */
 wg_int wg_replay_log(void *db, char *filename); /* restore from journal */
+wg_int wg_log_sync_mode(void *db, wg_int mode, wg_int interval); /* set journal durability */
+wg_int wg_log_flush(void *db); /* write and sync pending journal entries */
+wg_int wg_checkpoint(void *db); /* dump image and start a new journal */
+wg_int wg_checkpoint_limit(void *db, wg_int size); /* journal size for automatic checkpoint */
+wg_int wg_restore_checkpoint(void *db); /* recover from checkpoint and journal */
+wg_int wg_replica_start(void *db, wg_int primary); /* follow the journal of another db */
+wg_int wg_replica_poll(void *db); /* apply the new journal entries */
+wg_int wg_replica_promote(void *db); /* stop following, start own journal */
+wg_int wg_replica_lag(void *db); /* journal bytes not applied yet */
 
 /* ---------- concurrency support  ---------- */
 
 wg_int wg_start_write(void * dbase);          /* start write transaction */
 wg_int wg_end_write(void * dbase, wg_int lock); /* end write transaction */
+wg_int wg_abort_write(void * dbase, wg_int lock); /* roll back write transaction */
 wg_int wg_start_read(void * dbase);           /* start read transaction */
 wg_int wg_end_read(void * dbase, wg_int lock);  /* end read transaction */
 
+/* ---------- change data capture ---------- */
+
+wg_int wg_cdc_enable(void *db, wg_int capacity); /* start capturing changes */
+wg_int wg_cdc_subscribe(void *db); /* returns subscriber id */
+wg_int wg_cdc_unsubscribe(void *db, wg_int sub);
+wg_int wg_cdc_read(void *db, wg_int sub, wg_cdc_event *events, wg_int max);
+wg_int wg_cdc_pending(void *db, wg_int sub); /* unread events */
+wg_int wg_cdc_backlog(void *db); /* unread events of the slowest subscriber */
+
 /* ------------- utilities ----------------- */
 
 void wg_print_db(void *db);
@@ -330,6 +398,8 @@ wg_query *wg_make_query(void *db, void *matchrec, wg_int reclen,
 #define wg_make_prefetch_query wg_make_query
 wg_query *wg_make_query_rc(void *db, void *matchrec, wg_int reclen,
   wg_query_arg *arglist, wg_int argc, wg_uint rowlimit);
+wg_query *wg_make_query_after(void *db, void *matchrec, wg_int reclen,
+  wg_query_arg *arglist, wg_int argc, void *after, wg_uint rowlimit);
 void *wg_fetch(void *db, wg_query *query);
 void wg_free_query(void *db, wg_query *query);
 
@@ -0,0 +1,428 @@
+/*
+* $Id:  $
+* $Version: $
+*
+* This file is part of WhiteDB
+*
+* WhiteDB is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* WhiteDB is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with WhiteDB.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+ /** @file dbcdc.c
+ *  Change data capture.
+ *
+ *  Changes to records are published as events to a ring buffer in
+ *  the shared memory segment. Each event is given a sequence number,
+ *  the head of the ring is the sequence number of the next event.
+ *  Subscribers (in any process attached to the database) keep their
+ *  own cursor in the segment and read the events without locking.
+ *
+ *  The writers never wait for the subscribers. When a subscriber
+ *  falls behind by more than the capacity of the ring, the events
+ *  are lost and the subscriber is told to resynchronize. The distance
+ *  of the slowest subscriber is available for the writers to
+ *  throttle themselves.
+ *
+ *  Events are published by the holder of the write lock. Inside
+ *  a write transaction, they are buffered in the database handle
+ *  and published when the transaction is committed.
+ */
+
+/* ====== Includes =============== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef _WIN32
+#include "../config-w32.h"
+#else
+#include "../config.h"
+#endif
+#include "dballoc.h"
+#include "dblock.h"
+
+/* ====== Private headers and defs ======== */
+
+#include "dbcdc.h"
+
+#define CDC_INITIAL_EVENTS 64
+
+#if defined(_WIN32)
+#define CDC_BARRIER MemoryBarrier()
+#elif defined(__GNUC__)
+#define CDC_BARRIER __sync_synchronize()
+#else
+#define CDC_BARRIER
+#endif
+
+#define cdc_data(d) ((db_handle_cdcdata *) (((db_handle *) d)->cdcdata))
+#define cdc_ring(d) ((wg_cdc_event *) offsettoptr(d, dbmemsegh(d)->cdc.ring))
+
+/* ======= Private protos ================ */
+
+static void publish_event(void *db, gint op, gint record, gint column,
+  gint oldval, gint newval);
+static gint check_subscriber(void *db, gint sub);
+
+static gint show_cdc_error(void *db, char *errmsg);
+
+/* ====== Functions ============== */
+
+/* ------------------- public API ------------------- */
+
+/** Start or stop capturing the changes.
+ *  capacity is the number of events kept in the ring, rounded up
+ *  to a power of two. 0 stops capturing.
+ *
+ *  The ring is allocated from the free area of the segment and is
+ *  reused if it is large enough. Changing the capacity discards
+ *  the events that have not been read yet.
+ *
+ *  Should not be called while other clients modify the database.
+ *  returns 0 on success, -1 on error.
+ */
+gint wg_cdc_enable(void *db, gint capacity) {
+  db_cdc_area_header *cdc;
+  wg_cdc_event *ring;
+  gint size, i;
+
+#ifdef CHECK
+  if (!dbcheck(db)) {
+    show_cdc_error(db, "wrong database pointer given to wg_cdc_enable");
+    return -1;
+  }
+#endif
+  cdc = &(dbmemsegh(db)->cdc);
+  if(capacity <= 0) {
+    cdc->active = 0;
+    return 0;
+  }
+
+  for(size=WG_CDC_MIN_CAPACITY; size<capacity; size*=2);
+  if(size != cdc->capacity) {
+    if(size > cdc->allocated) {
+      gint offset = wg_alloc_segment_array(db, size*sizeof(wg_cdc_event));
+      if(!offset)
+        return show_cdc_error(db, "cannot allocate the event ring");
+      cdc->ring = offset;
+      cdc->allocated = size;
+    }
+    ring = cdc_ring(db);
+    for(i=0; i<size; i++)
+      ring[i].seq = 0;
+    CDC_BARRIER;
+    cdc->capacity = size;
+  }
+  cdc->active = 1;
+  return 0;
+}
+
+/** Register a subscriber.
+ *  The subscriber will receive the events published after this call.
+ *  returns the subscriber id.
+ *  returns -1 if all the subscriber slots are in use.
+ */
+gint wg_cdc_subscribe(void *db) {
+  db_cdc_area_header *cdc;
+  gint i;
+
+#ifdef CHECK
+  if (!dbcheck(db)) {
+    show_cdc_error(db, "wrong database pointer given to wg_cdc_subscribe");
+    return -1;
+  }
+#endif
+  cdc = &(dbmemsegh(db)->cdc);
+  for(i=0; i<WG_CDC_MAX_SUBSCRIBERS; i++) {
+    if(!cdc->cursor[i] &&\
+      wg_compare_and_swap(&(cdc->cursor[i]), 0, cdc->head))
+      return i;
+  }
+  return show_cdc_error(db, "no free subscriber slots");
+}
+
+/** Release the subscriber slot.
+ *  returns 0 on success, -1 if the subscriber id is invalid.
+ */
+gint wg_cdc_unsubscribe(void *db, gint sub) {
+  if(check_subscriber(db, sub))
+    return -1;
+  dbmemsegh(db)->cdc.cursor[sub] = 0;
+  return 0;
+}
+
+/** Read the next events of the subscriber.
+ *  Copies at most max events to the array and advances the cursor
+ *  of the subscriber past them. Does not wait for new events.
+ *
+ *  Old values of fields and deleted records may refer to data that
+ *  has been released by the time the event is read. Only the
+ *  immediate values can be decoded safely.
+ *
+ *  returns the number of events copied.
+ *  returns WG_CDC_OVERFLOW if events were lost because the subscriber
+ *  fell behind. The cursor is moved to the current head.
+ *  returns -1 if the subscriber id is invalid.
+ */
+gint wg_cdc_read(void *db, gint sub, wg_cdc_event *events, gint max) {
+  db_cdc_area_header *cdc;
+  wg_cdc_event *ring, *slot;
+  gint cursor, head, mask, n, i;
+
+  if(check_subscriber(db, sub))
+    return -1;
+  cdc = &(dbmemsegh(db)->cdc);
+  cursor = cdc->cursor[sub];
+  head = cdc->head;
+  CDC_BARRIER;
+  if(!cdc->capacity || head == cursor)
+    return 0;
+  if(head - cursor > cdc->capacity)
+    goto overflow;
+
+  ring = cdc_ring(db);
+  mask = cdc->capacity - 1;
+  n = head - cursor;
+  if(n > max)
+    n = max;
+  for(i=0; i<n; i++) {
+    /* The slot is valid if its sequence number stays the same
+     * while the event is copied. */
+    slot = &ring[(cursor + i) & mask];
+    if(slot->seq != cursor + i)
+      goto overflow;
+    CDC_BARRIER;
+    events[i].op = slot->op;
+    events[i].record = slot->record;
+    events[i].column = slot->column;
+    events[i].oldval = slot->oldval;
+    events[i].newval = slot->newval;
+    CDC_BARRIER;
+    if(slot->seq != cursor + i)
+      goto overflow;
+    events[i].seq = cursor + i;
+  }
+  cdc->cursor[sub] = cursor + n;
+  return n;
+
+overflow:
+  cdc->cursor[sub] = cdc->head;
+  return WG_CDC_OVERFLOW;
+}
+
+/** Return the number of unread events of the subscriber.
+ *  A value larger than the capacity of the ring means that
+ *  the subscriber has lost events.
+ *  returns -1 if the subscriber id is invalid.
+ */
+gint wg_cdc_pending(void *db, gint sub) {
+  db_cdc_area_header *cdc;
+  gint cursor;
+
+  if(check_subscriber(db, sub))
+    return -1;
+  cdc = &(dbmemsegh(db)->cdc);
+  cursor = cdc->cursor[sub];
+  return (cursor ? cdc->head - cursor : -1);
+}
+
+/** Return the number of unread events of the slowest subscriber.
+ *  Writers can use this to slow down before the subscribers
+ *  start losing events.
+ */
+gint wg_cdc_backlog(void *db) {
+  db_cdc_area_header *cdc;
+  gint head, cursor, max = 0, i;
+
+#ifdef CHECK
+  if (!dbcheck(db)) {
+    show_cdc_error(db, "wrong database pointer given to wg_cdc_backlog");
+    return -1;
+  }
+#endif
+  cdc = &(dbmemsegh(db)->cdc);
+  head = cdc->head;
+  for(i=0; i<WG_CDC_MAX_SUBSCRIBERS; i++) {
+    cursor = cdc->cursor[i];
+    if(cursor && head - cursor > max)
+      max = head - cursor;
+  }
+  return max;
+}
+
+/* ------------------- capturing ------------------- */
+
+/** Make room for the events of a change.
+ *  Called before the database is modified, so that adding the
+ *  events cannot fail later.
+ *  returns 0 on success, -1 if the transaction buffer cannot be extended.
+ */
+gint wg_cdc_reserve(void *db, gint events) {
+  db_handle_cdcdata *cd = cdc_data(db);
+  gint need = cd->used + events;
+
+  if(cd->intran && need > cd->size) {
+    gint newsize = (cd->size ? cd->size : CDC_INITIAL_EVENTS);
+    wg_cdc_event *newbuf;
+    while(newsize < need)
+      newsize *= 2;
+    newbuf = (wg_cdc_event *) realloc(cd->buf,
+      newsize*sizeof(wg_cdc_event));
+    if(!newbuf)
+      return show_cdc_error(db, "Failed to extend the change event buffer");
+    cd->buf = newbuf;
+    cd->size = newsize;
+  }
+  return 0;
+}
+
+/** Capture a change.
+ *  The space must have been reserved with wg_cdc_reserve().
+ */
+void wg_cdc_event_add(void *db, gint op, gint record, gint column,
+  gint oldval, gint newval)
+{
+  db_handle_cdcdata *cd = cdc_data(db);
+
+  if(cd->intran) {
+    wg_cdc_event *ev = &(cd->buf[cd->used++]);
+    ev->op = op;
+    ev->record = record;
+    ev->column = column;
+    ev->oldval = oldval;
+    ev->newval = newval;
+  } else {
+    publish_event(db, op, record, column, oldval, newval);
+  }
+}
+
+/** Start buffering the events.
+ *  Called when the write lock has been acquired.
+ */
+void wg_cdc_start_transaction(void *db) {
+  db_handle_cdcdata *cd = cdc_data(db);
+  cd->used = 0;
+  cd->intran = 1;
+}
+
+/** Publish the events of the transaction.
+ *  Called before the write lock is released.
+ */
+void wg_cdc_commit_transaction(void *db) {
+  db_handle_cdcdata *cd = cdc_data(db);
+  gint i;
+
+  if(WG_CDC_ACTIVE(db)) {
+    for(i=0; i<cd->used; i++)
+      publish_event(db, cd->buf[i].op, cd->buf[i].record,
+        cd->buf[i].column, cd->buf[i].oldval, cd->buf[i].newval);
+  }
+  cd->used = 0;
+  cd->intran = 0;
+}
+
+/** Discard the events of the transaction.
+ */
+void wg_cdc_abort_transaction(void *db) {
+  db_handle_cdcdata *cd = cdc_data(db);
+  cd->used = 0;
+  cd->intran = 0;
+}
+
+/** Set up the event buffer in the database handle.
+ *  Normally called when opening the database connection.
+ */
+gint wg_init_handle_cdcdata(void *db) {
+  db_handle_cdcdata **cd = \
+    (db_handle_cdcdata **) &(((db_handle *) db)->cdcdata);
+  *cd = malloc(sizeof(db_handle_cdcdata));
+  if(!(*cd)) {
+    return show_cdc_error(db, "Error initializing the change event buffer");
+  }
+  memset(*cd, 0, sizeof(db_handle_cdcdata));
+  return 0;
+}
+
+/** Free the event buffer in the database handle.
+ *  Normally called when closing the database connection.
+ */
+void wg_cleanup_handle_cdcdata(void *db) {
+  db_handle_cdcdata *cd = cdc_data(db);
+  if(cd) {
+    if(cd->buf)
+      free(cd->buf);
+    free(cd);
+    ((db_handle *) db)->cdcdata = NULL;
+  }
+}
+
+/* ------------------- private functions ------------------- */
+
+/** Write an event to the ring.
+ *  The sequence number of the slot is cleared while the event
+ *  is being written so that the readers can detect a torn copy.
+ */
+static void publish_event(void *db, gint op, gint record, gint column,
+  gint oldval, gint newval)
+{
+  db_cdc_area_header *cdc = &(dbmemsegh(db)->cdc);
+  gint seq = cdc->head;
+  wg_cdc_event *slot = &(cdc_ring(db)[seq & (cdc->capacity - 1)]);
+
+  slot->seq = 0;
+  CDC_BARRIER;
+  slot->op = op;
+  slot->record = record;
+  slot->column = column;
+  slot->oldval = oldval;
+  slot->newval = newval;
+  CDC_BARRIER;
+  slot->seq = seq;
+  CDC_BARRIER;
+  cdc->head = seq + 1;
+}
+
+static gint check_subscriber(void *db, gint sub) {
+#ifdef CHECK
+  if (!dbcheck(db)) {
+    return show_cdc_error(db, "wrong database pointer given to cdc function");
+  }
+#endif
+  if(sub < 0 || sub >= WG_CDC_MAX_SUBSCRIBERS ||\
+    !dbmemsegh(db)->cdc.cursor[sub]) {
+    return show_cdc_error(db, "invalid subscriber id");
+  }
+  return 0;
+}
+
+static gint show_cdc_error(void *db, char *errmsg) {
+#ifdef WG_NO_ERRPRINT
+#else
+  fprintf(stderr,"wg cdc error: %s.\n", errmsg);
+#endif
+  return -1;
+}
+
+#ifdef __cplusplus
+}
+#endif
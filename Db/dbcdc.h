@@ -0,0 +1,84 @@
+/*
+* $Id:  $
+* $Version: $
+*
+* This file is part of WhiteDB
+*
+* WhiteDB is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* WhiteDB is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with WhiteDB.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+ /** @file dbcdc.h
+ * Public headers for change data capture.
+ */
+
+#ifndef DEFINED_DBCDC_H
+#define DEFINED_DBCDC_H
+
+#ifdef _WIN32
+#include "../config-w32.h"
+#else
+#include "../config.h"
+#endif
+#include "dballoc.h"
+
+/* ====== data structures ======== */
+
+#define WG_CDC_CREATE 1     /** record created (column is the length) */
+#define WG_CDC_DELETE 2     /** record deleted */
+#define WG_CDC_SET 3        /** field value changed */
+
+#define WG_CDC_OVERFLOW -2  /** events were lost, subscriber must resync */
+#define WG_CDC_MIN_CAPACITY 16
+
+/** Change event. The ring in the segment consists of these. */
+typedef struct {
+  volatile gint seq;  /** sequence number */
+  gint op;            /** WG_CDC_CREATE, WG_CDC_DELETE or WG_CDC_SET */
+  gint record;        /** encoded record */
+  gint column;        /** field number */
+  gint oldval;        /** encoded value before the change */
+  gint newval;        /** encoded value after the change */
+} wg_cdc_event;
+
+/** Events of the write transaction, kept in the local database handle */
+typedef struct {
+  wg_cdc_event *buf;
+  gint used;
+  gint size;
+  int intran;         /** write transaction in progress */
+} db_handle_cdcdata;
+
+#define WG_CDC_ACTIVE(d) (dbmemsegh(d)->cdc.active)
+
+/* ==== Protos ==== */
+
+gint wg_cdc_enable(void *db, gint capacity);
+gint wg_cdc_subscribe(void *db);
+gint wg_cdc_unsubscribe(void *db, gint sub);
+gint wg_cdc_read(void *db, gint sub, wg_cdc_event *events, gint max);
+gint wg_cdc_pending(void *db, gint sub);
+gint wg_cdc_backlog(void *db);
+
+gint wg_cdc_reserve(void *db, gint events);
+void wg_cdc_event_add(void *db, gint op, gint record, gint column,
+  gint oldval, gint newval);
+void wg_cdc_start_transaction(void *db);
+void wg_cdc_commit_transaction(void *db);
+void wg_cdc_abort_transaction(void *db);
+
+gint wg_init_handle_cdcdata(void *db);
+void wg_cleanup_handle_cdcdata(void *db);
+
+#endif /* DEFINED_DBCDC_H */
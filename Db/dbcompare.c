@@ -39,6 +39,19 @@ extern "C" {
 
 #include "dbcompare.h"
 
+#ifndef INT64_MIN
+#define INT64_MIN _I64_MIN /* MSVC */
+#endif
+
+#define KEY_VALUE_LIMIT (((gint) 1) << (WG_KEY_VALUE_BITS - 1))
+#define KEY_VALUE_MASK ((((wg_uint) 1) << WG_KEY_VALUE_BITS) - 1)
+
+/* ======= Private protos ================ */
+
+static wg_uint int_key(gint val);
+static wg_uint double_key(double val);
+static wg_uint bytes_key(const char *ext, const char *data, gint len);
+
 /* ====== Functions ============== */
 
 /** Compare two encoded values
@@ -187,11 +200,20 @@ gint wg_compare(void *db, gint a, gint b, int depth) {
        */
       char *deca, *decb, *exa=NULL, *exb=NULL;
       char buf[4];
+      char tinya[sizeof(gint)], tinyb[sizeof(gint)];
       gint res;
       if(typea==WG_STRTYPE) {
-        /* lang is ignored */
-        deca = wg_decode_str(db, a);
-        decb = wg_decode_str(db, b);
+        /* lang is ignored. Tiny strings are decoded locally. */
+        if(istinystr(a)) {
+          wg_decode_tinystr_copy(a, tinya);
+          deca = tinya;
+        } else
+          deca = wg_decode_str(db, a);
+        if(istinystr(b)) {
+          wg_decode_tinystr_copy(b, tinyb);
+          decb = tinyb;
+        } else
+          decb = wg_decode_str(db, b);
       }
       else if(typea==WG_URITYPE) {
         exa = wg_decode_uri_prefix(db, a);
@@ -269,6 +291,120 @@ gint wg_compare(void *db, gint a, gint b, int depth) {
     return (typea>typeb ? WG_GREATER : WG_LESSTHAN);
 }
 
+/** Order-preserving key prefix of an encoded value
+ *
+ * The type is stored in the highest byte and a prefix of the
+ * value in the rest of the key. If the keys of two values differ,
+ * comparing the keys gives the same result as wg_compare(). Equal
+ * keys mean that the values need to be compared with wg_compare().
+ */
+wg_uint wg_compare_key(void *db, gint enc) {
+  gint type = wg_get_encoded_type(db, enc);
+  wg_uint key = 0;
+  char *ext;
+
+  switch(type) {
+    case WG_INTTYPE:
+      key = int_key(wg_decode_int(db, enc));
+      break;
+    case WG_DOUBLETYPE:
+      key = double_key(wg_decode_double(db, enc));
+      break;
+    case WG_FIXPOINTTYPE:
+      key = double_key(wg_decode_fixpoint(db, enc));
+      break;
+    case WG_DATETYPE:
+      key = int_key(wg_decode_date(db, enc));
+      break;
+    case WG_TIMETYPE:
+      key = int_key(wg_decode_time(db, enc));
+      break;
+    case WG_VARTYPE:
+      key = int_key(wg_decode_var(db, enc));
+      break;
+    case WG_CHARTYPE:
+      key = ((wg_uint) (unsigned char) wg_decode_char(db, enc)) <<\
+        (WG_KEY_VALUE_BITS - 8);
+      break;
+    case WG_STRTYPE:
+      if(istinystr(enc)) {
+        char buf[sizeof(gint)];
+        wg_decode_tinystr_copy(enc, buf);
+        key = bytes_key(NULL, buf, -1);
+      } else {
+        key = bytes_key(NULL, wg_decode_str(db, enc), -1);
+      }
+      break;
+    case WG_XMLLITERALTYPE:
+      ext = wg_decode_xmlliteral_xsdtype(db, enc);
+      key = bytes_key((ext ? ext : ""), wg_decode_xmlliteral(db, enc), -1);
+      break;
+    case WG_URITYPE:
+      ext = wg_decode_uri_prefix(db, enc);
+      key = bytes_key((ext ? ext : ""), wg_decode_uri(db, enc), -1);
+      break;
+    case WG_BLOBTYPE:
+      key = bytes_key(NULL, wg_decode_blob(db, enc),
+        wg_decode_blob_len(db, enc));
+      break;
+    default:
+      /* NULL, records, anonymous constants and unknown types
+       * only get the type in the key */
+      break;
+  }
+  return (((wg_uint) type) << WG_KEY_VALUE_BITS) | key;
+}
+
+/* Integers outside the range of the key are clamped to its ends */
+static wg_uint int_key(gint val) {
+  if(val < -KEY_VALUE_LIMIT)
+    return 0;
+  if(val >= KEY_VALUE_LIMIT)
+    return KEY_VALUE_MASK;
+  return (wg_uint) (val + KEY_VALUE_LIMIT);
+}
+
+/* The bits of a double are ordered like a signed integer when
+ * the magnitude of the negative numbers is negated. Only the
+ * highest bits are kept.
+ */
+static wg_uint double_key(double val) {
+  gint64 bits;
+
+  memcpy(&bits, &val, sizeof(gint64));
+  if(bits < 0)
+    bits = INT64_MIN - bits; /* -0.0 becomes equal to 0.0 */
+  bits >>= 64 - WG_KEY_VALUE_BITS;
+  return (wg_uint) (bits + KEY_VALUE_LIMIT);
+}
+
+/* The first bytes of the optional extra string, a 0 byte and the data.
+ * This is the order wg_compare() uses, with a missing extra string
+ * being equal to an empty one. Negative len means that the data is
+ * 0-terminated. The unused bytes are 0.
+ */
+static wg_uint bytes_key(const char *ext, const char *data, gint len) {
+  wg_uint key = 0;
+  int shift = WG_KEY_VALUE_BITS;
+
+  if(ext) {
+    for(; *ext && shift; ext++) {
+      shift -= 8;
+      key |= ((wg_uint) (unsigned char) *ext) << shift;
+    }
+    if(!shift)
+      return key;
+    shift -= 8; /* terminating 0 */
+  }
+  if(data) {
+    for(; (len < 0 ? *data != '\0' : len > 0) && shift; len--, data++) {
+      shift -= 8;
+      key |= ((wg_uint) (unsigned char) *data) << shift;
+    }
+  }
+  return key;
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -60,8 +60,15 @@
 #define WG_COMPARE(d,a,b) (a==b ? WG_EQUAL :\
   wg_compare(d,a,b,WG_COMPARE_REC_DEPTH))
 
+/* Key prefixes (see wg_compare_key()). The value prefix takes
+ * all but the highest byte of the key.
+ */
+#define WG_KEY_VALUE_BITS ((int) (sizeof(wg_uint) - 1) * 8)
+#define WG_KEY_COMPARE(a,b) ((a)<(b) ? WG_LESSTHAN : WG_GREATER)
+
 /* ==== Protos ==== */
 
 gint wg_compare(void *db, gint a, gint b, int depth);
+wg_uint wg_compare_key(void *db, gint enc);
 
 #endif /* DEFINED_DBCOMPARE_H */
@@ -0,0 +1,310 @@
+/*
+* $Id:  $
+* $Version: $
+*
+* This file is part of WhiteDB
+*
+* WhiteDB is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* WhiteDB is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with WhiteDB.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+ /** @file dbcompress.c
+ *  Checksums and compression of memory images.
+ *
+ *  CRC32C (Castagnoli polynomial) uses the SSE4.2 instruction when the
+ *  processor supports it and a slicing-by-8 table otherwise.
+ *
+ *  The compressor is a byte-oriented LZ77 variant in the style of LZ4:
+ *  each sequence is a token byte (literal length in the high nibble,
+ *  match length - 4 in the low nibble), optional length extension
+ *  bytes, the literals and a 2-byte offset of the match, followed by
+ *  more length extension bytes. The last sequence has no match. It is
+ *  meant for images that contain long runs of zeros and repeated
+ *  encoded values, where speed matters more than the ratio.
+ */
+
+/* ====== Includes =============== */
+
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef _WIN32
+#include "../config-w32.h"
+#else
+#include "../config.h"
+#endif
+#include "dballoc.h"
+
+/* ====== Private headers and defs ======== */
+
+#include "dbcompress.h"
+
+#define CRC32C_POLY 0x82f63b78U
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define CRC32C_SSE42
+#endif
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH(v) (((v) * 2654435761U) >> (32 - LZ_HASH_BITS))
+
+/* ======= Private protos ================ */
+
+static unsigned int crc32c_sw(unsigned int c, const unsigned char *buf,
+  gint len);
+#ifdef CRC32C_SSE42
+static unsigned int crc32c_hw(unsigned int c, const unsigned char *buf,
+  gint len);
+#endif
+static unsigned char *put_length(unsigned char *op, gint n);
+
+/* ======= Private data ================ */
+
+static unsigned int crc32c_table[8][256];
+static int crc32c_mode = 0; /* 0 - uninitialized, 1 - table, 2 - SSE4.2 */
+
+/* ====== Functions ============== */
+
+/* ------------------- CRC32C ------------------- */
+
+/** Initialize the CRC32C tables.
+ *  Called automatically, but needs to be called before the
+ *  checksums are computed in multiple threads.
+ */
+void wg_crc32c_init(void) {
+  unsigned int c;
+  int i, j;
+
+  if(crc32c_mode)
+    return;
+  for(i=0; i<256; i++) {
+    c = i;
+    for(j=0; j<8; j++)
+      c = (c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1);
+    crc32c_table[0][i] = c;
+  }
+  for(i=0; i<256; i++) {
+    c = crc32c_table[0][i];
+    for(j=1; j<8; j++) {
+      c = crc32c_table[0][c & 0xff] ^ (c >> 8);
+      crc32c_table[j][i] = c;
+    }
+  }
+#ifdef CRC32C_SSE42
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("sse4.2")) {
+    crc32c_mode = 2;
+    return;
+  }
+#endif
+  crc32c_mode = 1;
+}
+
+/** Update the CRC32C checksum.
+ *  crc is the result of the previous call (0 initially).
+ */
+gint32 wg_crc32c(gint32 crc, const unsigned char *buf, gint len) {
+  unsigned int c = ~((unsigned int) crc);
+
+  if(!crc32c_mode)
+    wg_crc32c_init();
+#ifdef CRC32C_SSE42
+  if(crc32c_mode == 2)
+    return (gint32) ~crc32c_hw(c, buf, len);
+#endif
+  return (gint32) ~crc32c_sw(c, buf, len);
+}
+
+static unsigned int crc32c_sw(unsigned int c, const unsigned char *buf,
+  gint len)
+{
+  while(len >= 8) {
+    c ^= buf[0] | (buf[1] << 8) | (buf[2] << 16) |\
+      ((unsigned int) buf[3] << 24);
+    c = crc32c_table[7][c & 0xff] ^ crc32c_table[6][(c >> 8) & 0xff] ^\
+      crc32c_table[5][(c >> 16) & 0xff] ^ crc32c_table[4][c >> 24] ^\
+      crc32c_table[3][buf[4]] ^ crc32c_table[2][buf[5]] ^\
+      crc32c_table[1][buf[6]] ^ crc32c_table[0][buf[7]];
+    buf += 8;
+    len -= 8;
+  }
+  while(len-- > 0)
+    c = crc32c_table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+  return c;
+}
+
+#ifdef CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_hw(unsigned int c, const unsigned char *buf,
+  gint len)
+{
+  unsigned long long c64 = c, w;
+
+  while(len >= 8) {
+    memcpy(&w, buf, 8);
+    c64 = __builtin_ia32_crc32di(c64, w);
+    buf += 8;
+    len -= 8;
+  }
+  c = (unsigned int) c64;
+  while(len-- > 0)
+    c = __builtin_ia32_crc32qi(c, *buf++);
+  return c;
+}
+#endif
+
+/* ------------------- compression ------------------- */
+
+/** Compress a buffer.
+ *  returns the length of the compressed data.
+ *  returns 0 if it does not fit in cap bytes (the data should
+ *  be stored uncompressed). WG_LZ_BOUND(len) bytes are always enough.
+ */
+gint wg_lz_compress(const unsigned char *src, gint len,
+  unsigned char *dst, gint cap)
+{
+  int table[1 << LZ_HASH_BITS];
+  const unsigned char *ip = src, *anchor = src, *end = src + len, *ref;
+  unsigned char *op = dst, *oend = dst + cap;
+  gint lit, mlen, pos, off;
+  unsigned int seq, h;
+
+  memset(table, 0, sizeof(table));
+  while(end - ip >= LZ_MIN_MATCH) {
+    memcpy(&seq, ip, LZ_MIN_MATCH);
+    h = LZ_HASH(seq);
+    pos = table[h] - 1; /* 0 marks an empty slot */
+    table[h] = (int) (ip - src) + 1;
+    if(pos < 0 || (ip - src) - pos > LZ_MAX_OFFSET ||\
+      memcmp(src + pos, ip, LZ_MIN_MATCH)) {
+      /* move faster over data that does not compress */
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+
+    ref = src + pos;
+    mlen = LZ_MIN_MATCH;
+    while(ip + mlen < end && ref[mlen] == ip[mlen])
+      mlen++;
+    lit = (gint) (ip - anchor);
+    if(oend - op < 1 + lit + lit/255 + 1 + 2 + mlen/255 + 1)
+      return 0;
+
+    *op++ = (unsigned char) (((lit >= 15 ? 15 : lit) << 4) |\
+      (mlen - LZ_MIN_MATCH >= 15 ? 15 : mlen - LZ_MIN_MATCH));
+    if(lit >= 15)
+      op = put_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    off = (gint) (ip - ref);
+    *op++ = (unsigned char) (off & 0xff);
+    *op++ = (unsigned char) (off >> 8);
+    if(mlen - LZ_MIN_MATCH >= 15)
+      op = put_length(op, mlen - LZ_MIN_MATCH - 15);
+
+    ip += mlen;
+    anchor = ip;
+  }
+
+  /* last literals */
+  lit = (gint) (end - anchor);
+  if(oend - op < 1 + lit + lit/255 + 1)
+    return 0;
+  *op++ = (unsigned char) ((lit >= 15 ? 15 : lit) << 4);
+  if(lit >= 15)
+    op = put_length(op, lit - 15);
+  memcpy(op, anchor, lit);
+  op += lit;
+  return (gint) (op - dst);
+}
+
+/** Decompress a buffer.
+ *  returns the length of the decompressed data.
+ *  returns -1 if the data is corrupt or does not fit in cap bytes.
+ */
+gint wg_lz_decompress(const unsigned char *src, gint len,
+  unsigned char *dst, gint cap)
+{
+  const unsigned char *ip = src, *iend = src + len, *ref;
+  unsigned char *op = dst, *oend = dst + cap;
+  gint lit, mlen, off;
+  unsigned int token;
+
+  while(ip < iend) {
+    token = *ip++;
+    lit = token >> 4;
+    if(lit == 15) {
+      do {
+        if(ip >= iend)
+          return -1;
+        lit += *ip;
+      } while(*ip++ == 255);
+    }
+    if(lit > iend - ip || lit > oend - op)
+      return -1;
+    memcpy(op, ip, lit);
+    op += lit;
+    ip += lit;
+    if(ip == iend)
+      break; /* last sequence */
+
+    if(iend - ip < 2)
+      return -1;
+    off = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if(off == 0 || off > op - dst)
+      return -1;
+    mlen = (token & 15) + LZ_MIN_MATCH;
+    if((token & 15) == 15) {
+      do {
+        if(ip >= iend)
+          return -1;
+        mlen += *ip;
+      } while(*ip++ == 255);
+    }
+    if(mlen > oend - op)
+      return -1;
+
+    ref = op - off;
+    if(off >= mlen) {
+      memcpy(op, ref, mlen);
+    } else if(off == 1) {
+      memset(op, *ref, mlen);
+    } else {
+      gint i;
+      for(i=0; i<mlen; i++) /* overlapping copy */
+        op[i] = ref[i];
+    }
+    op += mlen;
+  }
+  return (gint) (op - dst);
+}
+
+static unsigned char *put_length(unsigned char *op, gint n) {
+  while(n >= 255) {
+    *op++ = 255;
+    n -= 255;
+  }
+  *op++ = (unsigned char) n;
+  return op;
+}
+
+#ifdef __cplusplus
+}
+#endif
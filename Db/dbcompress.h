@@ -0,0 +1,50 @@
+/*
+* $Id:  $
+* $Version: $
+*
+* This file is part of WhiteDB
+*
+* WhiteDB is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* WhiteDB is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with WhiteDB.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+ /** @file dbcompress.h
+ * Public headers for checksums and compression of memory images.
+ */
+
+#ifndef DEFINED_DBCOMPRESS_H
+#define DEFINED_DBCOMPRESS_H
+
+#ifdef _WIN32
+#include "../config-w32.h"
+#else
+#include "../config.h"
+#endif
+#include "dballoc.h"
+
+/* ==== Public macros ==== */
+
+/** Size of the output buffer that always fits the compressed data */
+#define WG_LZ_BOUND(n) ((n) + (n)/255 + 16)
+
+/* ==== Protos ==== */
+
+void wg_crc32c_init(void);
+gint32 wg_crc32c(gint32 crc, const unsigned char *buf, gint len);
+gint wg_lz_compress(const unsigned char *src, gint len,
+  unsigned char *dst, gint cap);
+gint wg_lz_decompress(const unsigned char *src, gint len,
+  unsigned char *dst, gint cap);
+
+#endif /* DEFINED_DBCOMPRESS_H */
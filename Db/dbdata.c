@@ -62,6 +62,7 @@ extern "C" {
 #include "dbindex.h"
 #include "dbcompare.h"
 #include "dblock.h"
+#include "dbcdc.h"
 
 /* ====== Private headers and defs ======== */
 
@@ -72,6 +73,8 @@ static struct tm * localtime_r (const time_t *timer, struct tm *result);
 #define snprintf sprintf_s
 #endif
 
+/** Spins before giving up on the two-field update lock */
+#define ATOMIC_SPIN_LIMIT 10000000
 
 /* ======= Private protos ================ */
 
@@ -91,6 +94,23 @@ static void scalar_to_ymd (long scalar, unsigned *yr, unsigned *mo, unsigned *da
 static gint free_field_encoffset(void* db,gint encoffset);
 static gint find_create_longstr(void* db, char* data, char* extrastr, gint type, gint length);
 
+static gint undo_reserve(void *db, gint entries);
+static void undo_push(void *db, gint type, gint fieldnr, gint offset, gint value);
+static gint undo_set_field(void *db, void *record, gint fieldnr, gint data,
+  int reindex);
+static gint undo_delete_record(void *db, void *rec, gint meta);
+static void undo_release(void *db, gint *entry);
+#ifdef USE_BACKLINKING
+static gint remove_backlink(void *db, gint *child, gint parent_offset);
+static gint add_backlink(void *db, gint *child, gint parent_offset);
+#endif
+
+static gint atomic_field_check(void* db, void* record, gint fieldnr);
+static gint atomic_widen_int(void* db, volatile gint *fieldadr, gint enc,
+  gint data);
+static gint atomic_int_op(gint op, gint a, gint b, gint *res);
+static double atomic_double_op(gint op, double a, double b);
+
 #ifdef USE_CHILD_DB
 static void *get_ptr_owner(void *db, gint encoded);
 static int is_local_offset(void *db, gint offset);
@@ -152,6 +172,11 @@ void* wg_create_raw_record(void* db, wg_int length) {
   }
 #endif
 
+  if(WG_UNDO_ACTIVE(db) && undo_reserve(db, 1))
+    return 0;
+  if(WG_CDC_ACTIVE(db) && wg_cdc_reserve(db, 1))
+    return 0;
+
 #ifdef USE_DBLOG
   /* Log first, modify shared memory next */
   if(dbmemsegh(db)->logging.active) {
@@ -179,6 +204,13 @@ void* wg_create_raw_record(void* db, wg_int length) {
   for(i=RECORD_HEADER_GINTS;i<length+RECORD_HEADER_GINTS;i++) {
     dbstore(db,offset+(i*(sizeof(gint))),0);
   }
+  if(WG_UNDO_ACTIVE(db))
+    undo_push(db, WG_UNDO_CREATE, 0, offset, 0);
+  if(WG_CDC_ACTIVE(db))
+    wg_cdc_event_add(db, WG_CDC_CREATE, encode_datarec_offset(offset),
+      length, 0, 0);
+  if(!WG_UNDO_ACTIVE(db))
+    wg_bump_epoch(db); /* otherwise on commit */
 
 #ifdef USE_DBLOG
   /* Append the created offset to log */
@@ -197,6 +229,10 @@ void* wg_create_raw_record(void* db, wg_int length) {
  * returns -2 on general error
  * returns -3 on fatal error
  *
+ * Inside a write transaction the record is hidden (marked as a
+ * special record) and its storage is released when the transaction
+ * is committed.
+ *
  * XXX: when USE_BACKLINKING is off, this function should be used
  * with extreme care.
  */
@@ -218,6 +254,13 @@ gint wg_delete_record(void* db, void *rec) {
     return -1;
 #endif
 
+  if(WG_UNDO_ACTIVE(db)) {
+    if(undo_reserve(db, wg_get_record_len(db, rec) + 2))
+      return -2;
+  }
+  if(WG_CDC_ACTIVE(db) && wg_cdc_reserve(db, 1))
+    return -2;
+
 #ifdef USE_DBLOG
   /* Log first, modify shared memory next */
   if(dbmemsegh(db)->logging.active) {
@@ -240,6 +283,11 @@ gint wg_delete_record(void* db, void *rec) {
     return -2;
   }
 #endif
+  if(WG_CDC_ACTIVE(db))
+    wg_cdc_event_add(db, WG_CDC_DELETE, encode_datarec_offset(offset),
+      0, 0, 0);
+  if(!WG_UNDO_ACTIVE(db))
+    wg_bump_epoch(db); /* otherwise on commit */
 
   /* Loop over fields, freeing them */
   dendptr = (gint *) (((char *) rec) + datarec_size_bytes(*((gint *)rec)));
@@ -274,7 +322,21 @@ gint wg_delete_record(void* db, void *rec) {
 recdel_backlink_removed:
 #endif
 
-    if(isptr(data)) free_field_encoffset(db,data);
+    if(isptr(data)) {
+      if(WG_UNDO_ACTIVE(db))
+        undo_push(db, WG_UNDO_RELEASE, 0, 0, data);
+      else
+        free_field_encoffset(db,data);
+    }
+  }
+
+  if(WG_UNDO_ACTIVE(db)) {
+    /* Keep the storage until the transaction ends */
+    gint *meta = (gint *) rec + RECORD_META_POS;
+    undo_push(db, WG_UNDO_DELETE, 0, offset, *meta);
+    undo_push(db, WG_UNDO_FREEREC, 0, offset, 0);
+    *meta |= RECORD_META_NOTDATA;
+    return 0;
   }
 
   /* Free the record storage */
@@ -606,6 +668,8 @@ wg_int* wg_get_record_dataarray(void* db, void* record) {
  *  returns -4 for backlink-related error
  *  returns -5 for invalid external data
  *  returns -6 for journal error
+ *  returns -7 if the transaction undo log cannot be extended
+ *  returns -8 if the change event cannot be captured
  */
 wg_int wg_set_field(void* db, void* record, wg_int fieldnr, wg_int data) {
   gint* fieldadr;
@@ -624,6 +688,11 @@ wg_int wg_set_field(void* db, void* record, wg_int fieldnr, wg_int data) {
   recordcheck(db,record,fieldnr,"wg_set_field");
 #endif
 
+  if(WG_UNDO_ACTIVE(db) && undo_reserve(db, 2))
+    return -7;
+  if(WG_CDC_ACTIVE(db) && wg_cdc_reserve(db, 1))
+    return -8;
+
 #ifdef USE_DBLOG
   /* Do not proceed before we've logged the operation */
   if(dbh->logging.active) {
@@ -635,6 +704,9 @@ wg_int wg_set_field(void* db, void* record, wg_int fieldnr, wg_int data) {
   /* Read the old encoded value */
   fieldadr=((gint*)record)+RECORD_HEADER_GINTS+fieldnr;
   fielddata=*fieldadr;
+  if(WG_UNDO_ACTIVE(db))
+    undo_push(db, WG_UNDO_SETFIELD, fieldnr, ptrtooffset(db, record),
+      fielddata);
 
   /* Update index(es) while the old value is still in the db */
 #ifdef USE_INDEX_TEMPLATE
@@ -722,9 +794,17 @@ setfld_backlink_removed:
   //printf("wg_set_field adr %d offset %d\n",fieldadr,ptrtooffset(db,fieldadr));
   if (isptr(fielddata)) {
     //printf("wg_set_field freeing old data\n");
-    free_field_encoffset(db,fielddata);
+    if(WG_UNDO_ACTIVE(db))
+      undo_push(db, WG_UNDO_RELEASE, 0, 0, fielddata); /* keep until commit */
+    else
+      free_field_encoffset(db,fielddata);
   }
   (*fieldadr)=data; // store data to field
+  if(WG_CDC_ACTIVE(db))
+    wg_cdc_event_add(db, WG_CDC_SET, encode_datarec_offset(ptrtooffset(db,
+      record)), fieldnr, fielddata, data);
+  if(!WG_UNDO_ACTIVE(db))
+    wg_bump_epoch(db); /* otherwise on commit */
 #ifdef USE_CHILD_DB
   if (islongstr(data) && offset_owner == dbmemseg(db)) {
 #else
@@ -810,6 +890,8 @@ setfld_backlink_removed:
  *  returns -4 for backlink-related error
  *  returns -5 for invalid external data
  *  returns -6 for journal error
+ *  returns -7 if the transaction undo log cannot be extended
+ *  returns -8 if the change event cannot be captured
  */
 wg_int wg_set_new_field(void* db, void* record, wg_int fieldnr, wg_int data) {
   gint* fieldadr;
@@ -826,6 +908,11 @@ wg_int wg_set_new_field(void* db, void* record, wg_int fieldnr, wg_int data) {
   recordcheck(db,record,fieldnr,"wg_set_field");
 #endif
 
+  if(WG_UNDO_ACTIVE(db) && undo_reserve(db, 1))
+    return -7;
+  if(WG_CDC_ACTIVE(db) && wg_cdc_reserve(db, 1))
+    return -8;
+
 #ifdef USE_DBLOG
   /* Do not proceed before we've logged the operation */
   if(dbh->logging.active) {
@@ -853,7 +940,14 @@ wg_int wg_set_new_field(void* db, void* record, wg_int fieldnr, wg_int data) {
     return -2;
   }
 #endif
+  if(WG_UNDO_ACTIVE(db))
+    undo_push(db, WG_UNDO_NEWFIELD, fieldnr, ptrtooffset(db, record), 0);
   (*fieldadr)=data;
+  if(WG_CDC_ACTIVE(db))
+    wg_cdc_event_add(db, WG_CDC_SET, encode_datarec_offset(ptrtooffset(db,
+      record)), fieldnr, 0, data);
+  if(!WG_UNDO_ACTIVE(db))
+    wg_bump_epoch(db); /* otherwise on commit */
 
 #ifdef USE_CHILD_DB
   if (islongstr(data) && offset_owner == dbmemseg(db)) {
@@ -991,7 +1085,7 @@ wg_int wg_set_rec_field(void* db, void* record, wg_int fieldnr, void* data) {
  *  returns -11 if old value non-immediate
  *  returns -12 if cannot fetch old data
  *  returns -13 if the field has an index
- *  returns -14 if logging is active
+ *  returns -14 if logging or change capture is active
  *  returns -15 if the field value has been changed from old_data
  *  may return other field-setting error codes from wg_set_new_field
  *
@@ -999,7 +1093,6 @@ wg_int wg_set_rec_field(void* db, void* record, wg_int fieldnr, void* data) {
 
 wg_int wg_update_atomic_field(void* db, void* record, wg_int fieldnr, wg_int data, wg_int old_data) {
   gint* fieldadr;
-  db_memsegment_header *dbh = dbmemsegh(db);
   gint tmp;
 
   // basic sanity check
@@ -1009,132 +1102,436 @@ wg_int wg_update_atomic_field(void* db, void* record, wg_int fieldnr, wg_int dat
   // check whether new value and old value are direct values in a record
   if (!isimmediatedata(data)) return -10;
   if (!isimmediatedata(old_data)) return -11;
-  // check whether there is index on the field
-#ifdef USE_INDEX_TEMPLATE
-  if(!is_special_record(record) && fieldnr<=MAX_INDEXED_FIELDNR &&\
-    (dbh->index_control_area_header.index_table[fieldnr] ||\
-     dbh->index_control_area_header.index_template_table[fieldnr])) {
-#else
-  if(!is_special_record(record) && fieldnr<=MAX_INDEXED_FIELDNR &&\
-    dbh->index_control_area_header.index_table[fieldnr]) {
-#endif
-    return -13;
-  }
-  // check that no logging is used
-#ifdef USE_DBLOG
-  if(dbh->logging.active) {
-    return -14;
-  }
-#endif
+  // check the index and logging restrictions
+  tmp=atomic_field_check(db,record,fieldnr);
+  if (tmp) return tmp;
   // checks passed, do atomic field setting
   fieldadr=((gint*)record)+RECORD_HEADER_GINTS+fieldnr;
   tmp=wg_compare_and_swap(fieldadr, old_data, data);
-  if (tmp) return 0;
-  else return -15;
+  if (!tmp) return -15;
+  wg_bump_epoch(db);
+  return 0;
 }
 
 
 /** Special case of setting a field value without a write-lock.
  *
  * Calls wg_update_atomic_field iteratively until compare-and-swap succeeds.
+ * A failed compare-and-swap means that some other process succeeded in
+ * changing the field, so the loop retries immediately without backing off.
  *
  * The restrictions and error codes from wg_update_atomic_field apply.
  * returns 0 if successful
- * returns -1...-15 with an error defined before in wg_update_atomic_field.
- * returns -17 if atomic assignment failed after a large number (1000) of tries
+ * returns -1...-14 with an error defined before in wg_update_atomic_field.
 */
 
 wg_int wg_set_atomic_field(void* db, void* record, wg_int fieldnr, wg_int data) {
   gint* fieldadr;
   gint old,r;
-  int i;
-#ifdef _WIN32
-  int ts=1;
-#else
-  struct timespec ts;
-#endif
 
   // basic sanity check
 #ifdef CHECK
   recordcheck(db,record,fieldnr,"wg_set_atomic_field");
 #endif
   fieldadr=((gint*)record)+RECORD_HEADER_GINTS+fieldnr;
-  for(i=0;;i++) {
-    // loop until preconditions fail or addition succeeds and
-    // the old value is not changed during compare-and-swap
+  for(;;) {
+    // loop until preconditions fail or the old value is not
+    // changed during compare-and-swap
     old=*fieldadr;
     r=wg_update_atomic_field(db,record,fieldnr,data,old);
-    if (!r) return 0;
     if (r!=-15) return r; // -15 is field changed error
-    // here compare-and-swap failed, try again
-    if (i>1000) return -17; // possibly a deadlock
-    if (i%10!=0) continue; // sleep only every tenth loop
-    // several loops passed, sleep a bit
-#ifdef _WIN32
-    Sleep(ts); // 1000 for loops take ca 0.1 sec
-#else
-    ts.tv_sec=0;
-    ts.tv_nsec=100+i;
-    nanosleep(&ts,NULL); // 1000 for loops take ca 60 microsec
-#endif
   }
-  return -17; // should not reach here
 }
 
 
 /** Special case of adding to an int field without a write-lock.
  *
- * fieldnr must contain a smallint and the result of addition
- * must also be a smallint.
- *
- * The restrictions and error codes from wg_update_atomic_field apply.
+ * Same as wg_fetch_op_int_atomic_field() with WG_ATOMIC_ADD: a small int
+ * field is updated with compare-and-swap, a full-width int is updated
+ * in place.
  *
  * returns 0 if successful
- * returns -1...-15 with an error defined before in wg_set_atomic_field.
- * returns -16 if the result of the addition does not fit into a smallint
- * returns -17 if atomic assignment failed after a large number (1000) of tries
+ * returns -1...-17 with an error defined in wg_fetch_op_int_atomic_field.
  *
 */
 
 wg_int wg_add_int_atomic_field(void* db, void* record, wg_int fieldnr, int data) {
-  gint* fieldadr;
-  gint old,nxt,r;
-  int i,sum;
-#ifdef _WIN32
-  int ts=1;
-#else
-  struct timespec ts;
+  return wg_fetch_op_int_atomic_field(db, record, fieldnr, WG_ATOMIC_ADD,
+    data, NULL);
+}
+
+
+/** Atomic arithmetic on an int field.
+ *
+ *  Stores the result of op (WG_ATOMIC_ADD, WG_ATOMIC_MIN or WG_ATOMIC_MAX)
+ *  applied to the current value of the field and data. If prev is not
+ *  NULL, the value before the operation is stored there.
+ *
+ *  A small int is replaced using compare-and-swap on the field. If the
+ *  calling thread holds a read lock, a full-width int is changed using
+ *  compare-and-swap on its storage, and a small int that grows too large
+ *  is widened to a full-width int with the storage allocated under the
+ *  field pair spinlock (the read lock keeps the writers out). After that,
+ *  the field keeps the full-width storage. Without a read lock, the
+ *  storage could be replaced or freed by the holder of the write lock,
+ *  so these updates are done under the write lock instead.
+ *
+ *  An indexed field, or any field when logging or change capture is
+ *  active, is also updated under the write lock, taken and released
+ *  by this function. This is not possible while the thread holds
+ *  a read lock, -13 or -14 is returned then.
+ *
+ *  If the calling thread holds the write lock, the field is
+ *  set with wg_set_field(), maintaining the indexes, the journal and
+ *  the transaction undo log.
+ *
+ *  returns 0 if successful
+ *  returns -1 if wrong db pointer
+ *  returns -2 if wrong fieldnr
+ *  returns -3 if op is invalid
+ *  returns -11 if the field does not contain an int
+ *  returns -13 if the field has an index (with a read lock)
+ *  returns -14 if logging or change capture is active (with a read lock)
+ *  returns -16 if the result does not fit into wg_int or cannot be stored
+ *  returns -17 if a lock could not be acquired or the write failed
+ *  may return other field-setting error codes from wg_set_field
+ */
+
+wg_int wg_fetch_op_int_atomic_field(void* db, void* record, wg_int fieldnr,
+  wg_int op, wg_int data, wg_int *prev) {
+  volatile gint *fieldadr, *valadr;
+  gint enc, old, nxt, r, lock, readlock;
+
+#ifdef CHECK
+  recordcheck(db,record,fieldnr,"wg_fetch_op_int_atomic_field");
 #endif
+  if (op!=WG_ATOMIC_ADD && op!=WG_ATOMIC_MIN && op!=WG_ATOMIC_MAX)
+    return -3;
+  fieldadr=((gint*)record)+RECORD_HEADER_GINTS+fieldnr;
+
+  if (wg_holds_write_lock(db)) {
+    // holding the write lock, do a normal update
+    enc=*fieldadr;
+    if (!issmallint(enc) && !isfullint(enc)) return -11;
+    old=wg_decode_int(db,enc);
+    if (atomic_int_op(op,old,data,&nxt)) return -16;
+    if (prev) *prev=old;
+    if (nxt==old) return 0;
+    return wg_set_int_field(db,record,fieldnr,nxt);
+  }
+
+  readlock=wg_holds_read_lock(db);
+  r=atomic_field_check(db,record,fieldnr);
+  if (r && !readlock) goto locked;
+  if (r) return r;
+  for(;;) {
+    enc=*fieldadr;
+    if (issmallint(enc)) {
+      old=decode_smallint(enc);
+      if (atomic_int_op(op,old,data,&nxt)) return -16;
+      if (nxt!=old) {
+        if (fits_smallint(nxt)) {
+          if (!wg_compare_and_swap(fieldadr,enc,encode_smallint(nxt)))
+            continue;
+        } else if (readlock) {
+          r=atomic_widen_int(db,fieldadr,enc,nxt);
+          if (r<0) return r;
+          if (!r) continue;
+        } else {
+          goto locked;
+        }
+      }
+    } else if (isfullint(enc)) {
+      // the read lock keeps the writers from replacing or freeing
+      // the storage, so it is safe to update it in place.
+      if (!readlock) goto locked;
+      valadr=(gint *) offsettoptr(db,decode_fullint_offset(enc));
+      old=*valadr;
+      if (atomic_int_op(op,old,data,&nxt)) return -16;
+      if (nxt!=old && !wg_compare_and_swap(valadr,old,nxt)) continue;
+    } else {
+      return -11;
+    }
+    if (nxt!=old) wg_bump_epoch(db);
+    if (prev) *prev=old;
+    return 0;
+  }
+
+locked:
+  // no locks held, redo the update as a write transaction
+  lock=wg_start_write(db);
+  if (!lock) return -17;
+  r=wg_fetch_op_int_atomic_field(db,record,fieldnr,op,data,prev);
+  if (r) {
+    wg_abort_write(db,lock);
+    return r;
+  }
+  return (wg_end_write(db,lock) ? 0 : -17);
+}
+
+
+/** Atomic arithmetic on a double field.
+ *
+ *  Same as wg_fetch_op_int_atomic_field(), but the field must contain
+ *  a double. If the calling thread holds a read lock, the stored double
+ *  is updated in place using compare-and-swap. Otherwise, and for an
+ *  indexed field or with logging or change capture active, the update
+ *  is done under the write lock, as with ints.
+ *
+ *  returns 0 if successful
+ *  returns -1 if wrong db pointer
+ *  returns -2 if wrong fieldnr
+ *  returns -3 if op is invalid
+ *  returns -11 if the field does not contain a double
+ *  returns -13 if the field has an index (with a read lock)
+ *  returns -14 if logging or change capture is active (with a read lock)
+ *  returns -17 if the write lock could not be acquired or the write failed
+ *  returns -18 if the platform has no 64-bit compare-and-swap
+ *  may return other field-setting error codes from wg_set_field
+ */
+
+wg_int wg_fetch_op_double_atomic_field(void* db, void* record, wg_int fieldnr,
+  wg_int op, double data, double *prev) {
+  volatile gint *valadr;
+  gint enc, r, lock;
+  union { double d; gint g[2]; } old, nxt;
+
+#ifdef CHECK
+  recordcheck(db,record,fieldnr,"wg_fetch_op_double_atomic_field");
+#endif
+  if (op!=WG_ATOMIC_ADD && op!=WG_ATOMIC_MIN && op!=WG_ATOMIC_MAX)
+    return -3;
+  enc=*(((gint*)record)+RECORD_HEADER_GINTS+fieldnr);
+  if (!isfulldouble(enc)) return -11;
+
+  if (wg_holds_write_lock(db)) {
+    // holding the write lock, do a normal update
+    old.d=wg_decode_double(db,enc);
+    nxt.d=atomic_double_op(op,old.d,data);
+    if (prev) *prev=old.d;
+    if (nxt.d==old.d) return 0;
+    return wg_set_double_field(db,record,fieldnr,nxt.d);
+  }
+
+  if (!wg_holds_read_lock(db)) {
+    // no locks held, redo the update as a write transaction
+    lock=wg_start_write(db);
+    if (!lock) return -17;
+    r=wg_fetch_op_double_atomic_field(db,record,fieldnr,op,data,prev);
+    if (r) {
+      wg_abort_write(db,lock);
+      return r;
+    }
+    return (wg_end_write(db,lock) ? 0 : -17);
+  }
+  r=atomic_field_check(db,record,fieldnr);
+  if (r) return r;
+  // the storage is stable under the read lock, see above
+  valadr=(gint *) offsettoptr(db,decode_fulldouble_offset(enc));
+  for(;;) {
+    old.g[0]=valadr[0];
+    if (sizeof(gint)<sizeof(double)) old.g[1]=valadr[1];
+    nxt.d=atomic_double_op(op,old.d,data);
+    if (nxt.d!=old.d) {
+      if (sizeof(gint)<sizeof(double)) {
+        r=wg_compare_and_swap2(valadr,old.g[0],old.g[1],nxt.g[0],nxt.g[1]);
+        if (r<0) return -18;
+      } else {
+        r=wg_compare_and_swap(valadr,old.g[0],nxt.g[0]);
+      }
+      if (!r) continue;
+      wg_bump_epoch(db);
+    }
+    if (prev) *prev=old.d;
+    return 0;
+  }
+}
+
+
+/** Update two adjacent fields without a write-lock.
+ *
+ *  Like wg_update_atomic_field, but fields fieldnr and fieldnr+1
+ *  are set to data1 and data2 only if they contain old1 and old2.
+ *
+ *  Uses double-width compare-and-swap if the platform has it and
+ *  the fields are suitably aligned. Otherwise, the updates of field
+ *  pairs are serialized with a spinlock in the database; a parallel
+ *  reader may then see the first field changed before the second one.
+ *
+ *  If the calling thread holds the write lock, the fields are
+ *  set with wg_set_field() and may be indexed. Without any locks, indexed
+ *  fields, or any fields when logging or change capture is active,
+ *  are updated under the write lock, taken and released by this function.
+ *
+ *  returns 0 if successful
+ *  returns -1...-15 as wg_update_atomic_field
+ *  returns -17 if a lock could not be acquired or the write failed
+ *  returns -19 if the second field had changed and the first field was
+ *    changed by another update before it could be restored. The first
+ *    field then keeps the value of the other update.
+ */
+
+wg_int wg_update_atomic_field_pair(void* db, void* record, wg_int fieldnr,
+  wg_int data1, wg_int data2, wg_int old1, wg_int old2) {
+  volatile gint *fieldadr, *spin;
+  gint r, lock;
+  long i;
 
-  // basic sanity check
 #ifdef CHECK
-  recordcheck(db,record,fieldnr,"wg_add_int_atomic_field");
+  recordcheck(db,record,fieldnr,"wg_update_atomic_field_pair");
+  recordcheck(db,record,fieldnr+1,"wg_update_atomic_field_pair");
 #endif
+  if (!isimmediatedata(data1) || !isimmediatedata(data2)) return -10;
+  if (!isimmediatedata(old1) || !isimmediatedata(old2)) return -11;
   fieldadr=((gint*)record)+RECORD_HEADER_GINTS+fieldnr;
-  for(i=0;;i++) {
-    // loop until preconditions fail or addition succeeds and
-    // the old value is not changed during compare-and-swap
-    old=*fieldadr;
-    if (!issmallint(old)) return -11;
-    sum=wg_decode_int(db,(gint)old)+data;
-    if (!fits_smallint(sum)) return -16;
-    nxt=encode_smallint(sum);
-    r=wg_update_atomic_field(db,record,fieldnr,nxt,old);
-    if (!r) return 0;
-    if (r!=-15) return r; // -15 is field changed error
-    // here compare-and-swap failed, try again
-    if (i>1000) return -17; // possibly a deadlock
-    if (i%10!=0) continue; // sleep only every tenth loop
-    // several loops passed, sleep a bit
-#ifdef _WIN32
-    Sleep(ts); // 1000 for loops take ca 0.1 sec
+
+  if (wg_holds_write_lock(db)) {
+    // holding the write lock, do a normal update
+    if (fieldadr[0]!=old1 || fieldadr[1]!=old2) return -15;
+    r=wg_set_field(db,record,fieldnr,data1);
+    if (!r) r=wg_set_field(db,record,fieldnr+1,data2);
+    return r;
+  }
+
+  r=atomic_field_check(db,record,fieldnr);
+  if (!r) r=atomic_field_check(db,record,fieldnr+1);
+  if (r && !wg_holds_read_lock(db)) {
+    // no locks held, redo the update as a write transaction
+    lock=wg_start_write(db);
+    if (!lock) return -17;
+    r=wg_update_atomic_field_pair(db,record,fieldnr,data1,data2,old1,old2);
+    if (r) {
+      wg_abort_write(db,lock);
+      return r;
+    }
+    return (wg_end_write(db,lock) ? 0 : -17);
+  }
+  if (r) return r;
+
+  r=wg_compare_and_swap2(fieldadr,old1,old2,data1,data2);
+  if (r>0) wg_bump_epoch(db);
+  if (r>=0) return (r ? 0 : -15);
+
+  // no double-width compare-and-swap for these fields
+  spin=&(dbmemsegh(db)->locks.field_lock);
+  for(i=0; !wg_compare_and_swap(spin,0,1); i++) {
+    if (i>ATOMIC_SPIN_LIMIT) return -17; // possibly a dead process
+  }
+  r=-15;
+  if (wg_compare_and_swap(fieldadr,old1,data1)) {
+    if (wg_compare_and_swap(fieldadr+1,old2,data2)) r=0;
+    else if (!wg_compare_and_swap(fieldadr,data1,old1)) {
+      // a single field update not using the spinlock changed the
+      // first field meanwhile, it cannot be restored
+      r=-19;
+    }
+  }
+  wg_compare_and_swap(spin,1,0);
+  if (r==-19) {
+    show_data_error(db,"wg_update_atomic_field_pair could not restore "
+      "the first field");
+  }
+  if (!r) wg_bump_epoch(db);
+  return r;
+}
+
+
+/** Widen a small int field to a full-width int without a write-lock.
+ *
+ *  The calling thread holds a read lock, so no writer is allocating. Allocations
+ *  by the parallel readers are serialized with the field pair spinlock.
+ *
+ *  returns 1 if the field was replaced
+ *  returns 0 if the field no longer contains enc
+ *  returns -16 if the storage could not be allocated
+ *  returns -17 if the spinlock could not be acquired
+ */
+
+static gint atomic_widen_int(void* db, volatile gint *fieldadr, gint enc,
+  gint data) {
+  volatile gint *lock;
+  gint nenc, r;
+  long i;
+
+  lock=&(dbmemsegh(db)->locks.field_lock);
+  for(i=0; !wg_compare_and_swap(lock,0,1); i++) {
+    if (i>ATOMIC_SPIN_LIMIT) return -17; // possibly a dead process
+  }
+  nenc=wg_encode_int(db,data);
+  if (nenc==WG_ILLEGAL) r=-16;
+  else if (wg_compare_and_swap(fieldadr,enc,nenc)) r=1;
+  else {
+    wg_free_encoded(db,nenc);
+    r=0;
+  }
+  wg_compare_and_swap(lock,1,0);
+  return r;
+}
+
+
+/** Check whether a field may be updated without a write-lock.
+ *
+ *  returns 0 if allowed
+ *  returns -13 if the field has an index
+ *  returns -14 if logging or change capture is active
+ */
+
+static gint atomic_field_check(void* db, void* record, gint fieldnr) {
+  db_memsegment_header *dbh = dbmemsegh(db);
+
+#ifdef USE_INDEX_TEMPLATE
+  if(!is_special_record(record) && fieldnr<=MAX_INDEXED_FIELDNR &&\
+    (dbh->index_control_area_header.index_table[fieldnr] ||\
+     dbh->index_control_area_header.index_template_table[fieldnr])) {
 #else
-    ts.tv_sec=0;
-    ts.tv_nsec=100+i;
-    nanosleep(&ts,NULL); // 1000 for loops take ca 60 microsec
+  if(!is_special_record(record) && fieldnr<=MAX_INDEXED_FIELDNR &&\
+    dbh->index_control_area_header.index_table[fieldnr]) {
 #endif
+    return -13;
+  }
+#ifdef USE_DBLOG
+  if(dbh->logging.active) {
+    return -14;
+  }
+#endif
+  if(dbh->cdc.active) {
+    return -14; /* events can only be published under the write lock */
+  }
+  return 0;
+}
+
+/** Compute the result of an atomic int operation.
+ *  returns -1 if the result does not fit into gint.
+ */
+
+static gint atomic_int_op(gint op, gint a, gint b, gint *res) {
+  switch(op) {
+    case WG_ATOMIC_ADD:
+      *res=(gint) ((wg_uint) a + (wg_uint) b);
+      if ((b>=0) != (*res>=a)) return -1;
+      break;
+    case WG_ATOMIC_MIN:
+      *res=(b<a ? b : a);
+      break;
+    default:
+      *res=(b>a ? b : a);
+      break;
+  }
+  return 0;
+}
+
+/** Compute the result of an atomic double operation.
+ */
+
+static double atomic_double_op(gint op, double a, double b) {
+  switch(op) {
+    case WG_ATOMIC_ADD:
+      return a+b;
+    case WG_ATOMIC_MIN:
+      return (b<a ? b : a);
+    default:
+      return (b>a ? b : a);
   }
-  return -17; // should not reach here
 }
 
 
@@ -1182,6 +1579,13 @@ wg_int wg_free_encoded(void* db, wg_int data) {
     return 0;
   }
 #endif
+  if (isptr(data) && WG_UNDO_ACTIVE(db)) {
+    /* The value may still be needed if the transaction is aborted */
+    if(undo_reserve(db, 1))
+      return -1;
+    undo_push(db, WG_UNDO_FREEENC, 0, 0, data);
+    return 0;
+  }
   if (isptr(data)) {
     gint *strptr;
 
@@ -1328,6 +1732,433 @@ static gint free_field_encoffset(void* db,gint encoffset) {
 
 
 
+/* ------------ write transaction undo log ---------------- */
+
+/*
+ * Changes made inside a write transaction (between wg_start_write()
+ * and wg_end_write() or wg_abort_write()) are recorded in an undo
+ * log kept in local memory. The log holds just enough to restore
+ * the previous state: old field values, records and data objects
+ * allocated by the transaction and records added to indexes. Index
+ * entries, backlinks and string refcounts are restored by reverting
+ * the field values, in the same way that wg_set_field() maintains them.
+ *
+ * To make the reverting possible, no storage is freed while the
+ * transaction is running. Dropped references (overwritten field
+ * values, deleted records) are queued in the undo log and released
+ * on commit. As a side effect, refcounts of long strings may be
+ * higher than the actual number of references until commit.
+ *
+ * Index definitions (creating and dropping indexes) are not part of the
+ * transaction, the undo log is suspended while index templates are
+ * being modified. Atomic field updates do not use the write lock
+ * and are not recorded either.
+ */
+
+#ifdef USE_CHILD_DB
+#define UNDO_LOCAL(d, o) is_local_offset(d, o)
+#else
+#define UNDO_LOCAL(d, o) 1
+#endif
+
+/** Set up the undo log in the database handle.
+ *  Normally called when opening the database connection.
+ */
+gint wg_init_handle_undodata(void *db) {
+  db_handle_undodata **ud = \
+    (db_handle_undodata **) &(((db_handle *) db)->undodata);
+  *ud = malloc(sizeof(db_handle_undodata));
+  if(!(*ud)) {
+    return show_data_error(db, "Error initializing the undo log");
+  }
+  memset(*ud, 0, sizeof(db_handle_undodata));
+  return 0;
+}
+
+/** Free the undo log in the database handle.
+ *  Normally called when closing the database connection.
+ */
+void wg_cleanup_handle_undodata(void *db) {
+  db_handle_undodata *ud = wg_undo_data(db);
+  if(ud) {
+    if(ud->buf)
+      free(ud->buf);
+    free(ud);
+    ((db_handle *) db)->undodata = NULL;
+  }
+}
+
+/** Start recording changes.
+ *  Called when the write lock has been acquired.
+ */
+void wg_undo_start(void *db) {
+  db_handle_undodata *ud = wg_undo_data(db);
+  ud->used = 0;
+  ud->suspended = 0;
+  ud->active = 1;
+}
+
+/** Suspend recording the changes.
+ *  Operations made while suspended are not reverted by
+ *  wg_undo_rollback(), but storage is still released only
+ *  when the transaction ends.
+ */
+void wg_undo_suspend(void *db) {
+  wg_undo_data(db)->suspended++;
+}
+
+/** Resume recording the changes.
+ */
+void wg_undo_resume(void *db) {
+  wg_undo_data(db)->suspended--;
+}
+
+/** Record that a record was added to the indexes.
+ *  Should be called before the index is modified.
+ *  returns 0 on success
+ *  returns -1 if the undo log cannot be extended
+ */
+gint wg_undo_add_indexrec(void *db, void *rec) {
+  if(!WG_UNDO_ACTIVE(db))
+    return 0;
+  if(undo_reserve(db, 1))
+    return -1;
+  undo_push(db, WG_UNDO_INDEXREC, 0, ptrtooffset(db, rec), 0);
+  return 0;
+}
+
+/** End the transaction, releasing the storage that is
+ *  no longer referenced.
+ */
+void wg_undo_commit(void *db) {
+  db_handle_undodata *ud = wg_undo_data(db);
+  gint *entry, *end;
+
+  if(!ud->active)
+    return;
+  ud->active = 0; /* release immediately from now on */
+  if(ud->used)
+    wg_bump_epoch(db); /* once for all the changes of the transaction */
+
+  end = ud->buf + ud->used;
+  for(entry = ud->buf; entry < end; entry += WG_UNDO_ENTRY_GINTS) {
+    if((entry[0] & WG_UNDO_TYPEMASK) >= WG_UNDO_RELEASE)
+      undo_release(db, entry);
+  }
+  ud->used = 0;
+}
+
+/** Revert the changes made in the transaction.
+ *
+ *  The changes are reverted in reverse order. After that, the
+ *  objects allocated by the transaction are freed, unless
+ *  something that is not part of the transaction still refers to them.
+ *
+ *  returns 0 on success
+ *  returns -1 if the previous state could not be fully restored
+ */
+gint wg_undo_rollback(void *db) {
+  db_handle_undodata *ud = wg_undo_data(db);
+  gint *entry, *end;
+  gint err = 0;
+
+  if(!ud->active)
+    return 0;
+  ud->active = 0; /* restoring is not recorded */
+
+  end = ud->buf + ud->used;
+  for(entry = end - WG_UNDO_ENTRY_GINTS; entry >= ud->buf;
+    entry -= WG_UNDO_ENTRY_GINTS) {
+    void *rec = offsettoptr(db, entry[1]);
+    gint fieldnr = entry[0] >> WG_UNDO_FIELDSHFT;
+
+    switch(entry[0] & (WG_UNDO_TYPEMASK|WG_UNDO_KEEP)) {
+      case WG_UNDO_SETFIELD:
+        if(undo_set_field(db, rec, fieldnr, entry[2], 1))
+          err = -1;
+        break;
+      case WG_UNDO_NEWFIELD:
+        if(undo_set_field(db, rec, fieldnr, 0, 0))
+          err = -1;
+        break;
+      case WG_UNDO_INDEXREC:
+        if(wg_index_del_rec(db, rec) < -1)
+          err = -1;
+        break;
+      case WG_UNDO_DELETE:
+        if(undo_delete_record(db, rec, entry[2]))
+          err = -1;
+        break;
+      default:
+        break;
+    }
+  }
+
+  for(entry = ud->buf; entry < end; entry += WG_UNDO_ENTRY_GINTS) {
+    gint *strptr;
+    switch(entry[0] & (WG_UNDO_TYPEMASK|WG_UNDO_KEEP)) {
+      case WG_UNDO_CREATE:
+        wg_free_object(db, &(dbmemsegh(db)->datarec_area_header), entry[1]);
+        break;
+      case WG_UNDO_ALLOC:
+        if(islongstr(entry[2])) {
+          /* could be in use by an index template */
+          strptr = (gint *) offsettoptr(db, decode_longstr_offset(entry[2]));
+          if(strptr[LONGSTR_REFCOUNT_POS] > 0)
+            break;
+          strptr[LONGSTR_REFCOUNT_POS] = 1;
+        }
+        free_field_encoffset(db, entry[2]);
+        break;
+      case WG_UNDO_RELEASE|WG_UNDO_KEEP:
+      case WG_UNDO_FREEENC|WG_UNDO_KEEP:
+      case WG_UNDO_FREEREC|WG_UNDO_KEEP:
+        undo_release(db, entry);
+        break;
+      default:
+        break;
+    }
+  }
+  if(ud->used)
+    wg_bump_epoch(db);
+  ud->used = 0;
+  if(err)
+    show_data_error(db, "Failed to restore the state before transaction");
+  return err;
+}
+
+/** Make room for undo log entries.
+ *  Operations reserve all the entries they need before modifying
+ *  the database, so that undo_push() cannot fail.
+ */
+static gint undo_reserve(void *db, gint entries) {
+  db_handle_undodata *ud = wg_undo_data(db);
+  gint need = ud->used + entries*WG_UNDO_ENTRY_GINTS;
+
+  if(need > ud->size) {
+    gint newsize = (ud->size ? ud->size : WG_UNDO_INITIAL_SIZE);
+    gint *newbuf;
+    while(newsize < need)
+      newsize *= 2;
+    newbuf = (gint *) realloc(ud->buf, newsize*sizeof(gint));
+    if(!newbuf)
+      return show_data_error(db, "Failed to extend the undo log");
+    ud->buf = newbuf;
+    ud->size = newsize;
+  }
+  return 0;
+}
+
+/** Add an entry to the undo log.
+ *  Space should be reserved with undo_reserve() first.
+ */
+static void undo_push(void *db, gint type, gint fieldnr, gint offset,
+  gint value) {
+  db_handle_undodata *ud = wg_undo_data(db);
+  gint *entry;
+
+  if(ud->suspended) {
+    if(type < WG_UNDO_RELEASE)
+      return; /* change is not reverted */
+    type |= WG_UNDO_KEEP;
+  }
+  entry = ud->buf + ud->used;
+  entry[0] = (fieldnr << WG_UNDO_FIELDSHFT) | type;
+  entry[1] = offset;
+  entry[2] = value;
+  ud->used += WG_UNDO_ENTRY_GINTS;
+}
+
+/** Perform a deferred release.
+ */
+static void undo_release(void *db, gint *entry) {
+  switch(entry[0] & WG_UNDO_TYPEMASK) {
+    case WG_UNDO_RELEASE:
+      free_field_encoffset(db, entry[2]);
+      break;
+    case WG_UNDO_FREEENC:
+      wg_free_encoded(db, entry[2]);
+      break;
+    case WG_UNDO_FREEREC:
+      wg_free_object(db, &(dbmemsegh(db)->datarec_area_header), entry[1]);
+      break;
+    default:
+      break;
+  }
+}
+
+/** Restore a field value.
+ *
+ *  Works like wg_set_field(), except that nothing is logged or freed.
+ *  The refcount of the restored value is not incremented, since
+ *  the transaction never decremented it. If reindex is 0, the field
+ *  is returned to the un-indexed state of a fresh raw record.
+ */
+static gint undo_set_field(void *db, void *record, gint fieldnr, gint data,
+  int reindex) {
+  gint *fieldadr = ((gint *) record) + RECORD_HEADER_GINTS + fieldnr;
+  gint fielddata = *fieldadr;
+  gint indexed;
+#if defined(USE_BACKLINKING) && (WG_COMPARE_REC_DEPTH > 0)
+  gint backlink_list;
+  gint rec_enc = WG_ILLEGAL;
+#endif
+  db_memsegment_header *dbh = dbmemsegh(db);
+
+#ifdef USE_INDEX_TEMPLATE
+  indexed = (!is_special_record(record) && fieldnr<=MAX_INDEXED_FIELDNR &&\
+    (dbh->index_control_area_header.index_table[fieldnr] ||\
+     dbh->index_control_area_header.index_template_table[fieldnr]));
+#else
+  indexed = (!is_special_record(record) && fieldnr<=MAX_INDEXED_FIELDNR &&\
+    dbh->index_control_area_header.index_table[fieldnr]);
+#endif
+  if(indexed) {
+    if(wg_index_del_field(db, record, fieldnr) < -1)
+      return -3;
+  }
+
+#if defined(USE_BACKLINKING) && (WG_COMPARE_REC_DEPTH > 0)
+  backlink_list = *((gint *) record + RECORD_BACKLINKS_POS);
+  if(backlink_list) {
+    gcell *next = (gcell *) offsettoptr(db, backlink_list);
+    rec_enc = wg_encode_record(db, record);
+    for(;;) {
+      if(remove_backlink_index_entries(db,
+        (gint *) offsettoptr(db, next->car),
+        rec_enc, WG_COMPARE_REC_DEPTH-1))
+        return -4;
+      if(!next->cdr)
+        break;
+      next = (gcell *) offsettoptr(db, next->cdr);
+    }
+  }
+#endif
+
+#ifdef USE_BACKLINKING
+  if(wg_get_encoded_type(db, fielddata) == WG_RECORDTYPE &&
+    UNDO_LOCAL(db, decode_datarec_offset(fielddata))) {
+    if(remove_backlink(db, (gint *) wg_decode_record(db, fielddata),
+      ptrtooffset(db, record)))
+      return -4;
+  }
+#endif
+
+  /* Drop the reference made by the transaction */
+  if(islongstr(fielddata) &&
+    UNDO_LOCAL(db, decode_longstr_offset(fielddata))) {
+    gint *strptr = (gint *) offsettoptr(db,decode_longstr_offset(fielddata));
+    --(*(strptr+LONGSTR_REFCOUNT_POS));
+  }
+  (*fieldadr) = data;
+
+  if(indexed && reindex) {
+    if(wg_index_add_field(db, record, fieldnr) < -1)
+      return -3;
+  }
+
+#ifdef USE_BACKLINKING
+  if(wg_get_encoded_type(db, data) == WG_RECORDTYPE &&
+    UNDO_LOCAL(db, decode_datarec_offset(data))) {
+    if(add_backlink(db, (gint *) wg_decode_record(db, data),
+      ptrtooffset(db, record)))
+      return -4;
+  }
+#endif
+
+#if defined(USE_BACKLINKING) && (WG_COMPARE_REC_DEPTH > 0)
+  if(backlink_list) {
+    gcell *next = (gcell *) offsettoptr(db, backlink_list);
+    for(;;) {
+      if(restore_backlink_index_entries(db,
+        (gint *) offsettoptr(db, next->car),
+        rec_enc, WG_COMPARE_REC_DEPTH-1))
+        return -4;
+      if(!next->cdr)
+        break;
+      next = (gcell *) offsettoptr(db, next->cdr);
+    }
+  }
+#endif
+  return 0;
+}
+
+/** Bring back a record deleted in the transaction.
+ *
+ *  The field values were not released, so only the metadata,
+ *  the backlinks and the index entries need to be restored.
+ */
+static gint undo_delete_record(void *db, void *rec, gint meta) {
+#ifdef USE_BACKLINKING
+  gint *dptr, *dendptr;
+  gint offset = ptrtooffset(db, rec);
+#endif
+
+  *((gint *) rec + RECORD_META_POS) = meta;
+
+#ifdef USE_BACKLINKING
+  dendptr = (gint *) (((char *) rec) + datarec_size_bytes(*((gint *)rec)));
+  for(dptr=(gint *)rec+RECORD_HEADER_GINTS; dptr<dendptr; dptr++) {
+    if(wg_get_encoded_type(db, *dptr) == WG_RECORDTYPE &&
+      UNDO_LOCAL(db, decode_datarec_offset(*dptr))) {
+      if(add_backlink(db, (gint *) wg_decode_record(db, *dptr), offset))
+        return -4;
+    }
+  }
+#endif
+
+  if(!is_special_record(rec)) {
+    if(wg_index_add_rec(db, rec) < -1)
+      return -3;
+  }
+  return 0;
+}
+
+#ifdef USE_BACKLINKING
+
+/** Remove a parent from the backlink chain of a record.
+ *  returns 0 on success, -1 if the chain is corrupt.
+ */
+static gint remove_backlink(void *db, gint *child, gint parent_offset) {
+  gint *next_offset = child + RECORD_BACKLINKS_POS;
+  gcell *old;
+
+  while(*next_offset) {
+    old = (gcell *) offsettoptr(db, *next_offset);
+    if(old->car == parent_offset) {
+      gint old_offset = *next_offset;
+      *next_offset = old->cdr; /* remove from list chain */
+      wg_free_listcell(db, old_offset); /* free storage */
+      return 0;
+    }
+    next_offset = &(old->cdr);
+  }
+  return show_data_error(db, "Corrupt backlink chain");
+}
+
+/** Append a parent to the backlink chain of a record.
+ *  returns 0 on success, -1 if out of memory.
+ */
+static gint add_backlink(void *db, gint *child, gint parent_offset) {
+  gint *next_offset = child + RECORD_BACKLINKS_POS;
+  gint new_offset = wg_alloc_fixlen_object(db,
+    &(dbmemsegh(db)->listcell_area_header));
+  gcell *new_cell;
+
+  if(!new_offset)
+    return show_data_error(db, "Failed to allocate a backlink");
+  new_cell = (gcell *) offsettoptr(db, new_offset);
+  while(*next_offset)
+    next_offset = &(((gcell *) offsettoptr(db, *next_offset))->cdr);
+  new_cell->car = parent_offset;
+  new_cell->cdr = 0;
+  *next_offset = new_offset;
+  return 0;
+}
+
+#endif /* USE_BACKLINKING */
+
+
 /* ------------- data encoding and decoding ------------ */
 
 
@@ -1474,7 +2305,10 @@ wg_int wg_encode_int(void* db, wg_int data) {
         return WG_ILLEGAL;
     }
 #endif
-    offset=alloc_word(db);
+    if(WG_UNDO_ACTIVE(db) && undo_reserve(db, 1))
+      offset=0; /* undo log full */
+    else
+      offset=alloc_word(db);
     if (!offset) {
       show_data_error_nr(db,"cannot store an integer in wg_set_int_field: ",data);
 #ifdef USE_DBLOG
@@ -1485,6 +2319,8 @@ wg_int wg_encode_int(void* db, wg_int data) {
       return WG_ILLEGAL;
     }
     dbstore(db,offset,data);
+    if(WG_UNDO_ACTIVE(db))
+      undo_push(db, WG_UNDO_ALLOC, 0, 0, encode_fullint_offset(offset));
 #ifdef USE_DBLOG
     if(dbmemsegh(db)->logging.active) {
       if(wg_log_encval(db, encode_fullint_offset(offset)))
@@ -1559,7 +2395,10 @@ wg_int wg_encode_double(void* db, double data) {
   if (0) {
     // possible future case for tiny floats
   } else {
-    offset=alloc_doubleword(db);
+    if(WG_UNDO_ACTIVE(db) && undo_reserve(db, 1))
+      offset=0; /* undo log full */
+    else
+      offset=alloc_doubleword(db);
     if (!offset) {
       show_data_error_double(db,"cannot store a double in wg_set_double_field: ",data);
 #ifdef USE_DBLOG
@@ -1570,6 +2409,8 @@ wg_int wg_encode_double(void* db, double data) {
       return WG_ILLEGAL;
     }
     *((double*)(offsettoptr(db,offset)))=data;
+    if(WG_UNDO_ACTIVE(db))
+      undo_push(db, WG_UNDO_ALLOC, 0, 0, encode_fulldouble_offset(offset));
 #ifdef USE_DBLOG
     if(dbmemsegh(db)->logging.active) {
       if(wg_log_encval(db, encode_fulldouble_offset(offset)))
@@ -2476,14 +3317,17 @@ Universal funs for string, xmlliteral, uri, blob
 gint wg_encode_unistr(void* db, char* str, char* lang, gint type) {
   gint offset;
   gint len;
-#ifdef USETINYSTR
-  gint res;
-#endif
   char* dptr;
   char* sptr;
   char* dendptr;
 
   len=(gint)(strlen(str));
+#ifdef USETINYSTR
+  if (lang==NULL && type==WG_STRTYPE && fits_tinystr(len)) {
+    // self-contained like a smallint: nothing to allocate or log
+    return wg_encode_tinystr(str,len);
+  }
+#endif
 #ifdef USE_DBLOG
   /* Log before allocating. */
   if(dbmemsegh(db)->logging.active) {
@@ -2492,26 +3336,13 @@ gint wg_encode_unistr(void* db, char* str, char* lang, gint type) {
     if(wg_log_encode(db, type, str, len, lang, extlen))
       return WG_ILLEGAL;
   }
-#endif
-#ifdef USETINYSTR
-/* XXX: add tinystr support to logging */
-#ifdef USE_DBLOG
-#error USE_DBLOG and USETINYSTR are incompatible
-#endif
-  if (lang==NULL && type==WG_STRTYPE && len<(sizeof(gint)-1)) {
-    res=TINYSTRBITS; // first zero the field and set last byte to mask
-    if (LITTLEENDIAN) {
-      dptr=((char*)(&res))+1; // type bits stored in lowest addressed byte
-    } else {
-      dptr=((char*)(&res));  // type bits stored in highest addressed byte
-    }
-    memcpy(dptr,str,len+1);
-    return res;
-  }
 #endif
   if (lang==NULL && type==WG_STRTYPE && len<SHORTSTR_SIZE) {
     // short string, store in a fixlen area
-    offset=alloc_shortstr(db);
+    if(WG_UNDO_ACTIVE(db) && undo_reserve(db, 1))
+      offset=0; /* undo log full */
+    else
+      offset=alloc_shortstr(db);
     if (!offset) {
       show_data_error_str(db,"cannot store a string in wg_encode_unistr",str);
 #ifdef USE_DBLOG
@@ -2530,6 +3361,8 @@ gint wg_encode_unistr(void* db, char* str, char* lang, gint type) {
     //
     for(sptr=str; (*dptr=*sptr)!=0; sptr++, dptr++) {}; // copy string
     for(dptr++; dptr<dendptr; dptr++) { *dptr=0; }; // zero the rest
+    if(WG_UNDO_ACTIVE(db))
+      undo_push(db, WG_UNDO_ALLOC, 0, 0, encode_shortstr_offset(offset));
     // store offset to field
 #ifdef USE_DBLOG
     if(dbmemsegh(db)->logging.active) {
@@ -2576,8 +3409,24 @@ gint wg_encode_uniblob(void* db, char* str, char* lang, gint type, gint len) {
 }
 
 
+/** store a string of at most TINYSTRMAXLEN bytes in the encoded value
+*
+* bytes follow the type byte, the first one lowest, so the encoding
+* does not depend on the byte order and the unused bytes are 0.
+*/
+
+gint wg_encode_tinystr(char* str, gint len) {
+  wg_uint res=TINYSTRBITS;
+  gint i;
+
+  for (i=0; i<len; i++) {
+    res|=((wg_uint)(unsigned char)str[i])<<(TINYSTRSHFT+8*i);
+  }
+  return (gint)res;
+}
+
+
 static gint find_create_longstr(void* db, char* data, char* extrastr, gint type, gint length) {
-  db_memsegment_header* dbh = dbmemsegh(db);
   gint offset;
   size_t i;
   gint tmp;
@@ -2585,8 +3434,7 @@ static gint find_create_longstr(void* db, char* data, char* extrastr, gint type,
   gint lenrest;
   char* lstrptr;
   gint old=0;
-  int hash;
-  gint hasharrel;
+  wg_uint hash;
   gint res;
 
   if (0) {
@@ -2594,23 +3442,20 @@ static gint find_create_longstr(void* db, char* data, char* extrastr, gint type,
 
     // find hash, check if exists and use if found
     hash=wg_hash_typedstr(db,data,extrastr,type,length);
-    //hasharrel=((gint*)(offsettoptr(db,((db->strhash_area_header).arraystart))))[hash];
-    hasharrel=dbfetch(db,((dbh->strhash_area_header).arraystart)+(sizeof(gint)*hash));
-    //printf("hash %d((dbh->strhash_area_header).arraystart)+(sizeof(gint)*hash) %d hasharrel %d\n",
-    //        hash,((dbh->strhash_area_header).arraystart)+(sizeof(gint)*hash), hasharrel);
-    if (hasharrel) old=wg_find_strhash_bucket(db,data,extrastr,type,length,hasharrel);
+    old=wg_find_strhash_bucket(db,data,extrastr,type,length,hash);
     //printf("old %d \n",old);
     if (old) {
       //printf("str found in hash\n");
       return old;
     }
     //printf("str not found in hash\n");
-    //printf("hasharrel 1 %d \n",hasharrel);
     // equal string not found in hash
     // allocate a new string
     lengints=length/sizeof(gint);  // 7/4=1, 8/4=2, 9/4=2,
     lenrest=length%sizeof(gint);  // 7%4=3, 8%4=0, 9%4=1,
     if (lenrest) lengints++;
+    if(WG_UNDO_ACTIVE(db) && undo_reserve(db, 1))
+      return 0; /* undo log full */
     offset=wg_alloc_gints(db,
                      &(dbmemsegh(db)->longstr_area_header),
                     lengints+LONGSTR_HEADER_GINTS);
@@ -2628,7 +3473,13 @@ static gint find_create_longstr(void* db, char* data, char* extrastr, gint type,
     }
     // if extrastr exists, encode extrastr and store ptr to longstr record field
     if (extrastr!=NULL) {
-      tmp=wg_encode_str(db,extrastr,NULL);
+      /* extrastr is owned by this string, no separate undo entry */
+      if(WG_UNDO_ACTIVE(db)) {
+        wg_undo_suspend(db);
+        tmp=wg_encode_str(db,extrastr,NULL);
+        wg_undo_resume(db);
+      } else
+        tmp=wg_encode_str(db,extrastr,NULL);
       if (tmp==WG_ILLEGAL) {
         //show_data_error_nr(db,"cannot create an (extra)string of size ",strlen(extrastr));
         return 0;
@@ -2656,9 +3507,9 @@ static gint find_create_longstr(void* db, char* data, char* extrastr, gint type,
     // encode
     res=encode_longstr_offset(offset);
     // store to hash and update hashchain
-    dbstore(db,((dbh->strhash_area_header).arraystart)+(sizeof(gint)*hash),res);
-    //printf("hasharrel 2 %d \n",hasharrel);
-    dbstore(db,offset+LONGSTR_HASHCHAIN_POS*sizeof(gint),hasharrel); // store old hash array el
+    wg_add_to_strhash(db,res,hash);
+    if(WG_UNDO_ACTIVE(db))
+      undo_push(db, WG_UNDO_ALLOC, 0, 0, res);
     // return result
     return res;
   }
@@ -2667,17 +3518,165 @@ static gint find_create_longstr(void* db, char* data, char* extrastr, gint type,
 
 
 
+#ifdef USETINYSTR
+/* ------------- decoded tiny strings ----------------- */
+
+#define TINYSTR_TABLE_SIZE 1024 /** initial slots, a power of 2 */
+#define TINYSTR_CACHE_MAX 32768 /** strings kept in the table, at most */
+#define TINYSTR_RING_SIZE 4096  /** strings decoded after that, a power of 2 */
+
+/** Decoded tiny string kept in the handle until it is freed.
+*/
+typedef struct _tinystr_node {
+  gint enc;                     /** encoded tiny string */
+  struct _tinystr_node *next;   /** all nodes of the handle */
+  char str[sizeof(gint)];       /** decoded string */
+} tinystr_node;
+
+/** Open addressing table of tinystr_node pointers. Replaced tables
+*  are kept, as other threads may still be reading them.
+*/
+typedef struct _tinystr_table {
+  gint size;                    /** slots, a power of 2 */
+  volatile gint used;           /** slots filled */
+  struct _tinystr_table *prev;  /** replaced table */
+  volatile gint slot[1];        /** tinystr_node pointers */
+} tinystr_table;
+
+static gint tinystr_slot(gint data, gint size) {
+  wg_uint h=((wg_uint)data)>>TINYSTRSHFT;
+  h^=h>>29;
+  h*=0x9e3779b1;
+  h^=h>>15;
+  return (gint)(h&(size-1));
+}
+
+/** replace the table of the handle by a larger one
+*
+* returns 0 if the table was replaced, by this or another thread
+* returns -1 on allocation error
+*/
+
+static gint grow_tinystr_table(void* db, tinystr_table *old) {
+  db_handle *dbh = (db_handle *) db;
+  tinystr_table *tab;
+  gint size=(old ? old->size*4 : TINYSTR_TABLE_SIZE);
+  gint i, j, node;
+
+  tab=malloc(sizeof(tinystr_table)+(size-1)*sizeof(gint));
+  if (!tab) {
+    show_data_error(db,"cannot allocate memory for decoded tiny strings");
+    return -1;
+  }
+  memset(tab,0,sizeof(tinystr_table)+(size-1)*sizeof(gint));
+  tab->size=size;
+  tab->prev=old;
+  // strings added to the old table meanwhile may be missed here, they
+  // are decoded again when needed.
+  for (i=0; old && i<old->size; i++) {
+    node=old->slot[i];
+    if (!node) continue;
+    for (j=tinystr_slot(((tinystr_node *) node)->enc,size); tab->slot[j];
+      j=(j+1)&(size-1)) {}
+    tab->slot[j]=node;
+    tab->used++;
+  }
+  if (!wg_compare_and_swap(&(dbh->tinystrtab),(gint)old,(gint)tab)) {
+    free(tab);
+  }
+  return 0;
+}
+
+/** return a decoded tiny string from the ring of the handle
+*
+* Used when the table is full. The string is overwritten after
+* TINYSTR_RING_SIZE more strings have been decoded this way.
+*/
+
+static char* ring_tinystr(void* db, gint data) {
+  db_handle *dbh = (db_handle *) db;
+  volatile gint *ring;
+  gint pos;
+  union { gint g; char c[sizeof(gint)]; } str;
+
+  if (!dbh->tinystrring) {
+    ring=malloc(TINYSTR_RING_SIZE*sizeof(gint));
+    if (!ring) {
+      show_data_error(db,"cannot allocate memory for decoded tiny strings");
+      return NULL;
+    }
+    if (!wg_compare_and_swap(&(dbh->tinystrring),0,(gint)ring))
+      free((void *) ring);
+  }
+  ring=(volatile gint *) dbh->tinystrring;
+  do {
+    pos=dbh->tinystrpos;
+  } while (!wg_compare_and_swap(&(dbh->tinystrpos),pos,pos+1));
+  pos&=TINYSTR_RING_SIZE-1;
+  wg_decode_tinystr_copy(data,str.c);
+  ring[pos]=str.g; // a single store, readers never see a partial string
+  return (char *) &(ring[pos]);
+}
+
+/** return the decoded tiny string kept in the handle
+*
+* The first TINYSTR_CACHE_MAX distinct strings are kept in the table
+* until the handle is freed, the rest are decoded to the ring. Threads
+* sharing the handle add the strings with CAS, so no lock is needed.
+*/
+
+static char* find_create_tinystr(void* db, gint data) {
+  db_handle *dbh = (db_handle *) db;
+  tinystr_table *tab;
+  tinystr_node *node=NULL;
+  gint i, cur, used;
+
+  for (;;) {
+    tab=(tinystr_table *) dbh->tinystrtab;
+    if (!tab || (tab->used>=tab->size/2 && tab->used<TINYSTR_CACHE_MAX)) {
+      if (grow_tinystr_table(db,tab)) return NULL;
+      continue;
+    }
+    for (i=tinystr_slot(data,tab->size);; i=(i+1)&(tab->size-1)) {
+      cur=tab->slot[i];
+      if (!cur) {
+        if (tab->used>=TINYSTR_CACHE_MAX) return ring_tinystr(db,data);
+        if (!node) {
+          node=malloc(sizeof(tinystr_node));
+          if (!node) {
+            show_data_error(db,"cannot allocate memory for decoded tiny strings");
+            return NULL;
+          }
+          node->enc=data;
+          wg_decode_tinystr_copy(data,node->str);
+          do {
+            node->next=(tinystr_node *) dbh->tinystrnodes;
+          } while (!wg_compare_and_swap(&(dbh->tinystrnodes),
+            (gint)node->next,(gint)node));
+        }
+        if (wg_compare_and_swap(&(tab->slot[i]),0,(gint)node)) {
+          do {
+            used=tab->used;
+          } while (!wg_compare_and_swap(&(tab->used),used,used+1));
+          return node->str;
+        }
+        cur=tab->slot[i];
+      }
+      if (((tinystr_node *) cur)->enc==data) return ((tinystr_node *) cur)->str;
+    }
+  }
+}
+#endif
+
+
 char* wg_decode_unistr(void* db, gint data, gint type) {
   gint* objptr;
   char* dataptr;
 #ifdef USETINYSTR
-  if (type==WG_STRTYPE && istinystr(data)) {
-    if (LITTLEENDIAN) {
-      dataptr=((char*)(&data))+1; // type bits stored in lowest addressed byte
-    } else {
-      dataptr=((char*)(&data));  // type bits stored in highest addressed byte
-    }
-    return dataptr;
+  if (istinystr(data)) {
+    // the string has no storage of its own, use the copy kept in
+    // the handle. Also used for the lang of any string type.
+    return find_create_tinystr(db,data);
   }
 #endif
   if (isshortstr(data)) {
@@ -2701,7 +3700,7 @@ char* wg_decode_unistr_lang(void* db, gint data, gint type) {
   char* res;
 
 #ifdef USETINYSTR
-  if (type==WG_STRTYPE && istinystr(data)) {
+  if (istinystr(data)) {
     return NULL;
   }
 #endif
@@ -2733,13 +3732,9 @@ gint wg_decode_unistr_len(void* db, gint data, gint type) {
   gint strsize;
 
 #ifdef USETINYSTR
-  if (type==WG_STRTYPE && istinystr(data)) {
-    if (LITTLEENDIAN) {
-      dataptr=((char*)(&data))+1; // type bits stored in lowest addressed byte
-    } else {
-      dataptr=((char*)(&data));  // type bits stored in highest addressed byte
-    }
-    strsize=strlen(dataptr);
+  if (istinystr(data)) {
+    wg_uint bytes=((wg_uint)data)>>TINYSTRSHFT;
+    for (strsize=0; bytes; strsize++, bytes>>=8) {}
     return strsize;
   }
 #endif
@@ -2775,23 +3770,14 @@ gint wg_decode_unistr_copy(void* db, gint data, char* strbuf, gint buflen, gint
   gint strsize;
 
 #ifdef USETINYSTR
-  if (type==WG_STRTYPE && istinystr(data)) {
-    if (LITTLEENDIAN) {
-      dataptr=((char*)(&data))+1; // type bits stored in lowest addressed byte
-    } else {
-      dataptr=((char*)(&data));  // type bits stored in highest addressed byte
-    }
-    strsize=strlen(dataptr)+1;
-    if (strsize>=sizeof(gint)) {
-      show_data_error_nr(db,"wrong data stored as tinystr, impossible length:",strsize);
-      return 0;
-    }
+  if (istinystr(data)) {
+    char tinybuf[sizeof(gint)];
+    strsize=wg_decode_tinystr_copy(data,tinybuf)+1;
     if (buflen<strsize) {
       show_data_error_nr(db,"insufficient buffer length given to wg_decode_unistr_copy:",buflen);
-      return 0;
+      return -1;
     }
-    memcpy(strbuf,dataptr,strsize);
-    //printf("tinystr was read to strbuf '%s'\n",strbuf);
+    memcpy(strbuf,tinybuf,strsize);
     return strsize-1;
   }
 #endif
@@ -2830,6 +3816,47 @@ gint wg_decode_unistr_copy(void* db, gint data, char* strbuf, gint buflen, gint
   return -1;
 }
 
+/** decode a tiny string to a buffer of sizeof(gint) bytes
+*
+* returns the length of the string, not including terminating 0
+*/
+
+gint wg_decode_tinystr_copy(gint data, char* strbuf) {
+  wg_uint bytes=((wg_uint)data)>>TINYSTRSHFT;
+  gint len;
+
+  for (len=0; bytes; len++, bytes>>=8) {
+    strbuf[len]=(char)(bytes&0xff);
+  }
+  strbuf[len]=0;
+  return len;
+}
+
+/** Free the decoded tiny strings in the database handle.
+ *  Normally called when closing the database connection.
+ */
+void wg_cleanup_handle_tinystrs(void *db) {
+#ifdef USETINYSTR
+  db_handle *dbh = (db_handle *) db;
+  tinystr_table *tab, *prev;
+  tinystr_node *node, *next;
+
+  for (tab=(tinystr_table *) dbh->tinystrtab; tab; tab=prev) {
+    prev=tab->prev;
+    free(tab);
+  }
+  for (node=(tinystr_node *) dbh->tinystrnodes; node; node=next) {
+    next=node->next;
+    free(node);
+  }
+  free((void *) dbh->tinystrring);
+  dbh->tinystrtab=0;
+  dbh->tinystrnodes=0;
+  dbh->tinystrring=0;
+  dbh->tinystrpos=0;
+#endif
+}
+
 /**
 * return length of the lang string, not including terminating 0
 *
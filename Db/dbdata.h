@@ -75,6 +75,11 @@ extern double round(double);
 /* Illegal encoded data indicator */
 #define WG_ILLEGAL 0xff
 
+/* Atomic field operations */
+#define WG_ATOMIC_ADD 0
+#define WG_ATOMIC_MIN 1
+#define WG_ATOMIC_MAX 2
+
 /* prototypes of wg database api functions
 
 */
@@ -114,6 +119,12 @@ wg_int wg_set_str_field(void* db, void* record, wg_int fieldnr, char* data);
 wg_int wg_update_atomic_field(void* db, void* record, wg_int fieldnr, wg_int data, wg_int old_data);
 wg_int wg_set_atomic_field(void* db, void* record, wg_int fieldnr, wg_int data);
 wg_int wg_add_int_atomic_field(void* db, void* record, wg_int fieldnr, int data);
+wg_int wg_fetch_op_int_atomic_field(void* db, void* record, wg_int fieldnr,
+  wg_int op, wg_int data, wg_int *prev);
+wg_int wg_fetch_op_double_atomic_field(void* db, void* record, wg_int fieldnr,
+  wg_int op, double data, double *prev);
+wg_int wg_update_atomic_field_pair(void* db, void* record, wg_int fieldnr,
+  wg_int data1, wg_int data2, wg_int old1, wg_int old2);
 
 wg_int wg_get_field(void* db, void* record, wg_int fieldnr);      // returns 0 when error
 wg_int wg_get_field_type(void* db, void* record, wg_int fieldnr); // returns 0 when error
@@ -257,8 +268,7 @@ wg_int wg_decode_var(void* db, wg_int data);
 #define RECORD_META_POS 1           /** metainfo, reserved for future use */
 #define RECORD_BACKLINKS_POS 2      /** backlinks structure offset */
 
-#define LITTLEENDIAN 1  ///< (intel is little-endian) difference in encoding tinystr
-//#define USETINYSTR 1    ///< undef to prohibit usage of tinystr
+#define USETINYSTR 1    ///< undef to prohibit usage of tinystr
 
 /* Record meta bits. */
 #define RECORD_META_NOTDATA 0x1 /** Record is a "special" record (not data) */
@@ -297,7 +307,7 @@ Immediate short fixpoints               0000 1111  = is eq
 Immediate chars                         0001 1111  = is eq
 Immediate dates                         0010 1111  = is eq
 Immediate times                         0011 1111  = is eq
-// Immediate tiny strings                  0100 1111  = is eq  // not used yet
+Immediate tiny strings                  0100 1111  = is eq
 Immediate anon constants                0101 1111  = is eq  // not implemented yet
 */
 
@@ -398,6 +408,9 @@ Immediate anon constants                0101 1111  = is eq  // not implemented y
 #define TINYSTRMASK  0xff
 #define TINYSTRSHFT  8
 #define TINYSTRBITS  0x4f       ///< tiny str ends with 0100 1111
+#define TINYSTRMAXLEN  ((gint)sizeof(gint)-1) ///< 7 bytes on 64-bit, 3 on 32-bit
+
+#define fits_tinystr(len)  ((len)<=TINYSTRMAXLEN)
 
 #define ANONCONSTMASK  0xff
 #define ANONCONSTSHFT  8
@@ -604,14 +617,15 @@ gint usage from start:
 3:  backlinks
 4:  pointer to next longstr in the hash bucket, 0 if no following
 5:  lang/xsdtype/namespace str (offset):  if 0 not present
-6:  actual bytes ....
+6:  hash of the contents (see wg_hash_typedstr)
+7:  actual bytes ....
 ...
 
 
 */
 
 
-#define LONGSTR_HEADER_GINTS 6 /** including obj length gint */
+#define LONGSTR_HEADER_GINTS 7 /** including obj length gint */
 
 #define LONGSTR_META_POS 1 /** metainfo, incl object type (longstr/xmlliteral/uri/blob/datarec etc)
    last byte (low 0) object type (WG_STRTYPE,WG_XMLLITERALTYPE, etc)
@@ -627,7 +641,53 @@ gint usage from start:
 #define LONGSTR_BACKLINKS_POS 3 /**   backlinks structure offset */
 #define LONGSTR_HASHCHAIN_POS 4 /**  offset of next longstr in the hash bucket, 0 if no following */
 #define LONGSTR_EXTRASTR_POS 5 /**  lang/xsdtype/namespace str (encoded offset):  if 0 not present */
+#define LONGSTR_HASH_POS 6 /**  hash of the contents, compared before the contents */
+
+
+/* --------- write transaction undo log ------------ */
+
+/* Undo log entry structure (WG_UNDO_ENTRY_GINTS per entry):
 
+0: entry type, plus WG_UNDO_KEEP flag and field number (shifted)
+1: record offset
+2: encoded value (or record metadata)
+
+Entries from WG_UNDO_SETFIELD to WG_UNDO_ALLOC describe changes that
+are reverted when the transaction is aborted. Entries from
+WG_UNDO_RELEASE up are releases of storage that are deferred until
+the transaction ends. If WG_UNDO_KEEP is set, the release was made
+by an operation that is not part of the transaction and it is
+performed on both commit and abort.
+*/
+
+#define WG_UNDO_ENTRY_GINTS 3
+#define WG_UNDO_INITIAL_SIZE (WG_UNDO_ENTRY_GINTS*256) /** in gints */
+
+#define WG_UNDO_SETFIELD 1  /** field overwritten (rec, old value) */
+#define WG_UNDO_NEWFIELD 2  /** empty field initialized (rec) */
+#define WG_UNDO_CREATE 3    /** record allocated (rec) */
+#define WG_UNDO_INDEXREC 4  /** record added to indexes (rec) */
+#define WG_UNDO_DELETE 5    /** record deleted (rec, old metadata) */
+#define WG_UNDO_ALLOC 6     /** data object allocated (value) */
+#define WG_UNDO_RELEASE 7   /** reference to a value dropped (value) */
+#define WG_UNDO_FREEENC 8   /** wg_free_encoded() called (value) */
+#define WG_UNDO_FREEREC 9   /** record storage released (rec) */
+
+#define WG_UNDO_TYPEMASK 0xf
+#define WG_UNDO_KEEP 0x10
+#define WG_UNDO_FIELDSHFT 5
+
+/** Write transaction state, kept in the local database handle */
+typedef struct {
+  gint *buf;        /** undo log entries */
+  gint used;        /** number of gints used in buf */
+  gint size;        /** allocated size of buf in gints */
+  int active;       /** write transaction in progress */
+  int suspended;    /** changes are not recorded (nesting count) */
+} db_handle_undodata;
+
+#define wg_undo_data(d) ((db_handle_undodata *) (((db_handle *) d)->undodata))
+#define WG_UNDO_ACTIVE(d) (wg_undo_data(d)->active)
 
 /* --------- error handling ------------ */
 
@@ -657,6 +717,9 @@ gint wg_decode_unistr_len(void* db, wg_int data, gint type);
 gint wg_decode_unistr_lang_len(void* db, wg_int data, gint type);
 gint wg_decode_unistr_copy(void* db, wg_int data, char* strbuf, wg_int buflen, gint type);
 gint wg_decode_unistr_lang_copy(void* db, wg_int data, char* langbuf, wg_int buflen, gint type);
+gint wg_encode_tinystr(char* str, gint len); ///< len must fit in TINYSTRMAXLEN
+gint wg_decode_tinystr_copy(gint data, char* strbuf); ///< strbuf must hold sizeof(gint) bytes
+void wg_cleanup_handle_tinystrs(void *db);
 
 gint wg_encode_external_data(void *db, void *extdb, gint encoded);
 #ifdef USE_CHILD_DB
@@ -667,4 +730,13 @@ void *wg_get_rec_owner(void *db, void *rec);
 gint wg_recptr_check(void *db,void *ptr);
 #endif
 
+gint wg_init_handle_undodata(void *db);
+void wg_cleanup_handle_undodata(void *db);
+void wg_undo_start(void *db);
+void wg_undo_commit(void *db);
+gint wg_undo_rollback(void *db);
+void wg_undo_suspend(void *db);
+void wg_undo_resume(void *db);
+gint wg_undo_add_indexrec(void *db, void *rec);
+
 #endif /* DEFINED_DBDATA_H */
@@ -30,11 +30,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <malloc.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #endif
 
 #ifdef __cplusplus
@@ -54,10 +61,73 @@ extern "C" {
 /* ====== Private headers and defs ======== */
 
 #include "dbdump.h"
+#include "dbcompress.h"
 #include "crc1.h"
 
+/* Attempts to write a snapshot of shared memory without the lock */
+#define SNAPSHOT_TRIES 3
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#define DUMP_THREADS /* compress and verify chunks in parallel */
+#include <pthread.h>
+#endif
+
+/** Compression or verification of a chunk */
+typedef struct {
+  unsigned char *raw;   /** uncompressed data */
+  unsigned char *buf;   /** data stored in the file */
+  wg_chunk_header hdr;
+  int encode;           /** compress (otherwise verify) */
+  int err;
+} dump_chunk_job;
+
+/** Reads the memory image from either dump format */
+typedef struct {
+  FILE *f;
+  int chunked;
+  gint64 size;          /** image size (chunked format) */
+  gint64 pos;           /** image bytes decoded so far */
+  gint chunksize;
+  unsigned char *chunk; /** decoded chunk */
+  unsigned char *zbuf;  /** compressed chunk */
+  gint chunklen, chunkpos;
+} dump_reader;
+
 /* ======= Private protos ================ */
 
+static gint write_dump(void *db, FILE *f);
+static gint write_image(void *db, void *image, gint size, FILE *f);
+static gint write_chunked(void *db, unsigned char *image, gint size,
+  FILE *f, int format);
+static int dump_thread_count(void *db);
+static void process_chunk(dump_chunk_job *job);
+#ifdef DUMP_THREADS
+static void *chunk_thread(void *arg);
+#endif
+static void run_chunk_jobs(dump_chunk_job *jobs, int count);
+static gint open_dump(void *db, char *fileName, dump_reader *r);
+static gint read_dump_data(void *db, dump_reader *r, void *dst, gint len);
+static gint read_chunk(void *db, dump_reader *r, unsigned char *dst,
+  wg_chunk_header *hdr);
+static int valid_chunk_header(dump_reader *r, wg_chunk_header *hdr);
+static void close_dump(dump_reader *r);
+static gint check_chunked_dump(void *db, char *fileName,
+  gint *minsize, gint *maxsize);
+static gint read_dump(void *db, char *fileName, gint *imgsize, gint32 *crc);
+static gint start_imported(void *db, gint active, gint epoch);
+static wg_page_hash hash_page(unsigned char *buf, gint len);
+static gint write_delta(void *db, char *fileName, wg_page_hash *prevmap,
+  gint prevpages, wg_delta_header *hdr);
+static gint compare_prev_pages(void *db, char *fileName,
+  unsigned char *image, gint size, char *changed);
+static gint read_page_map(void *db, char *fileName, wg_page_hash **map,
+  gint *pages, gint32 *crc);
+#ifdef USE_DBLOG
+static int sync_dump(FILE *f);
+static int file_exists(char *fileName);
+static gint read_checkpoint_number(void *db, char *fileName);
+#endif
+
 
 static gint show_dump_error(void *db, char *errmsg);
 static gint show_dump_error_str(void *db, char *errmsg, char *str);
@@ -84,13 +154,11 @@ gint wg_dump(void * db,char fileName[]) {
 gint wg_dump_internal(void * db, char fileName[], int locking) {
   FILE *f;
   db_memsegment_header* dbh = dbmemsegh(db);
-  gint dbsize = dbh->free; /* first unused offset - 0 = db size */
 #ifdef USE_DBLOG
   gint active;
 #endif
   gint err = -1;
   gint lock_id = 0;
-  gint32 crc;
 
 #ifdef CHECK
   if(dbh->extdbs.count != 0) {
@@ -133,18 +201,7 @@ gint wg_dump_internal(void * db, char fileName[], int locking) {
   }
 #endif
 
-  /* Compute the CRC32 of the used area */
-  crc = update_crc32(dbmemsegbytes(db), dbsize, 0x0);
-
-  /* Now, write the memory area to file */
-  if(fwrite(dbmemseg(db), dbsize, 1, f) == 1) {
-    /* Overwrite checksum field */
-    fseek(f, ptrtooffset(db, &(dbh->checksum)), SEEK_SET);
-    if(fwrite(&crc, sizeof(gint32), 1, f) == 1) {
-      err = 0;
-    }
-  }
-
+  err = write_dump(db, f);
   if(err)
     show_dump_error(db, "Error writing file");
 
@@ -180,6 +237,473 @@ gint wg_dump_internal(void * db, char fileName[], int locking) {
 }
 
 
+/** Write the memory image with its checksum to an open file.
+ *  Returns 0 when successful, -1 on error.
+ */
+static gint write_dump(void *db, FILE *f) {
+  /* first unused offset - 0 = db size */
+  return write_image(db, dbmemseg(db), dbmemsegh(db)->free, f);
+}
+
+/** Write a copy of the memory segment to an open file.
+ *  image points to the segment header, size is the used area.
+ *  The format is selected with wg_dump_format().
+ *  Returns 0 when successful, -1 on error.
+ */
+static gint write_image(void *db, void *image, gint size, FILE *f) {
+  db_memsegment_header* dbh = (db_memsegment_header *) image;
+  gint32 crc;
+
+#ifdef USE_DATABASE_HANDLE
+  if(((db_handle *) db)->dump_format != WG_DUMP_FORMAT_RAW) {
+    return write_chunked(db, (unsigned char *) image, size, f,
+      ((db_handle *) db)->dump_format);
+  }
+#endif
+
+  /* Compute the CRC32 of the used area */
+  crc = update_crc32((char *) image, size, 0x0);
+
+  /* Now, write the memory area to file */
+  if(fwrite(image, size, 1, f) == 1) {
+    /* Overwrite checksum field */
+    fseek(f, (char *) &(dbh->checksum) - (char *) image, SEEK_SET);
+    if(fwrite(&crc, sizeof(gint32), 1, f) == 1) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/** Write a consistent dump while the database remains in use.
+ *  Returns 0 when successful (no error).
+ *  -1 non-fatal error (db may continue)
+ *  -2 fatal error (should abort db)
+ *
+ *  The database is only locked briefly. A local database is captured
+ *  by forking: the child process writes its copy-on-write view of the
+ *  memory while the parent continues. Shared memory is not copied on
+ *  fork, so it is written directly from the live segment without a lock
+ *  instead, and the image is accepted if no writer released the write
+ *  lock and no lock-free update changed the data in the meantime. After
+ *  SNAPSHOT_TRIES failed attempts, the dump is written while holding the
+ *  lock, like wg_dump().
+ *
+ *  The resulting file is a regular dump that can be loaded with
+ *  wg_import_dump(). If journal logging is active, the journal is
+ *  restarted as with wg_dump(), at the point where the image was
+ *  captured.
+ */
+gint wg_snapshot(void *db, char fileName[]) {
+  FILE *f;
+  db_memsegment_header* dbh = dbmemsegh(db);
+#ifdef USE_DBLOG
+  gint active;
+#endif
+  gint dbsize, epoch, wreleases;
+  gint err = 0, write_err = 0;
+  gint lock_id = 0;
+  int i, captured = 0;
+#ifndef _WIN32
+  pid_t pid = -1;
+  int status;
+#endif
+
+#ifdef CHECK
+  if(dbh->extdbs.count != 0) {
+    show_dump_error(db, "Database contains external references");
+  }
+#endif
+
+#ifdef _WIN32
+  if(fopen_s(&f, fileName, "wb")) {
+#else
+  if(!(f = fopen(fileName, "wb"))) {
+#endif
+    show_dump_error(db, "Error opening file");
+    return -1;
+  }
+
+#ifndef _WIN32
+  if(dbh->key || ((db_handle *) db)->mapshared)
+#endif
+  {
+    for(i=0; i<SNAPSHOT_TRIES; i++) {
+      /* note the state of the writers */
+      lock_id = db_rlock(db, DEFAULT_LOCK_TIMEOUT);
+      if(!lock_id)
+        break;
+      epoch = wg_database_epoch(db);
+      wreleases = dbh->locks.wreleases;
+      dbsize = dbh->free;
+      db_rulock(db, lock_id);
+
+      if(i > 0 && !(f = freopen(fileName, "wb", f))) {
+        show_dump_error(db, "Error opening file");
+        return -1;
+      }
+      write_err = write_image(db, dbmemseg(db), dbsize, f);
+      if(write_err || fflush(f)) {
+        write_err = -1;
+        break;
+      }
+
+#ifndef USE_DBLOG
+      lock_id = db_rlock(db, DEFAULT_LOCK_TIMEOUT);
+#else
+      /* exclusive lock, the logging area is modified */
+      lock_id = db_wlock(db, DEFAULT_LOCK_TIMEOUT);
+#endif
+      if(!lock_id)
+        break;
+      if(epoch == dbh->epoch && wreleases == dbh->locks.wreleases) {
+        captured = 1; /* the segment did not change while writing */
+        break;
+      }
+#ifndef USE_DBLOG
+      db_rulock(db, lock_id);
+#else
+      db_wulock(db, lock_id);
+#endif
+    }
+    if(write_err) {
+      show_dump_error(db, "Error writing file");
+      fclose(f);
+      return -1;
+    }
+  }
+
+  if(!captured) {
+#ifndef USE_DBLOG
+    lock_id = db_rlock(db, DEFAULT_LOCK_TIMEOUT);
+#else
+    lock_id = db_wlock(db, DEFAULT_LOCK_TIMEOUT);
+#endif
+  }
+  if(!lock_id) {
+    show_dump_error(db, "Failed to lock the database for snapshot");
+    fclose(f);
+    return -1;
+  }
+
+#ifdef USE_DBLOG
+  active = dbh->logging.active;
+  if(active) {
+    wg_stop_logging(db);
+  }
+#endif
+
+  if(!captured) {
+#ifndef _WIN32
+    if(!dbh->key && !((db_handle *) db)->mapshared) {
+      /* local memory is private to the process, so the child
+       * gets a copy-on-write image (unlike a shared file mapping). */
+      pid = fork();
+      if(pid == 0) {
+        /* child: avoid anything that might touch the parent's state */
+        if(write_dump(db, f) || fflush(f))
+          _exit(1);
+        _exit(0);
+      }
+    }
+    if(pid == -1)
+#endif
+    {
+      /* the segment keeps changing, write it under the lock */
+      if(!(f = freopen(fileName, "wb", f))) {
+        show_dump_error(db, "Error opening file");
+        err = -1;
+      } else {
+        write_err = write_dump(db, f);
+      }
+    }
+  }
+
+#ifndef USE_DBLOG
+  if(!db_rulock(db, lock_id)) {
+    show_dump_error(db, "Failed to unlock the database");
+    err = -2; /* This error should be handled as fatal */
+  }
+#else
+  if(active) {
+    dbh->logging.dirty = 0;
+    if(wg_start_logging(db)) {
+      err = -2; /* Failed to re-initialize log */
+    }
+  }
+  if(!db_wulock(db, lock_id)) {
+    show_dump_error(db, "Failed to unlock the database");
+    err = -2; /* Write lock failure --> fatal */
+  }
+#endif
+
+#ifndef _WIN32
+  if(pid > 0) {
+    while(waitpid(pid, &status, 0) == -1) {
+      if(errno != EINTR) {
+        status = -1;
+        break;
+      }
+    }
+    if(status == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+      write_err = -1;
+  }
+#endif
+
+  if(write_err) {
+    show_dump_error(db, "Error writing file");
+    if(!err)
+      err = -1;
+  }
+  if(f) {
+    fflush(f);
+    fclose(f);
+  }
+  return err;
+}
+
+/** Store the checksum of the used area in the memory image header.
+ *  Makes a database mapped from a dump file with WG_DUMP_MAP_SHARED
+ *  a valid dump again (see wg_attach_mapped_dump()).
+ */
+void wg_store_dump_checksum(void *db) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+
+  dbh->checksum = 0;
+  dbh->checksum = update_crc32((char *) dbh, dbh->free, 0x0);
+}
+
+/** Select the format of the dumps written through this handle.
+ *  Applies to wg_dump(), wg_snapshot() and checkpoints.
+ *  WG_DUMP_FORMAT_RAW is the plain memory image (the default),
+ *  WG_DUMP_FORMAT_CHUNKED splits the image into chunks with CRC32C
+ *  checksums and WG_DUMP_FORMAT_LZ also compresses the chunks.
+ *  threads is the number of threads that compress the chunks,
+ *  0 uses the number of processors.
+ *
+ *  Returns 0 when successful, -1 on error.
+ */
+gint wg_dump_format(void *db, gint format, gint threads) {
+  if(format < WG_DUMP_FORMAT_RAW || format > WG_DUMP_FORMAT_LZ ||\
+    threads < 0) {
+    return show_dump_error(db, "Invalid dump format");
+  }
+#ifdef USE_DATABASE_HANDLE
+  ((db_handle *) db)->dump_format = (int) format;
+  ((db_handle *) db)->dump_threads = (int) threads;
+  return 0;
+#else
+  return (format == WG_DUMP_FORMAT_RAW ? 0 :\
+    show_dump_error(db, "Dump format not supported"));
+#endif
+}
+
+/** Write a checkpoint of a logged database.
+ *  The memory image is written to the checkpoint file and a new journal
+ *  is started, so that recovery only needs to replay the changes made
+ *  after the checkpoint. The journal backups are removed.
+ *
+ *  Returns 0 when successful (no error).
+ *  -1 non-fatal error (db may continue)
+ *  -2 fatal error (journal could not be restarted)
+ */
+gint wg_checkpoint(void *db) {
+  return wg_checkpoint_internal(db, 1);
+}
+
+/** Handle the checkpoint (called by the API wrapper)
+ *  if locking is zero, the caller must already hold the write lock.
+ *
+ *  The image is first written to a temporary file, then the new
+ *  journal is started (with a marker that contains the checkpoint
+ *  number) and finally the temporary file is renamed. If the process
+ *  crashes in between, wg_restore_checkpoint() can still pick the image
+ *  matching the journal.
+ */
+gint wg_checkpoint_internal(void *db, int locking) {
+#ifdef USE_DBLOG
+  db_memsegment_header* dbh = dbmemsegh(db);
+  char fn[WG_CHECKPOINT_FN_BUFSIZE], tmpfn[WG_CHECKPOINT_FN_BUFSIZE + 4];
+  gint lock_id = 0;
+  gint err = -1;
+  FILE *f;
+
+  wg_checkpoint_filename(db, fn, WG_CHECKPOINT_FN_BUFSIZE);
+  strcpy(tmpfn, fn);
+  strcat(tmpfn, ".tmp");
+
+  if(locking) {
+    lock_id = db_wlock(db, DEFAULT_LOCK_TIMEOUT);
+    if(!lock_id) {
+      show_dump_error(db, "Failed to lock the database for checkpoint");
+      return -1;
+    }
+  }
+
+  if(!dbh->logging.active) {
+    show_dump_error(db, "Checkpoint requires an active journal");
+    goto done;
+  }
+
+#ifdef _WIN32
+  if(fopen_s(&f, tmpfn, "wb")) {
+#else
+  if(!(f = fopen(tmpfn, "wb"))) {
+#endif
+    show_dump_error_str(db, "Error opening file", tmpfn);
+    goto done;
+  }
+
+  /* The image is stored with logging turned off, like regular dumps */
+  dbh->logging.active = 0;
+  dbh->logging.checkpoint++;
+  err = write_dump(db, f);
+  if(!err)
+    err = sync_dump(f);
+  fclose(f);
+
+  if(err) {
+    /* Keep appending to the current journal */
+    show_dump_error(db, "Error writing checkpoint");
+    dbh->logging.checkpoint--;
+    dbh->logging.active = 1;
+    remove(tmpfn);
+    goto done;
+  }
+
+  /* Start the journal following the checkpoint */
+  dbh->logging.dirty = 0;
+  if(wg_start_logging_checkpoint(db, dbh->logging.checkpoint)) {
+    show_dump_error(db, "Failed to restart the journal");
+    err = -2;
+    goto done;
+  }
+
+#ifdef _WIN32
+  _unlink(fn);
+#endif
+  if(rename(tmpfn, fn)) {
+    /* not fatal, wg_restore_checkpoint() can use the temporary file */
+    show_dump_error_str(db, "Failed to rename the checkpoint", tmpfn);
+    err = -1;
+  } else {
+    wg_log_remove_backups(db);
+  }
+
+done:
+  if(locking) {
+    if(!db_wulock(db, lock_id)) {
+      show_dump_error(db, "Failed to unlock the database");
+      err = -2; /* Write lock failure --> fatal */
+    }
+  }
+  return err;
+#else
+  return show_dump_error(db, "Logging is disabled");
+#endif
+}
+
+/** Set the journal size that triggers an automatic checkpoint.
+ *  The checkpoint is taken at the end of the write transaction
+ *  (see wg_end_write()) that grew the journal past the limit. This
+ *  bounds the amount of journal that needs to be replayed on recovery.
+ *  Zero disables automatic checkpoints.
+ *
+ *  Returns 0 when successful, -1 on error.
+ */
+gint wg_checkpoint_limit(void *db, gint size) {
+#ifdef USE_DBLOG
+  if(size < 0) {
+    return show_dump_error(db, "Invalid checkpoint limit");
+  }
+  dbmemsegh(db)->logging.checkpoint_limit = size;
+  return 0;
+#else
+  return show_dump_error(db, "Logging is disabled");
+#endif
+}
+
+/** Recover the database from the latest checkpoint and journal.
+ *  Imports the checkpoint image, then replays the journal that
+ *  was started at that checkpoint. Logging must not be active
+ *  in the database.
+ *
+ *  Returns 0 when successful (no error).
+ *  -1 non-fatal error (db may continue)
+ *  -2 fatal error (should abort db)
+ */
+gint wg_restore_checkpoint(void *db) {
+#ifdef USE_DBLOG
+  char fn[WG_CHECKPOINT_FN_BUFSIZE], tmpfn[WG_CHECKPOINT_FN_BUFSIZE + 4];
+  char journal_fn[WG_JOURNAL_FN_BUFSIZE];
+  gint minsize, maxsize, journal_chk, chk;
+  gint err;
+
+  if(dbmemsegh(db)->logging.active) {
+    return show_dump_error(db, "Cannot recover a database that is logging");
+  }
+
+  wg_checkpoint_filename(db, fn, WG_CHECKPOINT_FN_BUFSIZE);
+  strcpy(tmpfn, fn);
+  strcat(tmpfn, ".tmp");
+  wg_journal_filename(db, journal_fn, WG_JOURNAL_FN_BUFSIZE);
+  journal_chk = wg_journal_checkpoint(db, journal_fn);
+
+  /* A complete temporary image is used if the journal was already
+   * restarted for it, otherwise it is stale.
+   */
+  if(file_exists(tmpfn)) {
+    if(!wg_check_dump(db, tmpfn, &minsize, &maxsize) &&\
+      (journal_chk < 0 || read_checkpoint_number(db, tmpfn) == journal_chk)) {
+#ifdef _WIN32
+      _unlink(fn);
+#endif
+      if(rename(tmpfn, fn)) {
+        return show_dump_error_str(db, "Failed to rename the checkpoint",
+          tmpfn);
+      }
+    } else {
+      remove(tmpfn);
+    }
+  }
+
+  if(file_exists(fn)) {
+    chk = read_checkpoint_number(db, fn);
+    if(chk < 0) {
+      return -1;
+    }
+    if(journal_chk >= 0 && chk != journal_chk) {
+      return show_dump_error(db, "Journal does not match the checkpoint");
+    }
+    err = wg_check_dump(db, fn, &minsize, &maxsize);
+    if(err) {
+      return -1;
+    }
+    err = wg_import_dump(db, fn);
+    if(err) {
+      return err;
+    }
+  } else if(journal_chk != 0) {
+    return show_dump_error(db, (journal_chk < 0 ? "Nothing to recover" :
+      "Checkpoint of the journal is missing"));
+  } else {
+    /* Journal started without a checkpoint, replay it all */
+    return wg_replay_log(db, journal_fn);
+  }
+
+  if(journal_chk >= 0) {
+    /* database is modified already */
+    if(wg_replay_log(db, journal_fn)) {
+      return -2;
+    }
+  }
+  return 0;
+#else
+  return show_dump_error(db, "Logging is disabled");
+#endif
+}
+
+
 /* This has to be large enough to hold all the relevant
  * fields in the header during the first pass of the read.
  * (Currently this is the first 24 bytes of the dump file)
@@ -220,7 +744,14 @@ gint wg_check_dump(void *db, char fileName[], gint *minsize, gint *maxsize) {
   }
 
   /* First pass of reading. Examine the header. */
-  if(fread(buf, BUFSIZE, 1, f) != 1) {
+  len = (gint) fread(buf, 1, BUFSIZE, f);
+  if(len >= WG_CHUNKED_MAGIC_BYTES &&\
+    !memcmp(buf, WG_CHUNKED_MAGIC, WG_CHUNKED_MAGIC_BYTES)) {
+    free(buf);
+    fclose(f);
+    return check_chunked_dump(db, fileName, minsize, maxsize);
+  }
+  if(len != BUFSIZE) {
     show_dump_error(db, "Error reading dump header");
     goto abort2;
   }
@@ -276,73 +807,108 @@ abort1:
  *  db concurrently may cause undefined behaviour (including data loss)
  */
 gint wg_import_dump(void * db,char fileName[]) {
-  db_memsegment_header* dumph;
-  FILE *f;
-  db_memsegment_header* dbh = dbmemsegh(db);
-  gint dbsize = -1, newsize;
-  gint err = -1;
 #ifdef USE_DBLOG
-  gint active = dbh->logging.active;
+  gint active = dbmemsegh(db)->logging.active;
+#else
+  gint active = 0;
 #endif
+  gint epoch = dbmemsegh(db)->epoch;
+  gint err;
+
+  err = read_dump(db, fileName, NULL, NULL);
+  if(err) return err;
+  return start_imported(db, active, epoch);
+}
 
+/** Read the memory image from the dump file.
+ *  Does not initialize the database state (see start_imported()).
+ *  If imgsize and crc are not NULL, the segment size and the
+ *  checksum stored in the dump are returned in them.
+ *
+ *  Returns 0 when successful, -1 if the memory was not modified
+ *  and -2 if the memory image is in an undetermined state.
+ */
+static gint read_dump(void *db, char *fileName, gint *imgsize, gint32 *crc) {
+  db_memsegment_header* dumph;
+  dump_reader r;
+  db_memsegment_header* dbh = dbmemsegh(db);
+  gint hdrsize = sizeof(db_memsegment_header);
+  gint dbsize = -1, newsize, key;
+  gint err = -1;
 
   /* Attempt to open the dump file */
-#ifdef _WIN32
-  if(fopen_s(&f, fileName, "rb")) {
-#else
-  if(!(f = fopen(fileName, "rb"))) {
-#endif
-    show_dump_error(db, "Error opening file");
+  if(open_dump(db, fileName, &r))
     return -1;
-  }
 
   /* Examine the dump header. We only read the size, it is
    * implied that the integrity and compatibility were verified
    * earlier.
    */
-  dumph = (db_memsegment_header *) malloc(sizeof(db_memsegment_header));
+  dumph = (db_memsegment_header *) malloc(hdrsize);
   if(!dumph) {
     show_dump_error(db, "malloc error in wg_import_dump");
   }
-  else if(fread(dumph, sizeof(db_memsegment_header), 1, f) != 1) {
+  else if(read_dump_data(db, &r, dumph, hdrsize) != hdrsize) {
     show_dump_error(db, "Error reading dump header");
   }
   else {
     dbsize = dumph->free;
+    if(imgsize)
+      *imgsize = dumph->size;
+    if(crc)
+      *crc = dumph->checksum;
     if(dumph->extdbs.count != 0) {
       show_dump_error(db, "Dump contains external references");
       goto abort;
     }
   }
-  if(dumph) free(dumph);
 
   /* 0 > dbsize >= dbh->size indicates that we were able to read the dump
    * and it contained a memory image that fits in our current shared memory.
    */
   if(dbh->size < dbsize) {
     show_dump_error(db, "Data does not fit in shared memory area");
-  } else if(dbsize > 0) {
-    /* We have a compatible dump file. */
+  } else if(dbsize >= hdrsize) {
+    /* We have a compatible dump file. The chunks are decoded
+     * directly to the shared memory. The segment keeps its own key,
+     * as the journal and checkpoint file names are derived from it. */
     newsize = dbh->size;
-    fseek(f, 0, SEEK_SET);
-    if(fread(dbmemseg(db), dbsize, 1, f) != 1) {
+    key = dbh->key;
+    memcpy(dbmemseg(db), dumph, hdrsize);
+    dbh->key = key;
+    if(read_dump_data(db, &r, dbmemsegbytes(db) + hdrsize,
+      dbsize - hdrsize) != dbsize - hdrsize) {
       show_dump_error(db, "Error reading dump file");
       err = -2; /* database is in undetermined state now */
     } else {
       err = 0;
       dbh->size = newsize;
       dbh->checksum = 0;
+      if(crc && r.chunked) {
+        /* chunked dumps only have the chunk checksums */
+        *crc = update_crc32(dbmemsegbytes(db), dbsize, 0x0);
+      }
     }
   }
 
 abort:
-  fclose(f);
+  if(dumph) free(dumph);
+  close_dump(&r);
+  return err;
+}
 
-  /* any errors up to now? */
-  if(err) return err;
+/** Initialize the state of an imported database.
+ *  active indicates whether logging was active before the import,
+ *  epoch is the write epoch before the import.
+ */
+static gint start_imported(void *db, gint active, gint epoch) {
+  db_memsegment_header* dbh = dbmemsegh(db);
 
-  /* Initialize db state */
+  /* the dump has an older epoch: results computed before must not match */
+  dbh->epoch = epoch + 1;
+  dbh->epochwatch = 1;
 #ifdef USE_DBLOG
+
   /* restart logging */
   dbh->logging.dirty = 0;
   dbh->logging.active = 0;
@@ -355,6 +921,969 @@ abort:
   return wg_init_locks(db);
 }
 
+/* ------------ delta dumps ---------------- */
+
+#define DELTA_HASH_BASIS ((wg_page_hash) 14695981039346656037ULL)
+#define DELTA_HASH_PRIME ((wg_page_hash) 1099511628211ULL)
+
+/* length of page n of an image of given size */
+#define DELTA_PAGE_LEN(n, size) \
+  ((size) - (n)*WG_DELTA_PAGESIZE < WG_DELTA_PAGESIZE ? \
+    (size) - (n)*WG_DELTA_PAGESIZE : WG_DELTA_PAGESIZE)
+
+/** Write the pages changed since the previous dump.
+ *  Returns 0 when successful (no error).
+ *  -1 non-fatal error (db may continue)
+ *  -2 fatal error (should abort db)
+ *
+ *  prevFile is either a full dump or the previous delta file. The
+ *  changed pages are found by comparing the page hashes of the
+ *  memory with those of the previous file; full dumps are read in
+ *  full to compute them, delta files contain the hashes of the whole
+ *  image. Pages with matching hashes are then compared with their
+ *  contents in the previous image, which is read from the chain of
+ *  delta files and the full dump it starts from. The delta can be
+ *  applied with wg_import_dump_deltas() on top of the dump it
+ *  (indirectly) refers to.
+ *
+ *  Like wg_snapshot(), the delta is written without holding the lock and
+ *  kept if the database did not change meanwhile, otherwise it is
+ *  finally written under the lock. With journal logging active the
+ *  journal is restarted.
+ */
+gint wg_dump_delta(void *db, char prevFile[], char fileName[]) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  wg_delta_header hdr;
+  wg_page_hash *prevmap = NULL;
+  gint prevpages, lock_id = 0, epoch = 0, wreleases = 0;
+  gint err = -1;
+  int i, locked;
+#ifdef USE_DBLOG
+  gint active;
+#endif
+
+  if(strlen(prevFile) >= WG_DELTA_NAMELEN) {
+    show_dump_error_str(db, "File name too long", prevFile);
+    return -1;
+  }
+  memset(&hdr, 0, sizeof(wg_delta_header));
+  strcpy(hdr.prev, prevFile);
+  if(read_page_map(db, prevFile, &prevmap, &prevpages, &hdr.base_crc))
+    return -1;
+
+  for(i=0; i<=SNAPSHOT_TRIES; i++) {
+    locked = (i == SNAPSHOT_TRIES);
+    if(locked) {
+#ifndef USE_DBLOG
+      lock_id = db_rlock(db, DEFAULT_LOCK_TIMEOUT);
+#else
+      /* exclusive lock, the logging area is modified */
+      lock_id = db_wlock(db, DEFAULT_LOCK_TIMEOUT);
+#endif
+      if(!lock_id)
+        break;
+      hdr.size = dbh->free;
+    } else {
+      /* note the state of the writers, see wg_snapshot() */
+      lock_id = db_rlock(db, DEFAULT_LOCK_TIMEOUT);
+      if(!lock_id)
+        break;
+      epoch = wg_database_epoch(db);
+      wreleases = dbh->locks.wreleases;
+      hdr.size = dbh->free;
+      db_rulock(db, lock_id);
+      lock_id = 0;
+    }
+
+    err = write_delta(db, fileName, prevmap, prevpages, &hdr);
+    if(err || locked)
+      break;
+
+#ifndef USE_DBLOG
+    lock_id = db_rlock(db, DEFAULT_LOCK_TIMEOUT);
+#else
+    lock_id = db_wlock(db, DEFAULT_LOCK_TIMEOUT);
+#endif
+    if(!lock_id)
+      break;
+    if(epoch == dbh->epoch && wreleases == dbh->locks.wreleases)
+      break; /* the segment did not change while writing */
+#ifndef USE_DBLOG
+    db_rulock(db, lock_id);
+#else
+    db_wulock(db, lock_id);
+#endif
+    lock_id = 0;
+  }
+  if(prevmap) free(prevmap);
+  if(!lock_id) {
+    if(!err) {
+      show_dump_error(db, "Failed to lock the database for dump");
+      err = -1;
+    }
+    return err;
+  }
+
+#ifndef USE_DBLOG
+  if(!db_rulock(db, lock_id)) {
+    show_dump_error(db, "Failed to unlock the database");
+    err = -2; /* This error should be handled as fatal */
+  }
+#else
+  active = dbh->logging.active;
+  if(active && !err) {
+    wg_stop_logging(db);
+    dbh->logging.dirty = 0;
+    if(wg_start_logging(db)) {
+      err = -2; /* Failed to re-initialize log */
+    }
+  }
+  if(!db_wulock(db, lock_id)) {
+    show_dump_error(db, "Failed to unlock the database");
+    err = -2; /* Write lock failure --> fatal */
+  }
+#endif
+  return err;
+}
+
+/** Write a delta file of the memory image.
+ *  hdr contains the name and checksum of the previous image and
+ *  the size of the current one. The pages changed since the previous
+ *  image are those beyond prevpages, those with a different hash and
+ *  those that differ from the contents of the previous image.
+ *  Returns 0 when successful, -1 on error.
+ */
+static gint write_delta(void *db, char *fileName, wg_page_hash *prevmap,
+  gint prevpages, wg_delta_header *hdr)
+{
+  FILE *f;
+  unsigned char *image = (unsigned char *) dbmemsegbytes(db);
+  wg_page_hash *map = NULL;
+  char *changed = NULL;
+  gint i, len, size = (gint) hdr->size;
+  gint64 pageno;
+  gint err = -1;
+
+#ifdef _WIN32
+  if(fopen_s(&f, fileName, "wb")) {
+#else
+  if(!(f = fopen(fileName, "wb"))) {
+#endif
+    show_dump_error(db, "Error opening file");
+    return -1;
+  }
+
+  memcpy(hdr->magic, WG_DELTA_MAGIC, WG_DELTA_MAGIC_BYTES);
+  hdr->pagesize = WG_DELTA_PAGESIZE;
+  hdr->pages = (size + WG_DELTA_PAGESIZE - 1) / WG_DELTA_PAGESIZE;
+  hdr->changed = 0;
+
+  map = (wg_page_hash *) malloc(hdr->pages * sizeof(wg_page_hash));
+  changed = (char *) malloc(hdr->pages);
+  if(!map || !changed) {
+    show_dump_error(db, "Failed to allocate the page map");
+    goto abort;
+  }
+  for(i=0; i<hdr->pages; i++) {
+    map[i] = hash_page(image + i*WG_DELTA_PAGESIZE, DELTA_PAGE_LEN(i, size));
+    changed[i] = (i >= prevpages || map[i] != prevmap[i]);
+  }
+  if(compare_prev_pages(db, hdr->prev, image, size, changed))
+    goto abort;
+  for(i=0; i<hdr->pages; i++) {
+    if(changed[i])
+      hdr->changed++;
+  }
+  hdr->image_crc = update_crc32((char *) image, size, 0x0);
+
+  if(fwrite(hdr, sizeof(wg_delta_header), 1, f) != 1 ||\
+    fwrite(map, sizeof(wg_page_hash), hdr->pages, f) != (size_t) hdr->pages) {
+    show_dump_error(db, "Error writing file");
+    goto abort;
+  }
+  for(i=0; i<hdr->pages; i++) {
+    if(changed[i]) {
+      len = DELTA_PAGE_LEN(i, size);
+      pageno = i;
+      if(fwrite(&pageno, sizeof(gint64), 1, f) != 1 ||\
+        fwrite(image + i*WG_DELTA_PAGESIZE, len, 1, f) != 1) {
+        show_dump_error(db, "Error writing file");
+        goto abort;
+      }
+    }
+  }
+  if(!fflush(f))
+    err = 0;
+  else
+    show_dump_error(db, "Error writing file");
+
+abort:
+  fclose(f);
+  if(map) free(map);
+  if(changed) free(changed);
+  return err;
+}
+
+/** Compare the pages not marked in changed with the previous image.
+ *  The previous image is read from the delta file fileName, the deltas
+ *  it was created against and the full dump at the start of the chain.
+ *  Each page is compared with its latest version. Pages that differ
+ *  from the image in memory are marked in changed.
+ *  Returns 0 when successful, -1 on error.
+ */
+static gint compare_prev_pages(void *db, char *fileName,
+  unsigned char *image, gint size, char *changed)
+{
+  FILE *f = NULL;
+  dump_reader r;
+  wg_delta_header hdr;
+  char name[WG_DELTA_NAMELEN];
+  unsigned char *buf;
+  char *seen;
+  gint i, j, len, prevsize, pages;
+  gint64 pageno;
+  gint err = -1;
+
+  pages = (size + WG_DELTA_PAGESIZE - 1) / WG_DELTA_PAGESIZE;
+  buf = (unsigned char *) malloc(WG_DELTA_PAGESIZE);
+  seen = (char *) calloc(pages + 1, 1);
+  if(!buf || !seen) {
+    show_dump_error(db, "Failed to allocate the page buffer");
+    goto abort;
+  }
+  strcpy(name, fileName);
+
+  for(;;) {
+#ifdef _WIN32
+    if(fopen_s(&f, name, "rb")) {
+#else
+    if(!(f = fopen(name, "rb"))) {
+#endif
+      show_dump_error_str(db, "Error opening file", name);
+      goto abort;
+    }
+    if(fread(&hdr, sizeof(wg_delta_header), 1, f) != 1 ||\
+      memcmp(hdr.magic, WG_DELTA_MAGIC, WG_DELTA_MAGIC_BYTES))
+      break; /* the full dump */
+
+    if(fseek(f, (long) (hdr.pages * sizeof(wg_page_hash)), SEEK_CUR))
+      goto read_error;
+    for(j=0; j<hdr.changed; j++) {
+      if(fread(&pageno, sizeof(gint64), 1, f) != 1 ||\
+        pageno < 0 || pageno >= hdr.pages)
+        goto read_error;
+      len = DELTA_PAGE_LEN((gint) pageno, (gint) hdr.size);
+      if(fread(buf, len, 1, f) != 1)
+        goto read_error;
+      if(pageno < pages && !seen[pageno]) {
+        seen[pageno] = 1;
+        if(len != DELTA_PAGE_LEN((gint) pageno, size) ||\
+          memcmp(buf, image + pageno*WG_DELTA_PAGESIZE, len))
+          changed[pageno] = 1;
+      }
+    }
+    fclose(f);
+    f = NULL;
+    hdr.prev[WG_DELTA_NAMELEN-1] = '\0';
+    strcpy(name, hdr.prev);
+  }
+
+  /* the remaining pages come from the full dump */
+  fclose(f);
+  f = NULL;
+  if(open_dump(db, name, &r))
+    goto abort;
+  len = read_dump_data(db, &r, buf, WG_DELTA_PAGESIZE);
+  if(len < (gint) (offsetof(db_memsegment_header, free) + sizeof(gint))) {
+    close_dump(&r);
+    show_dump_error_str(db, "Error reading file", name);
+    goto abort;
+  }
+  memcpy(&prevsize, buf + offsetof(db_memsegment_header, free), sizeof(gint));
+  /* the checksum is zero in memory */
+  memset(buf + offsetof(db_memsegment_header, checksum), 0, sizeof(gint32));
+  for(i=0; i<pages && i*WG_DELTA_PAGESIZE < prevsize; i++) {
+    if(i > 0)
+      len = read_dump_data(db, &r, buf, WG_DELTA_PAGESIZE);
+    if(len < DELTA_PAGE_LEN(i, prevsize)) {
+      close_dump(&r);
+      show_dump_error_str(db, "File size incorrect", name);
+      goto abort;
+    }
+    if(!seen[i] && (DELTA_PAGE_LEN(i, prevsize) != DELTA_PAGE_LEN(i, size) ||\
+      memcmp(buf, image + i*WG_DELTA_PAGESIZE, DELTA_PAGE_LEN(i, size))))
+      changed[i] = 1;
+  }
+  close_dump(&r);
+  err = 0;
+  goto abort;
+
+read_error:
+  show_dump_error_str(db, "Error reading file", name);
+abort:
+  if(f) fclose(f);
+  if(buf) free(buf);
+  if(seen) free(seen);
+  return err;
+}
+
+/** Import a dump and apply a chain of delta dumps to it.
+ *  Returns 0 when successful (no error).
+ *  -1 non-fatal error (db may continue)
+ *  -2 fatal error (should abort db)
+ *
+ *  deltaFiles lists count delta files, starting with the one that
+ *  was created against fileName. Each delta must apply to the image
+ *  produced by the previous one. In case of a non-fatal error after the
+ *  dump itself was imported, the database contains the image of the
+ *  last delta that could be applied (or the dump). The checksum of the
+ *  final image is verified.
+ *
+ *  this function is NOT parallel-safe, like wg_import_dump().
+ */
+gint wg_import_dump_deltas(void *db, char fileName[],
+  char *deltaFiles[], gint count)
+{
+  db_memsegment_header* dbh = dbmemsegh(db);
+  unsigned char *image = (unsigned char *) dbmemsegbytes(db);
+  wg_delta_header hdr;
+  FILE *f;
+  gint32 crc, imgcrc;
+  gint i, j, size, imgsize, len;
+  gint64 pageno;
+  gint err;
+#ifdef USE_DBLOG
+  gint active = dbh->logging.active;
+#else
+  gint active = 0;
+#endif
+  gint epoch = dbh->epoch;
+
+  err = read_dump(db, fileName, &imgsize, &crc);
+  if(err) return err;
+  size = dbh->size;
+
+  for(i=0; i<count; i++) {
+#ifdef _WIN32
+    if(fopen_s(&f, deltaFiles[i], "rb")) {
+#else
+    if(!(f = fopen(deltaFiles[i], "rb"))) {
+#endif
+      show_dump_error_str(db, "Error opening file", deltaFiles[i]);
+      err = -1;
+      break;
+    }
+    if(fread(&hdr, sizeof(wg_delta_header), 1, f) != 1 ||\
+      memcmp(hdr.magic, WG_DELTA_MAGIC, WG_DELTA_MAGIC_BYTES) ||\
+      hdr.pagesize != WG_DELTA_PAGESIZE) {
+      show_dump_error_str(db, "Not a delta dump file", deltaFiles[i]);
+      err = -1;
+    } else if(hdr.base_crc != crc) {
+      show_dump_error_str(db, "Delta does not apply to the image",
+        deltaFiles[i]);
+      err = -1;
+    } else if(hdr.size > size) {
+      show_dump_error(db, "Data does not fit in shared memory area");
+      err = -1;
+    } else if(fseek(f, (long) (hdr.pages * sizeof(wg_page_hash)), SEEK_CUR)) {
+      show_dump_error_str(db, "Error reading file", deltaFiles[i]);
+      err = -1;
+    }
+    if(err) {
+      fclose(f);
+      break;
+    }
+
+    /* From here on, errors leave the image in an undetermined state */
+    for(j=0; j<hdr.changed; j++) {
+      if(fread(&pageno, sizeof(gint64), 1, f) != 1 ||\
+        pageno < 0 || pageno >= hdr.pages) {
+        err = -2;
+        break;
+      }
+      len = DELTA_PAGE_LEN((gint) pageno, (gint) hdr.size);
+      if(fread(image + pageno*WG_DELTA_PAGESIZE, len, 1, f) != 1) {
+        err = -2;
+        break;
+      }
+      if(pageno == 0)
+        imgsize = dbh->size; /* header was replaced */
+    }
+    fclose(f);
+    if(err) {
+      show_dump_error_str(db, "Error reading file", deltaFiles[i]);
+      return err;
+    }
+    dbh->size = size;
+    crc = hdr.image_crc;
+  }
+
+  if(!err) {
+    /* The image should now be identical to the one that was
+     * dumped, apart from the segment size. */
+    dbh->size = imgsize;
+    imgcrc = update_crc32((char *) image, dbh->free, 0x0);
+    dbh->size = size;
+    if(imgcrc != crc) {
+      show_dump_error(db, "Checksum of the restored image is incorrect");
+      return -2;
+    }
+  }
+
+  j = start_imported(db, active, epoch);
+  return (j ? j : err);
+}
+
+/** Hash a page of the memory image.
+ *  Each step maps the running value to a different one for each
+ *  different input word, so changing a single word always changes
+ *  the hash.
+ */
+static wg_page_hash hash_page(unsigned char *buf, gint len) {
+  wg_page_hash h = DELTA_HASH_BASIS, w;
+  gint i;
+
+  for(i=0; i + (gint) sizeof(wg_page_hash) <= len;
+    i += sizeof(wg_page_hash)) {
+    memcpy(&w, buf + i, sizeof(wg_page_hash));
+    h = (h ^ w) * DELTA_HASH_PRIME;
+  }
+  for(; i<len; i++)
+    h = (h ^ buf[i]) * DELTA_HASH_PRIME;
+  return h ^ (h >> 32);
+}
+
+/** Get the page hashes of the image in a dump or delta file.
+ *  Also returns the checksum of the image.
+ *  Returns 0 when successful, -1 on error.
+ */
+static gint read_page_map(void *db, char *fileName, wg_page_hash **map,
+  gint *pages, gint32 *crc)
+{
+  FILE *f;
+  dump_reader r;
+  wg_delta_header hdr;
+  unsigned char *buf = NULL;
+  gint i, size, len;
+  int reader_open = 0;
+  gint err = -1;
+
+#ifdef _WIN32
+  if(fopen_s(&f, fileName, "rb")) {
+#else
+  if(!(f = fopen(fileName, "rb"))) {
+#endif
+    show_dump_error_str(db, "Error opening file", fileName);
+    return -1;
+  }
+  *map = NULL;
+
+  if(fread(&hdr, sizeof(wg_delta_header), 1, f) != 1) {
+    show_dump_error_str(db, "Error reading file", fileName);
+    goto abort;
+  }
+
+  if(!memcmp(hdr.magic, WG_DELTA_MAGIC, WG_DELTA_MAGIC_BYTES)) {
+    if(hdr.pagesize != WG_DELTA_PAGESIZE) {
+      show_dump_error_str(db, "Incompatible delta file", fileName);
+      goto abort;
+    }
+    *pages = (gint) hdr.pages;
+    *crc = hdr.image_crc;
+    *map = (wg_page_hash *) malloc((*pages + 1) * sizeof(wg_page_hash));
+    if(!*map) {
+      show_dump_error(db, "Failed to allocate the page map");
+      goto abort;
+    }
+    if(fread(*map, sizeof(wg_page_hash), *pages, f) != (size_t) *pages) {
+      show_dump_error_str(db, "Error reading file", fileName);
+      goto abort;
+    }
+  } else {
+    /* A full dump. The header fields are read directly from the
+     * buffer as the page is smaller than the header structure. */
+    fclose(f);
+    f = NULL;
+    buf = (unsigned char *) malloc(WG_DELTA_PAGESIZE);
+    if(!buf) {
+      show_dump_error(db, "Failed to allocate the page buffer");
+      goto abort;
+    }
+    if(open_dump(db, fileName, &r))
+      goto abort;
+    reader_open = 1;
+    len = read_dump_data(db, &r, buf, WG_DELTA_PAGESIZE);
+    if(len < (gint) (offsetof(db_memsegment_header, free) + sizeof(gint))) {
+      show_dump_error_str(db, "Error reading file", fileName);
+      goto abort;
+    }
+    memcpy(&size, buf + offsetof(db_memsegment_header, free), sizeof(gint));
+    memcpy(crc, buf + offsetof(db_memsegment_header, checksum),
+      sizeof(gint32));
+    if(r.chunked)
+      *crc = 0; /* computed from the pages */
+    *pages = (size + WG_DELTA_PAGESIZE - 1) / WG_DELTA_PAGESIZE;
+    *map = (wg_page_hash *) malloc((*pages + 1) * sizeof(wg_page_hash));
+    if(!*map) {
+      show_dump_error(db, "Failed to allocate the page map");
+      goto abort;
+    }
+    for(i=0; i<*pages; i++) {
+      if(i > 0) {
+        len = read_dump_data(db, &r, buf, WG_DELTA_PAGESIZE);
+      }
+      if(len < DELTA_PAGE_LEN(i, size)) {
+        show_dump_error_str(db, "File size incorrect", fileName);
+        goto abort;
+      }
+      if(i == 0) {
+        /* the checksum is zero in memory */
+        memset(buf + offsetof(db_memsegment_header, checksum), 0,
+          sizeof(gint32));
+      }
+      (*map)[i] = hash_page(buf, DELTA_PAGE_LEN(i, size));
+      if(r.chunked)
+        *crc = update_crc32((char *) buf, DELTA_PAGE_LEN(i, size), *crc);
+    }
+  }
+  err = 0;
+
+abort:
+  if(err && *map) {
+    free(*map);
+    *map = NULL;
+  }
+  if(buf) free(buf);
+  if(reader_open) close_dump(&r);
+  if(f) fclose(f);
+  return err;
+}
+
+/* ------------ chunked dumps ---------------- */
+
+/** Write the memory image in the chunked format.
+ *  The chunks are compressed and checksummed in parallel, up to
+ *  one chunk per thread at a time, then written in order.
+ *  Returns 0 when successful, -1 on error.
+ */
+static gint write_chunked(void *db, unsigned char *image, gint size,
+  FILE *f, int format)
+{
+  wg_chunked_header hdr;
+  dump_chunk_job jobs[WG_DUMP_MAX_THREADS];
+  int nthreads = dump_thread_count(db), i, count;
+  gint64 chunk, offset;
+  gint err = -1;
+
+  memset(&hdr, 0, sizeof(wg_chunked_header));
+  memcpy(hdr.magic, WG_CHUNKED_MAGIC, WG_CHUNKED_MAGIC_BYTES);
+  hdr.size = size;
+  hdr.chunksize = WG_DUMP_CHUNKSIZE;
+  hdr.chunks = (size + WG_DUMP_CHUNKSIZE - 1) / WG_DUMP_CHUNKSIZE;
+
+  memset(jobs, 0, sizeof(jobs));
+  wg_crc32c_init(); /* before the threads use it */
+  if(format == WG_DUMP_FORMAT_LZ) {
+    for(i=0; i<nthreads; i++) {
+      jobs[i].buf = (unsigned char *) malloc(WG_DUMP_CHUNKSIZE);
+      if(!jobs[i].buf) {
+        show_dump_error(db, "Failed to allocate the compression buffer");
+        goto done;
+      }
+    }
+  }
+
+  if(fwrite(&hdr, sizeof(wg_chunked_header), 1, f) != 1)
+    goto done;
+  for(chunk=0; chunk<hdr.chunks; chunk+=count) {
+    count = (hdr.chunks - chunk < nthreads ?\
+      (int) (hdr.chunks - chunk) : nthreads);
+    for(i=0; i<count; i++) {
+      offset = (chunk + i) * WG_DUMP_CHUNKSIZE;
+      jobs[i].encode = 1;
+      jobs[i].raw = image + offset;
+      jobs[i].hdr.codec = format;
+      jobs[i].hdr.rawlen = (gint32) (size - offset < WG_DUMP_CHUNKSIZE ?\
+        size - offset : WG_DUMP_CHUNKSIZE);
+    }
+    run_chunk_jobs(jobs, count);
+    for(i=0; i<count; i++) {
+      if(fwrite(&jobs[i].hdr, sizeof(wg_chunk_header), 1, f) != 1 ||\
+        fwrite(jobs[i].hdr.codec == WG_DUMP_FORMAT_LZ ?\
+          jobs[i].buf : jobs[i].raw, jobs[i].hdr.storedlen, 1, f) != 1) {
+        goto done;
+      }
+    }
+  }
+  err = 0;
+
+done:
+  for(i=0; i<nthreads; i++) {
+    if(jobs[i].buf) free(jobs[i].buf);
+  }
+  return err;
+}
+
+/** Number of threads used for the chunks.
+ *  db may be NULL.
+ */
+static int dump_thread_count(void *db) {
+  int n = 1;
+#ifdef DUMP_THREADS
+  n = 0;
+#ifdef USE_DATABASE_HANDLE
+  if(db)
+    n = ((db_handle *) db)->dump_threads;
+#endif
+#ifdef _SC_NPROCESSORS_ONLN
+  if(n <= 0)
+    n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if(n > WG_DUMP_MAX_THREADS)
+    n = WG_DUMP_MAX_THREADS;
+#endif
+  return (n < 1 ? 1 : n);
+}
+
+/** Compress or verify a chunk.
+ *  When compressing, the chunk is stored uncompressed if it does
+ *  not get smaller.
+ */
+static void process_chunk(dump_chunk_job *job) {
+  unsigned char *data = job->buf;
+  gint len = 0;
+
+  if(job->encode) {
+    job->hdr.crc = wg_crc32c(0, job->raw, job->hdr.rawlen);
+    if(job->hdr.codec == WG_DUMP_FORMAT_LZ) {
+      len = wg_lz_compress(job->raw, job->hdr.rawlen, job->buf,
+        job->hdr.rawlen - 1);
+    }
+    if(len > 0) {
+      job->hdr.storedlen = (gint32) len;
+    } else {
+      job->hdr.codec = WG_DUMP_FORMAT_CHUNKED;
+      job->hdr.storedlen = job->hdr.rawlen;
+    }
+    job->err = 0;
+  } else {
+    if(job->hdr.codec == WG_DUMP_FORMAT_LZ) {
+      if(wg_lz_decompress(job->buf, job->hdr.storedlen, job->raw,
+        job->hdr.rawlen) != job->hdr.rawlen) {
+        job->err = -1;
+        return;
+      }
+      data = job->raw;
+    }
+    job->err = (wg_crc32c(0, data, job->hdr.rawlen) == job->hdr.crc ?\
+      0 : -1);
+  }
+}
+
+#ifdef DUMP_THREADS
+static void *chunk_thread(void *arg) {
+  process_chunk((dump_chunk_job *) arg);
+  return NULL;
+}
+#endif
+
+/** Process the chunks, in parallel if possible.
+ */
+static void run_chunk_jobs(dump_chunk_job *jobs, int count) {
+#ifdef DUMP_THREADS
+  pthread_t threads[WG_DUMP_MAX_THREADS];
+  int started[WG_DUMP_MAX_THREADS];
+  int i;
+
+  for(i=1; i<count; i++)
+    started[i] = !pthread_create(&threads[i], NULL, chunk_thread, &jobs[i]);
+  process_chunk(&jobs[0]);
+  for(i=1; i<count; i++) {
+    if(started[i])
+      pthread_join(threads[i], NULL);
+    else
+      process_chunk(&jobs[i]); /* could not start the thread */
+  }
+#else
+  int i;
+  for(i=0; i<count; i++)
+    process_chunk(&jobs[i]);
+#endif
+}
+
+/** Open a dump file of either format for reading the image.
+ *  Returns 0 when successful, -1 on error.
+ */
+static gint open_dump(void *db, char *fileName, dump_reader *r) {
+  wg_chunked_header hdr;
+
+  memset(r, 0, sizeof(dump_reader));
+#ifdef _WIN32
+  if(fopen_s(&(r->f), fileName, "rb")) {
+#else
+  if(!(r->f = fopen(fileName, "rb"))) {
+#endif
+    show_dump_error(db, "Error opening file");
+    return -1;
+  }
+  if(fread(&hdr, sizeof(wg_chunked_header), 1, r->f) == 1 &&\
+    !memcmp(hdr.magic, WG_CHUNKED_MAGIC, WG_CHUNKED_MAGIC_BYTES)) {
+    if(hdr.chunksize <= 0 || hdr.chunksize > WG_DUMP_MAX_CHUNKSIZE ||\
+      hdr.size < 0) {
+      show_dump_error_str(db, "Incompatible dump file", fileName);
+      fclose(r->f);
+      return -1;
+    }
+    r->chunked = 1;
+    r->size = hdr.size;
+    r->chunksize = (gint) hdr.chunksize;
+  } else {
+    fseek(r->f, 0, SEEK_SET);
+  }
+  return 0;
+}
+
+/** Read from the memory image in the dump file.
+ *  Chunks that fit in the destination are decoded there directly,
+ *  otherwise they are buffered.
+ *  Returns the number of bytes read, -1 on error.
+ */
+static gint read_dump_data(void *db, dump_reader *r, void *dst, gint len) {
+  unsigned char *out = (unsigned char *) dst;
+  wg_chunk_header hdr;
+  gint done = 0, n;
+
+  if(!r->chunked)
+    return (gint) fread(dst, 1, len, r->f);
+
+  while(done < len) {
+    if(r->chunkpos < r->chunklen) {
+      n = r->chunklen - r->chunkpos;
+      if(n > len - done)
+        n = len - done;
+      memcpy(out + done, r->chunk + r->chunkpos, n);
+      r->chunkpos += n;
+      done += n;
+      continue;
+    }
+    if(r->pos >= r->size)
+      break;
+    if(fread(&hdr, sizeof(wg_chunk_header), 1, r->f) != 1 ||\
+      !valid_chunk_header(r, &hdr)) {
+      show_dump_error(db, "Invalid chunk in dump file");
+      return -1;
+    }
+    if(hdr.rawlen <= len - done) {
+      if(read_chunk(db, r, out + done, &hdr))
+        return -1;
+      done += hdr.rawlen;
+    } else {
+      if(!r->chunk) {
+        r->chunk = (unsigned char *) malloc(r->chunksize);
+        if(!r->chunk) {
+          show_dump_error(db, "Failed to allocate the chunk buffer");
+          return -1;
+        }
+      }
+      if(read_chunk(db, r, r->chunk, &hdr))
+        return -1;
+      r->chunklen = hdr.rawlen;
+      r->chunkpos = 0;
+    }
+    r->pos += hdr.rawlen;
+  }
+  return done;
+}
+
+/** Read and decode the data of a chunk, then verify the checksum.
+ *  Returns 0 when successful, -1 on error.
+ */
+static gint read_chunk(void *db, dump_reader *r, unsigned char *dst,
+  wg_chunk_header *hdr)
+{
+  if(hdr->codec == WG_DUMP_FORMAT_LZ) {
+    if(!r->zbuf) {
+      r->zbuf = (unsigned char *) malloc(r->chunksize);
+      if(!r->zbuf) {
+        show_dump_error(db, "Failed to allocate the chunk buffer");
+        return -1;
+      }
+    }
+    if(fread(r->zbuf, hdr->storedlen, 1, r->f) != 1 ||\
+      wg_lz_decompress(r->zbuf, hdr->storedlen, dst, hdr->rawlen) !=\
+        hdr->rawlen) {
+      show_dump_error(db, "Error reading compressed chunk");
+      return -1;
+    }
+  } else if(fread(dst, hdr->rawlen, 1, r->f) != 1) {
+    show_dump_error(db, "Error reading dump file");
+    return -1;
+  }
+  if(wg_crc32c(0, dst, hdr->rawlen) != hdr->crc) {
+    show_dump_error(db, "Chunk CRC32C incorrect");
+    return -1;
+  }
+  return 0;
+}
+
+/** Check that the chunk header is sensible before the data is read.
+ *  Returns 1 if the header is valid.
+ */
+static int valid_chunk_header(dump_reader *r, wg_chunk_header *hdr) {
+  if(hdr->rawlen <= 0 || hdr->rawlen > r->chunksize ||\
+    hdr->rawlen > r->size - r->pos || hdr->storedlen <= 0)
+    return 0;
+  if(hdr->codec == WG_DUMP_FORMAT_LZ)
+    return (hdr->storedlen < hdr->rawlen);
+  return (hdr->codec == WG_DUMP_FORMAT_CHUNKED &&\
+    hdr->storedlen == hdr->rawlen);
+}
+
+static void close_dump(dump_reader *r) {
+  if(r->chunk) free(r->chunk);
+  if(r->zbuf) free(r->zbuf);
+  fclose(r->f);
+}
+
+/** Check the chunked dump file for compatibility and errors.
+ *  The chunks are decompressed and verified in parallel.
+ *  Return values are the same as for wg_check_dump().
+ */
+static gint check_chunked_dump(void *db, char *fileName,
+  gint *minsize, gint *maxsize)
+{
+  dump_reader r;
+  dump_chunk_job jobs[WG_DUMP_MAX_THREADS];
+  db_memsegment_header *dumph;
+  int nthreads = dump_thread_count(db), i, count;
+  gint err = -1;
+
+  if(open_dump(db, fileName, &r))
+    return -1;
+  memset(jobs, 0, sizeof(jobs));
+  wg_crc32c_init();
+
+  /* Examine the header. This reads and verifies the first chunk. */
+  dumph = (db_memsegment_header *) malloc(sizeof(db_memsegment_header));
+  if(!dumph) {
+    show_dump_error(db, "malloc error in wg_check_dump");
+    goto abort;
+  }
+  if(read_dump_data(db, &r, dumph, sizeof(db_memsegment_header)) !=\
+    sizeof(db_memsegment_header)) {
+    show_dump_error_str(db, "Error reading dump header", fileName);
+    err = -3;
+    goto abort;
+  }
+  if(wg_check_header_compat(dumph)) {
+    show_dump_error_str(db, "Incompatible dump file", fileName);
+    wg_print_code_version();
+    wg_print_header_version(dumph, 1);
+    err = -2;
+    goto abort;
+  }
+  *minsize = dumph->free;
+  *maxsize = dumph->size;
+  if(r.size != *minsize) {
+    show_dump_error_str(db, "File size incorrect", fileName);
+    err = -3;
+    goto abort;
+  }
+
+  /* Verify the remaining chunks */
+  for(i=0; i<nthreads; i++) {
+    jobs[i].raw = (unsigned char *) malloc(r.chunksize);
+    jobs[i].buf = (unsigned char *) malloc(r.chunksize);
+    if(!jobs[i].raw || !jobs[i].buf) {
+      show_dump_error(db, "malloc error in wg_check_dump");
+      goto abort;
+    }
+  }
+  while(r.pos < r.size) {
+    for(count=0; count<nthreads && r.pos < r.size; count++) {
+      if(fread(&jobs[count].hdr, sizeof(wg_chunk_header), 1, r.f) != 1 ||\
+        !valid_chunk_header(&r, &jobs[count].hdr) ||\
+        fread(jobs[count].buf, jobs[count].hdr.storedlen, 1, r.f) != 1) {
+        show_dump_error_str(db, "File size incorrect", fileName);
+        err = -3;
+        goto abort;
+      }
+      jobs[count].encode = 0;
+      r.pos += jobs[count].hdr.rawlen;
+    }
+    run_chunk_jobs(jobs, count);
+    for(i=0; i<count; i++) {
+      if(jobs[i].err) {
+        show_dump_error_str(db, "Chunk CRC32C incorrect", fileName);
+        err = -3;
+        goto abort;
+      }
+    }
+  }
+  if(fgetc(r.f) != EOF) {
+    show_dump_error_str(db, "File size incorrect", fileName);
+    err = -3;
+  } else {
+    err = 0;
+  }
+
+abort:
+  for(i=0; i<nthreads; i++) {
+    if(jobs[i].raw) free(jobs[i].raw);
+    if(jobs[i].buf) free(jobs[i].buf);
+  }
+  if(dumph) free(dumph);
+  close_dump(&r);
+  return err;
+}
+
+/* ------------ file helpers ---------------- */
+
+#ifdef USE_DBLOG
+/** Flush the file to disk.
+ *  Returns 0 when successful, -1 on error.
+ */
+static int sync_dump(FILE *f) {
+  if(fflush(f))
+    return -1;
+#ifdef _WIN32
+  return (_commit(_fileno(f)) ? -1 : 0);
+#else
+  return (fsync(fileno(f)) ? -1 : 0);
+#endif
+}
+
+static int file_exists(char *fileName) {
+  FILE *f;
+#ifdef _WIN32
+  if(fopen_s(&f, fileName, "rb"))
+#else
+  if(!(f = fopen(fileName, "rb")))
+#endif
+    return 0;
+  fclose(f);
+  return 1;
+}
+
+/** Read the number of the checkpoint from the image header.
+ *  Returns -1 on error.
+ */
+static gint read_checkpoint_number(void *db, char *fileName) {
+  db_memsegment_header dumph;
+  dump_reader r;
+  gint len;
+
+  if(open_dump(db, fileName, &r))
+    return -1;
+  len = read_dump_data(db, &r, &dumph, sizeof(db_memsegment_header));
+  close_dump(&r);
+  if(len != sizeof(db_memsegment_header)) {
+    return show_dump_error_str(db, "Error reading dump header", fileName);
+  }
+  return dumph.logging.checkpoint;
+}
+#endif
+
 /* ------------ error handling ---------------- */
 
 static gint show_dump_error(void *db, char *errmsg) {
@@ -35,13 +35,78 @@
 
 /* ====== data structures ======== */
 
+#define WG_DUMP_FORMAT_RAW 0      /** plain memory image */
+#define WG_DUMP_FORMAT_CHUNKED 1  /** chunks with CRC32C checksums */
+#define WG_DUMP_FORMAT_LZ 2       /** compressed chunks with checksums */
+
+#define WG_CHUNKED_MAGIC "WGDUMPC1"
+#define WG_CHUNKED_MAGIC_BYTES 8
+#define WG_DUMP_CHUNKSIZE (1<<20)
+#define WG_DUMP_MAX_CHUNKSIZE (1<<26)
+#define WG_DUMP_MAX_THREADS 16
+
+/** Header of the chunked dump file.
+ *  It is followed by the chunks, each preceded by wg_chunk_header.
+ */
+typedef struct {
+  char magic[WG_CHUNKED_MAGIC_BYTES];
+  gint64 size;      /** size of the memory image */
+  gint64 chunksize; /** maximum size of the chunk data */
+  gint64 chunks;    /** number of chunks */
+} wg_chunked_header;
+
+typedef struct {
+  gint32 codec;     /** WG_DUMP_FORMAT_LZ if compressed */
+  gint32 rawlen;    /** length of the chunk in the image */
+  gint32 storedlen; /** length of the data in the file */
+  gint32 crc;       /** CRC32C of the uncompressed data */
+} wg_chunk_header;
+
+#define WG_DELTA_MAGIC "WGDELTA2"
+#define WG_DELTA_MAGIC_BYTES 8
+#define WG_DELTA_PAGESIZE 4096
+#define WG_DELTA_NAMELEN 1024
+
+#ifdef _MSC_VER
+typedef unsigned __int64 wg_page_hash;
+#else
+typedef uint64_t wg_page_hash;
+#endif
+
+/** Header of the delta dump file.
+ *  It is followed by the hashes of all pages of the image (used when
+ *  the next delta is created) and then the changed pages, each
+ *  preceded by its page number (gint64).
+ */
+typedef struct {
+  char magic[WG_DELTA_MAGIC_BYTES];
+  gint64 pagesize;
+  gint64 size;      /** used area of the image (dbh->free) */
+  gint64 pages;     /** number of page hashes that follow */
+  gint64 changed;   /** number of pages stored in the file */
+  gint32 base_crc;  /** checksum of the image this delta applies to */
+  gint32 image_crc; /** checksum of the resulting image */
+  char prev[WG_DELTA_NAMELEN]; /** file the delta was created against */
+} wg_delta_header;
+
 
 /* ==== Protos ==== */
 
 gint wg_dump(void * db,char fileName[]); /* dump shared memory database to the disk */
 gint wg_dump_internal(void * db,char fileName[], int locking); /* handle the dump */
+gint wg_snapshot(void *db, char fileName[]); /* dump without blocking writers */
 gint wg_import_dump(void * db,char fileName[]); /* import database from the disk */
 gint wg_check_dump(void *db, char fileName[],
   gint *mixsize, gint *maxsize); /* check the dump file and get the db size */
+gint wg_dump_delta(void *db, char prevFile[],
+  char fileName[]); /* dump the pages changed since the previous dump */
+gint wg_import_dump_deltas(void *db, char fileName[],
+  char *deltaFiles[], gint count); /* import a dump and apply deltas */
+gint wg_dump_format(void *db, gint format, gint threads); /* dump options */
+void wg_store_dump_checksum(void *db); /* seal a mapped dump file */
+gint wg_checkpoint(void *db); /* write checkpoint and restart the journal */
+gint wg_checkpoint_internal(void *db, int locking); /* handle the checkpoint */
+gint wg_checkpoint_limit(void *db, gint size); /* automatic checkpoints */
+gint wg_restore_checkpoint(void *db); /* recover from checkpoint and journal */
 
 #endif /* DEFINED_DBDUMP_H */
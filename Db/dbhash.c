@@ -100,6 +100,13 @@ typedef struct {
 #define FNV_prime ((wg_uint) 16777619UL)
 #endif
 
+/* MurmurHash64A constants */
+#define HASH_M 0xc6a4a7935bd1e995ULL
+#define HASH_R 47
+
+/* Number of strhash array elements moved to the new array per operation */
+#define STRHASH_MOVE_STEP 8
+
 /* ======= Private protos ================ */
 
 
@@ -111,6 +118,11 @@ static gint show_consistency_error_nr(void* db, char* errmsg, gint nr) ;
 static gint show_hash_error(void* db, char* errmsg);
 static gint show_ginthash_error(void *db, char* errmsg);
 
+static gint strhash_chain(void* db, wg_uint hash);
+static void strhash_grow(void* db);
+static void strhash_move(void* db, gint steps);
+static unsigned long long hash_mem(unsigned long long hash, const char *data,
+  gint length);
 static wg_uint hash_bytes(void *db, char *data, gint length, gint hashsz);
 static gint find_idxhash_bucket(void *db, char *data, gint length,
   gint *chainoffset);
@@ -128,49 +140,52 @@ static gint remove_from_bucket(ginthash_bucket *bucket, int idx);
 
 /* ------------- strhash operations ------------------- */
 
-
-
+/* The strhash array is indexed by the low bits of the hash, so the
+ * length of the array is a power of two. When the number of strings
+ * grows past STRHASH_MAX_LOAD per array element, a new array of
+ * double size is allocated from the longstr area. The chains of the
+ * old array are moved to the new one STRHASH_MOVE_STEP elements at
+ * a time whenever a string is added or removed. Until then, the
+ * elements that have not been moved yet are used from the old array.
+ *
+ * Each longstr stores its hash, so moving the chains and removing
+ * the strings does not need to hash the contents again, and the
+ * contents are only compared when the hashes match.
+ */
 
 /* Hash function for two-part strings and blobs.
 *
-* Based on sdbm.
+* Based on MurmurHash64A, reads 8 bytes at a time.
 *
 */
 
-int wg_hash_typedstr(void* db, char* data, char* extrastr, gint type, gint length) {
-  char* endp;
-  unsigned long hash = 0;
-  int c;
-
-  //printf("in wg_hash_typedstr %s %s %d %d \n",data,extrastr,type,length);
-  if (data!=NULL) {
-    for(endp=data+length; data<endp; data++) {
-      c = (int)(*data);
-      hash = c + (hash << 6) + (hash << 16) - hash;
-    }
-  }
-  if (extrastr!=NULL) {
-    while ((c = *extrastr++))
-      hash = c + (hash << 6) + (hash << 16) - hash;
-  }
+wg_uint wg_hash_typedstr(void* db, char* data, char* extrastr, gint type, gint length) {
+  unsigned long long hash = 0;
 
-  return (int)(hash % (dbmemsegh(db)->strhash_area_header).arraylength);
+  if (data!=NULL)
+    hash = hash_mem(hash, data, length);
+  if (extrastr!=NULL)
+    hash = hash_mem(hash, extrastr, strlen(extrastr));
+  return (wg_uint) hash;
 }
 
 
 
-/* Find longstr from strhash bucket chain
-*
+/* Find longstr from strhash
 *
+*  returns the encoded longstr, 0 if not found
 */
 
-gint wg_find_strhash_bucket(void* db, char* data, char* extrastr, gint type, gint size, gint hashchain) {
-  //printf("wg_find_strhash_bucket called %s %s type %d size %d hashchain %d\n",data,extrastr,type,size,hashchain);
-  for(;hashchain!=0;
-      hashchain=dbfetch(db,decode_longstr_offset(hashchain)+LONGSTR_HASHCHAIN_POS*sizeof(gint))) {
-    if (wg_right_strhash_bucket(db,hashchain,data,extrastr,type,size)) {
+gint wg_find_strhash_bucket(void* db, char* data, char* extrastr, gint type, gint size, wg_uint hash) {
+  gint hashchain;
+  gint *objptr;
+
+  hashchain=dbfetch(db,strhash_chain(db,hash));
+  for(;hashchain!=0;hashchain=objptr[LONGSTR_HASHCHAIN_POS]) {
+    objptr=(gint *) offsettoptr(db,decode_longstr_offset(hashchain));
+    if ((wg_uint) objptr[LONGSTR_HASH_POS]==hash &&
+        wg_right_strhash_bucket(db,hashchain,data,extrastr,type,size)) {
       // found equal longstr, return it
-      //printf("wg_find_strhash_bucket found hashchain %d\n",hashchain);
       return hashchain;
     }
   }
@@ -184,25 +199,47 @@ gint wg_find_strhash_bucket(void* db, char* data, char* extrastr, gint type, gin
 
 int wg_right_strhash_bucket
             (void* db, gint longstr, char* cstr, char* cextrastr, gint ctype, gint cstrsize) {
-  char* str;
-  char* extrastr;
-  int strsize;
-  gint type;
-  //printf("wg_right_strhash_bucket called with %s %s type %d size %d\n",
-  //              cstr,cextrastr,ctype,cstrsize);
-  type=wg_get_encoded_type(db,longstr);
-  if (type!=ctype) return 0;
-  strsize=wg_decode_str_len(db,longstr)+1;
-  if (strsize!=cstrsize) return 0;
-  str=wg_decode_str(db,longstr);
-  if ((cstr==NULL && str!=NULL) || (cstr!=NULL && str==NULL)) return 0;
-  if ((cstr!=NULL) && (memcmp(str,cstr,cstrsize))) return 0;
-  extrastr=wg_decode_str_lang(db,longstr);
-  if ((cextrastr==NULL && extrastr!=NULL) || (cextrastr!=NULL && extrastr==NULL)) return 0;
-  if ((cextrastr!=NULL) && (strcmp(extrastr,cextrastr))) return 0;
+  gint* objptr;
+  gint meta;
+  gint extrastr;
+
+  objptr=(gint *) offsettoptr(db,decode_longstr_offset(longstr));
+  meta=objptr[LONGSTR_META_POS];
+  if ((meta&LONGSTR_META_TYPEMASK)!=ctype) return 0;
+  if (getusedobjectsize(*objptr)-((meta&LONGSTR_META_LENDIFMASK)>>LONGSTR_META_LENDIFSHFT)
+      !=cstrsize) return 0;
+  if (cstr==NULL) return 0;
+  if (memcmp(((char*)objptr)+(LONGSTR_HEADER_GINTS*sizeof(gint)),cstr,cstrsize)) return 0;
+  extrastr=objptr[LONGSTR_EXTRASTR_POS];
+  if (extrastr==0 || cextrastr==NULL) return (extrastr==0 && cextrastr==NULL);
+  if (strcmp(wg_decode_str(db,extrastr),cextrastr)) return 0;
   return 1;
 }
 
+/* Add a new longstr to strhash
+*
+*  hash should be computed with wg_hash_typedstr(). The strhash array
+*  is grown if necessary, failing to grow it is not an error.
+*/
+
+void wg_add_to_strhash(void* db, gint longstr, wg_uint hash) {
+  db_strhash_growth* grow = &(dbmemsegh(db)->strhash_growth);
+  gint* objptr;
+  gint chainoffset;
+
+  objptr=(gint *) offsettoptr(db,decode_longstr_offset(longstr));
+  objptr[LONGSTR_HASH_POS]=(gint) hash;
+  chainoffset=strhash_chain(db,hash);
+  objptr[LONGSTR_HASHCHAIN_POS]=dbfetch(db,chainoffset);
+  dbstore(db,chainoffset,longstr);
+  grow->count++;
+
+  if (grow->oldstart)
+    strhash_move(db,STRHASH_MOVE_STEP);
+  else if (grow->count>grow->limit)
+    strhash_grow(db);
+}
+
 /* Remove longstr from strhash
 *
 *  Internal langstr etc are not removed by this op.
@@ -210,49 +247,23 @@ int wg_right_strhash_bucket
 */
 
 gint wg_remove_from_strhash(void* db, gint longstr) {
-  db_memsegment_header* dbh = dbmemsegh(db);
-  gint type;
-  gint* extrastrptr;
-  char* extrastr;
-  char* data;
-  gint length;
-  gint hash;
-  gint chainoffset;
-  gint hashchain;
-  gint nextchain;
+  db_strhash_growth* grow = &(dbmemsegh(db)->strhash_growth);
   gint offset;
   gint* objptr;
-  gint fldval;
-  gint objsize;
-  gint strsize;
-  gint* typeptr;
-
-  //printf("wg_remove_from_strhash called on %d\n",longstr);
-  //wg_debug_print_value(db,longstr);
-  //printf("\n\n");
+  gint chainoffset;
+  gint hashchain;
+
   offset=decode_longstr_offset(longstr);
   objptr=(gint*) offsettoptr(db,offset);
-  // get string data elements
-  //type=objptr=offsettoptr(db,decode_longstr_offset(data));
-  extrastrptr=(gint *) (((char*)(objptr))+(LONGSTR_EXTRASTR_POS*sizeof(gint)));
-  fldval=*extrastrptr;
-  if (fldval==0) extrastr=NULL;
-  else extrastr=wg_decode_str(db,fldval);
-  data=((char*)(objptr))+(LONGSTR_HEADER_GINTS*sizeof(gint));
-  objsize=getusedobjectsize(*objptr);
-  strsize=objsize-(((*(objptr+LONGSTR_META_POS))&LONGSTR_META_LENDIFMASK)>>LONGSTR_META_LENDIFSHFT);
-  length=strsize;
-  typeptr=(gint*)(((char*)(objptr))+(+LONGSTR_META_POS*sizeof(gint)));
-  type=(*typeptr)&LONGSTR_META_TYPEMASK;
-  //type=wg_get_encoded_type(db,longstr);
-  // get hash of data elements and find the location in hashtable/chains
-  hash=wg_hash_typedstr(db,data,extrastr,type,length);
-  chainoffset=((dbh->strhash_area_header).arraystart)+(sizeof(gint)*hash);
+  // the stored hash gives the location in hashtable/chains
+  chainoffset=strhash_chain(db,(wg_uint) objptr[LONGSTR_HASH_POS]);
   hashchain=dbfetch(db,chainoffset);
   while(hashchain!=0) {
     if (hashchain==longstr) {
-      nextchain=dbfetch(db,decode_longstr_offset(hashchain)+(LONGSTR_HASHCHAIN_POS*sizeof(gint)));
-      dbstore(db,chainoffset,nextchain);
+      dbstore(db,chainoffset,objptr[LONGSTR_HASHCHAIN_POS]);
+      grow->count--;
+      if (grow->oldstart)
+        strhash_move(db,STRHASH_MOVE_STEP);
       return 0;
     }
     chainoffset=decode_longstr_offset(hashchain)+(LONGSTR_HASHCHAIN_POS*sizeof(gint));
@@ -262,6 +273,123 @@ gint wg_remove_from_strhash(void* db, gint longstr) {
   return -1;
 }
 
+/* Return the offset of the strhash array element for the hash
+*
+*/
+
+static gint strhash_chain(void* db, wg_uint hash) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  gint i;
+
+  if (dbh->strhash_growth.oldstart) {
+    i=(gint) (hash & (dbh->strhash_growth.oldlength-1));
+    if (i>=dbh->strhash_growth.moved)
+      return dbh->strhash_growth.oldstart+(sizeof(gint)*i);
+  }
+  i=(gint) (hash & ((dbh->strhash_area_header).arraylength-1));
+  return (dbh->strhash_area_header).arraystart+(sizeof(gint)*i);
+}
+
+/* Start growing the strhash array
+*
+*/
+
+static void strhash_grow(void* db) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  db_hash_area_header* areah = &(dbh->strhash_area_header);
+  db_strhash_growth* grow = &(dbh->strhash_growth);
+  gint length=areah->arraylength*2;
+  gint object;
+
+  object=wg_alloc_gints(db,&(dbh->longstr_area_header),length+1);
+  if (!object) {
+    // keep using the current array, try again when it's fuller
+    grow->limit*=2;
+    return;
+  }
+  memset(offsettoptr(db,object+sizeof(gint)),0,length*sizeof(gint));
+  grow->oldstart=areah->arraystart;
+  grow->oldlength=areah->arraylength;
+  grow->oldobject=grow->arrayobject;
+  grow->moved=0;
+  grow->arrayobject=object;
+  grow->limit=length*STRHASH_MAX_LOAD;
+  areah->arraystart=object+sizeof(gint);
+  areah->arraylength=length;
+  strhash_move(db,STRHASH_MOVE_STEP);
+}
+
+/* Move chains from the old strhash array to the new one
+*
+*  The old array is released when all of it has been moved.
+*/
+
+static void strhash_move(void* db, gint steps) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  db_strhash_growth* grow = &(dbh->strhash_growth);
+  gint oldoffset, hashchain, nextchain, chainoffset;
+  gint* objptr;
+
+  for(;steps>0 && grow->moved<grow->oldlength;steps--) {
+    oldoffset=grow->oldstart+(sizeof(gint)*grow->moved);
+    hashchain=dbfetch(db,oldoffset);
+    dbstore(db,oldoffset,0);
+    grow->moved++;
+    for(;hashchain!=0;hashchain=nextchain) {
+      objptr=(gint *) offsettoptr(db,decode_longstr_offset(hashchain));
+      nextchain=objptr[LONGSTR_HASHCHAIN_POS];
+      chainoffset=strhash_chain(db,(wg_uint) objptr[LONGSTR_HASH_POS]);
+      objptr[LONGSTR_HASHCHAIN_POS]=dbfetch(db,chainoffset);
+      dbstore(db,chainoffset,hashchain);
+    }
+  }
+  if (grow->moved==grow->oldlength) {
+    // the initial array is not an object and cannot be released
+    if (grow->oldobject)
+      wg_free_object(db,&(dbh->longstr_area_header),grow->oldobject);
+    grow->oldstart=0;
+    grow->oldlength=0;
+    grow->oldobject=0;
+    grow->moved=0;
+  }
+}
+
+/* 64-bit hash of a byte buffer, continuing from a previous hash
+*
+*/
+
+static unsigned long long hash_mem(unsigned long long hash, const char *data,
+  gint length)
+{
+  const unsigned char* p=(const unsigned char*) data;
+  const unsigned char* endp=p+(length&~((gint) 7));
+  unsigned long long k;
+
+  hash^=(unsigned long long) length*HASH_M;
+  for(;p<endp;p+=8) {
+    memcpy(&k,p,8);
+    k*=HASH_M;
+    k^=k>>HASH_R;
+    k*=HASH_M;
+    hash^=k;
+    hash*=HASH_M;
+  }
+  switch(length&7) {
+    case 7: hash^=(unsigned long long) p[6]<<48; /* fall through */
+    case 6: hash^=(unsigned long long) p[5]<<40; /* fall through */
+    case 5: hash^=(unsigned long long) p[4]<<32; /* fall through */
+    case 4: hash^=(unsigned long long) p[3]<<24; /* fall through */
+    case 3: hash^=(unsigned long long) p[2]<<16; /* fall through */
+    case 2: hash^=(unsigned long long) p[1]<<8; /* fall through */
+    case 1: hash^=(unsigned long long) p[0];
+            hash*=HASH_M;
+  }
+  hash^=hash>>HASH_R;
+  hash*=HASH_M;
+  hash^=hash>>HASH_R;
+  return hash;
+}
+
 
 /* -------------- hash index support ------------------ */
 
@@ -297,6 +425,7 @@ gint wg_decode_for_hashing(void *db, gint enc, char **decbytes) {
   double doubledata;
   char *bytedata;
   char *exdata, *buf = NULL, *outbuf;
+  char tinybuf[sizeof(gint)];
 
   type = wg_get_encoded_type(db, enc);
   switch(type) {
@@ -326,8 +455,13 @@ gint wg_decode_for_hashing(void *db, gint enc, char **decbytes) {
       bytedata = (char *) &doubledata;
       break;
     case WG_STRTYPE:
-      len = wg_decode_str_len(db, enc);
-      bytedata = wg_decode_str(db, enc);
+      if(istinystr(enc)) {
+        len = wg_decode_tinystr_copy(enc, tinybuf);
+        bytedata = tinybuf;
+      } else {
+        len = wg_decode_str_len(db, enc);
+        bytedata = wg_decode_str(db, enc);
+      }
       break;
     case WG_URITYPE:
       len = wg_decode_uri_len(db, enc);
@@ -387,15 +521,9 @@ gint wg_decode_for_hashing(void *db, gint enc, char **decbytes) {
  * Calculate a hash for a byte buffer. Truncates the hash to given size.
  */
 static wg_uint hash_bytes(void *db, char *data, gint length, gint hashsz) {
-  char* endp;
-  wg_uint hash = 0;
-
-  if (data!=NULL) {
-    for(endp=data+length; data<endp; data++) {
-      hash = *data + (hash << 6) + (hash << 16) - hash;
-    }
-  }
-  return hash % hashsz;
+  if (data==NULL)
+    return 0;
+  return (wg_uint) (hash_mem(0, data, length) % hashsz);
 }
 
 /*
@@ -37,6 +37,7 @@
 #include "../config.h"
 #endif
 #include "dballoc.h"
+#include "dbdata.h"
 
 /* ==== Public macros ==== */
 
@@ -47,10 +48,11 @@
 
 /* ==== Protos ==== */
 
-int wg_hash_typedstr(void* db, char* data, char* extrastr, gint type, gint length);
-gint wg_find_strhash_bucket(void* db, char* data, char* extrastr, gint type, gint size, gint hashchain);
+wg_uint wg_hash_typedstr(void* db, char* data, char* extrastr, gint type, gint length);
+gint wg_find_strhash_bucket(void* db, char* data, char* extrastr, gint type, gint size, wg_uint hash);
 int wg_right_strhash_bucket
             (void* db, gint longstr, char* cstr, char* cextrastr, gint ctype, gint cstrsize);
+void wg_add_to_strhash(void* db, gint longstr, wg_uint hash);
 gint wg_remove_from_strhash(void* db, gint longstr);
 
 gint wg_decode_for_hashing(void *db, gint enc, char **decbytes);
@@ -62,12 +62,73 @@ extern "C" {
 #define HASHIDX_OP_REMOVE 2
 #define HASHIDX_OP_FIND 3
 
+#define WG_BTREE_MAX_DEPTH 32 /* path length limit for B+tree updates */
+
+/* T-node slot helpers. With TTREE_KEY_PREFIX the key prefix of the
+ * value (wg_compare_key()) is kept next to the row offset in each
+ * slot and the values are only compared if the keys are equal. The
+ * *_COMPARE macros compare the value v (with key k) to the slot or
+ * to the node bounds. They rely on current_min and current_max
+ * being in sync with the leftmost and rightmost slots.
+ */
+#define TNODE_SLOT_VALUE(d, n, i, c) wg_get_field(d, \
+  (void *)offsettoptr(d, (n)->array_of_values[i]), c)
+
+#ifdef TTREE_KEY_PREFIX
+#define TNODE_KEY(d, v) wg_compare_key(d, v)
+#define TNODE_SET(n, i, o, k) { (n)->array_of_values[i] = (o); \
+  (n)->array_of_keys[i] = (k); }
+#define TNODE_MOVE(dn, di, sn, si) { \
+  (dn)->array_of_values[di] = (sn)->array_of_values[si]; \
+  (dn)->array_of_keys[di] = (sn)->array_of_keys[si]; }
+#define TNODE_SLOT_COMPARE(d, n, i, c, v, k) \
+  ((n)->array_of_keys[i] != (k) ? \
+    WG_KEY_COMPARE(k, (n)->array_of_keys[i]) : \
+    WG_COMPARE(d, v, TNODE_SLOT_VALUE(d, n, i, c)))
+#define TNODE_MIN_COMPARE(d, n, v, k) \
+  ((n)->number_of_elements && (n)->array_of_keys[0] != (k) ? \
+    WG_KEY_COMPARE(k, (n)->array_of_keys[0]) : \
+    WG_COMPARE(d, v, (n)->current_min))
+#define TNODE_MAX_COMPARE(d, n, v, k) \
+  ((n)->number_of_elements && \
+    (n)->array_of_keys[(n)->number_of_elements - 1] != (k) ? \
+    WG_KEY_COMPARE(k, (n)->array_of_keys[(n)->number_of_elements - 1]) : \
+    WG_COMPARE(d, v, (n)->current_max))
+#else
+#define TNODE_KEY(d, v) ((wg_uint) 0)
+#define TNODE_SET(n, i, o, k) { (n)->array_of_values[i] = (o); (void) (k); }
+#define TNODE_MOVE(dn, di, sn, si) \
+  (dn)->array_of_values[di] = (sn)->array_of_values[si]
+#define TNODE_SLOT_COMPARE(d, n, i, c, v, k) \
+  ((void) (k), WG_COMPARE(d, v, TNODE_SLOT_VALUE(d, n, i, c)))
+#define TNODE_MIN_COMPARE(d, n, v, k) \
+  ((void) (k), WG_COMPARE(d, v, (n)->current_min))
+#define TNODE_MAX_COMPARE(d, n, v, k) \
+  ((void) (k), WG_COMPARE(d, v, (n)->current_max))
+#endif
+
+/* Rows with equal values are ordered by the row offsets, so that every
+ * row has a unique position in the tree. This lets a query continue
+ * after a given row without scanning the rows with the same value
+ * (see wg_search_ttree_after() and wg_search_btree_after()).
+ */
+#define ROW_COMPARE(a, b) ((a) < (b) ? WG_LESSTHAN : \
+  ((a) > (b) ? WG_GREATER : WG_EQUAL))
+
 /* ======= Private protos ================ */
 
 #ifndef TTREE_SINGLE_COMPARE
 static gint db_find_bounding_tnode(void *db, gint rootoffset, gint key,
-  gint *result, struct wg_tnode *rb_node);
+  wg_uint ckey, gint *result, struct wg_tnode *rb_node);
 #endif
+static gint search_ttree_rightmost(void *db, gint rootoffset,
+  gint key, wg_uint ckey, gint *result, struct wg_tnode *rb_node);
+static gint search_ttree_leftmost(void *db, gint rootoffset,
+  gint key, wg_uint ckey, gint *result, struct wg_tnode *lb_node);
+static gint tnode_slot_compare_row(void *db, struct wg_tnode *node, gint i,
+  gint column, gint key, wg_uint ckey, gint row);
+static gint find_bounding_tnode_row(void *db, gint rootoffset, gint key,
+  wg_uint ckey, gint row, gint *result);
 static int db_which_branch_causes_overweight(void *db, struct wg_tnode *root);
 static int db_rotate_ttree(void *db, gint index_id, struct wg_tnode *root,
   int overw);
@@ -77,6 +138,11 @@ static gint ttree_remove_row(void *db, gint index_id, void * rec);
 static gint create_ttree_index(void *db, gint index_id);
 static gint drop_ttree_index(void *db, gint column);
 
+static gint btree_add_row(void *db, gint index_id, void *rec);
+static gint btree_remove_row(void *db, gint index_id, void *rec);
+static gint create_btree_index(void *db, gint index_id);
+static gint drop_btree_index(void *db, gint index_id);
+
 static gint insert_into_list(void *db, gint *head, gint value);
 static void delete_from_list(void *db, gint *head);
 #ifdef USE_INDEX_TEMPLATE
@@ -148,7 +214,7 @@ static gint show_index_error_nr(void* db, char* errmsg, gint nr);
 *  returns bounding node offset or if no really bounding node exists, then the closest node
 */
 static gint db_find_bounding_tnode(void *db, gint rootoffset, gint key,
-  gint *result, struct wg_tnode *rb_node) {
+  wg_uint ckey, gint *result, struct wg_tnode *rb_node) {
 
   struct wg_tnode * node = (struct wg_tnode *)offsettoptr(db,rootoffset);
 
@@ -156,23 +222,23 @@ static gint db_find_bounding_tnode(void *db, gint rootoffset, gint key,
    * the node to determine immediately if the value falls between them.
    */
 
-  if(WG_COMPARE(db, key, node->current_min) == WG_LESSTHAN) {
+  if(TNODE_MIN_COMPARE(db, node, key, ckey) == WG_LESSTHAN) {
     /* if(key < node->current_max) */
     if(node->left_child_offset != 0)
       return db_find_bounding_tnode(db, node->left_child_offset,
-        key, result, NULL);
+        key, ckey, result, NULL);
     else {
       *result = DEAD_END_LEFT_NOT_BOUNDING;
       return rootoffset;
     }
-  } else if(WG_COMPARE(db, key, node->current_max) != WG_GREATER) {
+  } else if(TNODE_MAX_COMPARE(db, node, key, ckey) != WG_GREATER) {
     *result = REALLY_BOUNDING_NODE;
     return rootoffset;
   }
   else { /* if(key > node->current_max) */
     if(node->right_child_offset != 0)
       return db_find_bounding_tnode(db, node->right_child_offset,
-        key, result, NULL);
+        key, ckey, result, NULL);
     else{
       *result = DEAD_END_RIGHT_NOT_BOUNDING;
       return rootoffset;
@@ -183,9 +249,59 @@ static gint db_find_bounding_tnode(void *db, gint rootoffset, gint key,
 /* "rightmost" node search is the improved tree search described in
  * the original T-tree paper.
  */
-#define db_find_bounding_tnode wg_search_ttree_rightmost
+#define db_find_bounding_tnode search_ttree_rightmost
 #endif
 
+/** Compare a value and a row to the given slot of a node */
+static gint tnode_slot_compare_row(void *db, struct wg_tnode *node, gint i,
+  gint column, gint key, wg_uint ckey, gint row) {
+  gint cr = TNODE_SLOT_COMPARE(db, node, i, column, key, ckey);
+  if(cr == WG_EQUAL)
+    cr = ROW_COMPARE(row, node->array_of_values[i]);
+  return cr;
+}
+
+/**
+*  Find the node that bounds a value and a row. Unlike
+*  db_find_bounding_tnode(), equal values are told apart by the row
+*  offsets, so this is the only node where the row belongs.
+*  returns bounding node offset or if no really bounding node exists,
+*  then the closest node
+*/
+static gint find_bounding_tnode_row(void *db, gint rootoffset, gint key,
+  wg_uint ckey, gint row, gint *result) {
+  struct wg_tnode *node;
+  gint cr;
+
+  for(;;) {
+    node = (struct wg_tnode *) offsettoptr(db, rootoffset);
+    cr = TNODE_MIN_COMPARE(db, node, key, ckey);
+    if(cr == WG_EQUAL && node->number_of_elements)
+      cr = ROW_COMPARE(row, node->array_of_values[0]);
+    if(cr == WG_LESSTHAN) {
+      if(!node->left_child_offset) {
+        *result = DEAD_END_LEFT_NOT_BOUNDING;
+        return rootoffset;
+      }
+      rootoffset = node->left_child_offset;
+      continue;
+    }
+    cr = TNODE_MAX_COMPARE(db, node, key, ckey);
+    if(cr == WG_EQUAL && node->number_of_elements)
+      cr = ROW_COMPARE(row,
+        node->array_of_values[node->number_of_elements - 1]);
+    if(cr != WG_GREATER) {
+      *result = REALLY_BOUNDING_NODE;
+      return rootoffset;
+    }
+    if(!node->right_child_offset) {
+      *result = DEAD_END_RIGHT_NOT_BOUNDING;
+      return rootoffset;
+    }
+    rootoffset = node->right_child_offset;
+  }
+}
+
 /**
 *  returns the description of imbalance - 4 cases possible
 *  LL - left child of the left child is overweight
@@ -302,11 +418,11 @@ static int db_rotate_ttree(void *db, gint index_id, struct wg_tnode *root, int o
       int i;
 
       /* Create space for elements from B */
-      ee->array_of_values[bb->number_of_elements - 1] = ee->array_of_values[0];
+      TNODE_MOVE(ee, bb->number_of_elements - 1, ee, 0);
 
       /* All the values moved are smaller than in E */
       for(i=1; i<bb->number_of_elements; i++)
-        ee->array_of_values[i-1] = bb->array_of_values[i];
+        TNODE_MOVE(ee, i-1, bb, i);
       ee->number_of_elements = bb->number_of_elements;
 
       /* Examine the new leftmost element to find current_min */
@@ -365,7 +481,7 @@ static int db_rotate_ttree(void *db, gint index_id, struct wg_tnode *root, int o
 
       /* All the values moved are larger than in E */
       for(i=1; i<bb->number_of_elements; i++)
-        ee->array_of_values[i] = bb->array_of_values[i-1];
+        TNODE_MOVE(ee, i, bb, i-1);
       ee->number_of_elements = bb->number_of_elements;
 
       /* Examine the new rightmost element to find current_max */
@@ -373,8 +489,7 @@ static int db_rotate_ttree(void *db, gint index_id, struct wg_tnode *root, int o
         ee->array_of_values[ee->number_of_elements - 1]), column);
 
       /* Remaining B node array element should sit in slot 0 */
-      bb->array_of_values[0] = \
-        bb->array_of_values[bb->number_of_elements - 1];
+      TNODE_MOVE(bb, 0, bb, bb->number_of_elements - 1);
       bb -> number_of_elements = 1;
       bb -> current_min = bb -> current_max;
     }
@@ -426,7 +541,8 @@ static int db_rotate_ttree(void *db, gint index_id, struct wg_tnode *root, int o
 */
 static gint ttree_add_row(void *db, gint index_id, void *rec) {
   gint rootoffset, column;
-  gint newvalue, boundtype, bnodeoffset, newoffset;
+  gint newvalue, newrow, boundtype, bnodeoffset, newoffset;
+  wg_uint newkey;
   struct wg_tnode *node;
   wg_index_header *hdr = (wg_index_header *)offsettoptr(db,index_id);
   db_memsegment_header* dbh = dbmemsegh(db);
@@ -445,9 +561,12 @@ static gint ttree_add_row(void *db, gint index_id, void *rec) {
 
   //extract real value from the row (rec)
   newvalue = wg_get_field(db, rec, column);
+  newkey = TNODE_KEY(db, newvalue);
+  newrow = ptrtooffset(db, rec);
 
-  //find bounding node for the value
-  bnodeoffset = db_find_bounding_tnode(db, rootoffset, newvalue, &boundtype, NULL);
+  //find bounding node for the value, equal values ordered by the row
+  bnodeoffset = find_bounding_tnode_row(db, rootoffset, newvalue, newkey,
+    newrow, &boundtype);
   node = (struct wg_tnode *)offsettoptr(db,bnodeoffset);
   newoffset = 0;//save here the offset of newly created tnode - 0 if no node added into the tree
   //if bounding node exists - follow one algorithm, else the other
@@ -468,20 +587,19 @@ static gint ttree_add_row(void *db, gint index_id, void *rec) {
          * since here the compare is more expensive than the slot
          * copying.
          */
-        cr = WG_COMPARE(db, wg_get_field(db,
-          (void *)offsettoptr(db,node->array_of_values[i]), column),
-          newvalue);
+        cr = tnode_slot_compare_row(db, node, i, column,
+          newvalue, newkey, newrow);
 
-        if(cr != WG_LESSTHAN) { /* value >= newvalue */
+        if(cr != WG_GREATER) { /* value >= newvalue */
           /* Push remaining values to the right */
           for(j=node->number_of_elements; j>i; j--)
-            node->array_of_values[j] = node->array_of_values[j-1];
+            TNODE_MOVE(node, j, node, j-1);
           break;
         }
       }
       /* i is either number_of_elements or a vacated slot
        * in the array now. */
-      node->array_of_values[i] = ptrtooffset(db,rec);
+      TNODE_SET(node, i, ptrtooffset(db,rec), newkey);
       node->number_of_elements++;
 
       /* Update min. Due to the >= comparison max is preserved
@@ -499,27 +617,32 @@ static gint ttree_add_row(void *db, gint index_id, void *rec) {
       //get the minimum element from this node
       int i, j;
       gint cr, minvalue, minvaluerowoffset;
+      wg_uint minkey;
 
       minvalue = node->current_min;
       minvaluerowoffset = node->array_of_values[0];
+#ifdef TTREE_KEY_PREFIX
+      minkey = node->array_of_keys[0];
+#else
+      minkey = 0;
+#endif
 
       /* Now scan for the matching slot. However, since
        * we already know the 0 slot will be re-filled, we
        * do this scan (and sort) in reverse order, compared to the case
        * where array had some space left. */
       for(i=WG_TNODE_ARRAY_SIZE-1; i>0; i--) {
-        cr = WG_COMPARE(db, wg_get_field(db,
-          (void *)offsettoptr(db,node->array_of_values[i]), column),
-          newvalue);
-        if(cr != WG_GREATER) { /* value <= newvalue */
+        cr = tnode_slot_compare_row(db, node, i, column,
+          newvalue, newkey, newrow);
+        if(cr != WG_LESSTHAN) { /* value <= newvalue */
           /* Push remaining values to the left */
           for(j=0; j<i; j++)
-            node->array_of_values[j] = node->array_of_values[j+1];
+            TNODE_MOVE(node, j, node, j+1);
           break;
         }
       }
       /* i is either 0 or a freshly vacated slot */
-      node->array_of_values[i] = ptrtooffset(db,rec);
+      TNODE_SET(node, i, ptrtooffset(db,rec), newkey);
 
       /* Update minimum. Thanks to the sorted array, we know for a fact
        * that the minimum sits in slot 0. */
@@ -550,7 +673,7 @@ static gint ttree_add_row(void *db, gint index_id, void *rec) {
       //otherwise make the new node as right child and put the value there
       if(node->number_of_elements < WG_TNODE_ARRAY_SIZE){
         //add array entry and update control data
-        node->array_of_values[node->number_of_elements] = minvaluerowoffset;//save offset, use first free slot
+        TNODE_SET(node, node->number_of_elements, minvaluerowoffset, minkey);//save offset, use first free slot
         node->number_of_elements++;
         node->current_max = minvalue;
 
@@ -568,7 +691,7 @@ static gint ttree_add_row(void *db, gint index_id, void *rec) {
         leaf->number_of_elements = 1;
         leaf->left_child_offset = 0;
         leaf->right_child_offset = 0;
-        leaf->array_of_values[0] = minvaluerowoffset;
+        TNODE_SET(leaf, 0, minvaluerowoffset, minkey);
         /* If the original, full node did not have a left child, then
          * there also wasn't a separate GLB node, so we are adding one now
          * as the left child. Otherwise, the new node is added as the right
@@ -633,12 +756,13 @@ static gint ttree_add_row(void *db, gint index_id, void *rec) {
       if(boundtype == DEAD_END_LEFT_NOT_BOUNDING) {
         /* our new value is the new min, push everything right */
         for(i=node->number_of_elements; i>0; i--)
-          node->array_of_values[i] = node->array_of_values[i-1];
-        node->array_of_values[0] = ptrtooffset(db,rec);
+          TNODE_MOVE(node, i, node, i-1);
+        TNODE_SET(node, 0, ptrtooffset(db,rec), newkey);
         node->current_min = newvalue;
       } else { /* DEAD_END_RIGHT_NOT_BOUNDING */
         /* even simpler case, new value is added to the right */
-        node->array_of_values[node->number_of_elements] = ptrtooffset(db,rec);
+        TNODE_SET(node, node->number_of_elements, ptrtooffset(db,rec),
+          newkey);
         node->current_max = newvalue;
       }
 
@@ -664,7 +788,7 @@ static gint ttree_add_row(void *db, gint index_id, void *rec) {
       leaf->number_of_elements = 1;
       leaf->left_child_offset = 0;
       leaf->right_child_offset = 0;
-      leaf->array_of_values[0] = ptrtooffset(db,rec);
+      TNODE_SET(leaf, 0, ptrtooffset(db,rec), newkey);
       newoffset = newnode;
       //set new node as left or right leaf
       if(boundtype == DEAD_END_LEFT_NOT_BOUNDING){
@@ -763,6 +887,7 @@ static gint ttree_remove_row(void *db, gint index_id, void * rec) {
   int i, found;
   gint key, rootoffset, column, boundtype, bnodeoffset;
   gint rowoffset;
+  wg_uint ckey;
   struct wg_tnode *node, *parent;
   wg_index_header *hdr = (wg_index_header *)offsettoptr(db,index_id);
 
@@ -778,6 +903,7 @@ static gint ttree_remove_row(void *db, gint index_id, void * rec) {
 #endif
   column = hdr->rec_field_index[0]; /* always one column for T-tree */
   key = wg_get_field(db, rec, column);
+  ckey = TNODE_KEY(db, key);
   rowoffset = ptrtooffset(db, rec);
 
   /* find bounding node for the value. Since non-unique values
@@ -785,8 +911,8 @@ static gint ttree_remove_row(void *db, gint index_id, void * rec) {
    * right from there (we *need* the exact row offset).
    */
 
-  bnodeoffset = wg_search_ttree_leftmost(db,
-          rootoffset, key, &boundtype, NULL);
+  bnodeoffset = search_ttree_leftmost(db,
+          rootoffset, key, ckey, &boundtype, NULL);
   node = (struct wg_tnode *)offsettoptr(db,bnodeoffset);
 
   //if bounding node does not exist - error
@@ -808,7 +934,7 @@ static gint ttree_remove_row(void *db, gint index_id, void * rec) {
     if(!bnodeoffset)
       break; /* no more successors */
     node = (struct wg_tnode *)offsettoptr(db,bnodeoffset);
-    if(WG_COMPARE(db, node->current_min, key) == WG_GREATER)
+    if(TNODE_MIN_COMPARE(db, node, key, ckey) == WG_LESSTHAN)
       break; /* successor is not a bounding node */
   }
 
@@ -821,7 +947,7 @@ found_row:
     /* slide the elements to the right of the found value
      * one step to the left */
     for(i=found; i<node->number_of_elements; i++)
-      node->array_of_values[i] = node->array_of_values[i+1];
+      TNODE_MOVE(node, i, node, i+1);
   }
 
   /* Update min/max */
@@ -849,12 +975,11 @@ found_row:
 
       /* Make space for a new min value */
       for(i=node->number_of_elements; i>0; i--)
-        node->array_of_values[i] = node->array_of_values[i-1];
+        TNODE_MOVE(node, i, node, i-1);
 
       /* take the glb value (always the rightmost in the array) and
        * insert it in our node */
-      node -> array_of_values[0] = \
-        glbnode->array_of_values[glbnode->number_of_elements-1];
+      TNODE_MOVE(node, 0, glbnode, glbnode->number_of_elements-1);
       node -> number_of_elements++;
       node -> current_min = glbnode -> current_max;
       if(node->number_of_elements == 1) /* we just got our first element */
@@ -946,11 +1071,10 @@ found_row:
       if(left){
         /* Left child elements are all smaller than in current node */
         for(j=i-1; j>=0; j--){
-          node->array_of_values[j + child->number_of_elements] = \
-            node->array_of_values[j];
+          TNODE_MOVE(node, j + child->number_of_elements, node, j);
         }
         for(j=0;j<child->number_of_elements;j++){
-          node->array_of_values[j]=child->array_of_values[j];
+          TNODE_MOVE(node, j, child, j);
         }
         node->left_subtree_height=0;
         node->left_child_offset=0;
@@ -959,7 +1083,7 @@ found_row:
       }else{
         /* Right child elements are all larger than in current node */
         for(j=0;j<child->number_of_elements;j++){
-          node->array_of_values[i+j]=child->array_of_values[j];
+          TNODE_MOVE(node, i+j, child, j);
         }
         node->right_subtree_height=0;
         node->right_child_offset=0;
@@ -1042,7 +1166,8 @@ found_row:
 gint wg_search_ttree_index(void *db, gint index_id, gint key){
   int i;
   gint rootoffset, bnodetype, bnodeoffset;
-  gint rowoffset, column;
+  gint column;
+  wg_uint ckey;
   struct wg_tnode * node;
   wg_index_header *hdr = (wg_index_header *)offsettoptr(db,index_id);
 
@@ -1059,8 +1184,9 @@ gint wg_search_ttree_index(void *db, gint index_id, gint key){
 #endif
 
   /* Find the leftmost bounding node */
-  bnodeoffset = wg_search_ttree_leftmost(db,
-          rootoffset, key, &bnodetype, NULL);
+  ckey = TNODE_KEY(db, key);
+  bnodeoffset = search_ttree_leftmost(db,
+          rootoffset, key, ckey, &bnodetype, NULL);
   node = (struct wg_tnode *)offsettoptr(db,bnodeoffset);
 
   if(bnodetype != REALLY_BOUNDING_NODE) return 0;
@@ -1069,11 +1195,8 @@ gint wg_search_ttree_index(void *db, gint index_id, gint key){
   /* find the record inside the node. */
   for(;;) {
     for(i=0;i<node->number_of_elements;i++){
-      rowoffset = node->array_of_values[i];
-      if(WG_COMPARE(db,
-        wg_get_field(db, (void *)offsettoptr(db,rowoffset), column),
-        key) == WG_EQUAL) {
-        return rowoffset;
+      if(TNODE_SLOT_COMPARE(db, node, i, column, key, ckey) == WG_EQUAL) {
+        return node->array_of_values[i];
       }
     }
     /* Normally we cannot end up here. We'll keep the code in case
@@ -1083,7 +1206,7 @@ gint wg_search_ttree_index(void *db, gint index_id, gint key){
     if(!bnodeoffset)
       break; /* no more successors */
     node = (struct wg_tnode *)offsettoptr(db,bnodeoffset);
-    if(WG_COMPARE(db, node->current_min, key) == WG_GREATER)
+    if(TNODE_MIN_COMPARE(db, node, key, ckey) == WG_LESSTHAN)
       break; /* successor is not a bounding node */
   }
 
@@ -1179,6 +1302,13 @@ gint wg_ttree_find_leaf_successor(void *db, gint nodeoffset) {
  */
 gint wg_search_ttree_rightmost(void *db, gint rootoffset,
   gint key, gint *result, struct wg_tnode *rb_node) {
+  return search_ttree_rightmost(db, rootoffset, key, TNODE_KEY(db, key),
+    result, rb_node);
+}
+
+/* ckey is the key prefix of the value (see TNODE_KEY) */
+static gint search_ttree_rightmost(void *db, gint rootoffset,
+  gint key, wg_uint ckey, gint *result, struct wg_tnode *rb_node) {
 
   struct wg_tnode * node;
 
@@ -1190,14 +1320,14 @@ gint wg_search_ttree_rightmost(void *db, gint rootoffset,
    * is selected immediately. If the search ends in a dead end, the node where
    * the right branch was taken is examined again.
    */
-  if(WG_COMPARE(db, key, node->current_min) == WG_LESSTHAN) {
+  if(TNODE_MIN_COMPARE(db, node, key, ckey) == WG_LESSTHAN) {
     /* key < node->current_min */
     if(node->left_child_offset != 0) {
-      return wg_search_ttree_rightmost(db, node->left_child_offset, key,
-        result, rb_node);
+      return search_ttree_rightmost(db, node->left_child_offset, key,
+        ckey, result, rb_node);
     } else if (rb_node) {
       /* Dead end, but we still have an unexamined node left */
-      if(WG_COMPARE(db, key, rb_node->current_max) != WG_GREATER) {
+      if(TNODE_MAX_COMPARE(db, rb_node, key, ckey) != WG_GREATER) {
         /* key<=rb_node->current_max */
         *result = REALLY_BOUNDING_NODE;
         return ptrtooffset(db, rb_node);
@@ -1213,9 +1343,9 @@ gint wg_search_ttree_rightmost(void *db, gint rootoffset,
        * current_max of the node (therefore avoiding one expensive
        * compare operation).
        */
-      return wg_search_ttree_rightmost(db, node->right_child_offset, key,
-        result, node);
-    } else if(WG_COMPARE(db, key, node->current_max) != WG_GREATER) {
+      return search_ttree_rightmost(db, node->right_child_offset, key,
+        ckey, result, node);
+    } else if(TNODE_MAX_COMPARE(db, node, key, ckey) != WG_GREATER) {
       /* key<=node->current_max */
       *result = REALLY_BOUNDING_NODE;
       return rootoffset;
@@ -1228,18 +1358,19 @@ gint wg_search_ttree_rightmost(void *db, gint rootoffset,
 #else
   gint bnodeoffset;
 
-  bnodeoffset = db_find_bounding_tnode(db, rootoffset, key, result, NULL);
+  bnodeoffset = db_find_bounding_tnode(db, rootoffset, key, ckey,
+    result, NULL);
   if(*result != REALLY_BOUNDING_NODE)
     return bnodeoffset;
 
   /* There is at least one node with the key we're interested in,
    * now make sure we have the rightmost */
   node = offsettoptr(db, bnodeoffset);
-  while(WG_COMPARE(db, node->current_max, key) == WG_EQUAL) {
+  while(TNODE_MAX_COMPARE(db, node, key, ckey) == WG_EQUAL) {
     gint nextoffset = TNODE_SUCCESSOR(db, node);
     if(nextoffset) {
       struct wg_tnode *next = offsettoptr(db, nextoffset);
-        if(WG_COMPARE(db, next->current_min, key) == WG_GREATER)
+        if(TNODE_MIN_COMPARE(db, next, key, ckey) == WG_LESSTHAN)
           /* next->current_min > key */
           break; /* overshot */
       node = next;
@@ -1256,6 +1387,12 @@ gint wg_search_ttree_rightmost(void *db, gint rootoffset,
  */
 gint wg_search_ttree_leftmost(void *db, gint rootoffset,
   gint key, gint *result, struct wg_tnode *lb_node) {
+  return search_ttree_leftmost(db, rootoffset, key, TNODE_KEY(db, key),
+    result, lb_node);
+}
+
+static gint search_ttree_leftmost(void *db, gint rootoffset,
+  gint key, wg_uint ckey, gint *result, struct wg_tnode *lb_node) {
 
   struct wg_tnode * node;
 
@@ -1263,14 +1400,14 @@ gint wg_search_ttree_leftmost(void *db, gint rootoffset,
   node = (struct wg_tnode *)offsettoptr(db,rootoffset);
 
   /* Rightmost bound search mirrored */
-  if(WG_COMPARE(db, key, node->current_max) == WG_GREATER) {
+  if(TNODE_MAX_COMPARE(db, node, key, ckey) == WG_GREATER) {
     /* key > node->current_max */
     if(node->right_child_offset != 0) {
-      return wg_search_ttree_leftmost(db, node->right_child_offset, key,
-        result, lb_node);
+      return search_ttree_leftmost(db, node->right_child_offset, key,
+        ckey, result, lb_node);
     } else if (lb_node) {
       /* Dead end, but we still have an unexamined node left */
-      if(WG_COMPARE(db, key, lb_node->current_min) != WG_LESSTHAN) {
+      if(TNODE_MIN_COMPARE(db, lb_node, key, ckey) != WG_LESSTHAN) {
         /* key>=lb_node->current_min */
         *result = REALLY_BOUNDING_NODE;
         return ptrtooffset(db, lb_node);
@@ -1281,9 +1418,9 @@ gint wg_search_ttree_leftmost(void *db, gint rootoffset,
   }
   else {
     if(node->left_child_offset != 0) {
-      return wg_search_ttree_leftmost(db, node->left_child_offset, key,
-        result, node);
-    } else if(WG_COMPARE(db, key, node->current_min) != WG_LESSTHAN) {
+      return search_ttree_leftmost(db, node->left_child_offset, key,
+        ckey, result, node);
+    } else if(TNODE_MIN_COMPARE(db, node, key, ckey) != WG_LESSTHAN) {
       /* key>=node->current_min */
       *result = REALLY_BOUNDING_NODE;
       return rootoffset;
@@ -1294,18 +1431,19 @@ gint wg_search_ttree_leftmost(void *db, gint rootoffset,
 #else
   gint bnodeoffset;
 
-  bnodeoffset = db_find_bounding_tnode(db, rootoffset, key, result, NULL);
+  bnodeoffset = db_find_bounding_tnode(db, rootoffset, key, ckey,
+    result, NULL);
   if(*result != REALLY_BOUNDING_NODE)
     return bnodeoffset;
 
   /* One (we don't know which) bounding node found, traverse the
    * tree to the leftmost. */
   node = offsettoptr(db, bnodeoffset);
-  while(WG_COMPARE(db, node->current_min, key) == WG_EQUAL) {
+  while(TNODE_MIN_COMPARE(db, node, key, ckey) == WG_EQUAL) {
     gint prevoffset = TNODE_PREDECESSOR(db, node);
     if(prevoffset) {
       struct wg_tnode *prev = offsettoptr(db, prevoffset);
-      if(WG_COMPARE(db, prev->current_max, key) == WG_LESSTHAN)
+      if(TNODE_MAX_COMPARE(db, prev, key, ckey) == WG_GREATER)
         /* prev->current_max < key */
         break; /* overshot */
       node = prev;
@@ -1325,14 +1463,13 @@ gint wg_search_ttree_leftmost(void *db, gint rootoffset,
 gint wg_search_tnode_first(void *db, gint nodeoffset, gint key,
   gint column) {
 
-  gint i, encoded;
+  gint i;
+  wg_uint ckey = TNODE_KEY(db, key);
   struct wg_tnode *node = (struct wg_tnode *) offsettoptr(db, nodeoffset);
 
   for(i=0; i<node->number_of_elements; i++) {
     /* Naive scan is ok for small values of WG_TNODE_ARRAY_SIZE. */
-    encoded = wg_get_field(db,
-      (void *)offsettoptr(db,node->array_of_values[i]), column);
-    if(WG_COMPARE(db, encoded, key) != WG_LESSTHAN)
+    if(TNODE_SLOT_COMPARE(db, node, i, column, key, ckey) != WG_GREATER)
       /* encoded >= key */
       return i;
   }
@@ -1348,13 +1485,12 @@ gint wg_search_tnode_first(void *db, gint nodeoffset, gint key,
 gint wg_search_tnode_last(void *db, gint nodeoffset, gint key,
   gint column) {
 
-  gint i, encoded;
+  gint i;
+  wg_uint ckey = TNODE_KEY(db, key);
   struct wg_tnode *node = (struct wg_tnode *) offsettoptr(db, nodeoffset);
 
   for(i=node->number_of_elements -1; i>=0; i--) {
-    encoded = wg_get_field(db,
-      (void *)offsettoptr(db,node->array_of_values[i]), column);
-    if(WG_COMPARE(db, encoded, key) != WG_GREATER)
+    if(TNODE_SLOT_COMPARE(db, node, i, column, key, ckey) != WG_LESSTHAN)
       /* encoded <= key */
       return i;
   }
@@ -1362,6 +1498,42 @@ gint wg_search_tnode_last(void *db, gint nodeoffset, gint key,
   return -1;
 }
 
+/** Find the first entry that follows a value and a row
+ *  Rows with equal values are ordered by their offsets, so this
+ *  is the entry after the row, or where the row would be if it
+ *  is not in the index.
+ *  returns the offset of the node and stores the slot in *slot.
+ *  returns 0 if there is no such entry.
+ */
+gint wg_search_ttree_after(void *db, gint index_id, gint key, gint row,
+  gint *slot) {
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  gint column = hdr->rec_field_index[0];
+  wg_uint ckey = TNODE_KEY(db, key);
+  gint offset, boundtype, i = 0;
+  struct wg_tnode *node;
+
+  offset = find_bounding_tnode_row(db, TTREE_ROOT_NODE(hdr), key, ckey,
+    row, &boundtype);
+  node = (struct wg_tnode *) offsettoptr(db, offset);
+  if(!node->number_of_elements)
+    return 0; /* empty index */
+  if(boundtype == REALLY_BOUNDING_NODE) {
+    while(i < node->number_of_elements &&\
+      tnode_slot_compare_row(db, node, i, column, key, ckey, row) !=\
+      WG_LESSTHAN)
+      i++;
+  } else if(boundtype == DEAD_END_RIGHT_NOT_BOUNDING) {
+    i = node->number_of_elements;
+  }
+  if(i >= node->number_of_elements) {
+    offset = TNODE_SUCCESSOR(db, node);
+    i = 0;
+  }
+  *slot = i;
+  return offset;
+}
+
 /** Create T-tree index on a column
 *  returns:
 *  0 - on success
@@ -1463,6 +1635,505 @@ static gint drop_ttree_index(void *db, gint index_id){
   return 0;
 }
 
+/* ------------------- B+tree private functions ------------- */
+
+/*
+ * B+tree index:
+ * - all records are in the leaves, which are chained for range scans
+ * - internal nodes hold the smallest record of each child subtree, so
+ *   the same search function works on both kinds of nodes
+ * - equal values are ordered by the record offsets
+ * - nodes are searched by key prefixes first (branch-free binary search
+ *   over a contiguous array), values are compared only on prefix ties
+ * - nodes are split when full. Deleting does not merge nodes, they
+ *   are freed when they become empty.
+ */
+
+/** Binary search for the first key prefix >= key
+ *  The loop has no data-dependent branches, the compiler turns
+ *  the selection into a conditional move.
+ */
+static gint bnode_lower_bound(wg_uint *keys, gint n, wg_uint key) {
+  wg_uint *base = keys;
+  gint half;
+
+  if(!n)
+    return 0;
+  while(n > 1) {
+    half = n >> 1;
+    base = (base[half] < key ? base + half : base);
+    n -= half;
+  }
+  return (gint) (base - keys) + (*base < key);
+}
+
+/** Find the first entry in the node that is greater than (upper != 0)
+ *  or greater or equal to (upper == 0) the value. If row is not 0,
+ *  equal values are compared by the record offsets.
+ *  returns number_of_elements if there is no such entry.
+ */
+static gint bnode_search(void *db, struct wg_bnode *node, gint column,
+  gint value, wg_uint key, gint row, int upper) {
+  gint lo, hi, mid, cr;
+
+  lo = bnode_lower_bound(node->array_of_keys, node->number_of_elements, key);
+  hi = lo;
+  while(hi < node->number_of_elements && node->array_of_keys[hi] == key)
+    hi++;
+
+  /* Only the entries with an equal key prefix need the values */
+  while(lo < hi) {
+    mid = (lo + hi) >> 1;
+    cr = WG_COMPARE(db, value, wg_get_field(db,
+      (void *)offsettoptr(db, node->array_of_rows[mid]), column));
+    if(cr == WG_EQUAL && row)
+      cr = ROW_COMPARE(row, node->array_of_rows[mid]);
+    if(cr == WG_GREATER || (upper && cr == WG_EQUAL))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/** Descend from the root to the leaf where the value belongs
+ *  upper selects the rightmost (upper != 0) or the leftmost leaf
+ *  that may contain the value. If row is not 0, the leaf is the
+ *  one for the value and the row. If path is not NULL, the nodes
+ *  on the way are stored in path and the entry numbers that
+ *  were followed in pos.
+ *  returns the depth of the leaf.
+ */
+static int btree_find_leaf(void *db, wg_index_header *hdr, gint value,
+  wg_uint key, gint row, int upper, gint *path, gint *pos) {
+  gint offset = BTREE_ROOT_NODE(hdr);
+  gint column = hdr->rec_field_index[0];
+  struct wg_bnode *node = (struct wg_bnode *) offsettoptr(db, offset);
+  int depth = 0;
+  gint i;
+
+  while(node->level > 0) {
+    i = bnode_search(db, node, column, value, key, row, upper) - 1;
+    if(i < 0)
+      i = 0;
+    if(path) {
+      path[depth] = offset;
+      pos[depth] = i;
+    }
+    depth++;
+    offset = node->array_of_children[i];
+    node = (struct wg_bnode *) offsettoptr(db, offset);
+  }
+  if(path)
+    path[depth] = offset;
+  return depth;
+}
+
+/** Update the smallest values in the parents after the first
+ *  entry of the node at the given depth changed.
+ */
+static void btree_update_min(void *db, gint *path, gint *pos, int depth) {
+  struct wg_bnode *node, *parent;
+
+  node = (struct wg_bnode *) offsettoptr(db, path[depth]);
+  while(depth > 0) {
+    depth--;
+    parent = (struct wg_bnode *) offsettoptr(db, path[depth]);
+    parent->array_of_keys[pos[depth]] = node->array_of_keys[0];
+    parent->array_of_rows[pos[depth]] = node->array_of_rows[0];
+    if(pos[depth])
+      break; /* the smallest value of the parent did not change */
+    node = parent;
+  }
+}
+
+/** Insert an entry in the node, making room for it */
+static void bnode_insert_entry(struct wg_bnode *node, gint i,
+  wg_uint key, gint row, gint child) {
+  gint j;
+
+  for(j=node->number_of_elements; j>i; j--) {
+    node->array_of_keys[j] = node->array_of_keys[j-1];
+    node->array_of_rows[j] = node->array_of_rows[j-1];
+    node->array_of_children[j] = node->array_of_children[j-1];
+  }
+  node->array_of_keys[i] = key;
+  node->array_of_rows[i] = row;
+  node->array_of_children[i] = child;
+  node->number_of_elements++;
+}
+
+/** Remove an entry from the node */
+static void bnode_remove_entry(struct wg_bnode *node, gint i) {
+  node->number_of_elements--;
+  for(; i<node->number_of_elements; i++) {
+    node->array_of_keys[i] = node->array_of_keys[i+1];
+    node->array_of_rows[i] = node->array_of_rows[i+1];
+    node->array_of_children[i] = node->array_of_children[i+1];
+  }
+}
+
+/** Allocate and initialize an empty node */
+static gint btree_alloc_node(void *db, gint level) {
+  struct wg_bnode *node;
+  gint offset;
+
+  offset = wg_alloc_fixlen_object(db, &(dbmemsegh(db)->bnode_area_header));
+  if(!offset)
+    return 0;
+  node = (struct wg_bnode *) offsettoptr(db, offset);
+  node->number_of_elements = 0;
+  node->level = level;
+  node->next_offset = 0;
+  node->prev_offset = 0;
+  return offset;
+}
+
+/** Insert an entry in the node at the given depth of the path
+ *  Full nodes are split and the new nodes inserted in the parents.
+ *  returns 0 on success, -1 on error.
+ */
+static gint btree_insert_entry(void *db, wg_index_header *hdr,
+  gint *path, gint *pos, int depth, gint i,
+  wg_uint key, gint row, gint child) {
+  struct wg_bnode *node, *newnode;
+  gint newoffset, j, half = WG_BNODE_ARRAY_SIZE / 2;
+
+  for(;;) {
+    node = (struct wg_bnode *) offsettoptr(db, path[depth]);
+    if(node->number_of_elements < WG_BNODE_ARRAY_SIZE) {
+      bnode_insert_entry(node, i, key, row, child);
+      if(i == 0)
+        btree_update_min(db, path, pos, depth);
+      return 0;
+    }
+
+    /* Split the node: the upper half goes to a new right sibling */
+    newoffset = btree_alloc_node(db, node->level);
+    if(!newoffset)
+      return -1;
+    newnode = (struct wg_bnode *) offsettoptr(db, newoffset);
+    for(j=half; j<WG_BNODE_ARRAY_SIZE; j++) {
+      newnode->array_of_keys[j-half] = node->array_of_keys[j];
+      newnode->array_of_rows[j-half] = node->array_of_rows[j];
+      newnode->array_of_children[j-half] = node->array_of_children[j];
+    }
+    newnode->number_of_elements = WG_BNODE_ARRAY_SIZE - half;
+    node->number_of_elements = half;
+
+    newnode->prev_offset = path[depth];
+    newnode->next_offset = node->next_offset;
+    if(node->next_offset) {
+      struct wg_bnode *next = \
+        (struct wg_bnode *) offsettoptr(db, node->next_offset);
+      next->prev_offset = newoffset;
+    } else if(!node->level) {
+      BTREE_MAX_NODE(hdr) = newoffset;
+    }
+    node->next_offset = newoffset;
+
+    if(i <= half) {
+      bnode_insert_entry(node, i, key, row, child);
+      if(i == 0)
+        btree_update_min(db, path, pos, depth);
+    } else {
+      bnode_insert_entry(newnode, i - half, key, row, child);
+    }
+
+    /* The new node is added to the parent after the split node */
+    key = newnode->array_of_keys[0];
+    row = newnode->array_of_rows[0];
+    child = newoffset;
+
+    if(depth == 0) {
+      /* Root was split, add a new level */
+      gint rootoffset;
+      struct wg_bnode *root;
+
+      rootoffset = btree_alloc_node(db, node->level + 1);
+      if(!rootoffset)
+        return -1;
+      root = (struct wg_bnode *) offsettoptr(db, rootoffset);
+      bnode_insert_entry(root, 0, node->array_of_keys[0],
+        node->array_of_rows[0], path[0]);
+      bnode_insert_entry(root, 1, key, row, child);
+      BTREE_ROOT_NODE(hdr) = rootoffset;
+      return 0;
+    }
+    depth--;
+    i = pos[depth] + 1;
+  }
+}
+
+/**  inserts pointer to data row into B+tree
+*
+*  returns:
+*  0 - on success
+*  -1 - if error
+*/
+static gint btree_add_row(void *db, gint index_id, void *rec) {
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  gint column = hdr->rec_field_index[0]; /* always one column for B+tree */
+  gint path[WG_BTREE_MAX_DEPTH], pos[WG_BTREE_MAX_DEPTH];
+  gint value, row, i;
+  wg_uint key;
+  struct wg_bnode *leaf;
+  int depth;
+
+  value = wg_get_field(db, rec, column);
+  key = wg_compare_key(db, value);
+  row = ptrtooffset(db, rec);
+
+  /* Equal values are ordered by the record offsets */
+  depth = btree_find_leaf(db, hdr, value, key, row, 1, path, pos);
+  if(depth >= WG_BTREE_MAX_DEPTH - 1) {
+    show_index_error(db, "B+tree is too deep");
+    return -1;
+  }
+  leaf = (struct wg_bnode *) offsettoptr(db, path[depth]);
+  i = bnode_search(db, leaf, column, value, key, row, 1);
+  return btree_insert_entry(db, hdr, path, pos, depth, i, key, row, 0);
+}
+
+/**  removes pointer to data row from B+tree
+*
+*  returns:
+*  0 - on success
+*  -1 - if error, index doesnt exist
+*  -3 - if error, value not found
+*/
+static gint btree_remove_row(void *db, gint index_id, void *rec) {
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  gint column = hdr->rec_field_index[0];
+  gint path[WG_BTREE_MAX_DEPTH], pos[WG_BTREE_MAX_DEPTH];
+  gint value, rowoffset, i;
+  wg_uint key;
+  struct wg_bnode *node, *parent;
+  int depth;
+
+  value = wg_get_field(db, rec, column);
+  key = wg_compare_key(db, value);
+  rowoffset = ptrtooffset(db, rec);
+
+  /* Equal values are ordered by the record offsets, so the leaf
+   * and the position of the row are found directly */
+  depth = btree_find_leaf(db, hdr, value, key, rowoffset, 1, path, pos);
+  node = (struct wg_bnode *) offsettoptr(db, path[depth]);
+  i = bnode_search(db, node, column, value, key, rowoffset, 0);
+  if(i >= node->number_of_elements || node->array_of_rows[i] != rowoffset)
+    return -3;
+
+  bnode_remove_entry(node, i);
+  if(node->number_of_elements) {
+    if(i == 0)
+      btree_update_min(db, path, pos, depth);
+    return 0;
+  }
+
+  /* Free the empty nodes, except the root */
+  while(depth > 0 && !node->number_of_elements) {
+    if(node->prev_offset) {
+      struct wg_bnode *prev = \
+        (struct wg_bnode *) offsettoptr(db, node->prev_offset);
+      prev->next_offset = node->next_offset;
+    } else if(!node->level) {
+      BTREE_MIN_NODE(hdr) = node->next_offset;
+    }
+    if(node->next_offset) {
+      struct wg_bnode *next = \
+        (struct wg_bnode *) offsettoptr(db, node->next_offset);
+      next->prev_offset = node->prev_offset;
+    } else if(!node->level) {
+      BTREE_MAX_NODE(hdr) = node->prev_offset;
+    }
+    wg_free_fixlen_object(db, &(dbmemsegh(db)->bnode_area_header),
+      path[depth]);
+
+    depth--;
+    parent = (struct wg_bnode *) offsettoptr(db, path[depth]);
+    bnode_remove_entry(parent, pos[depth]);
+    if(parent->number_of_elements && pos[depth] == 0)
+      btree_update_min(db, path, pos, depth);
+    node = parent;
+  }
+
+  /* Remove the levels that have a single child */
+  node = (struct wg_bnode *) offsettoptr(db, BTREE_ROOT_NODE(hdr));
+  while(node->level > 0 && node->number_of_elements == 1) {
+    gint child = node->array_of_children[0];
+    wg_free_fixlen_object(db, &(dbmemsegh(db)->bnode_area_header),
+      BTREE_ROOT_NODE(hdr));
+    BTREE_ROOT_NODE(hdr) = child;
+    node = (struct wg_bnode *) offsettoptr(db, child);
+  }
+  if(!node->number_of_elements) {
+    /* Last record removed, the root becomes an empty leaf */
+    node->level = 0;
+    BTREE_MIN_NODE(hdr) = BTREE_ROOT_NODE(hdr);
+    BTREE_MAX_NODE(hdr) = BTREE_ROOT_NODE(hdr);
+  }
+  return 0;
+}
+
+/** Create B+tree index on a column
+*  returns:
+*  0 - on success
+*  -1 - error (failed to create the index)
+*/
+static gint create_btree_index(void *db, gint index_id){
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  gint column = hdr->rec_field_index[0];
+  gint root;
+  void *rec;
+
+  root = btree_alloc_node(db, 0);
+  if(!root)
+    return -1;
+  BTREE_ROOT_NODE(hdr) = root;
+  BTREE_MIN_NODE(hdr) = root;
+  BTREE_MAX_NODE(hdr) = root;
+
+  rec = wg_get_first_record(db);
+  while(rec != NULL) {
+    if(column < wg_get_record_len(db, rec) && MATCH_TEMPLATE(db, hdr, rec)) {
+      if(btree_add_row(db, index_id, rec))
+        return -1;
+    }
+    rec = wg_get_next_record(db, rec);
+  }
+  return 0;
+}
+
+/** Drop B+tree index by id
+*  Frees the nodes, one level at a time.
+*  returns 0
+*/
+static gint drop_btree_index(void *db, gint index_id){
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  struct wg_bnode *node;
+  gint offset, down;
+
+  offset = BTREE_ROOT_NODE(hdr);
+  while(offset) {
+    node = (struct wg_bnode *) offsettoptr(db, offset);
+    down = (node->level ? node->array_of_children[0] : 0);
+    while(offset) {
+      gint next;
+      node = (struct wg_bnode *) offsettoptr(db, offset);
+      next = node->next_offset;
+      wg_free_fixlen_object(db, &(dbmemsegh(db)->bnode_area_header), offset);
+      offset = next;
+    }
+    offset = down;
+  }
+  BTREE_ROOT_NODE(hdr) = 0;
+  return 0;
+}
+
+/* ------------------- B+tree public functions ---------------- */
+
+/**
+*  returns offset to data row:
+*  0 - if key NOT found
+*  other integer - if key found (= offset to data row)
+*  With duplicate values, the first one is returned.
+*/
+gint wg_search_btree_index(void *db, gint index_id, gint key){
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  struct wg_bnode *node;
+  gint offset, slot;
+
+  offset = wg_search_btree_first(db, index_id, key, 0, &slot);
+  if(!offset)
+    return 0;
+  node = (struct wg_bnode *) offsettoptr(db, offset);
+  if(WG_COMPARE(db, key, wg_get_field(db,
+    (void *)offsettoptr(db, node->array_of_rows[slot]),
+    hdr->rec_field_index[0])) != WG_EQUAL)
+    return 0;
+  return node->array_of_rows[slot];
+}
+
+/** Find the first value in the B+tree that is greater than or equal to
+ *  (after == 0) or greater than (after != 0) the key.
+ *  returns the offset of the leaf and stores the entry number in *slot.
+ *  returns 0 if there is no such value.
+ */
+gint wg_search_btree_first(void *db, gint index_id, gint key, gint after,
+  gint *slot) {
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  gint path[WG_BTREE_MAX_DEPTH], pos[WG_BTREE_MAX_DEPTH];
+  wg_uint ckey = wg_compare_key(db, key);
+  struct wg_bnode *node;
+  gint offset, i;
+
+  offset = path[btree_find_leaf(db, hdr, key, ckey, 0, after, path, pos)];
+  node = (struct wg_bnode *) offsettoptr(db, offset);
+  i = bnode_search(db, node, hdr->rec_field_index[0], key, ckey, 0, after);
+  if(i >= node->number_of_elements) {
+    /* The value is in the next leaf (leaves are never empty,
+     * except for the root) */
+    offset = node->next_offset;
+    i = 0;
+  }
+  *slot = i;
+  return offset;
+}
+
+/** Find the last value in the B+tree that is less than or equal to
+ *  (before == 0) or less than (before != 0) the key.
+ *  returns the offset of the leaf and stores the entry number in *slot.
+ *  returns 0 if there is no such value.
+ */
+gint wg_search_btree_last(void *db, gint index_id, gint key, gint before,
+  gint *slot) {
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  gint path[WG_BTREE_MAX_DEPTH], pos[WG_BTREE_MAX_DEPTH];
+  wg_uint ckey = wg_compare_key(db, key);
+  struct wg_bnode *node;
+  gint offset, i;
+
+  offset = path[btree_find_leaf(db, hdr, key, ckey, 0, !before, path, pos)];
+  node = (struct wg_bnode *) offsettoptr(db, offset);
+  i = bnode_search(db, node, hdr->rec_field_index[0], key, ckey,
+    0, !before) - 1;
+  if(i < 0) {
+    offset = node->prev_offset;
+    if(offset) {
+      node = (struct wg_bnode *) offsettoptr(db, offset);
+      i = node->number_of_elements - 1;
+    }
+  }
+  *slot = i;
+  return offset;
+}
+
+/** Find the first entry that follows a value and a record offset
+ *  Equal values are ordered by the record offsets, so this is
+ *  the entry after the record, or where the record would be if
+ *  it is not in the index.
+ *  returns the offset of the leaf and stores the entry number in *slot.
+ *  returns 0 if there is no such entry.
+ */
+gint wg_search_btree_after(void *db, gint index_id, gint key, gint row,
+  gint *slot) {
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  gint path[WG_BTREE_MAX_DEPTH], pos[WG_BTREE_MAX_DEPTH];
+  wg_uint ckey = wg_compare_key(db, key);
+  struct wg_bnode *node;
+  gint offset, i;
+
+  offset = path[btree_find_leaf(db, hdr, key, ckey, row, 1, path, pos)];
+  node = (struct wg_bnode *) offsettoptr(db, offset);
+  i = bnode_search(db, node, hdr->rec_field_index[0], key, ckey, row, 1);
+  if(i >= node->number_of_elements) {
+    offset = node->next_offset;
+    i = 0;
+  }
+  *slot = i;
+  return offset;
+}
+
 /* -------------- Hash index private functions ------------- */
 
 /**  inserts pointer to data row into index tree structure
@@ -2034,6 +2705,7 @@ gint wg_create_index(void *db, gint column, gint type,
  *        WG_INDEX_TYPE_TTREE_JSON - T-tree for JSON schema
  *        WG_INDEX_TYPE_HASH - multi-column hash index
  *        WG_INDEX_TYPE_HASH_JSON - hash index with JSON features
+ *        WG_INDEX_TYPE_BTREE - single-column B+tree index
  *
  * columns - array of column numbers
  * col_count - size of the column number array
@@ -2089,6 +2761,9 @@ gint wg_create_multi_index(void *db, gint *columns, gint col_count, gint type,
     (type == WG_INDEX_TYPE_TTREE || type == WG_INDEX_TYPE_TTREE_JSON)) {
     show_index_error(db, "Cannot create a T-tree index on multiple columns");
     return -1;
+  } else if(col_count > 1 && type == WG_INDEX_TYPE_BTREE) {
+    show_index_error(db, "Cannot create a B+tree index on multiple columns");
+    return -1;
   }
 
   if(sort_columns(sorted_cols, columns, col_count) < col_count) {
@@ -2127,7 +2802,10 @@ gint wg_create_multi_index(void *db, gint *columns, gint col_count, gint type,
       }
     }
 
+    /* Index templates are not part of the current write transaction */
+    wg_undo_suspend(db);
     template_offset = add_index_template(db, matchrec, reclen);
+    wg_undo_resume(db);
     if(!template_offset) {
       show_index_error(db, "Error adding index template");
       return -1;
@@ -2223,6 +2901,10 @@ gint wg_create_multi_index(void *db, gint *columns, gint col_count, gint type,
       if(create_hash_index(db, index_id))
         return -1;
       break;
+    case WG_INDEX_TYPE_BTREE:
+      if(create_btree_index(db, index_id))
+        return -1;
+      break;
     case WG_INDEX_TYPE_TTREE_JSON:
       /* Return an error, until proper implementation exists */
     default:
@@ -2347,6 +3029,10 @@ gint wg_drop_index(void *db, gint index_id){
       if(drop_hash_index(db, index_id))
         return -1;
       break;
+    case WG_INDEX_TYPE_BTREE:
+      if(drop_btree_index(db, index_id))
+        return -1;
+      break;
     default:
       show_index_error(db, "Invalid index type");
       return -1;
@@ -2356,8 +3042,11 @@ gint wg_drop_index(void *db, gint index_id){
   if(hdr->template_offset) {
     wg_index_template *tmpl = \
       (wg_index_template *) offsettoptr(db, hdr->template_offset);
-    if(!(--(tmpl->refcount)))
+    if(!(--(tmpl->refcount))) {
+      wg_undo_suspend(db);
       remove_index_template(db, hdr->template_offset);
+      wg_undo_resume(db);
+    }
   }
 #endif
 
@@ -2615,12 +3304,12 @@ void * wg_get_all_indexes(void *db, gint *count) {
 #define INDEX_ADD_ROW(d, h, i, r) \
   switch(h->type) { \
     case WG_INDEX_TYPE_TTREE: \
-      if(ttree_add_row(d, i, r)) \
+      if(!TTREE_DEFERRED(d) && ttree_add_row(d, i, r)) \
         return -2; \
       break; \
     case WG_INDEX_TYPE_TTREE_JSON: \
       if(is_plain_record(r)) { \
-        if(ttree_add_row(d, i, r)) \
+        if(!TTREE_DEFERRED(d) && ttree_add_row(d, i, r)) \
           return -2; \
       } \
       break; \
@@ -2634,6 +3323,10 @@ void * wg_get_all_indexes(void *db, gint *count) {
           return -2; \
       } \
       break; \
+    case WG_INDEX_TYPE_BTREE: \
+      if(!TTREE_DEFERRED(d) && btree_add_row(d, i, r)) \
+        return -2; \
+      break; \
     default: \
       show_index_error(db, "unknown index type, ignoring"); \
       break; \
@@ -2642,12 +3335,12 @@ void * wg_get_all_indexes(void *db, gint *count) {
 #define INDEX_REMOVE_ROW(d, h, i, r) \
   switch(h->type) { \
     case WG_INDEX_TYPE_TTREE: \
-      if(ttree_remove_row(d, i, r) < -2) \
+      if(!TTREE_DEFERRED(d) && ttree_remove_row(d, i, r) < -2) \
         return -2; \
       break; \
     case WG_INDEX_TYPE_TTREE_JSON: \
       if(is_plain_record(r)) { \
-        if(ttree_remove_row(d, i, r) < -2) \
+        if(!TTREE_DEFERRED(d) && ttree_remove_row(d, i, r) < -2) \
           return -2; \
       } \
       break; \
@@ -2661,6 +3354,10 @@ void * wg_get_all_indexes(void *db, gint *count) {
           return -2; \
       } \
       break; \
+    case WG_INDEX_TYPE_BTREE: \
+      if(!TTREE_DEFERRED(d) && btree_remove_row(d, i, r) < -2) \
+        return -2; \
+      break; \
     default: \
       show_index_error(db, "unknown index type, ignoring"); \
       break; \
@@ -2748,6 +3445,10 @@ gint wg_index_add_rec(void *db, void *rec) {
     return -1;
 #endif
 
+  /* Inside a write transaction, remember to undo this */
+  if(WG_UNDO_ACTIVE(db) && wg_undo_add_indexrec(db, rec))
+    return -2;
+
   if(reclen > MAX_INDEXED_FIELDNR)
     reclen = MAX_INDEXED_FIELDNR + 1;
 
@@ -2981,6 +3682,56 @@ nexttmpl2:
   return 0;
 }
 
+/** Defer the T-tree and B+tree index updates in this database handle.
+ *  Used when a large number of records is modified at once (such as
+ *  when replaying the journal); building the trees from the final data
+ *  is cheaper than updating them for each change. The indexes are
+ *  not usable until wg_rebuild_deferred_indexes() is called.
+ */
+void wg_defer_index_updates(void *db) {
+#if defined(USE_DATABASE_HANDLE) && defined(TTREE_CHAINED_NODES)
+  ((db_handle *) db)->index_deferred = 1;
+#endif
+}
+
+/** Rebuild the T-tree and B+tree indexes after the updates were deferred.
+ *  returns 0 on success
+ *  returns -1 on error
+ */
+gint wg_rebuild_deferred_indexes(void *db) {
+#ifdef USE_DATABASE_HANDLE
+  gint *indexes, count, i;
+  gint err = 0;
+
+  if(!TTREE_DEFERRED(db))
+    return 0;
+  ((db_handle *) db)->index_deferred = 0;
+
+  indexes = (gint *) wg_get_all_indexes(db, &count);
+  if(!indexes) {
+    return (dbmemsegh(db)->index_control_area_header.number_of_indexes ?
+      -1 : 0);
+  }
+  for(i=0; i<count; i++) {
+    wg_index_header *hdr = (wg_index_header *) offsettoptr(db, indexes[i]);
+    if(hdr->type == WG_INDEX_TYPE_TTREE ||
+      hdr->type == WG_INDEX_TYPE_TTREE_JSON) {
+      drop_ttree_index(db, indexes[i]);
+      if(create_ttree_index(db, indexes[i]))
+        err = -1;
+    } else if(hdr->type == WG_INDEX_TYPE_BTREE) {
+      drop_btree_index(db, indexes[i]);
+      if(create_btree_index(db, indexes[i]))
+        err = -1;
+    }
+  }
+  free(indexes);
+  return err;
+#else
+  return 0;
+#endif
+}
+
 /* --------------- error handling ------------------------------*/
 
 /** called with err msg
@@ -68,6 +68,7 @@
 #define WG_INDEX_TYPE_TTREE_JSON    51
 #define WG_INDEX_TYPE_HASH          60
 #define WG_INDEX_TYPE_HASH_JSON     61
+#define WG_INDEX_TYPE_BTREE         70
 
 /* Index header helpers */
 #define TTREE_ROOT_NODE(x) (x->ctl.t.offset_root_node)
@@ -75,14 +76,25 @@
 #define TTREE_MIN_NODE(x) (x->ctl.t.offset_min_node)
 #define TTREE_MAX_NODE(x) (x->ctl.t.offset_max_node)
 #endif
+#define BTREE_ROOT_NODE(x) (x->ctl.b.offset_root_node)
+#define BTREE_MIN_NODE(x) (x->ctl.b.offset_min_node)
+#define BTREE_MAX_NODE(x) (x->ctl.b.offset_max_node)
 #define HASHIDX_ARRAYP(x) (&(x->ctl.h.hasharea))
 
+/* T-tree updates are deferred in this handle (see wg_defer_index_updates) */
+#ifdef USE_DATABASE_HANDLE
+#define TTREE_DEFERRED(d) (((db_handle *) d)->index_deferred)
+#else
+#define TTREE_DEFERRED(d) 0
+#endif
+
 /* ====== data structures ======== */
 
 /** structure of t-node
 *   (array of data pointers, pointers to parent/children nodes, control data)
 *   overall size is currently 64 bytes (cache line?) if array size is 10,
 *   with extra node chaining pointers the array size defaults to 8.
+*   Key prefixes (TTREE_KEY_PREFIX) add one word per slot.
 */
 struct wg_tnode{
   gint parent_offset;
@@ -92,6 +104,9 @@ struct wg_tnode{
   unsigned char left_subtree_height;
   unsigned char right_subtree_height;
   gint array_of_values[WG_TNODE_ARRAY_SIZE];
+#ifdef TTREE_KEY_PREFIX
+  wg_uint array_of_keys[WG_TNODE_ARRAY_SIZE]; /** see wg_compare_key() */
+#endif
   gint left_child_offset;
   gint right_child_offset;
 #ifdef TTREE_CHAINED_NODES
@@ -100,6 +115,25 @@ struct wg_tnode{
 #endif
 };
 
+/** structure of B+tree node
+*   Entries are kept in three parallel arrays, so that the key prefixes
+*   (see wg_compare_key()) are contiguous for the binary search. Each
+*   entry has the offset of the record with the smallest value: in
+*   leaves this is the indexed record itself, in internal nodes the
+*   smallest record in the subtree of the child. Nodes on the same
+*   level are chained. The size is a multiple of 64 bytes (512 bytes
+*   on 64-bit, 256 bytes on 32-bit).
+*/
+struct wg_bnode{
+  gint number_of_elements;
+  gint level;           /** 0 for leaves */
+  gint next_offset;     /** next node on the same level */
+  gint prev_offset;     /** previous node on the same level */
+  wg_uint array_of_keys[WG_BNODE_ARRAY_SIZE];
+  gint array_of_rows[WG_BNODE_ARRAY_SIZE];
+  gint array_of_children[WG_BNODE_ARRAY_SIZE]; /** internal nodes only */
+};
+
 /* ==== Protos ==== */
 
 /* API functions (copied in indexapi.h) */
@@ -135,6 +169,16 @@ gint wg_search_tnode_first(void *db, gint nodeoffset, gint key,
   gint column);
 gint wg_search_tnode_last(void *db, gint nodeoffset, gint key,
   gint column);
+gint wg_search_ttree_after(void *db, gint index_id, gint key, gint row,
+  gint *slot);
+
+gint wg_search_btree_index(void *db, gint index_id, gint key);
+gint wg_search_btree_first(void *db, gint index_id, gint key, gint after,
+  gint *slot);
+gint wg_search_btree_last(void *db, gint index_id, gint key, gint before,
+  gint *slot);
+gint wg_search_btree_after(void *db, gint index_id, gint key, gint row,
+  gint *slot);
 
 gint wg_search_hash(void *db, gint index_id, gint *values, gint count);
 
@@ -146,6 +190,8 @@ gint wg_index_add_field(void *db, void *rec, gint column);
 gint wg_index_add_rec(void *db, void *rec);
 gint wg_index_del_field(void *db, void *rec, gint column);
 gint wg_index_del_rec(void *db, void *rec);
+void wg_defer_index_updates(void *db);
+gint wg_rebuild_deferred_indexes(void *db);
 
 
 #endif /* DEFINED_DBINDEX_H */
@@ -54,6 +54,10 @@ extern "C" {
 #include "../config.h"
 #endif
 #include "dballoc.h"
+#include "dbdata.h"
+#include "dblog.h"
+#include "dbdump.h"
+#include "dbcdc.h"
 #include "dblock.h"
 
 #if (LOCK_PROTO==TFQUEUE)
@@ -69,6 +73,25 @@ extern "C" {
 
 #define compare_and_swap wg_compare_and_swap // wg_ prefix used in dblock.h, non-wg below
 
+#ifdef _WIN32
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+#define THREAD_LOCK_HANDLES 16 /* handles locked by a thread at once */
+
+/* Transactions open in a handle by the current thread. Handles may be
+ * shared by threads, so this cannot be kept in the handle.
+ */
+typedef struct {
+  void *db;       /* handle, NULL if the entry is not used */
+  gint readlocks; /* read transactions open */
+  gint writelock; /* write transaction open */
+} thread_locks;
+
+static THREAD_LOCAL thread_locks thread_lock_table[THREAD_LOCK_HANDLES];
+
 #ifndef LOCK_PROTO
 #define DUMMY_ATOMIC_OPS /* allow compilation on unsupported platforms */
 #endif
@@ -197,6 +220,8 @@ static void futex_wake(volatile gint *addr1, int val1);
 #endif
 #endif
 
+static thread_locks *find_thread_locks(void *db, int create);
+static void release_thread_locks(void *db, int write);
 static gint show_lock_error(void *db, char *errmsg);
 
 
@@ -456,6 +481,82 @@ gint wg_compare_and_swap(volatile gint *ptr, gint oldv, gint newv) {
 #endif
 }
 
+/** Double-width compare and swap. If the two adjacent values at ptr
+ *  equal old1 and old2, set them to new1 and new2 and return 1.
+ *  If the values differ, the function returns 0.
+ *
+ *  Returns -1 if the platform does not support the operation or
+ *  ptr is not aligned to the double width. The caller should then
+ *  use some other way of synchronizing.
+ */
+
+gint wg_compare_and_swap2(volatile gint *ptr, gint old1, gint old2,
+  gint new1, gint new2) {
+#if defined(DUMMY_ATOMIC_OPS)
+  if(ptr[0] == old1 && ptr[1] == old2) {
+    ptr[0] = new1;
+    ptr[1] = new2;
+    return 1;
+  }
+  return 0;
+#elif defined(__GNUC__)
+  if(((size_t) ptr) & (2*sizeof(gint) - 1))
+    return -1;
+#if !defined(HAVE_64BIT_GINT) && defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_8)
+  {
+    union { gint g[2]; unsigned long long u; } o, n;
+    o.g[0] = old1; o.g[1] = old2;
+    n.g[0] = new1; n.g[1] = new2;
+    return __sync_bool_compare_and_swap((volatile unsigned long long *) ptr,
+      o.u, n.u);
+  }
+#elif defined(HAVE_64BIT_GINT) && defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_16)
+  {
+    union { gint g[2]; unsigned __int128 u; } o, n;
+    o.g[0] = old1; o.g[1] = old2;
+    n.g[0] = new1; n.g[1] = new2;
+    return __sync_bool_compare_and_swap((volatile unsigned __int128 *) ptr,
+      o.u, n.u);
+  }
+#elif defined(HAVE_64BIT_GINT) && defined(__x86_64__)
+  {
+    /* gcc only emits cmpxchg16b with -mcx16 */
+    unsigned char ret;
+    __asm__ __volatile__(
+      "lock; cmpxchg16b %1\n\t"
+      "setz %0"
+      : "=q" (ret), "+m" (*ptr), "+a" (old1), "+d" (old2)
+      : "b" (new1), "c" (new2)
+      : "memory", "cc");
+    return ret;
+  }
+#else
+  return -1;
+#endif
+#elif defined(_WIN32)
+  if(((size_t) ptr) & (2*sizeof(gint) - 1))
+    return -1;
+#ifdef HAVE_64BIT_GINT
+  {
+    __int64 cmp[2];
+    cmp[0] = old1; cmp[1] = old2;
+    return _InterlockedCompareExchange128((volatile __int64 *) ptr,
+      new2, new1, cmp);
+  }
+#else
+  {
+    union { gint g[2]; __int64 u; } o, n;
+    o.g[0] = old1; o.g[1] = old2;
+    n.g[0] = new1; n.g[1] = new2;
+    return (_InterlockedCompareExchange64((volatile __int64 *) ptr,
+      n.u, o.u) == o.u);
+  }
+#endif
+#else
+#error Atomic operations not implemented for this compiler
+#endif
+}
+
 /* ----------- read and write transaction support ----------- */
 
 /*
@@ -464,30 +565,101 @@ gint wg_compare_and_swap(volatile gint *ptr, gint oldv, gint newv) {
  * therefore use of the locking routines does not automatically guarantee
  * isolation, rather, all of the concurrently accessing clients are expected
  * to follow the same protocol.
+ *
+ * Write transactions are atomic: the changes are recorded in an undo
+ * log in the database handle and can be reverted with wg_abort_write().
+ * Journal entries and change events are buffered and written to the
+ * journal and the change data capture ring once, when the transaction
+ * is committed.
  */
 
 /** Start write transaction
  *   Current implementation: acquire database level exclusive lock
+ *   and start recording changes.
  */
 
 gint wg_start_write(void * db) {
-  return db_wlock(db, DEFAULT_LOCK_TIMEOUT);
+  thread_locks *tl;
+  gint lock = db_wlock(db, DEFAULT_LOCK_TIMEOUT);
+  if(lock) {
+    tl = find_thread_locks(db, 1);
+    if(!tl) {
+      db_wulock(db, lock);
+      return 0;
+    }
+    tl->writelock = 1;
+    wg_undo_start(db);
+    wg_log_start_transaction(db);
+    wg_cdc_start_transaction(db);
+  }
+  return lock;
 }
 
 /** End write transaction
- *   Current implementation: release database level exclusive lock
+ *   Current implementation: write the buffered journal entries,
+ *   publish the change events,
+ *   release the storage freed by the transaction, take a checkpoint
+ *   if the journal has grown past the limit and release
+ *   database level exclusive lock.
+ *
+ *   If the journal cannot be written, the transaction is
+ *   rolled back and 0 is returned (the lock is released regardless).
  */
 
 gint wg_end_write(void * db, gint lock) {
+  if(wg_log_commit_transaction(db)) {
+    wg_undo_rollback(db);
+    wg_cdc_abort_transaction(db);
+    release_thread_locks(db, 1);
+    db_wulock(db, lock);
+    return 0;
+  }
+  wg_cdc_commit_transaction(db);
+  wg_undo_commit(db);
+  if(wg_log_checkpoint_due(db)) {
+    /* Journal is past the size limit, start a new one. Errors are
+     * reported but do not affect the committed transaction. */
+    wg_checkpoint_internal(db, 0);
+  }
+  release_thread_locks(db, 1);
   return db_wulock(db, lock);
 }
 
+/** Abort write transaction
+ *   Reverts the changes made since wg_start_write(), discards the
+ *   buffered journal entries and releases database level exclusive lock.
+ *
+ *   returns 0 if the previous state could not be fully restored
+ *   or the lock could not be released.
+ */
+
+gint wg_abort_write(void * db, gint lock) {
+  gint err;
+  wg_log_abort_transaction(db);
+  err = wg_undo_rollback(db);
+  wg_cdc_abort_transaction(db);
+  release_thread_locks(db, 1);
+  if(!db_wulock(db, lock))
+    return 0;
+  return (err ? 0 : 1);
+}
+
 /** Start read transaction
  *   Current implementation: acquire database level shared lock
  */
 
 gint wg_start_read(void * db) {
-  return db_rlock(db, DEFAULT_LOCK_TIMEOUT);
+  thread_locks *tl;
+  gint lock = db_rlock(db, DEFAULT_LOCK_TIMEOUT);
+  if(lock) {
+    tl = find_thread_locks(db, 1);
+    if(!tl) {
+      db_rulock(db, lock);
+      return 0;
+    }
+    tl->readlocks++;
+  }
+  return lock;
 }
 
 /** End read transaction
@@ -495,9 +667,72 @@ gint wg_start_read(void * db) {
  */
 
 gint wg_end_read(void * db, gint lock) {
+  release_thread_locks(db, 0);
   return db_rulock(db, lock);
 }
 
+/** Check whether the current thread holds a read lock
+ *  through the database handle.
+ */
+
+gint wg_holds_read_lock(void * db) {
+  thread_locks *tl = find_thread_locks(db, 0);
+  return (tl ? tl->readlocks > 0 : 0);
+}
+
+/** Check whether the current thread holds the write lock
+ *  through the database handle.
+ */
+
+gint wg_holds_write_lock(void * db) {
+  thread_locks *tl = find_thread_locks(db, 0);
+  return (tl ? tl->writelock : 0);
+}
+
+/** Find the transactions of the current thread in a handle.
+ *  If create is set, an unused entry is taken if there is none yet.
+ *
+ *  returns NULL if not found or the thread has too many handles locked
+ */
+
+static thread_locks *find_thread_locks(void *db, int create) {
+  thread_locks *unused = NULL;
+  int i;
+
+  for(i=0; i<THREAD_LOCK_HANDLES; i++) {
+    if(thread_lock_table[i].db == db)
+      return &thread_lock_table[i];
+    if(!unused && !thread_lock_table[i].db)
+      unused = &thread_lock_table[i];
+  }
+  if(!create)
+    return NULL;
+  if(!unused) {
+    show_lock_error(db, "Too many databases locked by the thread");
+    return NULL;
+  }
+  unused->db = db;
+  unused->readlocks = 0;
+  unused->writelock = 0;
+  return unused;
+}
+
+/** End a read or write transaction of the current thread in a handle.
+ *  The entry is freed when no transactions remain open.
+ */
+
+static void release_thread_locks(void *db, int write) {
+  thread_locks *tl = find_thread_locks(db, 0);
+  if(!tl)
+    return;
+  if(write)
+    tl->writelock = 0;
+  else if(tl->readlocks)
+    tl->readlocks--;
+  if(!tl->readlocks && !tl->writelock)
+    tl->db = NULL;
+}
+
 /*
  * The following functions implement a giant shared/exclusive
  * lock on the database.
@@ -602,6 +837,9 @@ gint db_rpspin_wulock(void * db) {
 
   gl = (gint *) offsettoptr(db, dbmemsegh(db)->locks.global_lock);
 
+  /* Let wg_snapshot() know that the memory may have changed */
+  dbmemsegh(db)->locks.wreleases++;
+
   /* Clear the writer active flag */
   atomic_and(gl, ~(WAFLAG));
 
@@ -799,6 +1037,9 @@ gint db_wpspin_wulock(void * db) {
   gl = (gint *) offsettoptr(db, dbmemsegh(db)->locks.global_lock);
   w = (gint *) offsettoptr(db, dbmemsegh(db)->locks.writers);
 
+  /* Let wg_snapshot() know that the memory may have changed */
+  dbmemsegh(db)->locks.wreleases++;
+
   /* Clear the writer active flag */
   atomic_and(gl, ~(WAFLAG));
 
@@ -1065,6 +1306,9 @@ gint db_tfqueue_wulock(void * db, gint lock) {
   dbh = dbmemsegh(db);
   lockp = (lock_queue_node *) offsettoptr(db, lock);
 
+  /* Let wg_snapshot() know that the memory may have changed */
+  dbh->locks.wreleases++;
+
   lock_queue(db);
   if(lockp->next) {
     lock_queue_node *nextp = offsettoptr(db, lockp->next);
@@ -1270,6 +1514,7 @@ gint wg_init_locks(void * db) {
   dbstore(db, dbh->locks.global_lock, 0);
   dbstore(db, dbh->locks.writers, 0);
 #endif
+  dbh->locks.field_lock = 0;
   return 0;
 }
 
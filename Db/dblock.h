@@ -72,13 +72,18 @@ typedef struct {
 
 gint wg_start_write(void * dbase);          /* start write transaction */
 gint wg_end_write(void * dbase, gint lock); /* end write transaction */
+gint wg_abort_write(void * dbase, gint lock); /* roll back write transaction */
 gint wg_start_read(void * dbase);           /* start read transaction */
 gint wg_end_read(void * dbase, gint lock);  /* end read transaction */
 
 /* WhiteDB internal functions */
 
 gint wg_compare_and_swap(volatile gint *ptr, gint oldv, gint newv);
+gint wg_compare_and_swap2(volatile gint *ptr, gint old1, gint old2,
+  gint new1, gint new2);
 gint wg_init_locks(void * db); /* (re-) initialize locking subsystem */
+gint wg_holds_read_lock(void * dbase);  /* read lock held by this thread */
+gint wg_holds_write_lock(void * dbase); /* write lock held by this thread */
 
 #if (LOCK_PROTO==RPSPIN)
 
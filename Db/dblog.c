@@ -30,6 +30,7 @@
 /* ====== Includes =============== */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -45,6 +46,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/errno.h>
+#include <sys/mman.h>
 #endif
 
 #ifdef __cplusplus
@@ -58,7 +60,10 @@ extern "C" {
 #endif
 #include "dballoc.h"
 #include "dbdata.h"
-#include "dbhash.h"
+#include "dbindex.h"
+#include "dblock.h"
+#include "dbdump.h"
+#include "dbmem.h"
 
 /* ====== Private headers and defs ======== */
 
@@ -82,20 +87,13 @@ extern "C" {
   return e;
 #endif
 
-#define GET_LOG_BYTE(d, f, v) \
-  if((v = fgetc(f)) == EOF) { \
-    return show_log_error(d, "Failed to read log entry"); \
-  }
-
-#define GET_LOG_CMD(d, f, v) \
-  if((v = fgetc(f)) == EOF) { \
-    if(feof(f)) break; \
-    else return show_log_error(d, "Failed to read log entry"); \
-  }
+#define GET_LOG_CMD(d, r, v) \
+  if(r->pos >= r->end) break; \
+  v = *(r->pos++);
 
-/* Does not emit a message as fget_varint() does that already. */
-#define GET_LOG_VARINT(d, f, v, e) \
-  if(fget_varint(d, f, (wg_uint *) &v))  { \
+/* Does not emit a message as get_varint() does that already. */
+#define GET_LOG_VARINT(d, r, v, e) \
+  if(get_varint(d, r, (wg_uint *) &v))  { \
     return e; \
   }
 
@@ -105,8 +103,57 @@ extern "C" {
 #define VARINT_SIZE 5
 #endif
 
+/* Space reserved for the transaction frame header */
+#define TRAN_HEADER_SIZE (1 + VARINT_SIZE)
+
+/* The journal state is shared with the background sync only while it runs */
+#ifdef WG_JOURNAL_BGSYNC
+#define LOG_LOCK(ld) \
+  do { if(ld->flusher_state) pthread_mutex_lock(&ld->mutex); } while(0)
+#define LOG_UNLOCK(ld) \
+  do { if(ld->flusher_state) pthread_mutex_unlock(&ld->mutex); } while(0)
+#else
+#define LOG_LOCK(ld) do { } while(0)
+#define LOG_UNLOCK(ld) do { } while(0)
+#endif
+
+/* Size of the second level of the offset translation table */
+#define TRAN_CHUNK_BITS 12
+#define TRAN_CHUNK_SIZE (1 << TRAN_CHUNK_BITS)
+
 /* ====== data structures ======== */
 
+/** Journal contents being replayed */
+typedef struct {
+  unsigned char *pos;
+  unsigned char *end;
+  char *strbuf[2];          /* decoded string and extra string */
+  size_t strsize[2];
+} log_reader;
+
+/** Offset translation table for the replay */
+typedef struct {
+  gint **chunks;
+  gint count;
+} tran_table;
+
+#ifdef WG_JOURNAL_REPLICA
+/** State of a replica following the primary journal */
+typedef struct {
+  gint primary;             /* key of the primary database */
+  int fd;                   /* journal being followed */
+  gint ino;                 /* inode of the journal */
+  gint chk;                 /* checkpoint that the journal starts from */
+  gint pos;                 /* offset of the data not applied yet */
+  int switching;            /* primary has restarted the journal */
+  unsigned char *buf;       /* data read, but not applied yet */
+  size_t buflen;
+  size_t bufsize;
+  tran_table tran;          /* kept over the journal restarts */
+  log_reader reader;
+} replica_state;
+#endif
+
 /* ======= Private protos ================ */
 
 #ifdef USE_DBLOG
@@ -114,14 +161,43 @@ static int backup_journal(void *db, char *journal_fn);
 static gint check_journal(void *db, int fd);
 static int open_journal(void *db, int create);
 
-static gint add_tran_offset(void *db, void *table, gint old, gint new);
-static gint add_tran_enc(void *db, void *table, gint old, gint new);
-static gint translate_offset(void *db, void *table, gint offset);
-static gint translate_encoded(void *db, void *table, gint enc);
-static gint recover_encode(void *db, FILE *f, gint type);
-static gint recover_journal(void *db, FILE *f, void *table);
+static unsigned char *map_journal(void *db, int fd, size_t *len);
+static void unmap_journal(unsigned char *data, size_t len);
+static size_t dec_varint(unsigned char *buf, wg_uint *val);
+static unsigned char *next_varint(unsigned char *pos, unsigned char *end,
+  wg_uint *val);
+static int get_varint(void *db, log_reader *r, wg_uint *val);
+static char *get_strbuf(void *db, log_reader *r, int idx, size_t len);
+static gint add_tran_offset(void *db, tran_table *table, gint old, gint new);
+static gint add_tran_enc(void *db, tran_table *table, gint old, gint new);
+static gint translate_offset(void *db, tran_table *table, gint offset);
+static gint translate_encoded(void *db, tran_table *table, gint enc);
+static void free_tran_table(tran_table *table);
+static gint recover_encode(void *db, log_reader *r, gint type);
+static gint recover_journal(void *db, log_reader *r, tran_table *table);
+static gint journal_header_checkpoint(void *db, unsigned char *buf,
+  size_t len);
+#ifdef WG_JOURNAL_REPLICA
+static unsigned char *scan_journal(unsigned char *pos, unsigned char *end);
+static int open_primary_journal(void *db, gint primary, gint *chk,
+  gint *ino);
+static gint replica_seed(void *db, replica_state *rs);
+static gint replica_switch(void *db, void *src);
+static gint replica_apply(void *db, replica_state *rs);
+static gint replica_promote(void *db);
+static void free_replica(replica_state *rs);
+#endif
 
-static gint write_log_buffer(void *db, void *buf, int buflen);
+static gint write_journal(void *db, void *buf, int buflen);
+static gint sync_journal(void *db);
+static int sync_fd(int fd);
+static gint flush_log_buffer(void *db);
+static gint write_log_buffer(void *db, void *buf, int buflen, int opdone);
+#ifdef WG_JOURNAL_BGSYNC
+static void *log_flusher(void *arg);
+static gint start_log_flusher(void *db);
+static void stop_log_flusher(void *db);
+#endif
 #endif /* USE_DBLOG */
 
 static gint show_log_error(void *db, char *errmsg);
@@ -206,17 +282,35 @@ static int backup_journal(void *db, char *journal_fn) {
   return err;
 }
 
-void wg_journal_filename(void *db, char *buf, size_t buflen) {
-  db_memsegment_header* dbh = dbmemsegh(db);
+/* The file names are derived from the database key, so that the
+ * replicas can find the files of the primary.
+ */
+static void journal_filename(gint key, char *buf, size_t buflen) {
+#ifndef _WIN32
+  snprintf(buf, buflen, "%s.%td", WG_JOURNAL_FILENAME, key);
+#else
+  snprintf(buf, buflen, "%s.%Id", WG_JOURNAL_FILENAME, key);
+#endif
+  buf[buflen-1] = '\0';
+}
 
+static void checkpoint_filename(gint key, char *buf, size_t buflen) {
 #ifndef _WIN32
-  snprintf(buf, buflen, "%s.%td", WG_JOURNAL_FILENAME, dbh->key);
+  snprintf(buf, buflen, "%s.%td", WG_CHECKPOINT_FILENAME, key);
 #else
-  snprintf(buf, buflen, "%s.%Id", WG_JOURNAL_FILENAME, dbh->key);
+  snprintf(buf, buflen, "%s.%Id", WG_CHECKPOINT_FILENAME, key);
 #endif
   buf[buflen-1] = '\0';
 }
 
+void wg_journal_filename(void *db, char *buf, size_t buflen) {
+  journal_filename(dbmemsegh(db)->key, buf, buflen);
+}
+
+void wg_checkpoint_filename(void *db, char *buf, size_t buflen) {
+  checkpoint_filename(dbmemsegh(db)->key, buf, buflen);
+}
+
 /** Open the journal file.
  *
  * In create mode, we also take care of the backup copy.
@@ -336,7 +430,6 @@ static size_t enc_varint(unsigned char *buf, wg_uint val) {
   }
 }
 
-#if 0
 /** Varint decoder
  *  returns the number of bytes consumed (so that the caller
  *  knows where the next value starts). Note that this approach
@@ -402,70 +495,168 @@ static size_t dec_varint(unsigned char *buf, wg_uint *val) {
     return 1;
   }
 }
-#endif
 
-/** Read varint from a buffered stream
- *  returns 0 on success
- *  returns -1 on error
+/** Make the journal contents available for reading.
+ *  The file is mapped to memory where possible, otherwise it
+ *  is read into a buffer.
  */
-static int fget_varint(void *db, FILE *f, wg_uint *val) {
-  register int c;
-  wg_uint tmp;
-
-  GET_LOG_BYTE(db, f, c)
-  tmp = c & 0x7f;
-  if(c & 0x80) {
-    GET_LOG_BYTE(db, f, c)
-    tmp |= ((c & 0x7f) << 7);
-    if(c & 0x80) {
-      GET_LOG_BYTE(db, f, c)
-      tmp |= ((c & 0x7f) << 14);
-      if(c & 0x80) {
-        GET_LOG_BYTE(db, f, c)
-        tmp |= ((c & 0x7f) << 21);
-        if(c & 0x80) {
-          GET_LOG_BYTE(db, f, c)
-#ifndef HAVE_64BIT_GINT
-          tmp |= (c << 28);
+static unsigned char *map_journal(void *db, int fd, size_t *len)
+{
+  unsigned char *data;
+#ifndef _WIN32
+  struct stat st;
+
+  if(fstat(fd, &st) || st.st_size < WG_JOURNAL_MAGIC_BYTES) {
+    show_log_error(db, "Failed to determine the log size");
+    return NULL;
+  }
+  *len = (size_t) st.st_size;
+  data = (unsigned char *) mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(data == (unsigned char *) MAP_FAILED) {
+    show_log_error(db, "Failed to map the log file");
+    return NULL;
+  }
+#ifdef MADV_SEQUENTIAL
+  madvise(data, *len, MADV_SEQUENTIAL);
+#endif
 #else
-          tmp |= ((wg_uint) (c & 0x7f) << 28);
-          if(c & 0x80) {
-            GET_LOG_BYTE(db, f, c)
-            tmp |= ((wg_uint) (c & 0x7f) << 35);
-            if(c & 0x80) {
-              GET_LOG_BYTE(db, f, c)
-              tmp |= ((wg_uint) (c & 0x7f) << 42);
-              if(c & 0x80) {
-                GET_LOG_BYTE(db, f, c)
-                tmp |= ((wg_uint) (c & 0x7f) << 49);
-                if(c & 0x80) {
-                  GET_LOG_BYTE(db, f, c)
-                  tmp |= ((wg_uint) c << 56);
-                }
-              }
-            }
-          }
+  long size;
+  size_t done = 0;
+
+  if((size = _lseek(fd, 0, SEEK_END)) < WG_JOURNAL_MAGIC_BYTES ||\
+    _lseek(fd, 0, SEEK_SET)) {
+    show_log_error(db, "Failed to determine the log size");
+    return NULL;
+  }
+  *len = (size_t) size;
+  data = (unsigned char *) malloc(*len);
+  if(!data) {
+    show_log_error(db, "Failed to allocate the log buffer");
+    return NULL;
+  }
+  while(done < *len) {
+    int cnt = _read(fd, data + done, (unsigned int) (*len - done));
+    if(cnt <= 0) {
+      show_log_error(db, "Failed to read the log file");
+      free(data);
+      return NULL;
+    }
+    done += cnt;
+  }
 #endif
-        }
-      }
+  return data;
+}
+
+static void unmap_journal(unsigned char *data, size_t len)
+{
+#ifndef _WIN32
+  munmap(data, len);
+#else
+  free(data);
+#endif
+}
+
+/** Decode a varint that may be truncated by the end of the data
+ *  returns the position after the varint
+ *  returns NULL if the varint is incomplete
+ */
+static unsigned char *next_varint(unsigned char *pos, unsigned char *end,
+  wg_uint *val)
+{
+  wg_uint tmp = 0;
+  int shift = 0;
+
+  if(end - pos >= VARINT_SIZE) {
+    /* Fast path, no need to check the bounds */
+    return pos + dec_varint(pos, val);
+  }
+  /* Near the end of the journal, decode byte by byte */
+  while(pos < end) {
+    unsigned char c = *(pos++);
+    if(shift == 7 * (VARINT_SIZE - 1)) {
+      tmp |= ((wg_uint) c << shift);
+      *val = tmp;
+      return pos;
     }
+    tmp |= ((wg_uint) (c & 0x7f) << shift);
+    if(!(c & 0x80)) {
+      *val = tmp;
+      return pos;
+    }
+    shift += 7;
   }
-  *val = tmp;
+  return NULL;
+}
+
+/** Read varint from the journal buffer
+ *  returns 0 on success
+ *  returns -1 on error
+ */
+static int get_varint(void *db, log_reader *r, wg_uint *val) {
+  unsigned char *next = next_varint(r->pos, r->end, val);
+
+  if(!next)
+    return show_log_error(db, "Failed to read log entry");
+  r->pos = next;
   return 0;
 }
 
+/** Get a buffer for a string, to be terminated with a 0-byte.
+ *  The buffer is reused for all the strings in the journal.
+ */
+static char *get_strbuf(void *db, log_reader *r, int idx, size_t len) {
+  if(r->strsize[idx] < len + 1) {
+    size_t newsize = (r->strsize[idx] ? r->strsize[idx] : 256);
+    char *newbuf;
+    while(newsize < len + 1)
+      newsize *= 2;
+    newbuf = (char *) realloc(r->strbuf[idx], newsize);
+    if(!newbuf) {
+      show_log_error(db, "Failed to allocate buffers");
+      return NULL;
+    }
+    r->strbuf[idx] = newbuf;
+    r->strsize[idx] = newsize;
+  }
+  return r->strbuf[idx];
+}
+
 /** Add a log recovery translation entry
- *  Uses extendible gint hashtable internally.
+ *  Uses a two-level array indexed by the old offset, so that the
+ *  lookups are cheap. Second level chunks are allocated when a
+ *  translation falls into their range.
  */
-static gint add_tran_offset(void *db, void *table, gint old, gint new)
+static gint add_tran_offset(void *db, tran_table *table, gint old, gint new)
 {
-  return wg_ginthash_addkey(db, table, old, new);
+  gint idx = old / sizeof(gint);
+  gint chunk = idx >> TRAN_CHUNK_BITS;
+
+  if(chunk >= table->count) {
+    gint newcount = (table->count ? table->count : 64);
+    gint **newchunks;
+    while(newcount <= chunk)
+      newcount *= 2;
+    newchunks = (gint **) realloc(table->chunks, newcount * sizeof(gint *));
+    if(!newchunks)
+      return -1;
+    memset(newchunks + table->count, 0,
+      (newcount - table->count) * sizeof(gint *));
+    table->chunks = newchunks;
+    table->count = newcount;
+  }
+  if(!table->chunks[chunk]) {
+    table->chunks[chunk] = (gint *) calloc(TRAN_CHUNK_SIZE, sizeof(gint));
+    if(!table->chunks[chunk])
+      return -1;
+  }
+  table->chunks[chunk][idx & (TRAN_CHUNK_SIZE - 1)] = new;
+  return 0;
 }
 
 /** Wrapper around add_tran_offset() to handle encoded data
  *
  */
-static gint add_tran_enc(void *db, void *table, gint old, gint new)
+static gint add_tran_enc(void *db, tran_table *table, gint old, gint new)
 {
   if(isptr(old)) {
     gint offset, newoffset;
@@ -475,8 +666,10 @@ static gint add_tran_enc(void *db, void *table, gint old, gint new)
         newoffset = decode_longstr_offset(new);
         return add_tran_offset(db, table, offset, newoffset);
       case SHORTSTRBITS:
+        /* journals from before tiny strings: the replayed string
+         * may be immediate. It can't be mistaken for an offset. */
         offset = decode_shortstr_offset(old);
-        newoffset = decode_shortstr_offset(new);
+        newoffset = (istinystr(new) ? new : decode_shortstr_offset(new));
         return add_tran_offset(db, table, offset, newoffset);
       case FULLDOUBLEBITS:
         offset = decode_fulldouble_offset(old);
@@ -497,19 +690,22 @@ static gint add_tran_enc(void *db, void *table, gint old, gint new)
 /** Translate a log offset
  *
  */
-static gint translate_offset(void *db, void *table, gint offset)
+static gint translate_offset(void *db, tran_table *table, gint offset)
 {
+  gint idx = offset / sizeof(gint);
+  gint chunk = idx >> TRAN_CHUNK_BITS;
   gint newoffset;
-  if(wg_ginthash_getkey(db, table, offset, &newoffset))
+
+  if(chunk >= table->count || !table->chunks[chunk])
     return offset;
-  else
-    return newoffset;
+  newoffset = table->chunks[chunk][idx & (TRAN_CHUNK_SIZE - 1)];
+  return (newoffset ? newoffset : offset);
 }
 
 /** Wrapper around translate_offset() to handle encoded data
  *
  */
-static gint translate_encoded(void *db, void *table, gint enc)
+static gint translate_encoded(void *db, tran_table *table, gint enc)
 {
   if(isptr(enc)) {
     gint offset;
@@ -520,8 +716,10 @@ static gint translate_encoded(void *db, void *table, gint enc)
         offset = decode_longstr_offset(enc);
         return encode_longstr_offset(translate_offset(db, table, offset));
       case SHORTSTRBITS:
-        offset = decode_shortstr_offset(enc);
-        return encode_shortstr_offset(translate_offset(db, table, offset));
+        offset = translate_offset(db, table, decode_shortstr_offset(enc));
+        if(istinystr(offset))
+          return offset;
+        return encode_shortstr_offset(offset);
       case FULLDOUBLEBITS:
         offset = decode_fulldouble_offset(enc);
         return encode_fulldouble_offset(translate_offset(db, table, offset));
@@ -536,28 +734,48 @@ static gint translate_encoded(void *db, void *table, gint enc)
   return enc;
 }
 
+/** Free the translation table memory.
+ *
+ */
+static void free_tran_table(tran_table *table)
+{
+  gint i;
+  for(i=0; i<table->count; i++) {
+    if(table->chunks[i])
+      free(table->chunks[i]);
+  }
+  if(table->chunks)
+    free(table->chunks);
+  table->chunks = NULL;
+  table->count = 0;
+}
+
 /** Parse an encode entry from the log.
  *
  */
-gint recover_encode(void *db, FILE *f, gint type)
+gint recover_encode(void *db, log_reader *r, gint type)
 {
   char *strbuf, *extbuf;
-  gint length = 0, extlength = 0, enc;
+  gint length = 0, extlength = 0;
   int intval;
   double doubleval;
 
   switch(type) {
     case WG_INTTYPE:
-      if(fread((char *) &intval, sizeof(int), 1, f) != 1) {
+      if(r->end - r->pos < (ptrdiff_t) sizeof(int)) {
         show_log_error(db, "Failed to read log entry");
         return WG_ILLEGAL;
       }
+      memcpy(&intval, r->pos, sizeof(int));
+      r->pos += sizeof(int);
       return wg_encode_int(db, intval);
     case WG_DOUBLETYPE:
-      if(fread((char *) &doubleval, sizeof(double), 1, f) != 1) {
+      if(r->end - r->pos < (ptrdiff_t) sizeof(double)) {
         show_log_error(db, "Failed to read log entry");
         return WG_ILLEGAL;
       }
+      memcpy(&doubleval, r->pos, sizeof(double));
+      r->pos += sizeof(double);
       return wg_encode_double(db, doubleval);
     case WG_STRTYPE:
     case WG_URITYPE:
@@ -565,44 +783,33 @@ gint recover_encode(void *db, FILE *f, gint type)
     case WG_ANONCONSTTYPE:
     case WG_BLOBTYPE: /* XXX: no encode func for this yet */
       /* strings with extdata */
-      GET_LOG_VARINT(db, f, length, WG_ILLEGAL)
-      GET_LOG_VARINT(db, f, extlength, WG_ILLEGAL)
-
-      strbuf = (char *) malloc(length + 1);
-      if(!strbuf) {
-        show_log_error(db, "Failed to allocate buffers");
-        return WG_ILLEGAL;
-      }
-      if(fread(strbuf, 1, length, f) != length) {
+      GET_LOG_VARINT(db, r, length, WG_ILLEGAL)
+      GET_LOG_VARINT(db, r, extlength, WG_ILLEGAL)
+      if(length < 0 || extlength < 0 ||\
+        r->end - r->pos < (ptrdiff_t) (length + extlength)) {
         show_log_error(db, "Failed to read log entry");
-        free(strbuf);
         return WG_ILLEGAL;
       }
+
+      strbuf = get_strbuf(db, r, 0, length);
+      if(!strbuf)
+        return WG_ILLEGAL;
+      memcpy(strbuf, r->pos, length);
       strbuf[length] = '\0';
+      r->pos += length;
 
       if(extlength) {
-        extbuf = (char *) malloc(extlength + 1);
-        if(!extbuf) {
-          free(strbuf);
-          show_log_error(db, "Failed to allocate buffers");
-          return WG_ILLEGAL;
-        }
-        if(fread(extbuf, 1, extlength, f) != extlength) {
-          show_log_error(db, "Failed to read log entry");
-          free(strbuf);
-          free(extbuf);
+        extbuf = get_strbuf(db, r, 1, extlength);
+        if(!extbuf)
           return WG_ILLEGAL;
-        }
+        memcpy(extbuf, r->pos, extlength);
         extbuf[extlength] = '\0';
+        r->pos += extlength;
       } else {
         extbuf = NULL;
       }
 
-      enc = wg_encode_unistr(db, strbuf, extbuf, type);
-      free(strbuf);
-      if(extbuf)
-        free(extbuf);
-      return enc;
+      return wg_encode_unistr(db, strbuf, extbuf, type);
     default:
       break;
   }
@@ -613,7 +820,7 @@ gint recover_encode(void *db, FILE *f, gint type)
 /** Parse the journal file. Used internally only.
  *
  */
-static gint recover_journal(void *db, FILE *f, void *table)
+static gint recover_journal(void *db, log_reader *r, tran_table *table)
 {
   int c;
   gint length = 0, offset = 0, newoffset;
@@ -621,11 +828,11 @@ static gint recover_journal(void *db, FILE *f, void *table)
   void *rec;
 
   for(;;) {
-    GET_LOG_CMD(db, f, c)
+    GET_LOG_CMD(db, r, c)
     switch((unsigned char) c & WG_JOURNAL_ENTRY_CMDMASK) {
       case WG_JOURNAL_ENTRY_CRE:
-        GET_LOG_VARINT(db, f, length, -1)
-        GET_LOG_VARINT(db, f, offset, -1)
+        GET_LOG_VARINT(db, r, length, -1)
+        GET_LOG_VARINT(db, r, offset, -1)
         rec = wg_create_record(db, length);
         if(offset != 0) {
           /* XXX: should we have even tried if this failed earlier? */
@@ -633,7 +840,9 @@ static gint recover_journal(void *db, FILE *f, void *table)
             return show_log_error(db, "Failed to create a new record");
           }
           newoffset = ptrtooffset(db, rec);
-          if(newoffset != offset) {
+          /* An earlier record at the same offset may have been
+           * translated differently */
+          if(translate_offset(db, table, offset) != newoffset) {
             if(add_tran_offset(db, table, offset, newoffset)) {
               return show_log_error(db, "Failed to parse log "\
                 "(out of translation memory)");
@@ -642,7 +851,7 @@ static gint recover_journal(void *db, FILE *f, void *table)
         }
         break;
       case WG_JOURNAL_ENTRY_DEL:
-        GET_LOG_VARINT(db, f, offset, -1)
+        GET_LOG_VARINT(db, r, offset, -1)
         newoffset = translate_offset(db, table, offset);
         rec = offsettoptr(db, newoffset);
         if(wg_delete_record(db, rec) < -1) {
@@ -650,15 +859,15 @@ static gint recover_journal(void *db, FILE *f, void *table)
         }
         break;
       case WG_JOURNAL_ENTRY_ENC:
-        newenc = recover_encode(db, f,
+        newenc = recover_encode(db, r,
           (unsigned char) c & WG_JOURNAL_ENTRY_TYPEMASK);
-        GET_LOG_VARINT(db, f, enc, -1)
+        GET_LOG_VARINT(db, r, enc, -1)
         if(enc != WG_ILLEGAL) {
           /* Encode was supposed to succeed */
           if(newenc == WG_ILLEGAL) {
             return -1;
           }
-          if(newenc != enc) {
+          if(translate_encoded(db, table, enc) != newenc) {
             if(add_tran_enc(db, table, enc, newenc)) {
               return show_log_error(db, "Failed to parse log "\
                 "(out of translation memory)");
@@ -667,9 +876,9 @@ static gint recover_journal(void *db, FILE *f, void *table)
         }
         break;
       case WG_JOURNAL_ENTRY_SET:
-        GET_LOG_VARINT(db, f, offset, -1)
-        GET_LOG_VARINT(db, f, col, -1)
-        GET_LOG_VARINT(db, f, enc, -1)
+        GET_LOG_VARINT(db, r, offset, -1)
+        GET_LOG_VARINT(db, r, col, -1)
+        GET_LOG_VARINT(db, r, enc, -1)
         newoffset = translate_offset(db, table, offset);
         rec = offsettoptr(db, newoffset);
         newenc = translate_encoded(db, table, enc);
@@ -678,18 +887,408 @@ static gint recover_journal(void *db, FILE *f, void *table)
         }
         break;
       case WG_JOURNAL_ENTRY_META:
-        GET_LOG_VARINT(db, f, offset, -1)
-        GET_LOG_VARINT(db, f, meta, -1)
+        GET_LOG_VARINT(db, r, offset, -1)
+        GET_LOG_VARINT(db, r, meta, -1)
         newoffset = translate_offset(db, table, offset);
         rec = offsettoptr(db, newoffset);
         *((gint *) rec + RECORD_META_POS) = meta;
         break;
+      case WG_JOURNAL_ENTRY_TRAN:
+        /* The entries of the transaction follow. If they were
+         * not completely written, the transaction was never
+         * committed and the rest of the log is discarded.
+         */
+        GET_LOG_VARINT(db, r, length, -1)
+        if(length > r->end - r->pos)
+          return 0;
+        break;
+      case WG_JOURNAL_ENTRY_CHKP:
+        /* Checkpoint marker. Only used to match the journal with
+         * the checkpoint image, nothing to replay here. */
+        GET_LOG_VARINT(db, r, length, -1)
+        break;
       default:
         return show_log_error(db, "Invalid log entry");
     }
   }
   return 0;
 }
+
+/** Get the checkpoint number from the start of the journal.
+ *  Returns the checkpoint number, 0 if the journal does not start
+ *  from a checkpoint and -1 if the header is invalid.
+ */
+static gint journal_header_checkpoint(void *db, unsigned char *buf,
+  size_t len)
+{
+  wg_uint checkpoint = 0;
+  log_reader r;
+
+  if(len < WG_JOURNAL_MAGIC_BYTES ||\
+    strncmp((char *) buf, WG_JOURNAL_MAGIC, WG_JOURNAL_MAGIC_BYTES)) {
+    return -1;
+  }
+  if(len > WG_JOURNAL_MAGIC_BYTES &&\
+    buf[WG_JOURNAL_MAGIC_BYTES] == WG_JOURNAL_ENTRY_CHKP) {
+    memset(&r, 0, sizeof(log_reader));
+    r.pos = &buf[WG_JOURNAL_MAGIC_BYTES + 1];
+    r.end = &buf[len];
+    if(get_varint(db, &r, &checkpoint))
+      return -1;
+  }
+  return (gint) checkpoint;
+}
+
+#ifdef WG_JOURNAL_REPLICA
+/** Find the end of the complete entries in the journal data.
+ *  The primary may be in the middle of writing an entry, the rest
+ *  of it is read later. Invalid data is passed on, so that
+ *  recover_journal() can report it.
+ */
+static unsigned char *scan_journal(unsigned char *pos, unsigned char *end)
+{
+  unsigned char *entry;
+  wg_uint length, extlength;
+  int c, varints;
+
+  while(pos < end) {
+    entry = pos;
+    c = *(pos++);
+    switch((unsigned char) c & WG_JOURNAL_ENTRY_CMDMASK) {
+      case WG_JOURNAL_ENTRY_CRE:
+      case WG_JOURNAL_ENTRY_META:
+        varints = 2;
+        break;
+      case WG_JOURNAL_ENTRY_DEL:
+      case WG_JOURNAL_ENTRY_CHKP:
+        varints = 1;
+        break;
+      case WG_JOURNAL_ENTRY_SET:
+        varints = 3;
+        break;
+      case WG_JOURNAL_ENTRY_ENC:
+        /* the encoded data, followed by the encoded value */
+        switch((unsigned char) c & WG_JOURNAL_ENTRY_TYPEMASK) {
+          case WG_INTTYPE:
+            if(end - pos < (ptrdiff_t) sizeof(int))
+              return entry;
+            pos += sizeof(int);
+            break;
+          case WG_DOUBLETYPE:
+            if(end - pos < (ptrdiff_t) sizeof(double))
+              return entry;
+            pos += sizeof(double);
+            break;
+          case WG_STRTYPE:
+          case WG_URITYPE:
+          case WG_XMLLITERALTYPE:
+          case WG_ANONCONSTTYPE:
+          case WG_BLOBTYPE:
+            if(!(pos = next_varint(pos, end, &length)) ||\
+              !(pos = next_varint(pos, end, &extlength)))
+              return entry;
+            if((wg_uint) (end - pos) < length + extlength)
+              return entry;
+            pos += length + extlength;
+            break;
+          default:
+            return end;
+        }
+        varints = 1;
+        break;
+      case WG_JOURNAL_ENTRY_TRAN:
+        /* the transaction is applied when all of it is available */
+        if(!(pos = next_varint(pos, end, &length)) ||\
+          (wg_uint) (end - pos) < length)
+          return entry;
+        pos += length;
+        varints = 0;
+        break;
+      default:
+        return end;
+    }
+    while(varints--) {
+      if(!(pos = next_varint(pos, end, &length)))
+        return entry;
+    }
+  }
+  return pos;
+}
+
+/** Open the journal of the primary database.
+ *  Reads the checkpoint number and the inode of the journal. The
+ *  file offset is left after the magic.
+ *
+ *  Returns the file descriptor.
+ *  Returns -1 on error.
+ *  Returns -2 if the primary has not written the header yet.
+ */
+static int open_primary_journal(void *db, gint primary, gint *chk,
+  gint *ino)
+{
+  char journal_fn[WG_JOURNAL_FN_BUFSIZE];
+  unsigned char hdr[WG_JOURNAL_MAGIC_BYTES + 1 + VARINT_SIZE];
+  struct stat st;
+  ssize_t len;
+  int fd;
+
+  journal_filename(primary, journal_fn, WG_JOURNAL_FN_BUFSIZE);
+  if((fd = open(journal_fn, O_RDONLY)) == -1) {
+    show_log_error(db, "Error opening the primary journal");
+    return -1;
+  }
+  len = pread(fd, hdr, sizeof(hdr), 0);
+  if(len >= 0 && len < WG_JOURNAL_MAGIC_BYTES) {
+    JOURNAL_FAIL(fd, -2)
+  }
+  if(len < 0 || fstat(fd, &st) ||\
+    (*chk = journal_header_checkpoint(db, hdr, (size_t) len)) < 0 ||\
+    lseek(fd, WG_JOURNAL_MAGIC_BYTES, SEEK_SET) != WG_JOURNAL_MAGIC_BYTES) {
+    show_log_error(db, "Error reading the primary journal");
+    JOURNAL_FAIL(fd, -1)
+  }
+  *ino = (gint) st.st_ino;
+  return fd;
+}
+
+/** Load the state that the primary journal starts from.
+ *  This is either the checkpoint image of the journal or, if the
+ *  journal does not start from a checkpoint, an empty database (as
+ *  in wg_replay_log()). The primary may restart the journal at any
+ *  time, so the image is checked against the journal that was opened.
+ *
+ *  The state is built in a local database first and then copied over
+ *  the replica with replica_switch(), so the readers of the replica
+ *  only wait for the copy.
+ *
+ *  Returns 0 on success
+ *  Returns -1 on non-fatal error (database unmodified)
+ *  Returns -2 on fatal error (database inconsistent)
+ */
+static gint replica_seed(void *db, replica_state *rs)
+{
+  db_memsegment_header* dbh = dbmemsegh(db);
+  char fn[WG_CHECKPOINT_FN_BUFSIZE + 4];
+  gint chk = 0, ino = 0, minsize, maxsize, err;
+  void *seed;
+  int fd = -1, i, tmp;
+
+  seed = wg_attach_local_database(dbh->size);
+  if(!seed)
+    return show_log_error(db, "Failed to allocate the replica image");
+
+  for(i=0; i<WG_REPLICA_SEED_TRIES; i++) {
+    fd = open_primary_journal(db, rs->primary, &chk, &ino);
+    if(fd == -1)
+      break;
+    else if(fd == -2)
+      continue;
+    if(!chk) {
+      if(wg_init_db_memsegment(seed, 0, dbmemsegh(seed)->size)) {
+        close(fd);
+        fd = -1;
+      }
+      break;
+    }
+
+    /* The image is renamed after the journal was restarted */
+    for(tmp=0; tmp<2; tmp++) {
+      checkpoint_filename(rs->primary, fn, WG_CHECKPOINT_FN_BUFSIZE);
+      if(tmp)
+        strcat(fn, ".tmp");
+      if(access(fn, R_OK) || wg_check_dump(seed, fn, &minsize, &maxsize))
+        continue;
+      if(!wg_import_dump(seed, fn) &&\
+        dbmemsegh(seed)->logging.checkpoint == chk)
+        break;
+    }
+    if(tmp < 2)
+      break;
+    close(fd); /* the journal was restarted, try again */
+    fd = -1;
+  }
+  if(fd < 0) {
+    wg_delete_local_database(seed);
+    if(i == WG_REPLICA_SEED_TRIES)
+      show_log_error(db, "Checkpoint of the primary journal is missing");
+    return -1;
+  }
+
+  err = replica_switch(db, seed);
+  wg_delete_local_database(seed);
+  if(err) {
+    close(fd);
+    return err;
+  }
+
+  if(rs->fd >= 0)
+    close(rs->fd);
+  rs->fd = fd;
+  rs->ino = ino;
+  rs->chk = chk;
+  rs->pos = WG_JOURNAL_MAGIC_BYTES;
+  rs->switching = 0;
+  rs->buflen = 0;
+  free_tran_table(&rs->tran);
+
+  dbh->logging.replica_of = rs->primary;
+  dbh->logging.replica_promote = 0;
+  dbh->logging.replica_pos = rs->pos;
+  dbh->logging.replica_ino = rs->ino;
+  return 0;
+}
+
+/** Replace the image of the replica with that of the database src.
+ *  The readers of the replica may be holding or waiting for the lock,
+ *  so the lock area of the replica is kept as it is and everything
+ *  else is copied while holding the write lock. The databases have the
+ *  same size, so their lock areas are in the same place.
+ *
+ *  Returns 0 on success
+ *  Returns -1 on non-fatal error (database unmodified)
+ *  Returns -2 on fatal error (database inconsistent)
+ */
+static gint replica_switch(void *db, void *src)
+{
+  db_memsegment_header* dbh = dbmemsegh(db);
+  db_memsegment_header* srch = dbmemsegh(src);
+  char *dst = (char *) dbh, *img = (char *) srch;
+  size_t start = offsetof(db_memsegment_header, locks);
+  size_t end = start + sizeof(syn_var_area);
+  gint key = dbh->key, size = dbh->size, epoch = dbh->epoch, lock_id;
+#if (LOCK_PROTO==TFQUEUE)
+  gint qstart = dbh->locks.queue_lock;
+  gint qend = dbh->locks.storage + dbh->locks.max_nodes*SYN_VAR_PADDING;
+
+  if(srch->locks.queue_lock != qstart || srch->free < qend) {
+    return show_log_error(db, "Replica image has a different lock area");
+  }
+#endif
+
+  lock_id = db_wlock(db, DEFAULT_LOCK_TIMEOUT);
+  if(!lock_id)
+    return show_log_error(db, "Failed to lock the replica");
+  memcpy(dst, img, start);
+#if (LOCK_PROTO==TFQUEUE)
+  memcpy(dst + end, img + end, qstart - end);
+  memcpy(dst + qend, img + qend, srch->free - qend);
+#else
+  memcpy(dst + end, img + end, srch->free - end);
+#endif
+  dbh->key = key;
+  dbh->size = size;
+  /* results computed from the old image must not match */
+  dbh->epoch = epoch + 1;
+  dbh->epochwatch = 1;
+  if(!db_wulock(db, lock_id)) {
+    show_log_error(db, "Failed to unlock the replica");
+    return -2;
+  }
+  return 0;
+}
+
+/** Apply the new entries in the primary journal.
+ *  The journal is read until the end. The write lock is held for
+ *  one batch of entries at a time, so that the readers of the replica
+ *  are not blocked for long. An entry that is not completely written
+ *  yet is kept until the next call.
+ *
+ *  Returns 0 on success
+ *  Returns -1 on non-fatal error (database unmodified)
+ *  Returns -2 on fatal error (database inconsistent)
+ */
+static gint replica_apply(void *db, replica_state *rs)
+{
+  db_memsegment_header* dbh = dbmemsegh(db);
+  unsigned char *end;
+  ssize_t cnt;
+  size_t done;
+  gint lock_id, err;
+
+  for(;;) {
+    if(rs->bufsize < rs->buflen + WG_REPLICA_BATCH) {
+      unsigned char *newbuf = (unsigned char *) realloc(rs->buf,
+        rs->buflen + WG_REPLICA_BATCH);
+      if(!newbuf)
+        return show_log_error(db, "Failed to allocate the replica buffer");
+      rs->buf = newbuf;
+      rs->bufsize = rs->buflen + WG_REPLICA_BATCH;
+    }
+    cnt = read(rs->fd, rs->buf + rs->buflen, WG_REPLICA_BATCH);
+    if(cnt < 0)
+      return show_log_error(db, "Error reading the primary journal");
+    else if(cnt == 0)
+      return 0;
+    rs->buflen += cnt;
+
+    end = scan_journal(rs->buf, rs->buf + rs->buflen);
+    if(end == rs->buf)
+      continue;
+    lock_id = db_wlock(db, DEFAULT_LOCK_TIMEOUT);
+    if(!lock_id)
+      return show_log_error(db, "Failed to lock the replica");
+    rs->reader.pos = rs->buf;
+    rs->reader.end = end;
+    err = recover_journal(db, &rs->reader, &rs->tran);
+    if(!db_wulock(db, lock_id))
+      err = show_log_error(db, "Failed to unlock the replica");
+    if(err) {
+      show_log_error(db, "Failed to apply the primary journal");
+      return -2;
+    }
+
+    done = (size_t) (end - rs->buf);
+    memmove(rs->buf, end, rs->buflen - done);
+    rs->buflen -= done;
+    rs->pos += (gint) done;
+    dbh->logging.replica_pos = rs->pos;
+  }
+}
+
+/** Stop following the primary and start a journal of our own.
+ *  The new journal starts from a checkpoint, so that the promoted
+ *  database can be followed by other replicas.
+ */
+static gint replica_promote(void *db)
+{
+  db_memsegment_header* dbh = dbmemsegh(db);
+  db_handle_logdata *ld = \
+    (db_handle_logdata *) (((db_handle *) db)->logdata);
+  gint err;
+
+  /* apply what the primary managed to write */
+  err = replica_apply(db, (replica_state *) ld->replica);
+  if(err)
+    return err;
+  free_replica((replica_state *) ld->replica);
+  ld->replica = NULL;
+
+  dbh->logging.replica_of = 0;
+  dbh->logging.replica_promote = 0;
+  dbh->logging.replica_pos = 0;
+  dbh->logging.replica_ino = 0;
+  dbh->logging.dirty = 0;
+  if(wg_start_logging(db) || wg_checkpoint(db)) {
+    show_log_error(db, "Failed to start the journal of the promoted replica");
+    return -2;
+  }
+  return 0;
+}
+
+static void free_replica(replica_state *rs)
+{
+  if(rs->fd >= 0)
+    close(rs->fd);
+  if(rs->buf)
+    free(rs->buf);
+  free_tran_table(&rs->tran);
+  if(rs->reader.strbuf[0])
+    free(rs->reader.strbuf[0]);
+  if(rs->reader.strbuf[1])
+    free(rs->reader.strbuf[1]);
+  free(rs);
+}
+#endif /* WG_JOURNAL_REPLICA */
 #endif /* USE_DBLOG */
 
 /** Set up the logging area in the database handle
@@ -709,6 +1308,28 @@ gint wg_init_handle_logdata(void *db) {
   return 0;
 }
 
+/** Write out the journal entries pending in the database handle.
+ *  Called before detaching the database, as the entries can no longer
+ *  be checked against the journal serial after that. Stops the
+ *  background writer, if any.
+ */
+void wg_flush_handle_logdata(void *db) {
+#ifdef USE_DBLOG
+  db_handle_logdata *ld = \
+    (db_handle_logdata *) (((db_handle *) db)->logdata);
+  if(ld) {
+#ifdef WG_JOURNAL_BGSYNC
+    stop_log_flusher(db);
+#endif
+    if(!ld->intran)
+      flush_log_buffer(db);
+    ld->buflen = 0;
+    if(ld->unsynced && ld->sync_mode != WG_JOURNAL_SYNC_NONE)
+      sync_journal(db);
+  }
+#endif
+}
+
 /** Clean up the state of logging in the database handle.
  *  Normally called when closing the database connection.
  */
@@ -725,6 +1346,12 @@ void wg_cleanup_handle_logdata(void *db) {
 #endif
       ld->fd = -1;
     }
+    if(ld->buf)
+      free(ld->buf);
+#ifdef WG_JOURNAL_REPLICA
+    if(ld->replica)
+      free_replica((replica_state *) ld->replica);
+#endif
     free(ld);
     ((db_handle *) db)->logdata = NULL;
   }
@@ -771,10 +1398,25 @@ int wg_log_umask(void *db, int cmask) {
  * Returns -3 when additionally, the log file was possibly destroyed
  */
 gint wg_start_logging(void *db)
+{
+  return wg_start_logging_checkpoint(db, 0);
+}
+
+/** Activate logging, starting the journal at a checkpoint.
+ *
+ * If checkpoint is non-zero and a new journal is created, the journal
+ * starts with a marker that identifies the checkpoint image, so that
+ * the image and the journal can be matched when recovering.
+ *
+ * Returns the same values as wg_start_logging().
+ */
+gint wg_start_logging_checkpoint(void *db, gint checkpoint)
 {
 #ifdef USE_DBLOG
   db_memsegment_header* dbh = dbmemsegh(db);
 /*  db_handle_logdata *ld = ((db_handle *) db)->logdata;*/
+  unsigned char hdr[WG_JOURNAL_MAGIC_BYTES + 1 + VARINT_SIZE];
+  int hdrlen = WG_JOURNAL_MAGIC_BYTES;
   int fd;
 
   if(dbh->logging.active) {
@@ -790,14 +1432,19 @@ gint wg_start_logging(void *db)
   if(!dbh->logging.dirty) {
     /* logfile is clean, re-initialize */
     /* fseek(f, 0, SEEK_SET); */
+    memcpy(hdr, WG_JOURNAL_MAGIC, WG_JOURNAL_MAGIC_BYTES);
+    if(checkpoint) {
+      /* written together with the magic, so that the journal
+       * is never seen without the marker */
+      hdr[hdrlen++] = WG_JOURNAL_ENTRY_CHKP;
+      hdrlen += enc_varint(&hdr[hdrlen], (wg_uint) checkpoint);
+    }
 #ifndef _WIN32
     ftruncate(fd, 0); /* XXX: this is a no-op with backups */
-    if(write(fd, WG_JOURNAL_MAGIC, WG_JOURNAL_MAGIC_BYTES) != \
-                                            WG_JOURNAL_MAGIC_BYTES) {
+    if(write(fd, hdr, hdrlen) != hdrlen) {
 #else
     _chsize_s(fd, 0);
-    if(_write(fd, WG_JOURNAL_MAGIC, WG_JOURNAL_MAGIC_BYTES) != \
-                                            WG_JOURNAL_MAGIC_BYTES) {
+    if(_write(fd, hdr, hdrlen) != hdrlen) {
 #endif
       show_log_error(db, "Error initializing log file");
       JOURNAL_FAIL(fd, -3)
@@ -865,9 +1512,11 @@ gint wg_replay_log(void *db, char *filename)
 #ifdef USE_DBLOG
   db_memsegment_header* dbh = dbmemsegh(db);
   gint active, err = 0;
-  void *tran_tbl;
+  tran_table tran_tbl;
+  log_reader reader;
+  unsigned char *data;
+  size_t datalen;
   int fd;
-  FILE *f;
 
 #ifndef _WIN32
   if((fd = open(filename, O_RDONLY)) == -1) {
@@ -880,40 +1529,52 @@ gint wg_replay_log(void *db, char *filename)
 
   if(check_journal(db, fd)) {
     err = -1;
-    goto abort2;
+    goto abort1;
   }
 
-  active = dbh->logging.active;
-  dbh->logging.active = 0; /* turn logging off before restoring */
-
-  /* Reading can be done with buffered IO */
-#ifndef _WIN32
-  f = fdopen(fd, "r");
-#else
-  f = _fdopen(fd, "rb");
-#endif
   /* XXX: may consider fcntl-locking here */
-  /* restore the log contents */
-  tran_tbl = wg_ginthash_init(db);
-  if(!tran_tbl) {
-    show_log_error(db, "Failed to create log translation table");
+  data = map_journal(db, fd, &datalen);
+  if(!data) {
     err = -1;
     goto abort1;
   }
-  if(recover_journal(db, f, tran_tbl)) {
+
+  active = dbh->logging.active;
+  dbh->logging.active = 0; /* turn logging off before restoring */
+
+  memset(&reader, 0, sizeof(log_reader));
+  reader.pos = data + WG_JOURNAL_MAGIC_BYTES;
+  reader.end = data + datalen;
+  memset(&tran_tbl, 0, sizeof(tran_table));
+
+  /* restore the log contents. T-tree indexes are rebuilt
+   * once at the end instead of updating them for each entry. */
+  wg_defer_index_updates(db);
+  if(recover_journal(db, &reader, &tran_tbl)) {
+    err = -2;
+  }
+  if(wg_rebuild_deferred_indexes(db)) {
+    show_log_error(db, "Failed to rebuild the indexes");
     err = -2;
-    goto abort0;
   }
 
-  dbh->logging.dirty = 0; /* on success, set the log as clean. */
+  if(!err)
+    dbh->logging.dirty = 0; /* on success, set the log as clean. */
 
-abort0:
-  wg_ginthash_free(db, tran_tbl);
+  free_tran_table(&tran_tbl);
+  if(reader.strbuf[0])
+    free(reader.strbuf[0]);
+  if(reader.strbuf[1])
+    free(reader.strbuf[1]);
+  unmap_journal(data, datalen);
 
 abort1:
-  fclose(f);
+#ifndef _WIN32
+  close(fd);
+#else
+  _close(fd);
+#endif
 
-abort2:
   if(!err && active) {
     if(wg_start_logging(db)) {
       show_log_error(db, "Log restored but failed to reactivate logging");
@@ -927,11 +1588,441 @@ abort2:
 #endif /* USE_DBLOG */
 }
 
+/** Get the checkpoint number of a journal file.
+ *
+ * Returns the number of the checkpoint that the journal starts from
+ * Returns 0 if the journal does not start from a checkpoint
+ * Returns -1 if the journal does not exist or cannot be read
+ */
+gint wg_journal_checkpoint(void *db, char *filename)
+{
+#ifdef USE_DBLOG
+  unsigned char buf[WG_JOURNAL_MAGIC_BYTES + 1 + VARINT_SIZE];
+  size_t len;
+  FILE *f;
+
+#ifdef _WIN32
+  if(fopen_s(&f, filename, "rb"))
+#else
+  if(!(f = fopen(filename, "rb")))
+#endif
+    return -1;
+  len = fread(buf, 1, sizeof(buf), f);
+  fclose(f);
+  return journal_header_checkpoint(db, buf, len);
+#else
+  return show_log_error(db, "Logging is disabled");
+#endif /* USE_DBLOG */
+}
+
+/** Check if the journal has grown past the checkpoint limit.
+ *  Only the handle that wrote the data notices this. The flag is
+ *  cleared, the caller is expected to take the checkpoint (if that
+ *  fails, the next write past the limit sets it again).
+ */
+gint wg_log_checkpoint_due(void *db)
+{
+#ifdef USE_DBLOG
+  db_memsegment_header* dbh = dbmemsegh(db);
+  db_handle_logdata *ld = \
+    (db_handle_logdata *) (((db_handle *) db)->logdata);
+
+  if(!ld->checkpoint_due)
+    return 0;
+  if(!dbh->logging.active || ld->serial != dbh->logging.serial) {
+    /* someone else already restarted the journal */
+    ld->checkpoint_due = 0;
+    return 0;
+  }
+  ld->checkpoint_due = 0;
+  return 1;
+#else
+  return 0;
+#endif /* USE_DBLOG */
+}
+
+/** Remove the journal backups.
+ *  Called after a checkpoint, as the checkpoint image contains
+ *  all the changes recorded in the backups.
+ */
+void wg_log_remove_backups(void *db)
+{
+#ifdef USE_DBLOG
+  char journal_fn[WG_JOURNAL_FN_BUFSIZE];
+  char journal_backup[WG_JOURNAL_FN_BUFSIZE + 10];
+  int i;
+
+  wg_journal_filename(db, journal_fn, WG_JOURNAL_FN_BUFSIZE);
+  for(i=0; i<WG_JOURNAL_MAX_BACKUPS; i++) {
+    snprintf(journal_backup, WG_JOURNAL_FN_BUFSIZE + 10, "%s.%d",
+      journal_fn, i);
+#ifndef _WIN32
+    unlink(journal_backup);
+#else
+    _unlink(journal_backup);
+#endif
+  }
+#endif /* USE_DBLOG */
+}
+
+/** Start buffering the journal entries of a write transaction.
+ *
+ *  Entries still pending from outside of transactions are written
+ *  first, so that the journal follows the order in which the
+ *  write lock was held.
+ */
+void wg_log_start_transaction(void *db)
+{
+#ifdef USE_DBLOG
+  db_handle_logdata *ld = \
+    (db_handle_logdata *) (((db_handle *) db)->logdata);
+  LOG_LOCK(ld);
+  if(ld->buflen)
+    flush_log_buffer(db);
+  ld->buflen = TRAN_HEADER_SIZE;
+  ld->intran = 1;
+  LOG_UNLOCK(ld);
+#endif /* USE_DBLOG */
+}
+
+/** Write the buffered journal entries.
+ *
+ *  The entries are written with a single write, preceded by
+ *  a header that contains their total length, so that a partially
+ *  written transaction can be detected when replaying the log.
+ *  The write is followed by a sync if the sync mode requires it.
+ *
+ *  Returns 0 on success (also if there was nothing to write)
+ *  Returns non-zero on failure
+ */
+gint wg_log_commit_transaction(void *db)
+{
+#ifdef USE_DBLOG
+  db_handle_logdata *ld = \
+    (db_handle_logdata *) (((db_handle *) db)->logdata);
+  unsigned char hdr[TRAN_HEADER_SIZE];
+  size_t hdrlen, datalen;
+  gint err = 0;
+
+  if(!ld->intran)
+    return 0;
+  LOG_LOCK(ld);
+  ld->intran = 0;
+  datalen = ld->buflen - TRAN_HEADER_SIZE;
+  if(datalen) {
+    /* Place the header right before the entries */
+    hdr[0] = WG_JOURNAL_ENTRY_TRAN;
+    hdrlen = 1 + enc_varint(&hdr[1], (wg_uint) datalen);
+    memcpy(ld->buf + TRAN_HEADER_SIZE - hdrlen, hdr, hdrlen);
+    err = write_journal(db, ld->buf + TRAN_HEADER_SIZE - hdrlen,
+      (int) (hdrlen + datalen));
+    if(!err && ld->sync_mode == WG_JOURNAL_SYNC_COMMIT)
+      err = sync_journal(db);
+  }
+  ld->buflen = 0;
+  LOG_UNLOCK(ld);
+  return err;
+#else
+  return 0;
+#endif /* USE_DBLOG */
+}
+
+/** Discard the buffered journal entries.
+ *  Called when a write transaction is aborted.
+ */
+void wg_log_abort_transaction(void *db)
+{
+#ifdef USE_DBLOG
+  db_handle_logdata *ld = \
+    (db_handle_logdata *) (((db_handle *) db)->logdata);
+  LOG_LOCK(ld);
+  ld->intran = 0;
+  ld->buflen = 0;
+  LOG_UNLOCK(ld);
+#endif /* USE_DBLOG */
+}
+
+/** Set the journal durability mode of the database handle.
+ *
+ *  WG_JOURNAL_SYNC_NONE - journal is written, but syncing the
+ *    data to disk is left to the operating system (default)
+ *  WG_JOURNAL_SYNC_COMMIT - journal is synced on each commit
+ *  WG_JOURNAL_SYNC_INTERVAL - a background thread syncs the journal
+ *    every interval milliseconds, so that many commits share
+ *    a single sync.
+ *
+ *  Outside of write transactions, each logged operation counts as
+ *  a commit.
+ *
+ *  Returns 0 on success
+ *  Returns non-zero on failure
+ */
+gint wg_log_sync_mode(void *db, gint mode, gint interval)
+{
+#ifdef USE_DBLOG
+  db_handle_logdata *ld = \
+    (db_handle_logdata *) (((db_handle *) db)->logdata);
+
+  if(mode == WG_JOURNAL_SYNC_INTERVAL) {
+#ifdef WG_JOURNAL_BGSYNC
+    if(interval <= 0)
+      return show_log_error(db, "Invalid journal sync interval");
+#else
+    return show_log_error(db, "Background journal sync not supported");
+#endif
+  } else if(mode != WG_JOURNAL_SYNC_NONE && mode != WG_JOURNAL_SYNC_COMMIT) {
+    return show_log_error(db, "Invalid journal sync mode");
+  }
+
+#ifdef WG_JOURNAL_BGSYNC
+  stop_log_flusher(db);
+#endif
+  ld->sync_mode = (int) mode;
+  ld->sync_interval = (int) interval;
+#ifdef WG_JOURNAL_BGSYNC
+  if(mode == WG_JOURNAL_SYNC_INTERVAL)
+    return start_log_flusher(db);
+#endif
+  return 0;
+#else
+  return show_log_error(db, "Logging is disabled");
+#endif /* USE_DBLOG */
+}
+
+/** Write the pending journal entries and sync the journal.
+ *
+ *  Returns 0 on success
+ *  Returns non-zero on failure
+ */
+gint wg_log_flush(void *db)
+{
+#ifdef USE_DBLOG
+  db_handle_logdata *ld = \
+    (db_handle_logdata *) (((db_handle *) db)->logdata);
+  gint err = 0;
+
+  LOG_LOCK(ld);
+  if(!ld->intran)
+    err = flush_log_buffer(db);
+  if(!err && ld->unsynced)
+    err = sync_journal(db);
+  LOG_UNLOCK(ld);
+  return err;
+#else
+  return show_log_error(db, "Logging is disabled");
+#endif /* USE_DBLOG */
+}
+
+/** Start following the journal of the primary database.
+ *
+ * The replica is loaded from the checkpoint that the primary journal
+ * starts from and the journal is applied on top of it. After that,
+ * wg_replica_poll() applies the entries that the primary writes. The
+ * replica is meant for reading, the changes made to it directly are
+ * not coordinated with the primary.
+ *
+ * The primary should restart its journal with wg_checkpoint(), as a
+ * journal restarted otherwise may not continue from the state of the
+ * replica. Logging must not be active in the replica. The memory image
+ * is replaced while holding the write lock, so readers of the replica
+ * may stay attached.
+ *
+ * Returns 0 on success
+ * Returns -1 on non-fatal error (database unmodified)
+ * Returns -2 on fatal error (database inconsistent)
+ */
+gint wg_replica_start(void *db, gint primary)
+{
+#ifdef WG_JOURNAL_REPLICA
+  db_memsegment_header* dbh = dbmemsegh(db);
+  db_handle_logdata *ld = \
+    (db_handle_logdata *) (((db_handle *) db)->logdata);
+  replica_state *rs;
+  gint err;
+
+  if(ld->replica) {
+    return show_log_error(db, "Already following a primary");
+  }
+  if(dbh->logging.active) {
+    return show_log_error(db, "Cannot replicate to a database that is logging");
+  }
+  if(primary == dbh->key) {
+    return show_log_error(db, "Database cannot replicate itself");
+  }
+
+  rs = (replica_state *) malloc(sizeof(replica_state));
+  if(!rs) {
+    return show_log_error(db, "Failed to allocate the replica state");
+  }
+  memset(rs, 0, sizeof(replica_state));
+  rs->primary = primary;
+  rs->fd = -1;
+
+  err = replica_seed(db, rs);
+  if(err) {
+    free_replica(rs);
+    return err;
+  }
+  ld->replica = rs;
+  return replica_apply(db, rs);
+#elif defined(USE_DBLOG)
+  return show_log_error(db, "Replication is not supported on this platform");
+#else
+  return show_log_error(db, "Logging is disabled");
+#endif
+}
+
+/** Apply the new entries in the primary journal.
+ *
+ * Needs to be called periodically by the handle that called
+ * wg_replica_start(). When the primary restarts the journal, the
+ * replica continues with the new one. If a journal was missed, the
+ * replica is reloaded from the checkpoint.
+ *
+ * Returns 0 on success
+ * Returns 1 if the replica was promoted (see wg_replica_promote())
+ * Returns -1 on non-fatal error
+ * Returns -2 on fatal error (database inconsistent)
+ */
+gint wg_replica_poll(void *db)
+{
+#ifdef WG_JOURNAL_REPLICA
+  db_memsegment_header* dbh = dbmemsegh(db);
+  db_handle_logdata *ld = \
+    (db_handle_logdata *) (((db_handle *) db)->logdata);
+  replica_state *rs = (replica_state *) ld->replica;
+  char journal_fn[WG_JOURNAL_FN_BUFSIZE];
+  struct stat st;
+  gint chk, ino, err;
+  int fd;
+
+  if(!rs) {
+    return show_log_error(db, "Not following a primary");
+  }
+  if(dbh->logging.replica_promote) {
+    err = replica_promote(db);
+    return (err ? err : 1);
+  }
+
+  journal_filename(rs->primary, journal_fn, WG_JOURNAL_FN_BUFSIZE);
+  for(;;) {
+    err = replica_apply(db, rs);
+    if(err)
+      return err;
+    /* The name is briefly missing while the journal is restarted */
+    if(stat(journal_fn, &st) || (gint) st.st_ino == rs->ino)
+      return 0;
+    if(!rs->switching) {
+      /* read what was written before the restart */
+      rs->switching = 1;
+      continue;
+    }
+
+    fd = open_primary_journal(db, rs->primary, &chk, &ino);
+    if(fd == -2)
+      return 0;
+    else if(fd < 0)
+      return -1;
+    if(rs->chk && chk && chk != rs->chk + 1) {
+      /* the journals in between are gone */
+      close(fd);
+      err = replica_seed(db, rs);
+      if(err)
+        return err;
+      continue;
+    }
+    /* an incomplete entry was never committed */
+    close(rs->fd);
+    rs->fd = fd;
+    rs->ino = ino;
+    rs->chk = chk;
+    rs->pos = WG_JOURNAL_MAGIC_BYTES;
+    rs->switching = 0;
+    rs->buflen = 0;
+    dbh->logging.replica_pos = rs->pos;
+    dbh->logging.replica_ino = rs->ino;
+  }
+#elif defined(USE_DBLOG)
+  return show_log_error(db, "Replication is not supported on this platform");
+#else
+  return show_log_error(db, "Logging is disabled");
+#endif
+}
+
+/** Promote a replica to a database of its own.
+ *
+ * If the handle follows the primary, the remaining journal entries
+ * are applied and logging is started in the replica (with a
+ * checkpoint). Otherwise, the promotion is requested from the
+ * handle that follows the primary, it is carried out by the next
+ * wg_replica_poll() call.
+ *
+ * Returns 0 when the replica was promoted
+ * Returns 1 when the promotion was requested
+ * Returns -1 on non-fatal error
+ * Returns -2 on fatal error
+ */
+gint wg_replica_promote(void *db)
+{
+#ifdef WG_JOURNAL_REPLICA
+  db_memsegment_header* dbh = dbmemsegh(db);
+  db_handle_logdata *ld = \
+    (db_handle_logdata *) (((db_handle *) db)->logdata);
+
+  if(ld->replica) {
+    return replica_promote(db);
+  }
+  if(!dbh->logging.replica_of) {
+    return show_log_error(db, "Database is not a replica");
+  }
+  dbh->logging.replica_promote = 1;
+  return 1;
+#elif defined(USE_DBLOG)
+  return show_log_error(db, "Replication is not supported on this platform");
+#else
+  return show_log_error(db, "Logging is disabled");
+#endif
+}
+
+/** Get the replication lag.
+ *
+ * The lag is the amount of journal data (in bytes) that the primary
+ * has written, but the replica has not applied. If the primary has
+ * restarted the journal, only the new journal is counted.
+ *
+ * Returns the lag
+ * Returns -1 if the database is not a replica or the primary journal
+ * cannot be accessed
+ */
+gint wg_replica_lag(void *db)
+{
+#ifdef WG_JOURNAL_REPLICA
+  db_memsegment_header* dbh = dbmemsegh(db);
+  char journal_fn[WG_JOURNAL_FN_BUFSIZE];
+  struct stat st;
+  gint ino, pos;
+
+  if(!dbh->logging.replica_of)
+    return -1;
+  ino = dbh->logging.replica_ino;
+  pos = dbh->logging.replica_pos;
+  journal_filename(dbh->logging.replica_of, journal_fn,
+    WG_JOURNAL_FN_BUFSIZE);
+  if(stat(journal_fn, &st))
+    return -1;
+  if((gint) st.st_ino != ino)
+    return (gint) st.st_size;
+  return ((gint) st.st_size > pos ? (gint) st.st_size - pos : 0);
+#else
+  return -1;
+#endif
+}
+
 #ifdef USE_DBLOG
 /** Write a byte buffer to the log file.
  *
  */
-static gint write_log_buffer(void *db, void *buf, int buflen)
+static gint write_journal(void *db, void *buf, int buflen)
 {
   db_memsegment_header* dbh = dbmemsegh(db);
   db_handle_logdata *ld = \
@@ -979,8 +2070,204 @@ static gint write_log_buffer(void *db, void *buf, int buflen)
     JOURNAL_FAIL(ld->fd, -5)
   }
 
+  ld->unsynced = 1;
+
+  if(dbh->logging.checkpoint_limit > 0) {
+#ifndef _WIN32
+    off_t pos = lseek(ld->fd, 0, SEEK_CUR);
+#else
+    long pos = _lseek(ld->fd, 0, SEEK_CUR);
+#endif
+    if(pos >= dbh->logging.checkpoint_limit)
+      ld->checkpoint_due = 1;
+  }
+  return 0;
+}
+
+/** Sync the written journal data to disk.
+ *
+ */
+static gint sync_journal(void *db)
+{
+  db_handle_logdata *ld = \
+    (db_handle_logdata *) (((db_handle *) db)->logdata);
+
+  if(ld->fd < 0)
+    return 0;
+  ld->unsynced = 0;
+  if(sync_fd(ld->fd))
+    return show_log_error(db, "Error syncing the log file");
+  return 0;
+}
+
+static int sync_fd(int fd)
+{
+#ifdef _WIN32
+  return _commit(fd);
+#elif defined(__linux__)
+  return fdatasync(fd);
+#else
+  return fsync(fd);
+#endif
+}
+
+/** Write the entries pending in the buffer.
+ *  Entries that were buffered before the journal was restarted
+ *  are discarded, since the new journal starts after them.
+ */
+static gint flush_log_buffer(void *db)
+{
+  db_handle_logdata *ld = \
+    (db_handle_logdata *) (((db_handle *) db)->logdata);
+  gint err = 0;
+
+  if(ld->buflen) {
+    if(ld->bufserial == dbmemsegh(db)->logging.serial)
+      err = write_journal(db, ld->buf, (int) ld->buflen);
+    ld->buflen = 0;
+  }
+  return err;
+}
+
+/** Add a log entry to the buffer.
+ *
+ *  Inside a write transaction, the entries are kept until commit.
+ *  Otherwise, the buffer is written when the entry completes an
+ *  operation (or when the buffer fills up), so that the journal
+ *  follows the order of the operations of all the processes. The
+ *  sync mode only decides when the journal is synced.
+ */
+static gint write_log_buffer(void *db, void *buf, int buflen, int opdone)
+{
+  db_handle_logdata *ld = \
+    (db_handle_logdata *) (((db_handle *) db)->logdata);
+  gint err = 0;
+
+  LOG_LOCK(ld);
+  if(ld->buflen + buflen > ld->bufsize) {
+    size_t newsize = (ld->bufsize ? ld->bufsize : WG_JOURNAL_BUFSIZE);
+    unsigned char *newbuf;
+    while(newsize < ld->buflen + buflen)
+      newsize *= 2;
+    newbuf = (unsigned char *) realloc(ld->buf, newsize);
+    if(!newbuf) {
+      err = show_log_error(db, "Failed to extend the journal buffer");
+      goto done;
+    }
+    ld->buf = newbuf;
+    ld->bufsize = newsize;
+  }
+  if(ld->buflen && !ld->intran &&\
+    ld->bufserial != dbmemsegh(db)->logging.serial) {
+    /* The journal was restarted. The pending entries are already
+     * contained in the dump that started it. */
+    ld->buflen = 0;
+  }
+  if(!ld->buflen)
+    ld->bufserial = dbmemsegh(db)->logging.serial;
+  memcpy(ld->buf + ld->buflen, buf, buflen);
+  ld->buflen += buflen;
+
+  if(!ld->intran && (opdone || ld->buflen >= WG_JOURNAL_FLUSH_SIZE)) {
+    err = flush_log_buffer(db);
+    if(!err && opdone && ld->sync_mode == WG_JOURNAL_SYNC_COMMIT)
+      err = sync_journal(db);
+  }
+done:
+  LOG_UNLOCK(ld);
+  return err;
+}
+
+#ifdef WG_JOURNAL_BGSYNC
+/** Background thread that syncs the journal.
+ *  The entries are written by the logging process itself, while it
+ *  holds the database lock; this thread only syncs the data that
+ *  has been written. The sync uses a duplicate descriptor, so that
+ *  logging can continue while the sync is in progress.
+ */
+static void *log_flusher(void *arg)
+{
+  void *db = arg;
+  db_handle_logdata *ld = \
+    (db_handle_logdata *) (((db_handle *) db)->logdata);
+  struct timespec deadline;
+  int fd;
+
+  pthread_mutex_lock(&ld->mutex);
+  while(ld->flusher_state == 1) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ld->sync_interval / 1000;
+    deadline.tv_nsec += (long) (ld->sync_interval % 1000) * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&ld->cond, &ld->mutex, &deadline);
+    if(ld->flusher_state != 1)
+      break;
+
+    if(ld->unsynced && ld->fd >= 0 && (fd = dup(ld->fd)) >= 0) {
+      ld->unsynced = 0;
+      pthread_mutex_unlock(&ld->mutex);
+      if(sync_fd(fd))
+        show_log_error(db, "Error syncing the log file");
+      close(fd);
+      pthread_mutex_lock(&ld->mutex);
+    }
+  }
+  pthread_mutex_unlock(&ld->mutex);
+  return NULL;
+}
+
+/** Start the background journal sync.
+ *
+ */
+static gint start_log_flusher(void *db)
+{
+  db_handle_logdata *ld = \
+    (db_handle_logdata *) (((db_handle *) db)->logdata);
+
+  if(pthread_mutex_init(&ld->mutex, NULL))
+    return show_log_error(db, "Failed to initialize journal mutex");
+  if(pthread_cond_init(&ld->cond, NULL)) {
+    pthread_mutex_destroy(&ld->mutex);
+    return show_log_error(db, "Failed to initialize journal condition");
+  }
+  ld->flusher_state = 1;
+  if(pthread_create(&ld->flusher, NULL, log_flusher, db)) {
+    ld->flusher_state = 0;
+    pthread_cond_destroy(&ld->cond);
+    pthread_mutex_destroy(&ld->mutex);
+    return show_log_error(db, "Failed to start the journal sync thread");
+  }
   return 0;
 }
+
+/** Stop the background journal sync.
+ *  Pending entries are written and synced before returning.
+ */
+static void stop_log_flusher(void *db)
+{
+  db_handle_logdata *ld = \
+    (db_handle_logdata *) (((db_handle *) db)->logdata);
+
+  if(!ld->flusher_state)
+    return;
+  pthread_mutex_lock(&ld->mutex);
+  ld->flusher_state = 2;
+  pthread_cond_signal(&ld->cond);
+  pthread_mutex_unlock(&ld->mutex);
+  pthread_join(ld->flusher, NULL);
+  ld->flusher_state = 0;
+  pthread_cond_destroy(&ld->cond);
+  pthread_mutex_destroy(&ld->mutex);
+
+  if(!ld->intran)
+    flush_log_buffer(db);
+  if(ld->unsynced)
+    sync_journal(db);
+}
+#endif /* WG_JOURNAL_BGSYNC */
 #endif /* USE_DBLOG */
 
 /*
@@ -993,6 +2280,8 @@ static gint write_log_buffer(void *db, void *buf, int buflen)
  *   followed by a single varint field that contains the encoded value
  * WG_JOURNAL_ENTRY_SET - set a field value (record offset, column, encoded value)
  * WG_JOURNAL_ENTRY_META - set the metadata of a record
+ * WG_JOURNAL_ENTRY_TRAN - start of a committed write transaction (length
+ *   of the entries that belong to the transaction)
  *
  * lengths, offsets and encoded values are stored as varints
  */
@@ -1009,7 +2298,7 @@ gint wg_log_create_record(void *db, gint length)
   buf[0] = WG_JOURNAL_ENTRY_CRE;
   optr = &buf[1];
   optr += enc_varint(optr, (wg_uint) length);
-  return write_log_buffer(db, (void *) buf, optr - buf);
+  return write_log_buffer(db, (void *) buf, optr - buf, 0);
 #else
   return show_log_error(db, "Logging is disabled");
 #endif /* USE_DBLOG */
@@ -1025,7 +2314,7 @@ gint wg_log_delete_record(void *db, gint enc)
   buf[0] = WG_JOURNAL_ENTRY_DEL;
   optr = &buf[1];
   optr += enc_varint(optr, (wg_uint) enc);
-  return write_log_buffer(db, (void *) buf, optr - buf);
+  return write_log_buffer(db, (void *) buf, optr - buf, 1);
 #else
   return show_log_error(db, "Logging is disabled");
 #endif /* USE_DBLOG */
@@ -1041,7 +2330,7 @@ gint wg_log_encval(void *db, gint enc)
 #ifdef USE_DBLOG
   unsigned char buf[VARINT_SIZE];
   size_t buflen = enc_varint(buf, (wg_uint) enc);
-  return write_log_buffer(db, (void *) buf, buflen);
+  return write_log_buffer(db, (void *) buf, buflen, 1);
 #else
   return show_log_error(db, "Logging is disabled");
 #endif /* USE_DBLOG */
@@ -1121,7 +2410,7 @@ gint wg_log_encode(void *db, gint type, void *data, gint length,
   /* Add a fixed prefix */
   buf[0] = WG_JOURNAL_ENTRY_ENC | type;
 
-  err = write_log_buffer(db, (void *) buf, buflen);
+  err = write_log_buffer(db, (void *) buf, buflen, 0);
   free(buf);
   return err;
 #else
@@ -1142,7 +2431,7 @@ gint wg_log_set_field(void *db, void *rec, gint col, gint data)
   optr += enc_varint(optr, (wg_uint) ptrtooffset(db, rec));
   optr += enc_varint(optr, (wg_uint) col);
   optr += enc_varint(optr, (wg_uint) data);
-  return write_log_buffer(db, (void *) buf, optr - buf);
+  return write_log_buffer(db, (void *) buf, optr - buf, 1);
 #else
   return show_log_error(db, "Logging is disabled");
 #endif /* USE_DBLOG */
@@ -1160,7 +2449,7 @@ gint wg_log_set_meta(void *db, void *rec, gint meta)
   optr = &buf[1];
   optr += enc_varint(optr, (wg_uint) ptrtooffset(db, rec));
   optr += enc_varint(optr, (wg_uint) meta);
-  return write_log_buffer(db, (void *) buf, optr - buf);
+  return write_log_buffer(db, (void *) buf, optr - buf, 1);
 #else
   return show_log_error(db, "Logging is disabled");
 #endif /* USE_DBLOG */
@@ -35,6 +35,12 @@
 #define WG_JOURNAL_FILENAME DBLOG_DIR "\\wgdb_journal"
 #endif
 #define WG_JOURNAL_FN_BUFSIZE (sizeof(WG_JOURNAL_FILENAME) + 20)
+#ifndef _WIN32
+#define WG_CHECKPOINT_FILENAME DBLOG_DIR "/wgdb.checkpoint"
+#else
+#define WG_CHECKPOINT_FILENAME DBLOG_DIR "\\wgdb_checkpoint"
+#endif
+#define WG_CHECKPOINT_FN_BUFSIZE (sizeof(WG_CHECKPOINT_FILENAME) + 20)
 #define WG_JOURNAL_MAX_BACKUPS 10
 #define WG_JOURNAL_MAGIC "wgdb"
 #define WG_JOURNAL_MAGIC_BYTES 4
@@ -44,9 +50,31 @@
 #define WG_JOURNAL_ENTRY_DEL ((unsigned char) 0x80)
 #define WG_JOURNAL_ENTRY_SET ((unsigned char) 0xc0)
 #define WG_JOURNAL_ENTRY_META ((unsigned char) 0x20)
+#define WG_JOURNAL_ENTRY_TRAN ((unsigned char) 0x60)
+#define WG_JOURNAL_ENTRY_CHKP ((unsigned char) 0xa0)
 #define WG_JOURNAL_ENTRY_CMDMASK (0xe0)
 #define WG_JOURNAL_ENTRY_TYPEMASK (0x1f)
 
+#define WG_JOURNAL_BUFSIZE 4096 /* initial entry buffer size */
+#define WG_JOURNAL_FLUSH_SIZE 65536 /* write pending entries at this size */
+
+/* Journal durability modes */
+#define WG_JOURNAL_SYNC_NONE 0      /* leave syncing to the OS */
+#define WG_JOURNAL_SYNC_COMMIT 1    /* sync on each commit */
+#define WG_JOURNAL_SYNC_INTERVAL 2  /* sync periodically in background */
+
+#if defined(USE_DBLOG) && defined(HAVE_PTHREAD) && !defined(_WIN32)
+#define WG_JOURNAL_BGSYNC
+#include <pthread.h>
+#endif
+
+/* Replicas need to notice when the primary renames the journal */
+#if defined(USE_DBLOG) && !defined(_WIN32)
+#define WG_JOURNAL_REPLICA
+#endif
+#define WG_REPLICA_BATCH 1048576 /* journal data applied per write lock */
+#define WG_REPLICA_SEED_TRIES 3 /* attempts to match the checkpoint */
+
 
 /* ====== data structures ======== */
 
@@ -55,18 +83,51 @@ typedef struct {
   int fd;
   gint serial;
   int umask;
+  unsigned char *buf;     /* entries not yet written to the journal */
+  size_t buflen;
+  size_t bufsize;
+  gint bufserial;         /* journal serial of the buffered entries */
+  int intran;             /* buffering a write transaction */
+  int sync_mode;
+  int sync_interval;      /* in milliseconds */
+  int unsynced;           /* data written since last sync */
+  int checkpoint_due;     /* journal has grown past the checkpoint limit */
+  void *replica;          /* state of following the primary journal */
+#ifdef WG_JOURNAL_BGSYNC
+  pthread_t flusher;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int flusher_state;      /* 0 - none, 1 - running, 2 - stopping */
+#endif
 } db_handle_logdata;
 
 /* ==== Protos ==== */
 
 gint wg_init_handle_logdata(void *db);
+void wg_flush_handle_logdata(void *db);
 void wg_cleanup_handle_logdata(void *db);
 int wg_log_umask(void *db, int cmask);
 
 void wg_journal_filename(void *db, char *buf, size_t buflen);
+void wg_checkpoint_filename(void *db, char *buf, size_t buflen);
 gint wg_start_logging(void *db);
+gint wg_start_logging_checkpoint(void *db, gint checkpoint);
 gint wg_stop_logging(void *db);
 gint wg_replay_log(void *db, char *filename);
+gint wg_journal_checkpoint(void *db, char *filename);
+gint wg_log_checkpoint_due(void *db);
+void wg_log_remove_backups(void *db);
+
+void wg_log_start_transaction(void *db);
+gint wg_log_commit_transaction(void *db);
+void wg_log_abort_transaction(void *db);
+gint wg_log_sync_mode(void *db, gint mode, gint interval);
+gint wg_log_flush(void *db);
+
+gint wg_replica_start(void *db, gint primary);
+gint wg_replica_poll(void *db);
+gint wg_replica_promote(void *db);
+gint wg_replica_lag(void *db);
 
 gint wg_log_create_record(void *db, gint length);
 gint wg_log_delete_record(void *db, gint enc);
@@ -40,6 +40,9 @@
 #else
 #include <sys/shm.h>
 #include <sys/errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 #endif
 
@@ -55,10 +58,18 @@ extern "C" {
 #include "dballoc.h"
 #include "dbfeatures.h"
 #include "dbmem.h"
+#include "dbdata.h"
 #include "dblog.h"
+#include "dblock.h"
+#include "dbdump.h"
+#include "dbcdc.h"
 
 /* ====== Private headers and defs ======== */
 
+#if !defined(_WIN32) && !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
 /* ======= Private protos ================ */
 
 static int normalize_perms(int mode);
@@ -71,6 +82,9 @@ static int detach_shared_memory(void* shmptr);
 #ifdef USE_DATABASE_HANDLE
 static void *init_dbhandle(void);
 static void free_dbhandle(void *dbhandle);
+#ifndef _WIN32
+static void unmap_dump(void *dbhandle);
+#endif
 #endif
 
 #ifndef _WIN32
@@ -342,7 +356,11 @@ void* wg_attach_memsegment(char* dbasename, gint minsize,
  * returns 0 if OK
  */
 int wg_detach_database(void* dbase) {
-  int err = detach_shared_memory(dbmemseg(dbase));
+  int err;
+#ifdef USE_DBLOG
+  wg_flush_handle_logdata(dbase);
+#endif
+  err = detach_shared_memory(dbmemseg(dbase));
 #ifdef USE_DATABASE_HANDLE
   if(!err) {
     free_dbhandle(dbase);
@@ -417,6 +435,14 @@ void* wg_attach_local_database(gint size) {
 void wg_delete_local_database(void* dbase) {
   if(dbase) {
     void *localmem = dbmemseg(dbase);
+#ifdef USE_DBLOG
+    wg_flush_handle_logdata(dbase);
+#endif
+#if defined(USE_DATABASE_HANDLE) && !defined(_WIN32)
+    if(((db_handle *) dbase)->mapsize)
+      unmap_dump(dbase);
+    else
+#endif
     if(localmem)
       free(localmem);
 #ifdef USE_DATABASE_HANDLE
@@ -425,6 +451,170 @@ void wg_delete_local_database(void* dbase) {
   }
 }
 
+/** Use a dump file as a local database without reading it in.
+ * returns a pointer to the database, NULL if failure.
+ *
+ * The file is mapped to memory and the pages are read when they are
+ * first accessed, so the database can be used right away regardless
+ * of its size. size is the size of the database area; 0 keeps the size
+ * the database had when it was dumped.
+ *
+ * With WG_DUMP_MAP_PRIVATE the changes are not written to the file.
+ * With WG_DUMP_MAP_SHARED the file itself holds the database while it
+ * is in use and becomes a regular dump again when the database is freed
+ * with wg_delete_local_database().
+ *
+ * Only uncompressed dumps can be mapped. The checksum is not verified,
+ * use wg_check_dump() for that.
+ */
+
+void* wg_attach_mapped_dump(char* fileName, gint size, int mode) {
+#ifndef _WIN32
+  db_memsegment_header hdr;
+  db_memsegment_header* dbh;
+  struct stat st;
+  void *dbhandle, *shm;
+  gint mapsize;
+  off_t maplen;
+  ssize_t len;
+  int fd;
+
+  if(mode != WG_DUMP_MAP_PRIVATE && mode != WG_DUMP_MAP_SHARED) {
+    show_memory_error("Invalid dump mapping mode");
+    return NULL;
+  }
+  fd = open(fileName, (mode == WG_DUMP_MAP_SHARED ? O_RDWR : O_RDONLY));
+  if(fd == -1) {
+    show_memory_error("Error opening the dump file");
+    return NULL;
+  }
+  if(fstat(fd, &st) ||\
+    (len = read(fd, &hdr, sizeof(hdr))) < WG_CHUNKED_MAGIC_BYTES) {
+    show_memory_error("Error reading the dump header");
+    goto abort1;
+  }
+  if(!memcmp(&hdr, WG_CHUNKED_MAGIC, WG_CHUNKED_MAGIC_BYTES) ||\
+    !memcmp(&hdr, WG_DELTA_MAGIC, WG_DELTA_MAGIC_BYTES)) {
+    show_memory_error("Only uncompressed dumps can be mapped");
+    goto abort1;
+  }
+  if(len != sizeof(hdr)) {
+    show_memory_error("Error reading the dump header");
+    goto abort1;
+  }
+  if(wg_check_header_compat(&hdr)) {
+    show_memory_error("Dump file header is incompatible");
+    wg_print_code_version();
+    wg_print_header_version(&hdr, 1);
+    goto abort1;
+  }
+  if(hdr.free > st.st_size) {
+    show_memory_error("Dump file is truncated");
+    goto abort1;
+  }
+  if(hdr.extdbs.count != 0) {
+    show_memory_error("Dump contains external references");
+    goto abort1;
+  }
+
+  mapsize = (size > hdr.size ? size : hdr.size);
+  dbhandle = init_dbhandle();
+  if(!dbhandle)
+    goto abort1;
+
+  if(mode == WG_DUMP_MAP_SHARED) {
+    /* the rest of the area becomes a sparse part of the file */
+    if(st.st_size < mapsize && ftruncate(fd, mapsize)) {
+      show_memory_error("Error extending the dump file");
+      goto abort2;
+    }
+    shm = mmap(NULL, mapsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  } else {
+    /* the area past the end of the file is anonymous memory */
+    shm = mmap(NULL, mapsize, PROT_READ|PROT_WRITE,
+      MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    maplen = (st.st_size < mapsize ? st.st_size : mapsize);
+    if(shm != MAP_FAILED && mmap(shm, maplen, PROT_READ|PROT_WRITE,
+      MAP_PRIVATE|MAP_FIXED, fd, 0) == MAP_FAILED) {
+      munmap(shm, mapsize);
+      shm = MAP_FAILED;
+    }
+  }
+  if(shm == MAP_FAILED) {
+    show_memory_error("Failed to map the dump file");
+    goto abort2;
+  }
+
+  ((db_handle *) dbhandle)->db = shm;
+  ((db_handle *) dbhandle)->mapsize = mapsize;
+  if(mode == WG_DUMP_MAP_SHARED) {
+    ((db_handle *) dbhandle)->mapshared = 1;
+    ((db_handle *) dbhandle)->mapfd = fd;
+  } else {
+    close(fd);
+  }
+
+  /* Same state as after importing the dump. Only the modified
+   * pages of a private mapping are copied. */
+  dbh = dbmemsegh(dbhandle);
+  dbh->size = mapsize;
+  dbh->checksum = 0;
+  dbh->key = 0; /* no shared memory associated */
+#ifdef USE_DBLOG
+  dbh->logging.active = 0;
+  dbh->logging.dirty = 0;
+#endif
+  if(wg_init_locks(dbhandle)) {
+    wg_delete_local_database(dbhandle);
+    return NULL;
+  }
+  return dbhandle;
+
+abort2:
+  /* leave the file as it was */
+  if(mode == WG_DUMP_MAP_SHARED && st.st_size < mapsize &&\
+    ftruncate(fd, st.st_size))
+    show_memory_error("Error truncating the dump file");
+  free_dbhandle(dbhandle);
+abort1:
+  close(fd);
+  return NULL;
+#else
+  /* No mapping, the dump is read to local memory instead */
+  db_memsegment_header hdr;
+  void *db;
+  FILE *f;
+  gint err = -1;
+
+  if(mode != WG_DUMP_MAP_PRIVATE) {
+    show_memory_error("Shared dump mapping is not supported");
+    return NULL;
+  }
+  if(fopen_s(&f, fileName, "rb")) {
+    show_memory_error("Error opening the dump file");
+    return NULL;
+  }
+  if(fread(&hdr, sizeof(hdr), 1, f) != 1) {
+    show_memory_error("Error reading the dump header");
+    fclose(f);
+    return NULL;
+  }
+  fclose(f);
+  if(wg_check_header_compat(&hdr)) {
+    show_memory_error("Dump file is compressed or incompatible");
+    return NULL;
+  }
+  db = wg_attach_local_database(size > hdr.size ? size : hdr.size);
+  if(db)
+    err = wg_import_dump(db, fileName);
+  if(err) {
+    wg_delete_local_database(db);
+    return NULL;
+  }
+  return db;
+#endif
+}
+
 
 /* -------------------- database handle management -------------------- */
 
@@ -444,6 +634,21 @@ static void *init_dbhandle() {
     return NULL;
   }
 #endif
+  if(wg_init_handle_undodata(dbhandle)) {
+#ifdef USE_DBLOG
+    wg_cleanup_handle_logdata(dbhandle);
+#endif
+    free(dbhandle);
+    return NULL;
+  }
+  if(wg_init_handle_cdcdata(dbhandle)) {
+#ifdef USE_DBLOG
+    wg_cleanup_handle_logdata(dbhandle);
+#endif
+    wg_cleanup_handle_undodata(dbhandle);
+    free(dbhandle);
+    return NULL;
+  }
   return dbhandle;
 }
 
@@ -451,9 +656,35 @@ static void free_dbhandle(void *dbhandle) {
 #ifdef USE_DBLOG
   wg_cleanup_handle_logdata(dbhandle);
 #endif
+  wg_cleanup_handle_undodata(dbhandle);
+  wg_cleanup_handle_cdcdata(dbhandle);
+  wg_cleanup_handle_tinystrs(dbhandle);
   free(dbhandle);
 }
 
+#ifndef _WIN32
+/** Release the memory of a mapped dump file.
+ *  A shared mapping is turned back into a regular dump by storing
+ *  the checksum and truncating the file to the used area.
+ */
+static void unmap_dump(void *dbhandle) {
+  db_handle *h = (db_handle *) dbhandle;
+  gint used = dbmemsegh(dbhandle)->free;
+
+  if(h->mapshared) {
+    wg_store_dump_checksum(dbhandle);
+    if(msync(h->db, used, MS_SYNC))
+      show_memory_error("Error writing the dump file");
+  }
+  munmap(h->db, h->mapsize);
+  if(h->mapshared) {
+    if(ftruncate(h->mapfd, used))
+      show_memory_error("Error truncating the dump file");
+    close(h->mapfd);
+  }
+}
+#endif
+
 #endif
 
 /* ----------------- memory image/dump compatibility ------------------ */
@@ -511,13 +742,15 @@ void wg_print_code_version(void) {
     "  chained nodes in T-tree: %s\n"\
     "  record backlinking: %s\n"\
     "  child databases: %s\n"\
-    "  index templates: %s\n",
+    "  index templates: %s\n"\
+    "  key prefixes in T-tree: %s\n",
     (MEMSEGMENT_FEATURES & FEATURE_BITS_64BIT ? "yes" : "no"),
     (MEMSEGMENT_FEATURES & FEATURE_BITS_QUEUED_LOCKS ? "yes" : "no"),
     (MEMSEGMENT_FEATURES & FEATURE_BITS_TTREE_CHAINED ? "yes" : "no"),
     (MEMSEGMENT_FEATURES & FEATURE_BITS_BACKLINK ? "yes" : "no"),
     (MEMSEGMENT_FEATURES & FEATURE_BITS_CHILD_DB ? "yes" : "no"),
-    (MEMSEGMENT_FEATURES & FEATURE_BITS_INDEX_TMPL ? "yes" : "no"));
+    (MEMSEGMENT_FEATURES & FEATURE_BITS_INDEX_TMPL ? "yes" : "no"),
+    (MEMSEGMENT_FEATURES & FEATURE_BITS_TTREE_KEYS ? "yes" : "no"));
 }
 
 void wg_print_header_version(db_memsegment_header *dbh, int verbose) {
@@ -558,13 +791,15 @@ void wg_print_header_version(db_memsegment_header *dbh, int verbose) {
       "  chained nodes in T-tree: %s\n"\
       "  record backlinking: %s\n"\
       "  child databases: %s\n"\
-      "  index templates: %s\n",
+      "  index templates: %s\n"\
+      "  key prefixes in T-tree: %s\n",
       (features & FEATURE_BITS_64BIT ? "yes" : "no"),
       (features & FEATURE_BITS_QUEUED_LOCKS ? "yes" : "no"),
       (features & FEATURE_BITS_TTREE_CHAINED ? "yes" : "no"),
       (features & FEATURE_BITS_BACKLINK ? "yes" : "no"),
       (features & FEATURE_BITS_CHILD_DB ? "yes" : "no"),
-      (features & FEATURE_BITS_INDEX_TMPL ? "yes" : "no"));
+      (features & FEATURE_BITS_INDEX_TMPL ? "yes" : "no"),
+      (features & FEATURE_BITS_TTREE_KEYS ? "yes" : "no"));
   } else {
     printf("%d.%d.%d%s\n",
       (version & 0xff), ((version>>8) & 0xff), ((version>>16) & 0xff),
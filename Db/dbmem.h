@@ -44,6 +44,9 @@
 
 #define MAX_FILENAME_SIZE 100
 
+#define WG_DUMP_MAP_PRIVATE 0 /** changes are not written to the dump file */
+#define WG_DUMP_MAP_SHARED 1  /** the dump file holds the database */
+
 /* ====== data structures ======== */
 
 
@@ -65,6 +68,7 @@ void wg_print_header_version(db_memsegment_header *dbh, int verbose); // show ve
 
 void* wg_attach_local_database(gint size);
 void wg_delete_local_database(void* dbase);
+void* wg_attach_mapped_dump(char* fileName, gint size, int mode); // use a dump file as a local database
 
 int wg_memmode(void *db);
 int wg_memowner(void *db);
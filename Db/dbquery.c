@@ -97,8 +97,14 @@ static gint prepare_params(void *db, void *matchrec, gint reclen,
 static gint find_ttree_bounds(void *db, gint index_id, gint col,
   gint start_bound, gint end_bound, gint start_inclusive, gint end_inclusive,
   gint *curr_offset, gint *curr_slot, gint *end_offset, gint *end_slot);
+static gint find_btree_bounds(void *db, gint index_id,
+  gint start_bound, gint end_bound, gint start_inclusive, gint end_inclusive,
+  gint *curr_offset, gint *curr_slot, gint *end_offset, gint *end_slot);
 static wg_query *internal_build_query(void *db, void *matchrec, gint reclen,
-  wg_query_arg *arglist, gint argc, gint flags, wg_uint rowlimit);
+  wg_query_arg *arglist, gint argc, gint flags, wg_uint rowlimit,
+  void *after);
+static void skip_to_record(void *db, wg_query *query, gint index_id,
+  gint col, gint key, void *after);
 
 static query_result_set *create_resultset(void *db);
 static void free_resultset(void *db, query_result_set *set);
@@ -207,7 +213,8 @@ static gint most_restricting_column(void *db,
           wg_index_header *hdr = \
             (wg_index_header *) offsettoptr(db, ilistelem->car);
 
-          if(hdr->type == WG_INDEX_TYPE_TTREE) {
+          if(hdr->type == WG_INDEX_TYPE_TTREE ||\
+            hdr->type == WG_INDEX_TYPE_BTREE) {
 #ifdef USE_INDEX_TEMPLATE
             /* If index templates are available, we can increase the
              * score of the index if the template has any columns matching
@@ -644,6 +651,73 @@ static gint find_ttree_bounds(void *db, gint index_id, gint col,
   return 0;
 }
 
+/** Find start and end points for a query on a B+tree index.
+ * The leaves are chained, so the range is simply the first
+ * matching entry and the last matching entry.
+ *
+ * return -1 on error
+ * return 0 on success
+ */
+static gint find_btree_bounds(void *db, gint index_id,
+  gint start_bound, gint end_bound, gint start_inclusive, gint end_inclusive,
+  gint *curr_offset, gint *curr_slot, gint *end_offset, gint *end_slot)
+{
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  struct wg_bnode *node;
+  gint co, cs, eo, es;
+
+  if(start_bound==WG_ILLEGAL) {
+    co = BTREE_MIN_NODE(hdr);
+    cs = 0;
+    node = (struct wg_bnode *) offsettoptr(db, co);
+    if(!node->number_of_elements)
+      co = 0; /* empty index */
+  } else {
+    co = wg_search_btree_first(db, index_id, start_bound,
+      !start_inclusive, &cs);
+  }
+
+  if(end_bound==WG_ILLEGAL) {
+    eo = BTREE_MAX_NODE(hdr);
+    node = (struct wg_bnode *) offsettoptr(db, eo);
+    es = node->number_of_elements - 1;
+    if(es < 0)
+      eo = 0;
+  } else {
+    eo = wg_search_btree_last(db, index_id, end_bound,
+      !end_inclusive, &es);
+  }
+
+  /* The range is empty if the first entry is past the last one
+   * (for example, val > 1 & val < 2 with no values in between).
+   */
+  if(co && eo) {
+    gint column = hdr->rec_field_index[0];
+    gint first, last;
+
+    node = (struct wg_bnode *) offsettoptr(db, co);
+    first = wg_get_field(db,
+      offsettoptr(db, node->array_of_rows[cs]), column);
+    node = (struct wg_bnode *) offsettoptr(db, eo);
+    last = wg_get_field(db,
+      offsettoptr(db, node->array_of_rows[es]), column);
+    if(WG_COMPARE(db, first, last) == WG_GREATER ||\
+      (co == eo && cs > es)) {
+      co = 0;
+      eo = 0;
+    }
+  } else {
+    co = 0; /* if one offset is 0, the other should be, too */
+    eo = 0;
+  }
+
+  *curr_offset = co;
+  *curr_slot = cs;
+  *end_offset = eo;
+  *end_slot = es;
+  return 0;
+}
+
 /** Create a query object.
  *
  * matchrec - array of encoded integers. Can be a pointer to a database record
@@ -662,16 +736,21 @@ static gint find_ttree_bounds(void *db, gint index_id, gint col,
  * rowlimit - maximum number of rows fetched. Only has an effect if
  * QUERY_FLAGS_PREFETCH is set.
  *
+ * after - if not NULL, a record returned by an earlier query with the
+ * same arguments. The result set starts immediately after it.
+ *
  * returns NULL if constructing the query fails. Otherwise returns a pointer
  * to a wg_query object.
  */
 static wg_query *internal_build_query(void *db, void *matchrec, gint reclen,
-  wg_query_arg *arglist, gint argc, gint flags, wg_uint rowlimit) {
+  wg_query_arg *arglist, gint argc, gint flags, wg_uint rowlimit,
+  void *after) {
 
   wg_query *query;
   wg_query_arg *full_arglist;
   gint fargc = 0;
-  gint col, index_id = -1;
+  gint col = -1, index_id = -1;
+  gint key = WG_ILLEGAL;
   int i;
 
 #ifdef CHECK
@@ -684,6 +763,14 @@ static wg_query *internal_build_query(void *db, void *matchrec, gint reclen,
     return NULL;
   }
 #endif
+  if(after) {
+    gint offset = ptrtooffset(db, after);
+    if(offset <= 0 || offset >= dbmemsegh(db)->size ||\
+      !isnormalusedobject(dbfetch(db, offset))) {
+      show_query_error(db, "Invalid record to continue the query from");
+      return NULL;
+    }
+  }
 
   /* Check and prepare the parameters. If there was an error,
    * prepare_params() does it's own cleanup so we can (and should)
@@ -705,7 +792,7 @@ static wg_query *internal_build_query(void *db, void *matchrec, gint reclen,
     /* Find the best (hopefully) index to base the query on.
      * Then initialise the query object to the first row in the
      * query result set.
-     * XXX: only considering T-tree indexes now. */
+     * XXX: only considering T-tree and B+tree indexes now. */
     col = most_restricting_column(db, full_arglist, fargc, &index_id);
   }
   else {
@@ -718,8 +805,10 @@ static wg_query *internal_build_query(void *db, void *matchrec, gint reclen,
     int start_inclusive = 0, end_inclusive = 0;
     gint start_bound = WG_ILLEGAL; /* encoded values */
     gint end_bound = WG_ILLEGAL;
+    wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
 
-    query->qtype = WG_QTYPE_TTREE;
+    query->qtype = (hdr->type == WG_INDEX_TYPE_BTREE ?
+      WG_QTYPE_BTREE : WG_QTYPE_TTREE);
     query->column = col;
     query->curr_offset = 0;
     query->curr_slot = -1;
@@ -812,6 +901,25 @@ static wg_query *internal_build_query(void *db, void *matchrec, gint reclen,
       }
     }
 
+    /* Continuing after a record: the result set starts at its key
+     * at the earliest. The rows before it with an equal key are
+     * skipped once the bounds are known.
+     */
+    if(after) {
+      if(wg_get_record_len(db, after) <= col) {
+        show_query_error(db, "Invalid record to continue the query from");
+        free(query);
+        free(full_arglist);
+        return NULL;
+      }
+      key = wg_get_field(db, after, col);
+      if(start_bound==WG_ILLEGAL ||\
+        WG_COMPARE(db, start_bound, key)==WG_LESSTHAN) {
+        start_bound = key;
+        start_inclusive = 1;
+      }
+    }
+
     /* Simple sanity check. Is start_bound greater than end_bound? */
     if(start_bound!=WG_ILLEGAL && end_bound!=WG_ILLEGAL &&\
       WG_COMPARE(db, start_bound, end_bound) == WG_GREATER) {
@@ -823,7 +931,17 @@ static wg_query *internal_build_query(void *db, void *matchrec, gint reclen,
     }
 
     /* Now find the bounding nodes for the query */
-    if(find_ttree_bounds(db, index_id, col,
+    if(query->qtype == WG_QTYPE_BTREE) {
+      if(find_btree_bounds(db, index_id,
+          start_bound, end_bound, start_inclusive, end_inclusive,
+          &query->curr_offset, &query->curr_slot, &query->end_offset,
+          &query->end_slot)) {
+        free(query);
+        free(full_arglist);
+        return NULL;
+      }
+    }
+    else if(find_ttree_bounds(db, index_id, col,
         start_bound, end_bound, start_inclusive, end_inclusive,
         &query->curr_offset, &query->curr_slot, &query->end_offset,
         &query->end_slot)) {
@@ -832,6 +950,10 @@ static wg_query *internal_build_query(void *db, void *matchrec, gint reclen,
       return NULL;
     }
 
+    if(after && query->curr_offset && start_inclusive &&\
+      WG_COMPARE(db, start_bound, key) == WG_EQUAL)
+      skip_to_record(db, query, index_id, col, key, after);
+
     /* XXX: here we can reverse the direction and switch the start and
      * end nodes/slots, if "descending" sort order is needed.
      */
@@ -844,7 +966,10 @@ static wg_query *internal_build_query(void *db, void *matchrec, gint reclen,
     query->column = -1; /* no special column, entire argument list
                          * should be checked for each row */
 
-    rec = wg_get_first_record(db);
+    if(after)
+      rec = wg_get_next_record(db, after);
+    else
+      rec = wg_get_first_record(db);
     if(rec)
       query->curr_record = ptrtooffset(db, rec);
     else
@@ -954,7 +1079,7 @@ wg_query *wg_make_query(void *db, void *matchrec, gint reclen,
   wg_query_arg *arglist, gint argc) {
 
   return internal_build_query(db,
-    matchrec, reclen, arglist, argc, QUERY_FLAGS_PREFETCH, 0);
+    matchrec, reclen, arglist, argc, QUERY_FLAGS_PREFETCH, 0, NULL);
 }
 
 /** Create a query object and pre-fetch rowlimit number of rows.
@@ -966,7 +1091,61 @@ wg_query *wg_make_query_rc(void *db, void *matchrec, gint reclen,
   wg_query_arg *arglist, gint argc, wg_uint rowlimit) {
 
   return internal_build_query(db,
-    matchrec, reclen, arglist, argc, QUERY_FLAGS_PREFETCH, rowlimit);
+    matchrec, reclen, arglist, argc, QUERY_FLAGS_PREFETCH, rowlimit, NULL);
+}
+
+/** Create a query object that continues after a given record and
+ *  pre-fetch rowlimit number of rows.
+ *
+ * after must be a record returned by an earlier query with the same
+ * arguments. Together they implement keyset pagination: the cost of
+ * fetching a page does not depend on how many pages were fetched
+ * before, nor on how many rows share the key of the record. If the
+ * record has been deleted in the meantime, the result is undefined;
+ * the caller should verify that it still holds the same data.
+ *
+ * returns NULL if constructing the query fails. Otherwise returns a pointer
+ * to a wg_query object.
+ */
+wg_query *wg_make_query_after(void *db, void *matchrec, gint reclen,
+  wg_query_arg *arglist, gint argc, void *after, wg_uint rowlimit) {
+
+  return internal_build_query(db,
+    matchrec, reclen, arglist, argc, QUERY_FLAGS_PREFETCH, rowlimit, after);
+}
+
+/** Move an index based query past a given record.
+ *  The query starts at the first record with the key of the record.
+ *  Rows with equal keys are ordered by the record offsets in the
+ *  indexes, so the row following the record is found with a tree
+ *  search instead of scanning the equal keys.
+ */
+static void skip_to_record(void *db, wg_query *query, gint index_id,
+  gint col, gint key, void *after) {
+  gint row = ptrtooffset(db, after);
+  gint offset, slot, last, cr;
+
+  if(query->qtype == WG_QTYPE_BTREE) {
+    offset = wg_search_btree_after(db, index_id, key, row, &slot);
+    last = ((struct wg_bnode *) offsettoptr(db,
+      query->end_offset))->array_of_rows[query->end_slot];
+  } else {
+    offset = wg_search_ttree_after(db, index_id, key, row, &slot);
+    last = ((struct wg_tnode *) offsettoptr(db,
+      query->end_offset))->array_of_values[query->end_slot];
+  }
+
+  /* The result set is empty if it ends before the row found */
+  if(offset) {
+    cr = WG_COMPARE(db, wg_get_field(db, offsettoptr(db, last), col), key);
+    if(cr == WG_GREATER || (cr == WG_EQUAL && last > row)) {
+      query->curr_offset = offset;
+      query->curr_slot = slot;
+      return;
+    }
+  }
+  query->curr_offset = 0;
+  query->end_offset = 0;
 }
 
 
@@ -1016,6 +1195,39 @@ void *wg_fetch(void *db, wg_query *query) {
         return rec;
     }
   }
+  else if(query->qtype == WG_QTYPE_BTREE) {
+    struct wg_bnode *node;
+
+    for(;;) {
+      if(!query->curr_offset) {
+        /* No more leaves to examine */
+        return NULL;
+      }
+      node = (struct wg_bnode *) offsettoptr(db, query->curr_offset);
+      rec = offsettoptr(db, node->array_of_rows[query->curr_slot]);
+
+      if(query->curr_offset==query->end_offset && \
+        query->curr_slot==query->end_slot) {
+        query->curr_offset = 0;
+      } else {
+        query->curr_slot += query->direction;
+        if(query->curr_slot < 0) {
+          query->curr_offset = node->prev_offset;
+          if(query->curr_offset) {
+            node = (struct wg_bnode *) offsettoptr(db, query->curr_offset);
+            query->curr_slot = node->number_of_elements - 1;
+          }
+        } else if(query->curr_slot >= node->number_of_elements) {
+          query->curr_offset = node->next_offset;
+          query->curr_slot = 0;
+        }
+      }
+
+      if(!query->arglist || \
+        check_arglist(db, rec, query->arglist, query->argc))
+        return rec;
+    }
+  }
   else if(query->qtype == WG_QTYPE_TTREE) {
     struct wg_tnode *node;
 
@@ -1211,13 +1423,19 @@ gint wg_encode_query_param_uri(void *db, char *data, char *prefix) {
 
 /* Encode shortstr- or longstr-compatible data in local memory.
  * string type without lang is handled as "short", ignoring the
- * actual length. All other types require longstr storage to
+ * actual length, unless it fits in a tiny string that needs no
+ * storage at all. All other types require longstr storage to
  * handle the extdata field.
  */
 static gint encode_query_param_unistr(void *db, char *data, gint type,
   char *extdata, int length) {
 
   void *dptr;
+#ifdef USETINYSTR
+  if(type == WG_STRTYPE && extdata == NULL && fits_tinystr(length)) {
+    return wg_encode_tinystr(data, length);
+  }
+#endif
   if(type == WG_STRTYPE && extdata == NULL) {
     dptr=malloc(length+1);
     if(!dptr) {
@@ -1286,6 +1504,7 @@ static gint encode_query_param_unistr(void *db, char *data, gint type,
     dbstore(db, offset+LONGSTR_REFCOUNT_POS*sizeof(gint), 0);
     dbstore(db, offset+LONGSTR_BACKLINKS_POS*sizeof(gint), 0);
     dbstore(db, offset+LONGSTR_HASHCHAIN_POS*sizeof(gint), 0);
+    dbstore(db, offset+LONGSTR_HASH_POS*sizeof(gint), 0);
 
     return encode_longstr_offset(offset);
   }
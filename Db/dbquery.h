@@ -48,6 +48,7 @@
 #define WG_QTYPE_TTREE      0x01
 #define WG_QTYPE_HASH       0x02
 #define WG_QTYPE_SCAN       0x04
+#define WG_QTYPE_BTREE      0x08
 #define WG_QTYPE_PREFETCH   0x80
 
 /* ====== data structures ======== */
@@ -71,7 +72,7 @@ typedef struct {
   wg_query_arg *arglist;    /** check each row in result set against these */
   gint argc;                /** number of elements in arglist */
   gint column;              /** index on this column used */
-  /* Fields for T-tree query (XXX: some may be re-usable for
+  /* Fields for T-tree and B+tree query (XXX: some may be re-usable for
    * other types as well) */
   gint curr_offset;
   gint end_offset;
@@ -94,6 +95,8 @@ wg_query *wg_make_query(void *db, void *matchrec, gint reclen,
 #define wg_make_prefetch_query wg_make_query
 wg_query *wg_make_query_rc(void *db, void *matchrec, gint reclen,
   wg_query_arg *arglist, gint argc, wg_uint rowlimit);
+wg_query *wg_make_query_after(void *db, void *matchrec, gint reclen,
+  wg_query_arg *arglist, gint argc, void *after, wg_uint rowlimit);
 wg_query *wg_make_json_query(void *db, wg_json_query_arg *arglist, gint argc);
 void *wg_fetch(void *db, wg_query *query);
 void wg_free_query(void *db, wg_query *query);
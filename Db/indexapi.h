@@ -37,6 +37,7 @@
 #define WG_INDEX_TYPE_TTREE_JSON    51
 #define WG_INDEX_TYPE_HASH          60
 #define WG_INDEX_TYPE_HASH_JSON     61
+#define WG_INDEX_TYPE_BTREE         70
 
 /* Public protos */
 
@@ -67,6 +67,7 @@ void print_indexes(void *db, FILE *f);
 static int printhelp(){
   printf("\nindextool user commands:\n" \
       "indextool [shmname] createindex <column> - create ttree index\n" \
+      "indextool [shmname] createbtree <column> - create B+tree index\n" \
       "indextool [shmname] createhash <columns> - create hash index " \
                                                         "(JSON support)\n" \
       "indextool [shmname] dropindex <index id> - delete an index\n" \
@@ -110,6 +111,22 @@ int main(int argc, char **argv) {
       return 0;
     }
 
+    else if(!strcmp(argv[i], "createbtree")) {
+      int col;
+      if(argc < (i+2)) {
+        printhelp();
+        return 0;
+      }
+      db = (void *) wg_attach_database(shmname, shmsize);
+      if(!db) {
+        fprintf(stderr, "Failed to attach to database.\n");
+        return 0;
+      }
+      sscanf(argv[i+1], "%d", &col);
+      wg_create_index(db, col, WG_INDEX_TYPE_BTREE, NULL, 0);
+      return 0;
+    }
+
     else if(!strcmp(argv[i], "createhash")) {
       gint cols[MAX_INDEX_FIELDS], col_count, j;
       if(argc < (i+2)) {
@@ -410,6 +427,10 @@ void print_indexes(void *db, FILE *f) {
             typestr[0] = '#';
             typestr[1] = 'J';
             break;
+          case WG_INDEX_TYPE_BTREE:
+            typestr[0] = 'B';
+            typestr[1] = '\0';
+            break;
           default:
             break;
         }
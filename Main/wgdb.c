@@ -41,6 +41,7 @@
 #include <errno.h>
 #ifndef _WIN32
 #include <sys/types.h>
+#include <unistd.h>
 #include <pwd.h>
 #include <grp.h>
 #endif
@@ -81,6 +82,8 @@ extern "C" {
 
 #define FLAGS_FORCE 0x1
 #define FLAGS_LOGGING 0x2
+#define FLAGS_SNAPSHOT 0x4
+#define FLAGS_COMPRESS 0x8
 
 
 /* Helper macros for database lock management */
@@ -145,10 +148,15 @@ void usage(char *prog) {
     "    help (or \"-h\") - display this text.\n"\
     "    version (or \"-v\") - display libwgdb version.\n"\
     "    free - free shared memory.\n"\
-    "    export [-f] <filename> - write memory dump to disk (-f: force dump "\
-    "even if unable to get lock)\n"\
+    "    export [-f|-s] [-z] <filename> - write memory dump to disk (-f: force "\
+    "dump even if unable to get lock, -s: only lock while taking a snapshot, "\
+    "-z: write a compressed dump)\n"\
     "    import [-l] <filename> - read memory dump from disk. Overwrites "\
     " existing memory contents (-l: enable logging after import).\n"\
+    "    exportdelta <prevfile> <filename> - write the pages changed since "\
+    "an earlier dump or delta dump.\n"\
+    "    importdelta <filename> <delta> [<delta>...] - import a memory dump "\
+    "and apply delta dumps to it in the given order.\n"\
     "    exportcsv <filename> - export data to a CSV file.\n"\
     "    importcsv <filename> - import data from a CSV file.\n", prog);
 #ifdef USE_REASONER
@@ -164,6 +172,14 @@ void usage(char *prog) {
 #endif
 #ifdef USE_DBLOG
   printf("    replay <filename> - replay a journal file.\n");
+#endif
+#ifdef WG_JOURNAL_REPLICA
+  printf("    replicate <primary> [interval] - follow the journal of the "\
+    "primary database, polling every interval milliseconds (default "\
+    "100). Runs until the replica is promoted.\n"\
+    "    promote - make the replica a database of its own.\n"\
+    "    replicalag - print the journal bytes not applied to the "\
+    "replica yet.\n");
 #endif
   printf("    info - print information about the memory database.\n"\
     "    add <value1> .. - store data row (only int or str recognized)\n"\
@@ -242,6 +258,10 @@ gint parse_flag(char *arg) {
       return FLAGS_FORCE;
     case 'l':
       return FLAGS_LOGGING;
+    case 's':
+      return FLAGS_SNAPSHOT;
+    case 'z':
+      return FLAGS_COMPRESS;
     default:
       fprintf(stderr, "Unrecognized option: `%c'\n", arg[0]);
       break;
@@ -337,12 +357,55 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Import failed.\n");
       break;
     }
+    else if(argc>(i+2) && !strcmp(argv[i],"importdelta")){
+      wg_int err, minsize, maxsize;
+
+      err = wg_check_dump(NULL, argv[i+1], &minsize, &maxsize);
+      if(err) {
+        fprintf(stderr, "Import failed.\n");
+        break;
+      }
+
+      shmptr=wg_attach_memsegment(shmname, minsize, maxsize, 1, 0, 0);
+      if(!shmptr) {
+        fprintf(stderr, "Failed to attach to database.\n");
+        exit(1);
+      }
+
+      err = wg_import_dump_deltas(shmptr, argv[i+1], &argv[i+2],
+        argc-(i+2));
+      if(!err)
+        printf("Database imported.\n");
+      else if(err<-1)
+        fprintf(stderr, "Fatal error in wg_import_dump_deltas, db may have"\
+          " become corrupt\n");
+      else
+        fprintf(stderr, "Import failed.\n");
+      break;
+    }
+    else if(argc>(i+2) && !strcmp(argv[i],"exportdelta")){
+      wg_int err;
+
+      shmptr=wg_attach_existing_database(shmname);
+      if(!shmptr) {
+        fprintf(stderr, "Failed to attach to database.\n");
+        exit(1);
+      }
+
+      err = wg_dump_delta(shmptr,argv[i+1],argv[i+2]);
+      if(err<-1)
+        fprintf(stderr, "Fatal error in wg_dump_delta, db may have"\
+          " become corrupt\n");
+      else if(err)
+        fprintf(stderr, "Export failed.\n");
+      break;
+    }
     else if(argc>(i+1) && !strcmp(argv[i],"export")){
       wg_int err;
       int flags = 0;
 
-      if(argv[i+1][0] == '-') {
-        flags = parse_flag(argv[++i]);
+      while(argv[i+1][0] == '-') {
+        flags |= parse_flag(argv[++i]);
         if(argc<=(i+1)) {
           /* Filename argument missing */
           usage(argv[0]);
@@ -355,10 +418,14 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Failed to attach to database.\n");
         exit(1);
       }
+      if(flags & FLAGS_COMPRESS)
+        wg_dump_format(shmptr, WG_DUMP_FORMAT_LZ, 0);
 
       /* Locking is handled internally by the dbdump.c functions */
       if(flags & FLAGS_FORCE)
         err = wg_dump_internal(shmptr,argv[i+1], 0);
+      else if(flags & FLAGS_SNAPSHOT)
+        err = wg_snapshot(shmptr,argv[i+1]);
       else
         err = wg_dump(shmptr,argv[i+1]);
 
@@ -391,6 +458,61 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Failed to import log (database unmodified).\n");
       break;
     }
+#endif
+#ifdef WG_JOURNAL_REPLICA
+    else if(argc>(i+1) && !strcmp(argv[i],"replicate")){
+      wg_int err;
+      long interval = 100;
+
+      if(argc>(i+2))
+        interval = strtol(argv[i+2], NULL, 10);
+      shmptr=wg_attach_database(shmname, shmsize);
+      if(!shmptr) {
+        fprintf(stderr, "Failed to attach to database.\n");
+        exit(1);
+      }
+
+      err = wg_replica_start(shmptr, (wg_int) strtol(argv[i+1], NULL, 10));
+      if(err) {
+        fprintf(stderr, "Failed to start replication%s.\n",
+          (err<-1 ? ", database may have become corrupt" : ""));
+        break;
+      }
+      printf("Following database %s.\n", argv[i+1]);
+      while(!(err = wg_replica_poll(shmptr)))
+        usleep(interval * 1000);
+      if(err == 1)
+        printf("Replica promoted.\n");
+      else
+        fprintf(stderr, "Replication failed.\n");
+      break;
+    }
+    else if(!strcmp(argv[i],"promote")){
+      wg_int err;
+
+      shmptr=wg_attach_existing_database(shmname);
+      if(!shmptr) {
+        fprintf(stderr, "Failed to attach to database.\n");
+        exit(1);
+      }
+      err = wg_replica_promote(shmptr);
+      if(err == 1)
+        printf("Promotion requested from the replicating process.\n");
+      else if(!err)
+        printf("Replica promoted.\n");
+      else
+        fprintf(stderr, "Failed to promote the replica.\n");
+      break;
+    }
+    else if(!strcmp(argv[i],"replicalag")){
+      shmptr=wg_attach_existing_database(shmname);
+      if(!shmptr) {
+        fprintf(stderr, "Failed to attach to database.\n");
+        exit(1);
+      }
+      printf("%td\n", wg_replica_lag(shmptr));
+      break;
+    }
 #endif
     else if(argc>(i+1) && !strcmp(argv[i],"exportcsv")){
       shmptr=wg_attach_existing_database(shmname);
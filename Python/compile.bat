@@ -4,7 +4,7 @@ set PYDIR=c:\Python25
 @rem When compiling for Python 3, replace /export:initwgdb
 @rem with /export:PyInit_wgdb
 
-@cl /Ox /W3 /MT /I..\Db /I%PYDIR%\include wgdbmodule.c ..\Db\dbmem.c ..\Db\dballoc.c ..\Db\dbdata.c ..\Db\dblock.c ..\DB\dbdump.c ..\Db\dblog.c ..\Db\dbhash.c  ..\Db\dbindex.c ..\Db\dbcompare.c ..\Db\dbquery.c ..\Db\dbutil.c ..\Db\dbmpool.c  ..\Db\dbjson.c ..\Db\dbschema.c ..\json\yajl_all.c /link /dll /incremental:no /MANIFEST:NO /LIBPATH:%PYDIR%\libs /export:initwgdb /out:wgdb.pyd
+@cl /Ox /W3 /MT /I..\Db /I%PYDIR%\include wgdbmodule.c ..\Db\dbmem.c ..\Db\dballoc.c ..\Db\dbdata.c ..\Db\dblock.c ..\DB\dbdump.c ..\Db\dbcompress.c ..\Db\dbcdc.c ..\Db\dblog.c ..\Db\dbhash.c  ..\Db\dbindex.c ..\Db\dbcompare.c ..\Db\dbquery.c ..\Db\dbutil.c ..\Db\dbmpool.c  ..\Db\dbjson.c ..\Db\dbschema.c ..\json\yajl_all.c /link /dll /incremental:no /MANIFEST:NO /LIBPATH:%PYDIR%\libs /export:initwgdb /out:wgdb.pyd
 @rem Currently this script produced a statically linked DLL for ease of
 @rem testing and debugging. If dynamic linking is needed:
 @rem 1. replace /MT with /MD
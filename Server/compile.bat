@@ -10,7 +10,10 @@ copy ..\wgdb.dll .
 @rem compile a server version of dserve
 @rem dserve.h must contain #define SERVEROPTION (does so by default) for this
 
-cl /Ox /I"." dserve.c dserve_util.c dserve_net.c wgdb.lib
+cl /Ox /I"." dserve.c dserve_util.c dserve_net.c dserve_bin.c dserve_import.c dserve_cache.c wgdb.lib
+
+@rem to compress responses add /DUSE_ZLIB before and zlib.lib after the source files:
+@rem zlib.h and zlib.lib must be in this folder
 
 @rem or alternatively compile a non-server version of dserve
 @rem remove #define SERVEROPTION from dserve.h before using this alternative
@@ -83,6 +83,7 @@ other projects without linking to the whitedb library.
 #include <string.h>
 #include <signal.h> // for alarm and termination signal handling
 #include <limits.h> // LONG_MAX
+#include <time.h> // db cache age
 #if _MSC_VER   // no alarm on windows
 #else
 #include <unistd.h> // for alarm
@@ -104,6 +105,10 @@ static char* create(thread_data_p tdata, char* inparams[], char* invalues[],
   int incount);
 static char* drop(thread_data_p tdata, char* inparams[], char* invalues[], 
   int incount);
+#ifdef SERVEROPTION
+static char* stats(thread_data_p tdata, char* inparams[], char* invalues[], 
+  int incount);
+#endif
 
 static int op_print_record(thread_data_p tdata,void* rec,int gcount);
 static int op_delete_record(thread_data_p tdata,void* rec);
@@ -114,8 +119,14 @@ static char* handle_fld_param(thread_data_p tdata,char* key,char* value,
               char** sfields, char** svalues, char** stypes, int sfcount, char* errbuf);                                  
 static int op_print_data_start(thread_data_p tdata, int listflag);
 static int op_print_data_end(thread_data_p tdata, int listflag);
+static int op_print_data_cursor_end(thread_data_p tdata, char* cursor);
+static unsigned long op_record_check(void* db, void* rec);
+static void op_make_cursor(void* db, void* rec, char* cursor);
+static void* op_cursor_record(void* db, char* cursor);
 static int op_update_record(thread_data_p tdata,void* db, void* rec, wg_int fld, wg_int value);
-static void* op_create_database(thread_data_p tdata,char* database,long size);
+static void* op_cached_database(thread_data_p tdata, char* database);
+static void op_cache_database(thread_data_p tdata, char* database, void* db, int epoch);
+static void op_uncache_database(thread_data_p tdata, void* db);
 
 
 /* =============== globals =================== */
@@ -367,18 +378,22 @@ static char* get_cgi_query(thread_data_p tdata, char* inmethod) {
 }
   
 static void setup_globals(void) {
-  int i;
-  
   // set up global data
   globalptr=malloc(sizeof(struct dserve_global));
   if (globalptr==NULL) {errprint(CANNOT_ALLOC_ERR,NULL); exit(-1);}
   globalptr->conf=malloc(sizeof(struct dserve_conf));
   if (globalptr->conf==NULL) {errprint(CANNOT_ALLOC_ERR,NULL); exit(-1);}
-  globalptr->maxthreads=MAX_THREADS;
-  for(i=0;i<globalptr->maxthreads;i++) {
-    globalptr->threads_data[i].db=NULL;
-    globalptr->threads_data[i].inuse=0;
-  }
+  globalptr->maxthreads=0;
+  globalptr->threads_data=NULL;
+  if (alloc_threads_data(globalptr,MAX_THREADS)) {errprint(CANNOT_ALLOC_ERR,NULL); exit(-1);}
+  globalptr->dropepoch=0;
+  globalptr->rcache=NULL;
+  globalptr->compress_level=0;
+  globalptr->compress_min=COMPRESS_MIN_SIZE;
+  globalptr->queue_limit=QUEUE_SIZE;
+  globalptr->write_threads=WRITE_THREADS;
+  globalptr->queue_timeout=QUEUE_TIMEOUT_MS;
+  memset(&(globalptr->stats),0,sizeof(struct pool_stats));
   globalptr->conf->default_dbase.size=0;
   globalptr->conf->default_dbase_size.size=0;
   globalptr->conf->max_dbase_size.size=0;
@@ -389,6 +404,14 @@ static void setup_globals(void) {
   globalptr->conf->admin_tokens.size=0;
   globalptr->conf->write_tokens.size=0;
   globalptr->conf->read_tokens.size=0;
+  globalptr->conf->binary_port.size=0;
+  globalptr->conf->result_cache_size.size=0;
+  globalptr->conf->compress_level.size=0;
+  globalptr->conf->compress_min_size.size=0;
+  globalptr->conf->threads.size=0;
+  globalptr->conf->queue_size.size=0;
+  globalptr->conf->write_threads.size=0;
+  globalptr->conf->queue_timeout.size=0;
   globalptr->conf->default_dbase.used=0;
   globalptr->conf->default_dbase_size.used=0;
   globalptr->conf->max_dbase_size.size=0;
@@ -399,6 +422,40 @@ static void setup_globals(void) {
   globalptr->conf->admin_tokens.used=0;
   globalptr->conf->write_tokens.used=0;
   globalptr->conf->read_tokens.used=0;  
+  globalptr->conf->binary_port.used=0;
+  globalptr->conf->result_cache_size.used=0;
+  globalptr->conf->compress_level.used=0;
+  globalptr->conf->compress_min_size.used=0;
+  globalptr->conf->threads.used=0;
+  globalptr->conf->queue_size.used=0;
+  globalptr->conf->write_threads.used=0;
+  globalptr->conf->queue_timeout.used=0;
+}
+
+/* allocate and initialize n thread data blocks, keeping the old ones
+
+  called before any threads are started: the server uses one block
+  per thread in the pool.
+
+  returns 0 if ok, -1 on failure
+*/
+
+int alloc_threads_data(struct dserve_global *globalptr, int n) {
+  struct thread_data *p;
+  int i;
+
+  if (n<1) return -1;
+  p=realloc(globalptr->threads_data,n*sizeof(struct thread_data));
+  if (p==NULL) return -1;
+  globalptr->threads_data=p;
+  for(i=globalptr->maxthreads;i<n;i++) {
+    // pointers, counters and the lock id all start from zero
+    memset(&(p[i]),0,sizeof(struct thread_data));
+    p[i].encoding=ENCODING_NONE;
+    p[i].zencoding=ENCODING_NONE;
+  }
+  globalptr->maxthreads=n;
+  return 0;
 }
   
 char* process_query(char* inquery, thread_data_p tdata) {  
@@ -420,7 +477,6 @@ char* process_query(char* inquery, thread_data_p tdata) {
 #endif  
   tdata->database=NULL;
   tdata->lock_id=0;
-  tdata->intype=0;
   tdata->jsonp=NULL;
   tdata->format=1;
   tdata->showid=0;
@@ -430,6 +486,7 @@ char* process_query(char* inquery, thread_data_p tdata) {
   tdata->buf=NULL;
   tdata->bufptr=NULL;
   tdata->bufsize=0;      
+  tdata->rkeylen=0;
   // or use your own query string for testing a la
   // inquery="db=1000&op=search&field=1&value=2&compare=equal&type=record&from=0&count=3";
   // parse the query   
@@ -497,6 +554,12 @@ char* process_query(char* inquery, thread_data_p tdata) {
         found=1;
         res=insert(tdata,params,values,pcount);
         break; 
+#ifdef SERVEROPTION
+      } else if (!strncmp(values[i],"import",MAXQUERYLEN)) {
+        found=1;
+        res=import_data(tdata,params,values,pcount);
+        break; 
+#endif
       } else if (!strncmp(values[i],"update",MAXQUERYLEN)) {
         found=1;
         res=search(tdata,params,values,pcount,UPDATE_CODE);
@@ -513,6 +576,12 @@ char* process_query(char* inquery, thread_data_p tdata) {
         found=1;
         res=drop(tdata,params,values,pcount);
         break;       
+#ifdef SERVEROPTION
+      } else if (!strncmp(values[i],"stats",MAXQUERYLEN)) {
+        found=1;
+        res=stats(tdata,params,values,pcount);
+        break;
+#endif
       } else {
         return errhalt(UNKNOWN_OP_ERR,tdata);
       }        
@@ -564,6 +633,8 @@ static char* search(thread_data_p tdata, char* inparams[], char* invalues[],
   char* types[MAXPARAMS]; // search value types
   char* cids=NULL;             
   wg_int ids[MAXIDS];  // select these ids only         
+  char* cursor=NULL; // continue after the record given by this token
+  char nextcursor[CURSOR_LEN]; // token for the next page
   int fcount=0, vcount=0, ccount=0, tcount=0; // array el counters for above
   char* sfields[MAXPARAMS]; // set / selected fields
   char* svalues[MAXPARAMS]; // set field values
@@ -572,7 +643,7 @@ static char* search(thread_data_p tdata, char* inparams[], char* invalues[],
   int from=0;             
   unsigned long count,rcount,gcount,handlecount;
   void* db=NULL; // actual database pointer
-  void *rec, *oldrec; 
+  void *rec, *oldrec, *lastrec=NULL; 
   char* res;
   wg_query *wgquery;  // query datastructure built later
   wg_query_arg wgargs[MAXPARAMS]; 
@@ -624,6 +695,8 @@ static char* search(thread_data_p tdata, char* inparams[], char* invalues[],
       from=atoi(invalues[i]);
     } else if (strncmp(inparams[i],"count",MAXQUERYLEN)==0) {      
       count=atoi(invalues[i]);    
+    } else if (strncmp(inparams[i],"cursor",MAXQUERYLEN)==0) {      
+      cursor=invalues[i];    
     } else {  
       // handle generic parameters for all queries: at end of param check
       res=handle_generic_param(tdata,inparams[i],invalues[i],&token,errbuf);      
@@ -657,10 +730,27 @@ static char* search(thread_data_p tdata, char* inparams[], char* invalues[],
     // search by fields
     searchtype=2;
   }    
+  if (cursor!=NULL) {
+    // paging with a cursor: a query without fields is a full scan
+    if (opcode!=SEARCH_CODE || searchtype==1) 
+      return errhalt(CURSOR_COMBINED_ERR,tdata);
+    searchtype=2;
+  }  
+  nextcursor[0]='\0';
   // attach to database
   db=op_attach_database(tdata,database,READ_LEVEL);
   if (!db) return errhalt(DB_ATTACH_ERR,tdata);   
   // database attached OK
+#ifdef SERVEROPTION
+  // give a cached result if nothing has been written since computing it
+  if (rcache_key(tdata,opcode,inparams,invalues,incount)) {
+    res=rcache_get(tdata,db);
+    if (res!=NULL) {
+      op_detach_database(tdata,db);
+      return res;
+    }
+  }
+#endif
   // create output string buffer (may be reallocated later)  
   tdata->buf=str_new(INITIAL_MALLOC);
   if (tdata->buf==NULL) return errhalt(MALLOC_ERR,tdata);
@@ -669,7 +759,7 @@ static char* search(thread_data_p tdata, char* inparams[], char* invalues[],
   // check printing depth
   if (tdata->maxdepth>MAX_DEPTH_HARD) tdata->maxdepth=MAX_DEPTH_HARD;  
   // initial print
-  if(!op_print_data_start(tdata,opcode==SEARCH_CODE))
+  if(!op_print_data_start(tdata,cursor!=NULL ? 2 : opcode==SEARCH_CODE))
   return err_clear_detach_halt(MALLOC_ERR,tdata);
   // zero counters
   rcount=0;
@@ -681,6 +771,7 @@ static char* search(thread_data_p tdata, char* inparams[], char* invalues[],
   tdata->lock_id=lock_id;
   tdata->lock_type=READ_LOCK_TYPE;
   if (!lock_id) return err_clear_detach_halt(LOCK_ERR,tdata);
+  if (tdata->rkeylen) tdata->repoch=wg_database_epoch(db);
   // handle one of the cases
   if (searchtype==0) {
     // ------- full scan case  ---     
@@ -765,8 +856,19 @@ static char* search(thread_data_p tdata, char* inparams[], char* invalues[],
       if (wgargs[i].value==WG_ILLEGAL) return err_clear_detach_halt(INTYPE_ERR,tdata);
     }   
     
-    // make the query structure       
-    wgquery = wg_make_query(db, NULL, 0, wgargs, i);
+    // make the query structure: with a cursor only the page after 
+    // the cursor record is fetched, plus one to see if there are more
+    if (cursor!=NULL && cursor[0] && strcmp(cursor,"start")) {
+      rec=op_cursor_record(db,cursor);
+      if (rec==NULL) return err_clear_detach_halt(CURSOR_ERR,tdata);
+      wgquery = wg_make_query_after(db, NULL, 0, (i ? wgargs : NULL), i, 
+                                    rec, from+count+1);
+    } else if (cursor!=NULL) {  
+      wgquery = wg_make_query_rc(db, NULL, 0, (i ? wgargs : NULL), i, 
+                                 from+count+1);  
+    } else {
+      wgquery = wg_make_query(db, NULL, 0, wgargs, i);
+    }  
     if (!wgquery) return err_clear_detach_halt(QUERY_ERR,tdata);
     
     // actually perform the query           
@@ -778,6 +880,7 @@ static char* search(thread_data_p tdata, char* inparams[], char* invalues[],
         else if (opcode==SEARCH_CODE) {
           itmp=op_print_record(tdata,rec,gcount);
           if (!itmp) return err_clear_detach_halt(MALLOC_ERR,tdata);
+          lastrec=rec;
         } else if (opcode==UPDATE_CODE) {
           itmp=op_update_record(tdata,db,rec,0,0);
           if (!itmp) handlecount++;          
@@ -790,6 +893,9 @@ static char* search(thread_data_p tdata, char* inparams[], char* invalues[],
       rcount++;
       if (gcount>=count) break;    
     }   
+    // a full page: give a cursor if there is at least one more record
+    if (cursor!=NULL && lastrec!=NULL && gcount>=count && wg_fetch(db,wgquery)) 
+      op_make_cursor(db,lastrec,nextcursor);
     // free query datastructure, 
     for(i=0;i<fcount;i++) wg_free_query_param(db, wgargs[i].value);
     wg_free_query(db,wgquery); 
@@ -808,8 +914,22 @@ static char* search(thread_data_p tdata, char* inparams[], char* invalues[],
   }
   tdata->lock_id=0;
   op_detach_database(tdata,db);
-  if(!op_print_data_end(tdata,opcode==SEARCH_CODE))
-    return err_clear_detach_halt(MALLOC_ERR,tdata);
+  if (cursor!=NULL) itmp=op_print_data_cursor_end(tdata,nextcursor);
+  else itmp=op_print_data_end(tdata,opcode==SEARCH_CODE);
+  if (!itmp) return err_clear_detach_halt(MALLOC_ERR,tdata);
+  // send the rest of a streamed result
+  if (tdata->streamed && !stream_flush(tdata,1)) 
+    return err_clear_detach_halt(STREAM_ERR,tdata);
+#ifdef SERVEROPTION
+  if (tdata->rkeylen) {
+    // the result is cached as it is sent: compressed if the client accepts it
+    if (!tdata->streamed) {
+      tdata->buf=encode_result(tdata,tdata->buf,tdata->bufptr-tdata->buf);
+      tdata->bufptr=tdata->buf+tdata->reslen;
+    }  
+    rcache_put(tdata);
+  }
+#endif
   return tdata->buf;
 }
 
@@ -1084,9 +1204,16 @@ static char* drop(thread_data_p tdata, char* inparams[], char* invalues[], int i
     tdata->lock_id=lock_id;
     tdata->lock_type=WRITE_LOCK_TYPE;
     if (!lock_id) return err_clear_detach_halt(LOCK_ERR,tdata); 
+    op_uncache_database(tdata,db); // detached here, not kept for later requests
     tmp=wg_detach_database(db); // detaches a database: returns 0 if OK
     if (tmp) return err_clear_detach_halt(DB_DROP_ERR,tdata);
     tmp=wg_delete_database(database);    
+    // other threads must not use their cached attachments any more
+#if _MSC_VER
+    InterlockedIncrement((volatile LONG *)&((tdata->global)->dropepoch));
+#else
+    __sync_add_and_fetch(&((tdata->global)->dropepoch),1);
+#endif
     if (tmp) return errhalt(DB_DROP_ERR,tdata);
   }  
   // deleted successfully 
@@ -1102,6 +1229,55 @@ static char* drop(thread_data_p tdata, char* inparams[], char* invalues[], int i
   return tdata->buf;
 }
 
+#ifdef SERVEROPTION
+
+/* threadpool and queue state of the server: no database is used */
+
+static char* stats(thread_data_p tdata, char* inparams[], char* invalues[], int incount) {
+  struct dserve_global *g=tdata->global;
+  struct pool_stats s;
+  char *token=NULL;
+  int i,itmp;
+  char *res;
+  char errbuf[ERRBUF_LEN];
+
+  // find and check parameters
+  for(i=0;i<incount;i++) {
+    res=handle_generic_param(tdata,inparams[i],invalues[i],&token,errbuf);
+    if (res!=NULL) return res;  // return error string
+  }
+  if (!authorize(ADMIN_LEVEL,tdata,NULL,token)) {
+    return errhalt(NOT_AUTHORIZED_ERR,tdata);
+  }
+  // the counters are changed under the queue lock: an unlocked copy
+  // may be slightly inconsistent, which is fine for monitoring
+  s=g->stats;
+  tdata->buf=str_new(INITIAL_MALLOC);
+  if (tdata->buf==NULL) return errhalt(MALLOC_ERR,tdata);
+  tdata->bufsize=INITIAL_MALLOC;
+  tdata->bufptr=tdata->buf;
+  tdata->format=1;
+  op_print_data_start(tdata,0);
+  if(!str_guarantee_space(tdata,MIN_STRLEN*6))
+    return errhalt(MALLOC_ERR,tdata);
+  itmp=snprintf(tdata->bufptr,MIN_STRLEN*6,
+    "{\"threads\":%d,\"write_threads\":%d,\"queue_size\":%d,\"queue_timeout\":%d,"
+    "\"busy\":%d,\"writing\":%d,\"read_queue\":%d,\"write_queue\":%d,"
+    "\"requests\":%ld,\"rejected\":%ld,\"expired\":%ld,"
+    "\"wait_avg_ms\":%.3f,\"wait_max_ms\":%.3f}",
+    g->maxthreads,g->write_threads,g->queue_limit,g->queue_timeout,
+    s.busy,s.writing,s.readqueue,s.writequeue,
+    s.requests,s.rejected,s.expired,
+    s.requests>0 ? (double)s.waitsum/s.requests/1000.0 : 0.0,
+    (double)s.waitmax/1000.0);
+  tdata->bufptr+=itmp;
+  if(!op_print_data_end(tdata,0))
+    return errhalt(MALLOC_ERR,tdata);
+  return tdata->buf;
+}
+
+#endif
+
 /* ***** print, delete, update utilities ****** */
 
 // print a single record to output string buffer of tdata
@@ -1124,6 +1300,9 @@ static int op_print_record(thread_data_p tdata,void* rec,int gcount) {
     snprintf(tdata->bufptr,MIN_STRLEN,"\r\n");
     tdata->bufptr+=2;
   }
+  // send a full chunk instead of growing the buffer
+  if (tdata->stream && tdata->bufptr-tdata->buf>=STREAM_CHUNK_SIZE) 
+    return stream_flush(tdata,0);
   return 1;
 }  
 
@@ -1203,6 +1382,7 @@ static char* handle_fld_param(thread_data_p tdata,char* key,char* value,
 }
 
 // call to print output start
+// listflag 2 wraps the list into an object which also holds the cursor
 // return 1 if successful, 0 if fails
 
 static int op_print_data_start(thread_data_p tdata, int listflag) {
@@ -1212,11 +1392,15 @@ static int op_print_data_start(thread_data_p tdata, int listflag) {
   if (tdata->format!=0) {
     // json
     if (tdata->jsonp!=NULL) {
-      if (listflag) itmp=snprintf(tdata->bufptr,MIN_STRLEN,"%s([\n",tdata->jsonp);
+      if (listflag==2) itmp=snprintf(tdata->bufptr,MIN_STRLEN,"%s({\"data\":[\n",tdata->jsonp);
+      else if (listflag) itmp=snprintf(tdata->bufptr,MIN_STRLEN,"%s([\n",tdata->jsonp);
       else itmp=snprintf(tdata->bufptr,MIN_STRLEN,"%s(",tdata->jsonp);
       tdata->bufptr+=itmp;
     } else {
-      if (listflag) { 
+      if (listflag==2) {
+        itmp=snprintf(tdata->bufptr,MIN_STRLEN,"{\"data\":[\n");
+        tdata->bufptr+=itmp;
+      } else if (listflag) { 
         itmp=snprintf(tdata->bufptr,MIN_STRLEN,"[\n");      
         tdata->bufptr+=itmp;
       }  
@@ -1248,6 +1432,90 @@ static int op_print_data_end(thread_data_p tdata, int listflag) {
   return 1;  
 } 
 
+// call instead of op_print_data_end to finish a list started with listflag 2:
+// adds the continuation token, empty cursor if there are no more results
+// return 1 if successful, 0 if fails
+
+static int op_print_data_cursor_end(thread_data_p tdata, char* cursor) {
+  int itmp;
+
+  if(!str_guarantee_space(tdata,MIN_STRLEN+CURSOR_LEN)) return 0; 
+  if (tdata->format!=0) {
+    // json
+    if (cursor[0]) 
+      itmp=snprintf(tdata->bufptr,MIN_STRLEN+CURSOR_LEN,"\n],\"cursor\":\"%s\"}",cursor);
+    else 
+      itmp=snprintf(tdata->bufptr,MIN_STRLEN,"\n],\"cursor\":null}");
+    tdata->bufptr+=itmp;
+    if (tdata->jsonp!=NULL) {
+      itmp=snprintf(tdata->bufptr,MIN_STRLEN,");");
+      tdata->bufptr+=itmp;
+    }  
+  } else if (cursor[0]) {
+    // csv: token as a last line
+    itmp=snprintf(tdata->bufptr,MIN_STRLEN+CURSOR_LEN,"cursor,%s\r\n",cursor);
+    tdata->bufptr+=itmp;
+  }  
+  return 1;  
+}
+
+// fingerprint of the record contents for checking a search cursor
+
+static unsigned long op_record_check(void* db, void* rec) {
+  unsigned long h=2166136261UL;
+  wg_int i,len;
+
+  len=wg_get_record_len(db,rec);
+  h=((h^(unsigned long)len)*16777619UL)&0xffffffffUL;
+  for(i=0;i<len;i++) 
+    h=((h^(unsigned long)wg_get_field(db,rec,i))*16777619UL)&0xffffffffUL;
+  return h;
+}
+
+// print the continuation token for a search ending at rec
+
+static void op_make_cursor(void* db, void* rec, char* cursor) {
+  snprintf(cursor,CURSOR_LEN,"%lx-%lx",
+           (unsigned long)wg_encode_record(db,rec),op_record_check(db,rec));
+}
+
+// find the record a search cursor points to
+// returns NULL if the cursor is malformed or the record is gone or changed
+
+static void* op_cursor_record(void* db, char* cursor) {
+  char *end;
+  unsigned long enc,check;
+  void* rec;
+
+  enc=strtoul(cursor,&end,16);
+  if (end==cursor || *end!='-') return NULL;
+  check=strtoul(end+1,&end,16);
+  if (*end!='\0') return NULL;
+  rec=op_check_record(db,(wg_int)enc);
+  if (rec==NULL) return NULL;
+  if (op_record_check(db,rec)!=check) return NULL;
+  return rec;
+}
+
+// decode a record id given by a client: NULL if it cannot be a record
+
+void* op_check_record(void* db, wg_int id) {
+  wg_int len,size;
+  void* rec;
+
+  size=wg_database_size(db);
+  if (id<=0 || id%sizeof(wg_int) || id>=size) return NULL;
+  if (wg_get_encoded_type(db,id)!=WG_RECORDTYPE) return NULL;
+  rec=wg_decode_record(db,id);
+  if (rec==NULL) return NULL;
+  // the object header of a record in use has the lowest bit 0, as
+  // checked by wg_make_query_after: a deleted record is free memory
+  if ((*(wg_int*)rec)&1) return NULL;
+  len=wg_get_record_len(db,rec);
+  if (len<=0 || len>(size-id)/(wg_int)sizeof(wg_int)) return NULL;
+  return rec;
+}
+
 
 // update a record
 
@@ -1260,7 +1528,7 @@ static int op_update_record(thread_data_p tdata,void* db, void* rec, wg_int fld,
 
 // create a new database 
 
-static void* op_create_database(thread_data_p tdata,char* database,long size) {
+void* op_create_database(thread_data_p tdata,char* database,long size) {
   void* db;
   char* sizestr;
   long max_size=0;
@@ -1316,6 +1584,7 @@ void* op_attach_database(thread_data_p tdata,char* database,int accesslevel) {
   void* db;
   int i;
   int found=0;
+  int epoch=0;
   
   if (database==NULL) {
     //use default
@@ -1338,6 +1607,15 @@ void* op_attach_database(thread_data_p tdata,char* database,int accesslevel) {
     if (!found) return NULL;
   }
 
+  if (tdata->isserver) {
+    // use a cached attachment if still valid
+    db=op_cached_database(tdata,database);
+    if (db!=NULL) {
+      tdata->db=db;
+      return db;
+    }
+    epoch=(tdata->global)->dropepoch;
+  }
 #if _MSC_VER
   //db = tdata->db;
   db = wg_attach_existing_database(database);
@@ -1347,15 +1625,106 @@ void* op_attach_database(thread_data_p tdata,char* database,int accesslevel) {
   //db = wg_attach_database(database,100000000);
   tdata->db=db;
 #endif
+  if (tdata->isserver && db!=NULL) op_cache_database(tdata,database,db,epoch);
   return db;
 }
 
+/* 
+  Server threads keep attached databases in tdata->dbcache instead of
+  detaching after each request. An entry is valid if no database has 
+  been dropped through op=drop since attaching and it is not older 
+  than DB_CACHE_SECONDS.
+*/
+
+static void* op_cached_database(thread_data_p tdata, char* database) {
+  struct db_cache_entry *e;
+  void *db;
+  time_t now;
+  int i;
+
+  if (tdata->dbcachecount==0) return NULL;
+  if (tdata->dbcache[0].epoch!=(tdata->global)->dropepoch) {
+    // a database was dropped: all entries have the same epoch
+    op_clear_db_cache(tdata);
+    return NULL;
+  }
+  now=time(NULL);
+  for(i=0;i<tdata->dbcachecount;i++) {
+    e=&(tdata->dbcache[i]);
+    if (strcmp(e->name,database)) continue;
+    if (now-e->attached>=DB_CACHE_SECONDS) {
+      // uncaching moves the last entry to e
+      db=e->db;
+      op_uncache_database(tdata,db);
+      wg_detach_database(db);
+      return NULL;
+    }
+    e->lastused=++(tdata->dbcacheuses);
+    return e->db;
+  }
+  return NULL;
+}
+
+// store an attached database in the cache, replacing the least recently used entry
+
+static void op_cache_database(thread_data_p tdata, char* database, void* db, int epoch) {
+  struct db_cache_entry *e;
+  int i,j;
+
+  if (strlen(database)>=DB_NAME_LEN) return;
+  if (tdata->dbcachecount>0 && tdata->dbcache[0].epoch!=epoch) op_clear_db_cache(tdata);
+  if (tdata->dbcachecount<DB_CACHE_SIZE) {
+    j=tdata->dbcachecount++;
+  } else {
+    for(i=1,j=0;i<DB_CACHE_SIZE;i++) {
+      if (tdata->dbcache[i].lastused<tdata->dbcache[j].lastused) j=i;
+    }
+    wg_detach_database(tdata->dbcache[j].db);
+  }
+  e=&(tdata->dbcache[j]);
+  strcpy(e->name,database);
+  e->db=db;
+  e->attached=time(NULL);
+  e->epoch=epoch;
+  e->lastused=++(tdata->dbcacheuses);
+}
+
+// remove a database from the cache without detaching it
+
+static void op_uncache_database(thread_data_p tdata, void* db) {
+  int i;
+
+  for(i=0;i<tdata->dbcachecount;i++) {
+    if (tdata->dbcache[i].db==db) {
+      tdata->dbcache[i]=tdata->dbcache[--(tdata->dbcachecount)];
+      return;
+    }
+  }
+}
+
+// detach all cached databases
+
+void op_clear_db_cache(thread_data_p tdata) {
+  int i;
+
+  for(i=0;i<tdata->dbcachecount;i++) {
+    if (tdata->db==tdata->dbcache[i].db) tdata->db=NULL;
+    wg_detach_database(tdata->dbcache[i].db);
+  }
+  tdata->dbcachecount=0;
+}
+
 // detach database
 
 int op_detach_database(thread_data_p tdata, void* db) {
+  int i;
   
 #if _MSC_VER
 #else
+  // cached databases stay attached
+  for(i=0;i<tdata->dbcachecount;i++) {
+    if (tdata->dbcache[i].db==db) db=NULL;
+  }
   if (db!=NULL) wg_detach_database(db);
   tdata->db=NULL;
 #endif
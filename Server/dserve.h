@@ -20,9 +20,11 @@ see dserve.c for details.
 #if _MSC_VER
 #include <dbapi.h> // set this to "../Db/dbapi.h" if whitedb is not installed
 #define snprintf _snprintf
+#define strncasecmp _strnicmp
 #else
 #include <whitedb/dbapi.h> 
 #endif
+#include <time.h> // time_t in the structures below
 
 #ifdef SERVEROPTION
 #if _MSC_VER
@@ -42,6 +44,11 @@ see dserve.c for details.
 #include <pthread.h>
 #define THREADPOOL 1 // set to 0 for no threadpool (instead, new thread for each connection)
 #define CLOSE_CHECK_THRESHOLD 10000 // close immediately after shutdown for msg len less than this
+#if defined(__linux__) && !defined(USE_OPENSSL)
+#define EVENTLOOP 1 // threadpool gets requests from epoll event loops: set to 0 for blocking accept
+#else
+#define EVENTLOOP 0 // https and non-linux servers use blocking i/o in the threadpool
+#endif
 #endif
 #endif
 
@@ -80,9 +87,43 @@ see dserve.c for details.
 
 //#define DEFAULT_PORT 8080 // define this to run as a server on that port if no params given
 //#define USE_OPENSSL // define this to build a https server: normally defined in compiler flags
+//#define USE_ZLIB // define this to compress responses with zlib: normally defined in compiler flags
 #define MULTI_THREAD // removing this creates a simple iterative server
-#define MAX_THREADS 8 // size of threadpool and max nr of threads in an always-new-thread model
-#define QUEUE_SIZE 100 // task queue size for threadpool
+#define MAX_THREADS 8 // size of threadpool and max nr of threads in an always-new-thread model:
+  // overruled by threads in the configuration file
+#define MAX_POOL_THREADS 1000 // limit for threads in the configuration file
+#define QUEUE_SIZE 1000 // threadpool: max nr of requests waiting in a queue, more get 503 at once:
+  // overruled by queue_size in the configuration file
+#define WRITE_THREADS 2 // event loop only: max nr of threads serving writing requests, the rest
+  // are kept for reads: overruled by write_threads in the configuration file
+#define QUEUE_TIMEOUT_MS 0 // threadpool: a request waiting longer for a thread gets 503, 0 for no limit:
+  // overruled by queue_timeout in the configuration file
+#define RETRY_AFTER_SECONDS 1 // Retry-After of the 503 response to an overloaded server
+#define EVENT_THREADS 2 // nr of event loop threads feeding the threadpool if EVENTLOOP is set
+#define MAX_CONNECTIONS 20000 // event loop only: max nr of simultaneously open connections
+#define CONN_BUF_SIZE 4096 // event loop only: initial input buffer size of a connection
+#define MAX_HEADER_LEN 16384 // event loop only: max length of request line and headers
+#define READ_TIMEOUT_SECONDS 10 // event loop only: time limit for receiving a full request
+#define WRITE_TIMEOUT_SECONDS 10 // event loop only: time limit for a stalled response write
+#define KEEPALIVE_TIMEOUT_SECONDS 5 // idle persistent connection is closed after this
+#define MAX_KEEPALIVE_REQUESTS 1000 // persistent connection is closed after this many requests
+#define DB_CACHE_SIZE 8 // server only: nr of attached databases kept by each thread
+#define DB_CACHE_SECONDS 10 // server only: cached attachment is renewed after this to notice
+  // databases dropped by other programs: op=drop in dserve invalidates caches at once
+#define DB_NAME_LEN 20 // server only: longer database names are not cached
+#define STREAM_CHUNK_SIZE 16384 // server only: bigger search results are sent in chunks of about this size
+#define RESULT_CACHE_SIZE 0 // server only: memory budget for cached search results, 0 for no cache:
+  // overruled by result_cache_size in the configuration file
+#define RESULT_CACHE_KEY_LEN 1000 // server only: searches with a longer normalized query are not cached
+#define COMPRESS_LEVEL 6 // server with zlib only: 1 fastest .. 9 smallest, 0 for no compression:
+  // overruled by compress_level in the configuration file
+#define COMPRESS_MIN_SIZE 1000 // server with zlib only: smaller responses are not compressed:
+  // overruled by compress_min_size in the configuration file
+#define IMPORT_BATCH_ROWS 10000 // op=import: default nr of rows inserted under one write lock
+#define MAX_IMPORT_BATCH_ROWS 1000000 // op=import: limit for the batch parameter
+#define IMPORT_BATCH_BYTES 4000000 // op=import: a batch is ended early when its strings take this much
+#define IMPORT_READ_SIZE 65536 // op=import: posted data is read and parsed in parts of this size
+#define MAX_IMPORT_ERRORS 100 // op=import: max nr of rejected rows listed in the result
 #define TIMEOUT_SECONDS 2 // used for cgi and command line only
 #define CATCH_SIGNALS // remove this to leave system error signals unhandled
 
@@ -91,10 +132,29 @@ see dserve.c for details.
 #define JSON_CONTENT_TYPE "Content-Type: application/json\r\n\r\n"
 #define CSV_CONTENT_TYPE "Content-Type: text/csv\r\n\r\n"
 #define CONTENT_LENGTH "Content-Length: %d\r\n"
-#define HEADER_TEMPLATE "HTTP/1.0 200 OK\r\n\
+#define CHUNKED_ENCODING "Transfer-Encoding: chunked\r\n" // replaces Content-Length in a template
+#define CONTINUE_RESPONSE "HTTP/1.1 100 Continue\r\n\r\n" // for Expect: 100-continue before a streamed body
+#define OVERLOAD_RESPONSE "HTTP/1.1 503 Service Unavailable\r\n\
+Server: dserve\r\n\
+Access-Control-Allow-Origin: *\r\n\
+Connection: close\r\n\
+Retry-After: %d\r\n\
+Content-Length: %d\r\n\
+Content-Type: text/plain\r\n\r\n%s" // answer to a request not queued or waiting too long
+#define GZIP_ENCODING "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n" // added for a compressed response
+#define DEFLATE_ENCODING "Content-Encoding: deflate\r\nVary: Accept-Encoding\r\n"
+#define HEADER_TEMPLATE "HTTP/1.1 200 OK\r\n\
+Server: dserve\r\n\
+Access-Control-Allow-Origin: *\r\n\
+Connection: close\r\n\
+Cache-Control: no-cache, must-revalidate\r\n\
+Pragma: no-cache\r\n\
+Content-Length: XXXXXXXXXX \r\n\
+Content-Type: text/plain\r\n\r\n"
+#define KEEPALIVE_HEADER_TEMPLATE "HTTP/1.1 200 OK\r\n\
 Server: dserve\r\n\
 Access-Control-Allow-Origin: *\r\n\
-Connection: Close\r\n\
+Connection: keep-alive\r\n\
 Cache-Control: no-cache, must-revalidate\r\n\
 Pragma: no-cache\r\n\
 Content-Length: XXXXXXXXXX \r\n\
@@ -106,6 +166,7 @@ Content-Type: text/plain\r\n\r\n"
 #define MAXPARAMS 100 // max number of cgi params in query
 #define MAXCOUNT 100000 // max number of result records
 #define MAXIDS 1000 // max number of rec id-s in recids query
+#define CURSOR_LEN 40 // max length of a search continuation token
 #define MAXLINE 10000 // server query input buffer and one header line max
 #define MAXLINES 1000 // server query input: max nr of header lines
 #define CONF_BUF_SIZE 1000 // initial conf buf size, incremented as necessary
@@ -180,7 +241,9 @@ Content-Type: text/plain\r\n\r\n"
 #define HTTP_METHOD_ERR "method given in http not implemented: use GET"
 #define HTTP_REQUEST_ERR "incorrect http request"
 #define HTTP_NOQUERY_ERR "no query found"
+#define HTTP_HEADER_LEN_ERR "http headers too long"
 #define WRITEN_ERROR "writen error\n"
+#define STREAM_ERR "sending result failed"
 
 // formatting normal err messages 
 
@@ -200,6 +263,20 @@ Content-Type: text/plain\r\n\r\n"
 #define JSON_ERR "json parsing failed"
 #define DB_CREATE_ERR "database creation failed"
 #define RECIDS_COMBINED_ERR "search by record ids cannot be combined with search by fields"
+#define CURSOR_COMBINED_ERR "cursor can be used only for search, not with record ids"
+#define CURSOR_ERR "cursor is invalid or the record it points to has changed: restart the search"
+#define IMPORT_BODY_ERR "import data must be posted as the request body, with the query in the url"
+#define IMPORT_FORMAT_ERR "unrecognized import format: use format=csv, json or ndjson or a matching Content-Type"
+#define IMPORT_READ_ERR "reading the posted data failed"
+#define IMPORT_ROW_ERR "row is not an array of plain values"
+#define IMPORT_JSON_ERR "json data must be an array of rows"
+#define IMPORT_FIELD_ERR "field encoding failed"
+#define IMPORT_RECORD_ERR "record creation failed: database may be full"
+#define BIN_FRAME_ERR "malformed binary frame"
+#define BIN_RECORD_ERR "no record with this id"
+#define BIN_FIELD_ERR "field number out of record bounds"
+#define BIN_INSERT_ERR "record insertion failed"
+#define BIN_UPDATE_ERR "field update failed"
 
 // globally terminating error strings
 
@@ -208,6 +285,7 @@ Content-Type: text/plain\r\n\r\n"
 #define LOCK_ERR "database locked"
 #define INCONSISTENT_ERR "database inconsistent"
 #define LOCK_RELEASE_ERR "releasing read lock failed: database may be in deadlock"
+#define OVERLOAD_ERR "server busy, retry later"
 
 #define WSASTART_ERR "WSAStartup failed\n"
 #define MUTEX_ERROR "Error initializing pthread mutex, cond or attr\n"
@@ -239,8 +317,15 @@ Content-Type: text/plain\r\n\r\n"
 #define READING_FAILED_WARN "Failed to read input.\n"
 #define CONTENT_LENGTH_MISSING_WARN "Content-length missing.\n"
 #define CONTENT_LENGTH_BIG_WARN "Content-length too big.\n"
+#define CHUNKED_BODY_WARN "Malformed chunked request body.\n"
 
 #define THREADPOOL_INFO "Running multithreaded with a threadpool.\n"
+#define EVENTLOOP_INFO "Using epoll event loops for connections.\n"
+#define EPOLL_ERR "Cannot set up epoll: %s\n"
+#define CONN_LIMIT_WARN "Connection limit reached, dropping a connection.\n"
+#define BINARY_PORT_WARN "binary_port needs the epoll event loop: ignored.\n"
+#define THREADS_CONF_WARN "Bad threads value %s in the configuration file: using the default.\n"
+#define RESULT_CACHE_WARN "Cannot create the result cache: running without it.\n"
 #define MULTITHREAD_INFO "Running multithreaded without threadpool.\n"
 
 // internal values
@@ -256,10 +341,20 @@ Content-Type: text/plain\r\n\r\n"
 #define CONTENT_TYPE_UNKNOWN     0 // this and following determined by "Content-Type:" 
 #define CONTENT_TYPE_URLENCODED  1 // application/x-www-form-urlencoded
 #define CONTENT_TYPE_JSON        2 // application/json
+#define CONTENT_TYPE_CSV         3 // text/csv
+#define CONTENT_TYPE_NDJSON      4 // application/x-ndjson
 
 #define GET_METHOD_CODE  1  // GET request code for tdata->method 
 #define POST_METHOD_CODE 2  // POST request code code for tdata->method 
 
+#define CONNECTION_DEFAULT   0 // no "Connection:" header: decided by the http version
+#define CONNECTION_CLOSE     1 // "Connection: close"
+#define CONNECTION_KEEPALIVE 2 // "Connection: keep-alive"
+
+#define ENCODING_NONE    0 // response content-encoding, chosen by "Accept-Encoding:"
+#define ENCODING_GZIP    1 // gzip: preferred
+#define ENCODING_DEFLATE 2 // deflate (zlib format)
+
 #define COUNT_CODE 0 // passed as last arg to generic search
 #define SEARCH_CODE 1 // passed as last arg to generic search
 #define DELETE_CODE 2 // passed as last arg to generic search
@@ -267,6 +362,15 @@ Content-Type: text/plain\r\n\r\n"
 
 #define BAD_WG_VALUE  WG_ILLEGAL // 0xff used for returning encoding failures
 
+#define BIN_OP_INSERT 1 // op codes of the binary protocol: see dserve_bin.c
+#define BIN_OP_GET    2
+#define BIN_OP_FIND   3
+#define BIN_OP_UPDATE 4
+#define BIN_OP_DELETE 5
+
+#define BIN_STATUS_OK  0 // frame and op result status of the binary protocol
+#define BIN_STATUS_ERR 1
+
 // err codes from sysexit.h project
 
 #define ERR_EX_NOINPUT 66      // required file was missing or unreadable
@@ -287,9 +391,27 @@ Content-Type: text/plain\r\n\r\n"
 #define CONF_READ_TOKENS "read_tokens"
 #define CONF_KEY_FILE "key_file"
 #define CONF_CERT_FILE "cert_file"
+#define CONF_BINARY_PORT "binary_port"
+#define CONF_RESULT_CACHE_SIZE "result_cache_size"
+#define CONF_COMPRESS_LEVEL "compress_level"
+#define CONF_COMPRESS_MIN_SIZE "compress_min_size"
+#define CONF_THREADS "threads"
+#define CONF_QUEUE_SIZE "queue_size"
+#define CONF_WRITE_THREADS "write_threads"
+#define CONF_QUEUE_TIMEOUT "queue_timeout"
 
 /*   ========== global structures =============  */
 
+// an attached database kept by a server thread between requests
+
+struct db_cache_entry{
+  char   name[DB_NAME_LEN]; // database name
+  void  *db; // attached database
+  time_t attached; // time of attaching
+  int    epoch; // global dropepoch at the time of attaching
+  int    lastused; // request counter value at last use, for replacing
+};
+
 // each thread (or a single cgi/command line) has its own thread_data block
 
 typedef struct thread_data * thread_data_p;
@@ -307,6 +429,9 @@ struct thread_data{
   wg_int lock_id; // 0 iff not locked
   int    lock_type; // 1 read, 2 write  
   int    inuse; // 1 if in use, 0 if not (free to reuse)
+  struct db_cache_entry dbcache[DB_CACHE_SIZE]; // attached databases: server only
+  int    dbcachecount; // nr of used dbcache entries
+  int    dbcacheuses; // request counter for dbcache
   // task details   
   int    conn; // actual socket id
 #ifdef USE_OPENSSL    
@@ -316,9 +441,14 @@ struct thread_data{
   int    port;  // request port
   int    method; // request method code: unknown 0, GET 1, POST 2, ...
   int    res;    // stored by thread
+  int    nonblock; // 1 if conn is a non-blocking socket of an event loop
+  int    keepalive; // 1 if conn stays open after the response
+  int    stream; // 1 if a big result may be sent in chunks while computing (http/1.1)
+  int    streamed; // 0 nothing sent yet, 1 sending chunks, 2 whole response sent
   // input data
   char  *inbuf;  // input buffer: used only by post, should be freed
-  int    intype; // 0 missing content-type, 1 urlencoded, 2 json
+  int    intype; // 0 missing content-type, 1 urlencoded, 2 json, 3 csv, 4 ndjson
+  struct body_src *body; // posted data for op=import, NULL if none
   // printing
   char  *jsonp; // NULL or jsonp function string 
   int    format;  // 1 json, 0 csv    
@@ -334,6 +464,57 @@ struct thread_data{
   char   *buf; // address of the whole string buffer start (not the start itself)
   char   *bufptr;  // address of the next place in buf to write into
   int    bufsize; // buffer length
+  // result cache: server only
+  int    rkeylen; // length of rkey, 0 if the result is not cached
+  char   rkey[RESULT_CACHE_KEY_LEN]; // normalized query of a search
+  unsigned int rhash; // hash of rkey
+  wg_int repoch; // database write epoch the result is computed at
+  int    rdropepoch; // global dropepoch the result is computed at
+  char  *rbuf; // part of a streamed result already sent, kept for the cache
+  int    rbuflen; // used length of rbuf
+  int    rbufsize; // allocated length of rbuf
+  // response compression: server with zlib only
+  int    encoding; // accepted by the client: ENCODING_NONE, ENCODING_GZIP or ENCODING_DEFLATE
+  int    encoded; // 1 if the response is compressed with encoding
+  int    reslen; // length of the response set by encode_result or by the result cache
+  void  *zstream; // zlib stream kept between responses, NULL until needed
+  int    zencoding; // encoding zstream is set up for
+};
+
+// posted data of op=import, read in parts while importing:
+// raw input is kept in buf between base and size
+
+#define BODY_DATA       0 // reading data: left bytes of the body or the chunk
+#define BODY_CHUNK_SIZE 1 // expecting a chunk size line
+#define BODY_CHUNK_END  2 // expecting the line end after chunk data
+#define BODY_TRAILER    3 // reading trailer lines up to the empty line
+#define BODY_DONE       4 // whole body read
+
+struct body_src{
+  char  *buf;
+  int    base; // start of the raw input area in buf
+  int    pos; // next unread byte
+  int    used; // end of the bytes read into buf
+  int    size; // end of the raw input area
+  long   left; // bytes left of the body or of the current chunk
+  int    chunked; // 1 for chunked transfer encoding
+  int    state; // BODY_DATA etc
+  int  (*fill)(struct body_src *src, char *buf, int n); // NULL if all data is in buf
+  void  *ctx; // used by fill
+};
+
+// threadpool load: changed under the threadpool mutex, given by op=stats
+
+struct pool_stats{
+  int    busy; // threads serving a request
+  int    writing; // threads serving a writing request
+  int    readqueue; // requests waiting in the read queue
+  int    writequeue; // requests waiting in the write queue
+  long   requests; // requests taken from the queues
+  long   rejected; // answered 503 at once as the queue was full
+  long   expired; // answered 503 after waiting longer than queue_timeout
+  long long waitsum; // total time waited in the queues, microseconds
+  long long waitmax; // longest wait in the queues, microseconds
 };
 
 // a single dserve_global is created as a global var dsglobal
@@ -342,8 +523,16 @@ typedef struct dserve_global * dserve_global_p;
 
 struct dserve_global{
   struct dserve_conf *conf;
-  int                maxthreads;  
-  struct thread_data threads_data[MAX_THREADS];  
+  int                maxthreads; // nr of threads_data blocks
+  volatile int       dropepoch; // incremented by op=drop: invalidates all db caches
+  struct result_cache *rcache; // search result cache, NULL if none: see dserve_cache.c
+  int                compress_level; // zlib level for responses, 0 for no compression
+  int                compress_min; // smaller responses are not compressed
+  int                queue_limit; // max nr of requests waiting in a queue
+  int                write_threads; // max nr of threads serving writing requests
+  int                queue_timeout; // max wait in a queue in milliseconds, 0 for no limit
+  struct pool_stats  stats;
+  struct thread_data *threads_data; // maxthreads blocks
 };
 
 // configuration data read from file, kept as sized_strlst for each kind
@@ -370,6 +559,14 @@ struct dserve_conf{
   struct sized_strlst read_tokens;
   struct sized_strlst key_file;
   struct sized_strlst cert_file;
+  struct sized_strlst binary_port;
+  struct sized_strlst result_cache_size;
+  struct sized_strlst compress_level;
+  struct sized_strlst compress_min_size;
+  struct sized_strlst threads;
+  struct sized_strlst queue_size;
+  struct sized_strlst write_threads;
+  struct sized_strlst queue_timeout;
 };
 
 #ifdef SERVEROPTION
@@ -404,6 +601,61 @@ struct common_data{
 
 #else
 // linux
+
+#if EVENTLOOP
+
+#define CONN_READING 0 // event loop is reading the request
+#define CONN_QUEUED  1 // request is in the task queue or handled by a worker
+#define CONN_CLOSING 2 // response sent, event loop waits for the client to close
+
+// a connection handled by an event loop: only one of the loop
+// and a worker thread owns it at any time
+
+struct conn_data{
+  int    fd;
+  int    state; // CONN_READING, CONN_QUEUED or CONN_CLOSING
+  struct event_loop *loop; // owning event loop
+  struct conn_data *prev; // list of all connections of the loop
+  struct conn_data *next;
+  time_t deadline; // closed by the loop if still reading or closing by then
+  char  *buf; // input buffer
+  int    bufsize;
+  int    used; // nr of bytes read into buf
+  int    hdrlen; // length of request line and headers, 0 if not parsed yet
+  int    reqlen; // length of the whole request, 0 if not known yet
+  int    chunked; // 1 if the request body uses chunked transfer encoding
+  int    method; // request method code
+  int    qpos; // offset of the query in buf, -1 if none
+  int    qend; // offset of the terminating 0 of a posted query
+  int    intype; // content-type code for POST
+  char   savedchar; // byte overwritten by the terminating 0 of a posted query
+  char  *err; // NULL or a http error string for the request
+  int    http11; // 1 for a http/1.1 request: chunked response allowed
+  int    keepalive; // 1 if the connection stays open after the response
+  int    nreqs; // nr of requests served on the connection
+  char   ip[48]; // request ip: INET6_ADDRSTRLEN fits
+  int    port; // request port
+  int    binary; // 1 if accepted on the binary port: frames instead of http
+  int    streambody; // 1 for op=import: the body is read by the worker while importing
+  long   bodylen; // Content-Length of a streamed body
+  int    bodychunked; // 1 if a streamed body uses chunked transfer encoding
+  int    bodyexpect; // 1 if the client waits for 100 Continue before sending the body
+  int    encoding; // content-encoding accepted for the response
+};
+
+struct event_loop{
+  int    epfd;
+  int    listenfd;
+  int    binfd; // binary protocol listener, -1 if none
+  pthread_t thread;
+  pthread_mutex_t mutex; // protects the connection list
+  struct conn_data *head; // all open connections of the loop
+  struct common_data *common;
+  time_t lastsweep; // last check for timed out connections
+};
+
+#endif
+
 // task queue elements
 
 typedef struct {
@@ -411,6 +663,10 @@ typedef struct {
 #ifdef USE_OPENSSL
   SSL    *ssl; 
 #endif  
+#if EVENTLOOP
+  struct conn_data *cdata; // parsed request from an event loop, NULL for a plain socket
+#endif
+  long long queued; // time of queueing in microseconds, for the wait time
 } common_task_t;
 
 // common information pointed to from each thread data block: lock, queue, etc
@@ -419,14 +675,19 @@ struct common_data{
   pthread_t       *threads;
   pthread_mutex_t mutex;    
   pthread_cond_t  cond;  
-  common_task_t   *queue;
+  common_task_t   *queue; // read queue, the only one without event loops
   int             thread_count;
   int             queue_size;
   int             head;
   int             tail;
   int             count;
+  common_task_t   *wqueue; // writing requests from event loops, also queue_size long
+  int             whead;
+  int             wtail;
+  int             wcount;
   int             started;
   int             shutdown;  
+  struct dserve_global *global; // for the limits and stats of the queues
 };
 #endif // win or linux server
 #else
@@ -458,11 +719,37 @@ char* process_query(char* inquery, thread_data_p tdata);
 void print_final(char* str, thread_data_p tdata);
 void* op_attach_database(thread_data_p tdata,char* database,int accesslevel);
 int op_detach_database(thread_data_p tdata, void* db);
+void op_clear_db_cache(thread_data_p tdata);
+void* op_check_record(void* db, wg_int id);
+void* op_create_database(thread_data_p tdata,char* database,long size);
+int alloc_threads_data(struct dserve_global *globalptr, int n);
+
+// in dserve_bin.c:
+
+char* process_frame(char* frame, int len, thread_data_p tdata, int* reslen);
+int is_write_frame(char* frame, int len);
+char* reject_frame(char* frame, int len, char* err, int* reslen);
 
 // in dserve_net.c:
 
 int run_server(int port, struct dserve_global * globalptr);
 char* make_http_errstr(char* str, thread_data_p tdata);
+int stream_flush(thread_data_p tdata, int final);
+char* encode_result(thread_data_p tdata, char* res, int len);
+int body_read(struct body_src *src, char *out, int n);
+
+// in dserve_cache.c:
+
+int rcache_init(struct dserve_global *globalptr, long size);
+int rcache_key(thread_data_p tdata, int opcode,
+               char* inparams[], char* invalues[], int incount);
+char* rcache_get(thread_data_p tdata, void* db);
+void rcache_capture(thread_data_p tdata, char* data, int len);
+void rcache_put(thread_data_p tdata);
+
+// in dserve_import.c:
+
+char* import_data(thread_data_p tdata, char* inparams[], char* invalues[], int incount);
 
 // in dserve_util.c:
 
@@ -472,6 +759,8 @@ wg_int encode_invalue(void* db, char* invalue, wg_int type);
 int isint(char* s);
 int isdbl(char* s);
 int parse_query(char* query, int ql, char* params[], char* values[]);
+int is_import_query(char* query);
+int is_write_query(char* query);
 char* urldecode(char *indst, char *src);
 
 int sprint_record(void *db, wg_int *rec, thread_data_p tdata);                   
@@ -0,0 +1,682 @@
+/*
+
+dserve_bin.c contains the binary protocol of dserve
+
+dserve is a tool for performing REST queries from WhiteDB using a cgi
+protocol over http(s). Results are given in the json or csv format.
+
+The binary protocol is meant for programs talking to dserve: it is
+served on a separate port (binary_port in the configuration file),
+sends typed values instead of text and allows many operations in one
+frame, all run under a single database lock.
+
+See http://whitedb.org/tools.html for a detailed manual.
+
+Copyright (c) 2013, Tanel Tammet
+
+This software is under MIT licence unless linked with WhiteDB:
+see dserve.c for details.
+
+*/
+
+/*
+  Frame formats. All integers are unsigned little-endian unless noted.
+
+  request:  u32 length of the rest of the frame
+            u32 id, copied to the response
+            u8 length, database name (empty for the default database)
+            u8 length, access token (empty if none)
+            u16 nr of ops, ops
+
+  op:       u8 code, then by code:
+            BIN_OP_INSERT: u32 nr of fields, values   -> u64 record id
+            BIN_OP_GET:    u64 record id              -> u32 n (0 or 1), records
+            BIN_OP_FIND:   u8 nr of conditions,
+                           conditions: u32 field, u8 WG_COND_*, value
+                           u32 max nr of records (0 for MAXCOUNT)
+                                                      -> u32 n, records
+            BIN_OP_UPDATE: u64 record id, u32 field, value  -> nothing
+            BIN_OP_DELETE: u64 record id              -> nothing
+
+  value:    u8 WhiteDB type (WG_NULLTYPE etc), then by type:
+            null: nothing
+            record: u64 record id
+            int: signed 64 bits
+            double, fixpoint: 64-bit IEEE double
+            str: u32 length, bytes (in responses xmlliteral, uri and blob too)
+            char: u8
+            date, time: signed 32 bits
+
+  record:   u64 record id, u32 nr of fields, values
+
+  response: u32 length of the rest of the frame
+            u32 id of the request
+            u8 status: 0 ok, 1 error
+            if ok: u16 nr of results, results
+            if error: u16 length, error message
+
+  result:   u8 status: 0 ok, 1 error
+            if ok: data given above for the op
+            if error: u16 length, error message
+
+  A frame containing any writing op runs under a write lock,
+  otherwise under a read lock. An op failing does not stop the
+  later ops. Record fields pointing to records are given as record
+  ids, not as nested records.
+*/
+
+#include "dserve.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* ============= local protos ============= */
+
+struct frame_in;
+
+static unsigned int get_u8(struct frame_in *in);
+static unsigned int get_u16(struct frame_in *in);
+static unsigned long get_u32(struct frame_in *in);
+static unsigned long long get_u64(struct frame_in *in);
+static unsigned char* get_bytes(struct frame_in *in, unsigned long n);
+static double get_double(struct frame_in *in);
+static wg_int get_value(struct frame_in *in, void* db, int param);
+static int skip_value(struct frame_in *in);
+static int skip_op(struct frame_in *in, int *write);
+
+static int put_bytes(thread_data_p tdata, void* data, int n);
+static int put_u8(thread_data_p tdata, unsigned int v);
+static int put_u16(thread_data_p tdata, unsigned int v);
+static int put_u32(thread_data_p tdata, unsigned long v);
+static int put_u64(thread_data_p tdata, unsigned long long v);
+static int put_double(thread_data_p tdata, double d);
+static int put_error(thread_data_p tdata, char* err);
+static int put_value(thread_data_p tdata, void* db, wg_int enc);
+static int put_record(thread_data_p tdata, void* db, void* rec);
+static void patch_u32(char* p, unsigned long v);
+
+static int run_op(thread_data_p tdata, void* db, struct frame_in *in);
+static int run_insert(thread_data_p tdata, void* db, struct frame_in *in);
+static int run_find(thread_data_p tdata, void* db, struct frame_in *in);
+static int run_update(thread_data_p tdata, void* db, struct frame_in *in);
+static char* frame_error(unsigned long id, char* err, int* reslen);
+
+/*   ========== structures =============  */
+
+// reading position in a request frame
+
+struct frame_in{
+  unsigned char *p; // next byte to read
+  unsigned char *end; // end of the frame
+  int err; // set if reading went past the end
+};
+
+/* =============== functions =================== */
+
+/*
+  Runs the ops of a complete request frame of len bytes, including
+  the length prefix. The frame buffer must have one writable byte
+  after the frame: it is used for terminating strings temporarily.
+
+  Returns a malloced response frame and its length in *reslen,
+  NULL if out of memory.
+*/
+
+char* process_frame(char* frame, int len, thread_data_p tdata, int* reslen) {
+  struct frame_in in;
+  unsigned long id;
+  unsigned int n, nops;
+  char database[256], token[256];
+  unsigned char *p, *ops;
+  int i, write=0, level;
+  void* db;
+  wg_int lock_id;
+
+  in.p=(unsigned char*)frame+4;
+  in.end=(unsigned char*)frame+len;
+  in.err=0;
+  id=get_u32(&in);
+  // database and token strings
+  n=get_u8(&in);
+  p=get_bytes(&in,n);
+  if (in.err) return frame_error(id,BIN_FRAME_ERR,reslen);
+  memcpy(database,p,n);
+  database[n]='\0';
+  if (n && atoi(database)==0 && strcmp(database,"0")) 
+    return frame_error(id,DB_PARAM_ERR,reslen);
+  n=get_u8(&in);
+  p=get_bytes(&in,n);
+  if (in.err) return frame_error(id,BIN_FRAME_ERR,reslen);
+  memcpy(token,p,n);
+  token[n]='\0';
+  // check the ops before taking a lock
+  nops=get_u16(&in);
+  ops=in.p;
+  for(i=0;i<nops;i++) {
+    if (skip_op(&in,&write)<0) return frame_error(id,BIN_FRAME_ERR,reslen);
+  }
+  if (in.p!=in.end) return frame_error(id,BIN_FRAME_ERR,reslen);
+  // authorize and attach
+  level=write ? WRITE_LEVEL : READ_LEVEL;
+  if (!authorize(level,tdata,database[0] ? database : NULL,token[0] ? token : NULL))
+    return frame_error(id,NOT_AUTHORIZED_ERR,reslen);
+  db=op_attach_database(tdata,database[0] ? database : NULL,level);
+  if (!db) return frame_error(id,DB_ATTACH_ERR,reslen);
+  tdata->buf=str_new(INITIAL_MALLOC);
+  if (tdata->buf==NULL) return NULL;
+  tdata->bufsize=INITIAL_MALLOC;
+  tdata->bufptr=tdata->buf;
+  // length is filled in at the end
+  if (!put_u32(tdata,0) || !put_u32(tdata,id) ||
+      !put_u8(tdata,BIN_STATUS_OK) || !put_u16(tdata,nops)) {
+    op_detach_database(tdata,db);
+    return NULL;
+  }
+  // one lock for all the ops
+  if (write) lock_id=wg_start_write(db);
+  else lock_id=wg_start_read(db);
+  if (!lock_id) {
+    free(tdata->buf);
+    op_detach_database(tdata,db);
+    return frame_error(id,LOCK_ERR,reslen);
+  }
+  tdata->lock_id=lock_id;
+  tdata->lock_type=write ? WRITE_LOCK_TYPE : READ_LOCK_TYPE;
+  in.p=ops;
+  for(i=0;i<nops;i++) {
+    if (!run_op(tdata,db,&in)) break;
+  }
+  if (write) lock_id=wg_end_write(db,lock_id);
+  else lock_id=wg_end_read(db,lock_id);
+  tdata->lock_id=0;
+  op_detach_database(tdata,db);
+  if (i<nops) {
+    // out of memory: buffer already freed by str_guarantee_space
+    return frame_error(id,MALLOC_ERR,reslen);
+  }
+  if (!lock_id) {
+    free(tdata->buf);
+    return frame_error(id,LOCK_RELEASE_ERR,reslen);
+  }
+  *reslen=(int)(tdata->bufptr-tdata->buf);
+  patch_u32(tdata->buf,*reslen-4);
+  return tdata->buf;
+}
+
+/*
+  Checks a complete request frame without running it: returns 1 if
+  some op of the frame writes, 0 otherwise. A malformed frame counts
+  as reading: process_frame reports the error.
+*/
+
+int is_write_frame(char* frame, int len) {
+  struct frame_in in;
+  unsigned int n, nops;
+  int i, write=0;
+
+  in.p=(unsigned char*)frame+4;
+  in.end=(unsigned char*)frame+len;
+  in.err=0;
+  get_u32(&in);
+  n=get_u8(&in);
+  get_bytes(&in,n);
+  n=get_u8(&in);
+  get_bytes(&in,n);
+  nops=get_u16(&in);
+  if (in.err) return 0;
+  for(i=0;i<nops;i++) {
+    if (skip_op(&in,&write)<0) return 0;
+  }
+  return write;
+}
+
+/*
+  Builds an error response to a request frame which is not run, for
+  example when the server is overloaded.
+
+  Returns a malloced response frame and its length in *reslen,
+  NULL if out of memory.
+*/
+
+char* reject_frame(char* frame, int len, char* err, int* reslen) {
+  struct frame_in in;
+  unsigned long id;
+
+  in.p=(unsigned char*)frame+4;
+  in.end=(unsigned char*)frame+len;
+  in.err=0;
+  id=get_u32(&in);
+  return frame_error(id,err,reslen);
+}
+
+// build a response frame with an error status
+
+static char* frame_error(unsigned long id, char* err, int* reslen) {
+  char* res;
+  int n=strlen(err);
+
+  *reslen=4+4+1+2+n;
+  res=malloc(*reslen);
+  if (res==NULL) return NULL;
+  patch_u32(res,*reslen-4);
+  patch_u32(res+4,id);
+  res[8]=BIN_STATUS_ERR;
+  res[9]=n & 0xff;
+  res[10]=(n>>8) & 0xff;
+  memcpy(res+11,err,n);
+  return res;
+}
+
+/* ------------ ops ----------------- */
+
+// run one op and write its result: returns 0 if out of memory
+
+static int run_op(thread_data_p tdata, void* db, struct frame_in *in) {
+  void* rec;
+
+  switch(get_u8(in)) {
+    case BIN_OP_INSERT:
+      return run_insert(tdata,db,in);
+    case BIN_OP_GET:
+      rec=op_check_record(db,(wg_int)get_u64(in));
+      if (!put_u8(tdata,BIN_STATUS_OK)) return 0;
+      if (rec==NULL) return put_u32(tdata,0);
+      return put_u32(tdata,1) && put_record(tdata,db,rec);
+    case BIN_OP_FIND:
+      return run_find(tdata,db,in);
+    case BIN_OP_UPDATE:
+      return run_update(tdata,db,in);
+    case BIN_OP_DELETE:
+      rec=op_check_record(db,(wg_int)get_u64(in));
+      if (rec==NULL) return put_error(tdata,BIN_RECORD_ERR);
+      if (wg_delete_record(db,rec)) return put_error(tdata,DELETE_ERR);
+      return put_u8(tdata,BIN_STATUS_OK);
+  }
+  return put_error(tdata,BIN_FRAME_ERR); // skip_op has checked the codes
+}
+
+static int run_insert(thread_data_p tdata, void* db, struct frame_in *in) {
+  unsigned long i, n;
+  void* rec;
+  wg_int enc;
+
+  n=get_u32(in);
+  rec=wg_create_record(db,n);
+  for(i=0;i<n;i++) {
+    if (rec==NULL) {
+      skip_value(in);
+      continue;
+    }
+    enc=get_value(in,db,0);
+    if (enc==WG_ILLEGAL || wg_set_new_field(db,rec,i,enc)) {
+      // drop the half-made record, skip the rest of the values
+      wg_delete_record(db,rec);
+      rec=NULL;
+    }
+  }
+  if (rec==NULL) return put_error(tdata,BIN_INSERT_ERR);
+  return put_u8(tdata,BIN_STATUS_OK) && put_u64(tdata,(unsigned long long)wg_encode_record(db,rec));
+}
+
+static int run_find(thread_data_p tdata, void* db, struct frame_in *in) {
+  wg_query_arg args[MAXPARAMS];
+  wg_query *query=NULL;
+  unsigned long limit, count=0;
+  unsigned int i, j, n;
+  void* rec=NULL;
+  int countpos, bad=0;
+
+  n=get_u8(in);
+  for(i=0,j=0;i<n;i++) {
+    args[j].column=get_u32(in);
+    args[j].cond=get_u8(in);
+    if (bad || j>=MAXPARAMS) {
+      skip_value(in);
+      bad=1;
+      continue;
+    }
+    args[j].value=get_value(in,db,1);
+    if (args[j].value==WG_ILLEGAL) bad=1;
+    else j++;
+  }
+  limit=get_u32(in);
+  if (!limit || limit>MAXCOUNT) limit=MAXCOUNT;
+  if (!bad) query=wg_make_query_rc(db,NULL,0,(j ? args : NULL),j,limit);
+  if (query==NULL) {
+    for(i=0;i<j;i++) wg_free_query_param(db,args[i].value);
+    return put_error(tdata,QUERY_ERR);
+  }
+  // record count is filled in after fetching
+  if (put_u8(tdata,BIN_STATUS_OK) && put_u32(tdata,0)) {
+    countpos=(int)(tdata->bufptr-tdata->buf)-4;
+    while(count<limit && (rec=wg_fetch(db,query))!=NULL) {
+      if (!put_record(tdata,db,rec)) break;
+      count++;
+    }
+    if (rec==NULL || count==limit) patch_u32(tdata->buf+countpos,count);
+    else bad=1;
+  } else {
+    bad=1;
+  }
+  for(i=0;i<j;i++) wg_free_query_param(db,args[i].value);
+  wg_free_query(db,query);
+  return !bad;
+}
+
+static int run_update(thread_data_p tdata, void* db, struct frame_in *in) {
+  unsigned long col;
+  void* rec;
+  wg_int enc;
+
+  rec=op_check_record(db,(wg_int)get_u64(in));
+  col=get_u32(in);
+  if (rec==NULL) {
+    skip_value(in);
+    return put_error(tdata,BIN_RECORD_ERR);
+  }
+  if (col>=(unsigned long)wg_get_record_len(db,rec)) {
+    skip_value(in);
+    return put_error(tdata,BIN_FIELD_ERR);
+  }
+  enc=get_value(in,db,0);
+  if (enc==WG_ILLEGAL) return put_error(tdata,INTYPE_ERR);
+  if (wg_set_field(db,rec,col,enc)) {
+    wg_free_encoded(db,enc);
+    return put_error(tdata,BIN_UPDATE_ERR);
+  }
+  return put_u8(tdata,BIN_STATUS_OK);
+}
+
+/* ------------ reading a request frame ----------------- */
+
+static unsigned int get_u8(struct frame_in *in) {
+  if (in->end-in->p<1) { in->err=1; return 0; }
+  return *(in->p)++;
+}
+
+static unsigned int get_u16(struct frame_in *in) {
+  unsigned char *p=in->p;
+
+  if (in->end-p<2) { in->err=1; return 0; }
+  in->p+=2;
+  return p[0] | (p[1]<<8);
+}
+
+static unsigned long get_u32(struct frame_in *in) {
+  unsigned char *p=in->p;
+
+  if (in->end-p<4) { in->err=1; return 0; }
+  in->p+=4;
+  return p[0] | (p[1]<<8) | ((unsigned long)p[2]<<16) | ((unsigned long)p[3]<<24);
+}
+
+static unsigned long long get_u64(struct frame_in *in) {
+  unsigned long long v;
+
+  v=get_u32(in);
+  return v | ((unsigned long long)get_u32(in)<<32);
+}
+
+// returns a pointer to the next n bytes, NULL if the frame is shorter
+
+static unsigned char* get_bytes(struct frame_in *in, unsigned long n) {
+  unsigned char *p=in->p;
+
+  if ((unsigned long)(in->end-p)<n) { in->err=1; return NULL; }
+  in->p+=n;
+  return p;
+}
+
+static double get_double(struct frame_in *in) {
+  unsigned long long v=get_u64(in);
+  double d;
+
+  memcpy(&d,&v,sizeof(d));
+  return d;
+}
+
+/*
+  Reads a value and encodes it: as a query parameter if param is set.
+  Strings are terminated in place for encoding, then restored.
+
+  Returns WG_ILLEGAL for an unsupported type, a bad record id or 
+  if encoding fails.
+*/
+
+static wg_int get_value(struct frame_in *in, void* db, int param) {
+  unsigned long n;
+  char *s, saved;
+  void* rec;
+  wg_int enc;
+
+  switch(get_u8(in)) {
+    case WG_NULLTYPE:
+      return param ? wg_encode_query_param_null(db,NULL) : wg_encode_null(db,0);
+    case WG_RECORDTYPE:
+      rec=op_check_record(db,(wg_int)get_u64(in));
+      if (rec==NULL) return WG_ILLEGAL;
+      return param ? wg_encode_query_param_record(db,rec) : wg_encode_record(db,rec);
+    case WG_INTTYPE:
+      enc=(wg_int)(long long)get_u64(in);
+      return param ? wg_encode_query_param_int(db,enc) : wg_encode_int(db,enc);
+    case WG_DOUBLETYPE:
+      return param ? wg_encode_query_param_double(db,get_double(in)) : 
+                     wg_encode_double(db,get_double(in));
+    case WG_FIXPOINTTYPE:
+      return param ? wg_encode_query_param_fixpoint(db,get_double(in)) : 
+                     wg_encode_fixpoint(db,get_double(in));
+    case WG_STRTYPE:
+      n=get_u32(in);
+      s=(char*)get_bytes(in,n);
+      if (s==NULL) return WG_ILLEGAL;
+      saved=s[n];
+      s[n]='\0';
+      enc=param ? wg_encode_query_param_str(db,s,NULL) : wg_encode_str(db,s,NULL);
+      s[n]=saved;
+      return enc;
+    case WG_CHARTYPE:
+      return param ? wg_encode_query_param_char(db,(char)get_u8(in)) : 
+                     wg_encode_char(db,(char)get_u8(in));
+    case WG_DATETYPE:
+      return param ? wg_encode_query_param_date(db,(int)get_u32(in)) : 
+                     wg_encode_date(db,(int)get_u32(in));
+    case WG_TIMETYPE:
+      return param ? wg_encode_query_param_time(db,(int)get_u32(in)) : 
+                     wg_encode_time(db,(int)get_u32(in));
+  }
+  return WG_ILLEGAL;
+}
+
+// returns 0 if the value is well formed, -1 if not
+
+static int skip_value(struct frame_in *in) {
+  switch(get_u8(in)) {
+    case WG_NULLTYPE:
+      break;
+    case WG_RECORDTYPE: case WG_INTTYPE: case WG_DOUBLETYPE: case WG_FIXPOINTTYPE:
+      get_bytes(in,8);
+      break;
+    case WG_STRTYPE:
+      get_bytes(in,get_u32(in));
+      break;
+    case WG_CHARTYPE:
+      get_u8(in);
+      break;
+    case WG_DATETYPE: case WG_TIMETYPE:
+      get_u32(in);
+      break;
+    default:
+      return -1;
+  }
+  return in->err ? -1 : 0;
+}
+
+// returns 0 if the op is well formed, -1 if not: sets *write for writing ops
+
+static int skip_op(struct frame_in *in, int *write) {
+  unsigned long i, n;
+
+  switch(get_u8(in)) {
+    case BIN_OP_INSERT:
+      *write=1;
+      n=get_u32(in);
+      for(i=0;i<n;i++) {
+        if (skip_value(in)<0) return -1;
+      }
+      break;
+    case BIN_OP_GET:
+      get_bytes(in,8);
+      break;
+    case BIN_OP_FIND:
+      n=get_u8(in);
+      for(i=0;i<n;i++) {
+        get_u32(in);
+        switch(get_u8(in)) {
+          case WG_COND_EQUAL: case WG_COND_NOT_EQUAL: 
+          case WG_COND_LESSTHAN: case WG_COND_GREATER: 
+          case WG_COND_LTEQUAL: case WG_COND_GTEQUAL:
+            break;
+          default:
+            return -1;
+        }
+        if (skip_value(in)<0) return -1;
+      }
+      get_u32(in);
+      break;
+    case BIN_OP_UPDATE:
+      *write=1;
+      get_bytes(in,8);
+      get_u32(in);
+      if (skip_value(in)<0) return -1;
+      break;
+    case BIN_OP_DELETE:
+      *write=1;
+      get_bytes(in,8);
+      break;
+    default:
+      return -1;
+  }
+  return in->err ? -1 : 0;
+}
+
+/* ------------ writing a response frame -----------------
+
+  put_* functions append to tdata->buf and return 0 if out of memory:
+  the buffer is freed then.
+
+*/
+
+static int put_bytes(thread_data_p tdata, void* data, int n) {
+  if (!str_guarantee_space(tdata,n+1)) return 0;
+  memcpy(tdata->bufptr,data,n);
+  tdata->bufptr+=n;
+  return 1;
+}
+
+static int put_u8(thread_data_p tdata, unsigned int v) {
+  if (!str_guarantee_space(tdata,2)) return 0;
+  *(tdata->bufptr)++=(char)v;
+  return 1;
+}
+
+static int put_u16(thread_data_p tdata, unsigned int v) {
+  unsigned char b[2];
+
+  b[0]=v & 0xff;
+  b[1]=(v>>8) & 0xff;
+  return put_bytes(tdata,b,2);
+}
+
+static int put_u32(thread_data_p tdata, unsigned long v) {
+  if (!str_guarantee_space(tdata,5)) return 0;
+  patch_u32(tdata->bufptr,v);
+  tdata->bufptr+=4;
+  return 1;
+}
+
+static int put_u64(thread_data_p tdata, unsigned long long v) {
+  return put_u32(tdata,(unsigned long)(v & 0xffffffffUL)) && 
+         put_u32(tdata,(unsigned long)(v>>32));
+}
+
+static int put_double(thread_data_p tdata, double d) {
+  unsigned long long v;
+
+  memcpy(&v,&d,sizeof(v));
+  return put_u64(tdata,v);
+}
+
+static int put_error(thread_data_p tdata, char* err) {
+  int n=strlen(err);
+
+  return put_u8(tdata,BIN_STATUS_ERR) && put_u16(tdata,n) && put_bytes(tdata,err,n);
+}
+
+static void patch_u32(char* p, unsigned long v) {
+  p[0]=(char)(v & 0xff);
+  p[1]=(char)((v>>8) & 0xff);
+  p[2]=(char)((v>>16) & 0xff);
+  p[3]=(char)((v>>24) & 0xff);
+}
+
+// write a field value: types not in the protocol are written as null
+
+static int put_value(thread_data_p tdata, void* db, wg_int enc) {
+  int type;
+  char* s;
+  wg_int n;
+
+  type=wg_get_encoded_type(db,enc);
+  switch(type) {
+    case WG_RECORDTYPE:
+      return put_u8(tdata,type) && put_u64(tdata,(unsigned long long)enc);
+    case WG_INTTYPE:
+      return put_u8(tdata,type) && 
+             put_u64(tdata,(unsigned long long)(long long)wg_decode_int(db,enc));
+    case WG_DOUBLETYPE:
+      return put_u8(tdata,type) && put_double(tdata,wg_decode_double(db,enc));
+    case WG_FIXPOINTTYPE:
+      return put_u8(tdata,type) && put_double(tdata,wg_decode_fixpoint(db,enc));
+    case WG_STRTYPE:
+      s=wg_decode_str(db,enc);
+      n=wg_decode_str_len(db,enc);
+      break;
+    case WG_XMLLITERALTYPE:
+      s=wg_decode_xmlliteral(db,enc);
+      n=wg_decode_xmlliteral_len(db,enc);
+      break;
+    case WG_URITYPE:
+      s=wg_decode_uri(db,enc);
+      n=wg_decode_uri_len(db,enc);
+      break;
+    case WG_BLOBTYPE:
+      s=wg_decode_blob(db,enc);
+      n=wg_decode_blob_len(db,enc);
+      break;
+    case WG_CHARTYPE:
+      return put_u8(tdata,type) && put_u8(tdata,(unsigned char)wg_decode_char(db,enc));
+    case WG_DATETYPE:
+      return put_u8(tdata,type) && put_u32(tdata,(unsigned long)wg_decode_date(db,enc));
+    case WG_TIMETYPE:
+      return put_u8(tdata,type) && put_u32(tdata,(unsigned long)wg_decode_time(db,enc));
+    default:
+      return put_u8(tdata,WG_NULLTYPE);
+  }
+  // string-like types
+  if (s==NULL || n<0) n=0;
+  return put_u8(tdata,type) && put_u32(tdata,(unsigned long)n) && put_bytes(tdata,s,n);
+}
+
+static int put_record(thread_data_p tdata, void* db, void* rec) {
+  wg_int i, len;
+
+  len=wg_get_record_len(db,rec);
+  if (len<0) len=0;
+  if (!put_u64(tdata,(unsigned long long)wg_encode_record(db,rec)) || 
+      !put_u32(tdata,(unsigned long)len)) return 0;
+  for(i=0;i<len;i++) {
+    if (!put_value(tdata,db,wg_get_field(db,rec,i))) return 0;
+  }
+  return 1;
+}
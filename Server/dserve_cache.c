@@ -0,0 +1,344 @@
+/*
+
+dserve_cache.c contains the search result cache of dserve
+
+dserve is a tool for performing REST queries from WhiteDB using a cgi
+protocol over http(s). Results are given in the json or csv format.
+
+The server keeps the response bodies of op=search and op=count in
+memory, keyed by the database, the op and the other query parameters
+in a normalized order. A cached result is given out only if the write
+epoch of the database is the same as it was while computing the result:
+any write, also by another program, makes the old results stale.
+The cache has a memory budget (result_cache_size in the configuration
+file) and the least recently used results are dropped to keep to it.
+Results are kept as they were sent, compressed if the client accepted
+a compressed response, so the compression is done only once.
+
+See http://whitedb.org/tools.html for a detailed manual.
+
+Copyright (c) 2013, Tanel Tammet
+
+This software is under MIT licence unless linked with WhiteDB:
+see dserve.c for details.
+
+*/
+
+#include "dserve.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* =============== local macros =================== */
+
+#define RCACHE_BUCKETS 4096 // hash table size: a power of 2
+#define RCACHE_ENTRY_PART 8 // a single result may take this part of the budget
+
+#if _MSC_VER
+// windows server is iterative: no locking needed
+#define RCACHE_LOCK(c)
+#define RCACHE_UNLOCK(c)
+#else
+#define RCACHE_LOCK(c) pthread_mutex_lock(&((c)->mutex))
+#define RCACHE_UNLOCK(c) pthread_mutex_unlock(&((c)->mutex))
+#endif
+
+/*   ========== structures =============  */
+
+// a cached result: the key and the result follow the struct in the same block
+
+struct rcache_entry{
+  struct rcache_entry *next; // hash chain
+  struct rcache_entry *newer; // lru list
+  struct rcache_entry *older;
+  unsigned int hash;
+  wg_int epoch; // database write epoch of the result
+  int    dropepoch; // global dropepoch of the result
+  int    keylen;
+  int    len; // result length
+  int    encoded; // 1 if the result is compressed
+  long   size; // whole block size, counted against the budget
+};
+
+struct result_cache{
+#if _MSC_VER
+  void*  mutex;
+#else
+  pthread_mutex_t mutex;
+#endif
+  struct rcache_entry *table[RCACHE_BUCKETS];
+  struct rcache_entry *newest;
+  struct rcache_entry *oldest;
+  long   size; // memory budget
+  long   used;
+};
+
+/* ======== local protos ========= */
+
+static int key_append(thread_data_p tdata, char* str);
+static struct rcache_entry* find_entry(struct result_cache *c, thread_data_p tdata);
+static void unlink_entry(struct result_cache *c, struct rcache_entry *e);
+static void link_newest(struct result_cache *c, struct rcache_entry *e);
+
+#define ENTRY_KEY(e) ((char*)(e)+sizeof(struct rcache_entry))
+#define ENTRY_DATA(e) (ENTRY_KEY(e)+(e)->keylen)
+
+/* =============== functions =================== */
+
+/* create the cache for the whole server: size is the memory budget
+
+  returns 0 if ok or not configured, -1 on failure
+*/
+
+int rcache_init(struct dserve_global *globalptr, long size) {
+  struct result_cache *c;
+
+  globalptr->rcache=NULL;
+  if (size<=0) return 0;
+  c=(struct result_cache *)malloc(sizeof(struct result_cache));
+  if (c==NULL) return -1;
+  memset(c,0,sizeof(struct result_cache));
+#if _MSC_VER
+#else
+  if (pthread_mutex_init(&(c->mutex),NULL)) {
+    free(c);
+    return -1;
+  }
+#endif
+  c->size=size;
+  globalptr->rcache=c;
+  return 0;
+}
+
+/* build the cache key of a search into tdata->rkey
+
+  The key is the op, the accepted response encoding and the database
+  followed by the parameters sorted
+  by name. The sort is stable, keeping the order of repeated parameters
+  like field and value, which is significant. Access tokens and the
+  no-action parameter do not change the result and are left out.
+
+  returns 1 if the result may be cached, 0 if not
+*/
+
+int rcache_key(thread_data_p tdata, int opcode,
+               char* inparams[], char* invalues[], int incount) {
+  int order[MAXPARAMS];
+  int i,j,x;
+  unsigned int h;
+
+  tdata->rkeylen=0;
+  if (tdata->global->rcache==NULL || !tdata->isserver) return 0;
+  if (opcode!=SEARCH_CODE && opcode!=COUNT_CODE) return 0;
+  // insertion sort of parameter indexes by name
+  for(i=0;i<incount;i++) {
+    x=i;
+    for(j=i;j>0 && strcmp(inparams[order[j-1]],inparams[x])>0;j--)
+      order[j]=order[j-1];
+    order[j]=x;
+  }
+  tdata->rkey[0]=(char)opcode;
+  tdata->rkey[1]=(char)(tdata->encoding);
+  tdata->rkeylen=2;
+  if (!key_append(tdata,tdata->database)) return 0;
+  for(i=0;i<incount;i++) {
+    x=order[i];
+    if (!strcmp(inparams[x],"op") || !strcmp(inparams[x],"db") ||
+        !strcmp(inparams[x],"token") || !strcmp(inparams[x],NOACTION_PARAM))
+      continue;
+    if (!key_append(tdata,inparams[x]) || !key_append(tdata,invalues[x]))
+      return 0;
+  }
+  // fnv-1a
+  h=2166136261U;
+  for(i=0;i<tdata->rkeylen;i++) {
+    h^=(unsigned char)(tdata->rkey[i]);
+    h*=16777619U;
+  }
+  tdata->rhash=h;
+  tdata->rdropepoch=tdata->global->dropepoch;
+  tdata->rbuflen=0;
+  return 1;
+}
+
+/* append a 0-terminated string to the key: the terminator separates
+   the parts unambiguously
+
+  returns 0 and stops caching if the key gets too long
+*/
+
+static int key_append(thread_data_p tdata, char* str) {
+  int l;
+
+  if (str==NULL) str="";
+  l=strlen(str)+1;
+  if (tdata->rkeylen+l>RESULT_CACHE_KEY_LEN) {
+    tdata->rkeylen=0;
+    return 0;
+  }
+  memcpy(tdata->rkey+tdata->rkeylen,str,l);
+  tdata->rkeylen+=l;
+  return 1;
+}
+
+/* look up the result for tdata->rkey
+
+  db must be attached: the entry is valid only if the current write
+  epoch of db is the one of the entry. A stale entry is dropped.
+
+  returns a malloced copy of the result, also stored in tdata->buf,
+  or NULL if there is no valid result. The length of the result is set
+  in tdata->reslen: a compressed result is not 0-terminated.
+*/
+
+char* rcache_get(thread_data_p tdata, void* db) {
+  struct result_cache *c=tdata->global->rcache;
+  struct rcache_entry *e;
+  char* res=NULL;
+
+  RCACHE_LOCK(c);
+  e=find_entry(c,tdata);
+  if (e!=NULL) {
+    if (e->epoch!=wg_database_epoch(db) || e->dropepoch!=tdata->global->dropepoch) {
+      unlink_entry(c,e);
+      free(e);
+    } else {
+      res=str_new(e->len+1);
+      if (res!=NULL) {
+        memcpy(res,ENTRY_DATA(e),e->len);
+        res[e->len]='\0';
+        // move to the front of the lru list
+        unlink_entry(c,e);
+        link_newest(c,e);
+        tdata->buf=res;
+        tdata->bufptr=res+e->len;
+        tdata->bufsize=e->len+1;
+        tdata->encoded=e->encoded;
+        tdata->reslen=e->len;
+      }
+    }
+  }
+  RCACHE_UNLOCK(c);
+  return res;
+}
+
+/* keep a copy of a part of the result sent out before the rest is ready
+
+  called with the bytes written out in a chunk while streaming
+*/
+
+void rcache_capture(thread_data_p tdata, char* data, int len) {
+  long max=tdata->global->rcache->size/RCACHE_ENTRY_PART;
+  char* p;
+  int n;
+
+  if (tdata->rbuflen+len>max) {
+    // too big to be cached
+    tdata->rkeylen=0;
+    return;
+  }
+  if (tdata->rbuflen+len>tdata->rbufsize) {
+    n=tdata->rbufsize*2;
+    if (n<tdata->rbuflen+len) n=tdata->rbuflen+len;
+    if (n>max) n=max;
+    p=realloc(tdata->rbuf,n);
+    if (p==NULL) {
+      tdata->rkeylen=0;
+      return;
+    }
+    tdata->rbuf=p;
+    tdata->rbufsize=n;
+  }
+  memcpy(tdata->rbuf+tdata->rbuflen,data,len);
+  tdata->rbuflen+=len;
+}
+
+/* store the result of a finished search: the part captured while
+   streaming followed by the contents of tdata->buf
+
+  the oldest results are dropped to make room. Called after the
+  result is finished: a streamed result has been captured whole.
+*/
+
+void rcache_put(thread_data_p tdata) {
+  struct result_cache *c=tdata->global->rcache;
+  struct rcache_entry *e, *old;
+  long len, size;
+
+  if (tdata->rkeylen==0) return;
+  len=tdata->rbuflen+(tdata->bufptr-tdata->buf);
+  size=sizeof(struct rcache_entry)+tdata->rkeylen+len;
+  e=NULL;
+  if (size<=c->size/RCACHE_ENTRY_PART) e=(struct rcache_entry *)malloc(size);
+  if (e==NULL) {
+    tdata->rkeylen=0;
+    return;
+  }
+  e->hash=tdata->rhash;
+  e->epoch=tdata->repoch;
+  e->dropepoch=tdata->rdropepoch;
+  e->keylen=tdata->rkeylen;
+  e->len=len;
+  e->encoded=tdata->encoded;
+  e->size=size;
+  memcpy(ENTRY_KEY(e),tdata->rkey,tdata->rkeylen);
+  memcpy(ENTRY_DATA(e),tdata->rbuf,tdata->rbuflen);
+  memcpy(ENTRY_DATA(e)+tdata->rbuflen,tdata->buf,tdata->bufptr-tdata->buf);
+  RCACHE_LOCK(c);
+  // a concurrent search may have stored the same result already
+  old=find_entry(c,tdata);
+  if (old!=NULL) {
+    unlink_entry(c,old);
+    free(old);
+  }
+  while (c->used+size>c->size && c->oldest!=NULL) {
+    old=c->oldest;
+    unlink_entry(c,old);
+    free(old);
+  }
+  link_newest(c,e);
+  RCACHE_UNLOCK(c);
+  tdata->rkeylen=0;
+}
+
+/* ---------- hash table and lru list, called under the cache lock ---------- */
+
+static struct rcache_entry* find_entry(struct result_cache *c, thread_data_p tdata) {
+  struct rcache_entry *e;
+
+  e=c->table[tdata->rhash&(RCACHE_BUCKETS-1)];
+  for(;e!=NULL;e=e->next) {
+    if (e->hash==tdata->rhash && e->keylen==tdata->rkeylen &&
+        !memcmp(ENTRY_KEY(e),tdata->rkey,e->keylen))
+      return e;
+  }
+  return NULL;
+}
+
+static void unlink_entry(struct result_cache *c, struct rcache_entry *e) {
+  struct rcache_entry **p;
+
+  p=&(c->table[e->hash&(RCACHE_BUCKETS-1)]);
+  while (*p!=e) p=&((*p)->next);
+  *p=e->next;
+  if (e->newer!=NULL) e->newer->older=e->older;
+  else c->newest=e->older;
+  if (e->older!=NULL) e->older->newer=e->newer;
+  else c->oldest=e->newer;
+  c->used-=e->size;
+}
+
+static void link_newest(struct result_cache *c, struct rcache_entry *e) {
+  struct rcache_entry **p;
+
+  p=&(c->table[e->hash&(RCACHE_BUCKETS-1)]);
+  e->next=*p;
+  *p=e;
+  e->newer=NULL;
+  e->older=c->newest;
+  if (c->newest!=NULL) c->newest->newer=e;
+  else c->oldest=e;
+  c->newest=e;
+  c->used+=e->size;
+}
@@ -0,0 +1,660 @@
+/*
+
+dserve_import.c contains the bulk import op of dserve
+
+dserve is a tool for performing REST queries from WhiteDB using a cgi
+protocol over http(s). Results are given in the json or csv format.
+
+op=import reads csv, a json array of rows or ndjson (one json row per
+line) posted as the request body and creates a record for each row.
+The data is parsed in parts while it arrives and the records are
+created in batches, each under its own write lock, so a big import
+neither needs the whole data in memory nor blocks other clients
+for long.
+
+See http://whitedb.org/tools.html for a detailed manual.
+
+Copyright (c) 2013, Tanel Tammet
+
+This software is under MIT licence unless linked with WhiteDB:
+see dserve.c for details.
+
+*/
+
+#include "dserve.h"
+#include "../json/yajl_api.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+
+/* =============== local macros =================== */
+
+#define IMPORT_CSV    0 // formats of the posted data
+#define IMPORT_JSON   1
+#define IMPORT_NDJSON 2
+
+#define IMPORT_PARSE_TYPE 0 // csv field: type is found by wg_parse_and_encode
+
+#define CSV_NONE   0 // csv parser states: between fields
+#define CSV_FIELD  1 // in an unquoted field
+#define CSV_QUOTED 2 // in a quoted field
+#define CSV_QUOTE  3 // quote seen in a quoted field: end or an escaped quote
+
+/*   ========== structures =============  */
+
+// a parsed value waiting for insertion
+
+struct import_val{
+  int    type; // WG_NULLTYPE, WG_INTTYPE, WG_DOUBLETYPE, WG_STRTYPE or IMPORT_PARSE_TYPE
+  long long i; // int value or offset of the 0-terminated string in strs
+  double d;
+};
+
+// a parsed row waiting for insertion
+
+struct import_row{
+  int    start; // index of the first value in vals
+  long   row; // row number in the data, from 1
+};
+
+// import progress: rows of the current batch are kept until inserted
+
+struct import_state{
+  thread_data_p tdata;
+  void  *db;
+  int    format; // IMPORT_CSV, IMPORT_JSON or IMPORT_NDJSON
+  int    batchrows; // max nr of rows in a batch
+  // current batch
+  struct import_val *vals;
+  int    nvals;
+  int    valsize;
+  struct import_row *rows;
+  int    nrows;
+  char  *strs; // strings of the batch
+  int    nstrs;
+  int    strsize;
+  int    batchread; // rows read for the batch, also rejected ones
+  long   errrows[MAX_IMPORT_ERRORS]; // rejected rows of the batch
+  char  *errstrs[MAX_IMPORT_ERRORS];
+  int    nerrs;
+  // totals
+  long   rowcount; // rows read
+  long   inserted; // records created
+  int    batches;
+  int    reported; // rejected rows listed
+  char  *err; // NULL or the error which stopped the import
+  char   errbuf[ERRBUF_LEN];
+  // parser state
+  int    depth; // json nesting depth
+  int    rowdepth; // json depth of rows: 2 in an array, 1 for ndjson
+  int    badrow; // current json row is rejected
+  int    csvstate; // CSV_NONE etc
+  int    eatsep; // a quoted csv field ended: next separator is skipped
+  int    fieldstart; // offset in strs of the csv field being read
+  int    rowstart; // index in vals of the row being read
+};
+
+/* ============= local protos ============= */
+
+static int import_format(thread_data_p tdata, char* format);
+static int import_alloc(struct import_state *st);
+static void import_free(struct import_state *st);
+static int add_val(struct import_state *st, int type, long long i, double d);
+static int add_str(struct import_state *st, char* str, int len, int term);
+static void row_start(struct import_state *st);
+static int row_end(struct import_state *st, char* rowerr);
+static int row_error(struct import_state *st, long row, char* err);
+static int commit_batch(struct import_state *st);
+static int print_batch(struct import_state *st, long inserted);
+static int print_str(thread_data_p tdata, char* fmt, ...);
+static void json_error(struct import_state *st, yajl_handle hand);
+static void parse_csv(struct import_state *st, char* buf, int n);
+static void end_csv(struct import_state *st);
+static int csv_field(struct import_state *st);
+
+static int json_null(void* ctx);
+static int json_boolean(void* ctx, int val);
+static int json_integer(void* ctx, long long val);
+static int json_double(void* ctx, double val);
+static int json_string(void* ctx, const unsigned char* str, size_t len);
+static int json_start(void* ctx);
+static int json_start_map(void* ctx);
+static int json_end(void* ctx);
+static int json_scalar(struct import_state *st, int type, long long i, double d);
+
+/* =============== globals =================== */
+
+static yajl_callbacks import_callbacks = {
+  json_null,
+  json_boolean,
+  json_integer,
+  json_double,
+  NULL,
+  json_string,
+  json_start_map,
+  NULL,
+  json_end,
+  json_start,
+  json_end
+};
+
+/* =============== functions =================== */
+
+/*
+  op=import: the query is in the url and the data is the posted body.
+
+  Result is a json object listing the batches with rejected rows and
+  the totals. For http/1.1 clients each batch is sent as soon as it
+  is inserted, so the result shows the progress. If the import stops
+  midway, error gives the reason: the batches before remain inserted.
+*/
+
+char* import_data(thread_data_p tdata, char* inparams[], char* invalues[], int incount) {
+  char* database=tdata->database;
+  char *token=NULL, *format=NULL;
+  char *buf;
+  int i, n=0, batchrows=IMPORT_BATCH_ROWS;
+  void* db=NULL;
+  struct import_state st;
+  yajl_handle hand=NULL;
+  char errbuf[ERRBUF_LEN];
+
+  // format is the format of the data: the result is always json
+  for(i=0;i<incount;i++) {
+    if (strncmp(inparams[i],"format",MAXQUERYLEN)==0) {
+      format=invalues[i];
+    } else if (strncmp(inparams[i],"batch",MAXQUERYLEN)==0) {
+      batchrows=atoi(invalues[i]);
+      if (batchrows<=0 || batchrows>MAX_IMPORT_BATCH_ROWS) {
+        snprintf(errbuf,ERRBUF_LEN,UNKNOWN_PARAM_VALUE_ERR,invalues[i],inparams[i]);
+        return errhalt(errbuf,tdata);
+      }
+    } else if (strncmp(inparams[i],"token",MAXQUERYLEN)==0) {
+      token=invalues[i];
+    } else if (strncmp(inparams[i],"db",MAXQUERYLEN) &&
+               strncmp(inparams[i],"op",MAXQUERYLEN) &&
+               strncmp(inparams[i],NOACTION_PARAM,MAXQUERYLEN)) {
+#ifndef ALLOW_UNKNOWN_PARAMS
+      snprintf(errbuf,ERRBUF_LEN,UNKNOWN_PARAM_ERR,inparams[i]);
+      return errhalt(errbuf,tdata);
+#endif
+    }
+  }
+  tdata->format=1;
+  tdata->jsonp=NULL;
+  st.format=import_format(tdata,format);
+  if (st.format<0) return errhalt(IMPORT_FORMAT_ERR,tdata);
+  if (tdata->body==NULL) return errhalt(IMPORT_BODY_ERR,tdata);
+  // authorization
+  if (!authorize(WRITE_LEVEL,tdata,database,token)) {
+    return errhalt(NOT_AUTHORIZED_ERR,tdata);
+  }
+  // attach to database, create like insert does
+  db=op_attach_database(tdata,database,READ_LEVEL);
+  if (!db) {
+    if (!authorize(ADMIN_LEVEL,tdata,database,token))
+      return errhalt(NOT_AUTHORIZED_INSERT_CREATE_ERR,tdata);
+    if (tdata->realthread && tdata->common->shutdown) return NULL;
+    db=op_create_database(tdata,database,0);
+    if (!db) return err_clear_detach_halt(DB_CREATE_ERR,tdata);
+  }
+  tdata->buf=str_new(INITIAL_MALLOC);
+  if (tdata->buf==NULL) return err_clear_detach_halt(MALLOC_ERR,tdata);
+  tdata->bufsize=INITIAL_MALLOC;
+  tdata->bufptr=tdata->buf;
+  // prepare the parser
+  st.tdata=tdata;
+  st.db=db;
+  st.batchrows=batchrows;
+  if (!import_alloc(&st) || (buf=malloc(IMPORT_READ_SIZE))==NULL) {
+    import_free(&st);
+    return err_clear_detach_halt(MALLOC_ERR,tdata);
+  }
+  if (st.format!=IMPORT_CSV) {
+    hand=yajl_alloc(&import_callbacks,NULL,(void *) &st);
+    if (hand==NULL) {
+      free(buf);
+      import_free(&st);
+      return err_clear_detach_halt(MALLOC_ERR,tdata);
+    }
+    if (st.format==IMPORT_NDJSON) yajl_config(hand,yajl_allow_multiple_values,1);
+  }
+  if (!print_str(tdata,"{\"batches\":[")) st.err=MALLOC_ERR;
+  // read, parse and insert part by part
+  while(st.err==NULL) {
+    n=body_read(tdata->body,buf,IMPORT_READ_SIZE);
+    if (n<0) st.err=IMPORT_READ_ERR;
+    if (n<=0) break;
+    if (tdata->common!=NULL && tdata->common->shutdown) st.err=TERMINATE_ERR;
+    else if (st.format==IMPORT_CSV) parse_csv(&st,buf,n);
+    else {
+      if (yajl_parse(hand,(unsigned char *) buf,n)!=yajl_status_ok) json_error(&st,hand);
+    }
+  }
+  // the rest of the data
+  if (st.err==NULL) {
+    if (st.format==IMPORT_CSV) end_csv(&st);
+    else if (yajl_complete_parse(hand)!=yajl_status_ok) json_error(&st,hand);
+  }
+  if (st.err==NULL && st.batchread>0) commit_batch(&st);
+  if (hand!=NULL) yajl_free(hand);
+  free(buf);
+  import_free(&st);
+  op_detach_database(tdata,db);
+  if (tdata->buf==NULL) return err_clear_detach_halt(MALLOC_ERR,tdata);
+  if (st.err==NULL)
+    n=print_str(tdata,"],\n\"rows\":%ld,\"inserted\":%ld,\"error\":null}",
+                st.rowcount,st.inserted);
+  else
+    n=print_str(tdata,"],\n\"rows\":%ld,\"inserted\":%ld,\"error\":\"%s\"}",
+                st.rowcount,st.inserted,st.err);
+  if (!n) return err_clear_detach_halt(MALLOC_ERR,tdata);
+  // send the rest of a streamed result
+  if (tdata->streamed && !stream_flush(tdata,1))
+    return err_clear_detach_halt(STREAM_ERR,tdata);
+  return tdata->buf;
+}
+
+// format from the parameter or the content type, -1 if unknown
+
+static int import_format(thread_data_p tdata, char* format) {
+  if (format==NULL) {
+    if (tdata->intype==CONTENT_TYPE_CSV) return IMPORT_CSV;
+    if (tdata->intype==CONTENT_TYPE_JSON) return IMPORT_JSON;
+    if (tdata->intype==CONTENT_TYPE_NDJSON) return IMPORT_NDJSON;
+    return -1;
+  }
+  if (!strcmp(format,"csv")) return IMPORT_CSV;
+  if (!strcmp(format,"json")) return IMPORT_JSON;
+  if (!strcmp(format,"ndjson")) return IMPORT_NDJSON;
+  return -1;
+}
+
+static int import_alloc(struct import_state *st) {
+  st->valsize=st->batchrows < 1000 ? 8*st->batchrows : 8000;
+  st->vals=malloc(sizeof(struct import_val)*st->valsize);
+  st->rows=malloc(sizeof(struct import_row)*st->batchrows);
+  st->strsize=INITIAL_MALLOC;
+  st->strs=malloc(st->strsize);
+  st->nvals=st->nrows=st->nstrs=st->batchread=st->nerrs=0;
+  st->rowcount=st->inserted=0;
+  st->batches=st->reported=0;
+  st->err=NULL;
+  st->depth=st->badrow=0;
+  st->rowdepth=(st->format==IMPORT_JSON) ? 2 : 1;
+  st->csvstate=CSV_NONE;
+  st->eatsep=0;
+  st->fieldstart=0;
+  st->rowstart=0;
+  return st->vals!=NULL && st->rows!=NULL && st->strs!=NULL;
+}
+
+static void import_free(struct import_state *st) {
+  if (st->vals!=NULL) free(st->vals);
+  if (st->rows!=NULL) free(st->rows);
+  if (st->strs!=NULL) free(st->strs);
+  st->vals=NULL;
+  st->rows=NULL;
+  st->strs=NULL;
+}
+
+/* ------------ collecting rows of a batch ----------------- */
+
+// returns 0 if out of memory
+
+static int add_val(struct import_state *st, int type, long long i, double d) {
+  struct import_val *nvals;
+
+  if (st->nvals>=st->valsize) {
+    nvals=realloc(st->vals,sizeof(struct import_val)*st->valsize*2);
+    if (nvals==NULL) {
+      st->err=MALLOC_ERR;
+      return 0;
+    }
+    st->vals=nvals;
+    st->valsize*=2;
+  }
+  st->vals[st->nvals].type=type;
+  st->vals[st->nvals].i=i;
+  st->vals[st->nvals].d=d;
+  st->nvals++;
+  return 1;
+}
+
+// append len chars to strs, with the terminating 0 if term is set
+
+static int add_str(struct import_state *st, char* str, int len, int term) {
+  char* nstrs;
+  int need=st->nstrs+len+1;
+
+  if (need>st->strsize) {
+    if (need<2*st->strsize) need=2*st->strsize;
+    nstrs=realloc(st->strs,need);
+    if (nstrs==NULL) {
+      st->err=MALLOC_ERR;
+      return 0;
+    }
+    st->strs=nstrs;
+    st->strsize=need;
+  }
+  memcpy(st->strs+st->nstrs,str,len);
+  st->nstrs+=len;
+  if (term) st->strs[st->nstrs++]='\0';
+  return 1;
+}
+
+static void row_start(struct import_state *st) {
+  st->rowstart=st->nvals;
+  st->badrow=0;
+}
+
+/*
+  Ends the row started by row_start: the row is rejected if rowerr
+  is given. A full batch is inserted. Returns 0 if the import stops.
+*/
+
+static int row_end(struct import_state *st, char* rowerr) {
+  st->rowcount++;
+  st->batchread++;
+  if (rowerr!=NULL) {
+    st->nvals=st->rowstart;
+    row_error(st,st->rowcount,rowerr);
+  } else if (st->nvals>st->rowstart) {
+    // empty rows are skipped like in wg_import_db_csv
+    st->rows[st->nrows].start=st->rowstart;
+    st->rows[st->nrows].row=st->rowcount;
+    st->nrows++;
+  }
+  st->rowstart=st->nvals; // csv rows have no explicit start
+  if (st->nrows>=st->batchrows || st->nstrs>=IMPORT_BATCH_BYTES)
+    return commit_batch(st);
+  return 1;
+}
+
+// note a rejected row for the batch result
+
+static int row_error(struct import_state *st, long row, char* err) {
+  if (st->reported>=MAX_IMPORT_ERRORS) return 0;
+  st->errrows[st->nerrs]=row;
+  st->errstrs[st->nerrs]=err;
+  st->nerrs++;
+  st->reported++;
+  return 1;
+}
+
+/*
+  Creates the records of the batch under one write lock and
+  prints the batch result. Returns 0 if the import stops.
+*/
+
+static int commit_batch(struct import_state *st) {
+  thread_data_p tdata=st->tdata;
+  void* db=st->db;
+  void* rec;
+  struct import_val *v;
+  wg_int lock_id, enc;
+  long inserted=0;
+  int r, i, len, end;
+
+  if (st->nrows>0) {
+    lock_id=wg_start_write(db);
+    if (!lock_id) {
+      st->err=LOCK_ERR;
+      return 0;
+    }
+    tdata->lock_id=lock_id;
+    tdata->lock_type=WRITE_LOCK_TYPE;
+    for(r=0;r<st->nrows;r++) {
+      end=(r+1<st->nrows) ? st->rows[r+1].start : st->nvals;
+      len=end-st->rows[r].start;
+      rec=wg_create_record(db,len);
+      if (rec==NULL) {
+        st->err=IMPORT_RECORD_ERR;
+        break;
+      }
+      for(i=0;i<len;i++) {
+        v=&(st->vals[st->rows[r].start+i]);
+        switch(v->type) {
+          case IMPORT_PARSE_TYPE: enc=wg_parse_and_encode(db,st->strs+v->i); break;
+          case WG_NULLTYPE: enc=wg_encode_null(db,0); break;
+          case WG_INTTYPE: enc=wg_encode_int(db,(wg_int)v->i); break;
+          case WG_DOUBLETYPE: enc=wg_encode_double(db,v->d); break;
+          default: enc=wg_encode_str(db,st->strs+v->i,NULL); break;
+        }
+        if (enc==WG_ILLEGAL || wg_set_new_field(db,rec,i,enc)) break;
+      }
+      if (i<len) {
+        wg_delete_record(db,rec);
+        row_error(st,st->rows[r].row,IMPORT_FIELD_ERR);
+        continue;
+      }
+      inserted++;
+    }
+    lock_id=wg_end_write(db,lock_id);
+    tdata->lock_id=0;
+    if (!lock_id) st->err=LOCK_RELEASE_ERR;
+  }
+  st->inserted+=inserted;
+  if (!print_batch(st,inserted)) st->err=MALLOC_ERR;
+  // send the batch result at once to show progress
+  else if (tdata->stream && !stream_flush(tdata,0)) st->err=STREAM_ERR;
+  st->nvals=st->nrows=st->nstrs=st->batchread=st->nerrs=0;
+  st->rowstart=st->fieldstart=0;
+  return st->err==NULL;
+}
+
+static int print_batch(struct import_state *st, long inserted) {
+  thread_data_p tdata=st->tdata;
+  int i;
+
+  st->batches++;
+  if (!print_str(tdata,"%s\n{\"batch\":%d,\"rows\":%d,\"inserted\":%ld",
+                 st->batches>1 ? "," : "",st->batches,st->batchread,inserted)) return 0;
+  if (st->nerrs) {
+    if (!print_str(tdata,",\"errors\":[")) return 0;
+    for(i=0;i<st->nerrs;i++) {
+      if (!print_str(tdata,"%s{\"row\":%ld,\"error\":\"%s\"}",
+                     i ? "," : "",st->errrows[i],st->errstrs[i])) return 0;
+    }
+    if (!print_str(tdata,"]")) return 0;
+  }
+  return print_str(tdata,"}");
+}
+
+// print a short formatted string to tdata->buf: returns 0 if out of memory
+
+static int print_str(thread_data_p tdata, char* fmt, ...) {
+  va_list args;
+  int n;
+
+  if (!str_guarantee_space(tdata,MIN_STRLEN+ERRBUF_LEN)) {
+    tdata->buf=NULL;
+    return 0;
+  }
+  va_start(args,fmt);
+  n=vsnprintf(tdata->bufptr,MIN_STRLEN+ERRBUF_LEN,fmt,args);
+  va_end(args);
+  tdata->bufptr+=n;
+  return 1;
+}
+
+// keep the message of a json syntax error, made safe for printing in json
+
+static void json_error(struct import_state *st, yajl_handle hand) {
+  unsigned char *jerr;
+  char *p;
+
+  if (st->err!=NULL) return; // canceled by a callback
+  jerr=yajl_get_error(hand,0,NULL,0);
+  snprintf(st->errbuf,ERRBUF_LEN,"%s: %s",JSON_ERR,(char *) jerr);
+  yajl_free_error(hand,jerr);
+  for(p=st->errbuf; *p!='\0'; p++) {
+    if (*p=='"' || *p=='\\' || (unsigned char)*p<' ') *p=' ';
+  }
+  st->err=st->errbuf;
+}
+
+/* ------------ csv -----------------
+
+  Fields are separated by CSV_SEPARATOR and rows by line ends.
+  Quoted fields may contain separators, line ends and "" for a quote.
+  The field values are typed like in wg_import_db_csv.
+
+*/
+
+static void parse_csv(struct import_state *st, char* buf, int n) {
+  int i;
+  char c;
+
+  for(i=0;i<n && st->err==NULL;i++) {
+    c=buf[i];
+    if (st->csvstate==CSV_QUOTE) {
+      if (c=='"') {
+        // escaped quote
+        add_str(st,&c,1,0);
+        st->csvstate=CSV_QUOTED;
+        continue;
+      }
+      // quoted field ended: the char is handled after it
+      if (!csv_field(st)) return;
+      st->csvstate=CSV_NONE;
+      st->eatsep=1;
+    }
+    if (st->csvstate==CSV_QUOTED) {
+      if (c=='"') st->csvstate=CSV_QUOTE;
+      else add_str(st,&c,1,0);
+    } else if (st->csvstate==CSV_FIELD) {
+      if (c==CSV_SEPARATOR) {
+        st->csvstate=CSV_NONE;
+        csv_field(st);
+      } else if (c=='\n') {
+        st->csvstate=CSV_NONE;
+        if (csv_field(st)) row_end(st,NULL);
+      } else if (c!='\r') {
+        add_str(st,&c,1,0);
+      }
+    } else {
+      // between fields
+      if (c==CSV_SEPARATOR) {
+        if (st->eatsep) st->eatsep=0;
+        else csv_field(st);
+      } else if (c=='\n') {
+        if (st->eatsep) st->eatsep=0;
+        else if (st->nvals>st->rowstart && !csv_field(st)) return;
+        row_end(st,NULL);
+      } else if (c!='\r') {
+        // a new field
+        st->eatsep=0;
+        if (c=='"') {
+          st->csvstate=CSV_QUOTED;
+        } else {
+          st->csvstate=CSV_FIELD;
+          add_str(st,&c,1,0);
+        }
+      }
+    }
+  }
+}
+
+// the last row may lack the line end
+
+static void end_csv(struct import_state *st) {
+  if (st->csvstate!=CSV_NONE) {
+    if (!csv_field(st)) return;
+    st->csvstate=CSV_NONE;
+  }
+  if (st->nvals>st->rowstart) row_end(st,NULL);
+}
+
+// end the field read into strs after fieldstart
+
+static int csv_field(struct import_state *st) {
+  if (!add_str(st,"",0,1)) return 0;
+  if (!add_val(st,IMPORT_PARSE_TYPE,st->fieldstart,0)) return 0;
+  st->fieldstart=st->nstrs;
+  return 1;
+}
+
+/* ------------ json -----------------
+
+  Rows are arrays of plain values: null, true and false (as 1 and 0),
+  numbers and strings. A row with nested arrays or objects is rejected.
+  For the json format the rows are elements of a top level array,
+  for ndjson the rows are top level values.
+
+*/
+
+static int json_null(void* ctx) {
+  return json_scalar((struct import_state *) ctx,WG_NULLTYPE,0,0);
+}
+
+static int json_boolean(void* ctx, int val) {
+  return json_scalar((struct import_state *) ctx,WG_INTTYPE,val ? 1 : 0,0);
+}
+
+static int json_integer(void* ctx, long long val) {
+  return json_scalar((struct import_state *) ctx,WG_INTTYPE,val,0);
+}
+
+static int json_double(void* ctx, double val) {
+  return json_scalar((struct import_state *) ctx,WG_DOUBLETYPE,0,val);
+}
+
+static int json_string(void* ctx, const unsigned char* str, size_t len) {
+  struct import_state *st=(struct import_state *) ctx;
+  long long offset=st->nstrs;
+
+  if (st->depth!=st->rowdepth || st->badrow)
+    return json_scalar(st,WG_STRTYPE,0,0);
+  if (!add_str(st,(char *) str,len,1)) return 0;
+  return json_scalar(st,WG_STRTYPE,offset,0);
+}
+
+// start of an array or an object
+
+static int json_start(void* ctx) {
+  struct import_state *st=(struct import_state *) ctx;
+
+  st->depth++;
+  if (st->depth==st->rowdepth) row_start(st);
+  else if (st->depth>st->rowdepth) st->badrow=1;
+  return 1;
+}
+
+// start of an object: only arrays are accepted as rows
+
+static int json_start_map(void* ctx) {
+  struct import_state *st=(struct import_state *) ctx;
+
+  if (!(st->depth) && st->format==IMPORT_JSON) {
+    st->err=IMPORT_JSON_ERR;
+    return 0;
+  }
+  st->depth++;
+  if (st->depth==st->rowdepth) row_start(st);
+  if (st->depth>=st->rowdepth) st->badrow=1;
+  return 1;
+}
+
+// end of an array or an object
+
+static int json_end(void* ctx) {
+  struct import_state *st=(struct import_state *) ctx;
+
+  st->depth--;
+  if (st->depth==st->rowdepth-1)
+    return row_end(st,st->badrow ? IMPORT_ROW_ERR : NULL);
+  return 1;
+}
+
+static int json_scalar(struct import_state *st, int type, long long i, double d) {
+  if (st->depth<st->rowdepth) {
+    // a plain value in place of a row
+    row_start(st);
+    return row_end(st,IMPORT_ROW_ERR);
+  }
+  if (st->depth>st->rowdepth || st->badrow) return 1;
+  return add_val(st,type,i,d);
+}
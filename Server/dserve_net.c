@@ -23,6 +23,9 @@ see dserve.c for details.
 #include <ctype.h> 
 #include <errno.h>
 #include <time.h> // linux nanosleep 
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
 
 #if _MSC_VER   
 #else
@@ -31,17 +34,42 @@ see dserve.c for details.
 #include <sys/socket.h>
 #include <netinet/tcp.h>
 #include <unistd.h> // for alarm
+#include <strings.h> // strncasecmp
 #ifdef MULTI_THREAD
 #include <pthread.h>
 #endif
+#if EVENTLOOP
+#include <sys/epoll.h>
+#include <poll.h>
+#include <fcntl.h>
+#endif
 #endif
 
 /* ============= local protos ============= */
 
-static char* get_post_data(int connsd,char* buf,void* ssl,thread_data_p tdata);
+struct http_headers;
+
+static int read_headers(int connsd,void* ssl,struct http_headers *hdrs);
+static void parse_header_line(char* line, struct http_headers *hdrs);
+static int keep_alive(char* version, int connection);
+#ifdef USE_ZLIB
+static int accept_encoding(char* s);
+#endif
+static char* get_post_data(int connsd,void* ssl,thread_data_p tdata,struct http_headers *hdrs);
+static char* read_chunked_body(int connsd,void* ssl);
+static int body_more(struct body_src *src);
 int open_listener(int port);
-void write_header(char* buf);
+void write_header(char* buf, int keepalive);
 void write_header_clen(char* buf, int clen);
+void write_header_chunked(char* buf);
+void write_header_encoding(char* buf, int encoding);
+static char* response_body(thread_data_p tdata, char* res, int* len);
+static int stream_chunk(thread_data_p tdata, char* buf, int n, int more);
+static int stream_write(thread_data_p tdata, char* buf, int n, int more);
+#ifdef USE_ZLIB
+static z_stream* zstream_reset(thread_data_p tdata);
+static int stream_deflate(thread_data_p tdata, char* buf, int n, int final);
+#endif
 int parse_uri(char *uri, char *filename, char *cgiargs);
 ssize_t readlineb(int fd, void *usrbuf, size_t maxlen, void* sslp);
 ssize_t readn(int fd, void *usrbuf, size_t n, void* sslp);
@@ -55,30 +83,93 @@ void *handle_http(void *targ);
 SSL_CTX *init_openssl(dserve_conf_p conf);
 void ShowCerts(SSL* ssl);
 #endif
+#ifdef MULTI_THREAD
+#if THREADPOOL
+static long long now_usec(void);
+static int task_ready(struct common_data *common);
+static int take_task(struct common_data *common, common_task_t *task, int *expired);
+static void end_task(struct common_data *common, int write);
+#ifndef USE_OPENSSL
+static int overload_response(char *buf, int size);
+static void reject_socket(int fd);
+#endif
+#endif
+#endif
+#if EVENTLOOP
+static int run_event_loops(int sd, int bsd, struct common_data *common);
+static void *event_loop_thread(void *arg);
+static void accept_conns(struct event_loop *loop, int binary);
+static void read_conn(struct conn_data *c);
+static void drain_conn(struct conn_data *c);
+static int parse_request(struct conn_data *c);
+static int parse_frame(struct conn_data *c);
+static int request_error(struct conn_data *c, char *err, int reqlen);
+static int scan_chunked(char *p, int n, int *declen, int decode);
+static void reset_request(struct conn_data *c);
+static void consume_request(struct conn_data *c);
+static void queue_conn(struct conn_data *c);
+static void reject_conn(struct conn_data *c);
+static void serve_conn(struct conn_data *c, thread_data_p tdata);
+static void serve_frames(struct conn_data *c, thread_data_p tdata);
+static int rearm_conn(struct conn_data *c, unsigned int events);
+static int write_conn(int fd, char *buf, int n, int more);
+static int fill_conn(struct body_src *src, char *buf, int n);
+static void unlink_conn(struct conn_data *c);
+static void free_conn(struct conn_data *c);
+static void close_conn(struct conn_data *c);
+static void sweep_conns(struct event_loop *loop, time_t now);
+#endif
 
 /*   ========== structures =============  */
 
+// request headers recognized by the server
+
+struct http_headers{
+  int clen; // Content-Length, 0 if missing
+  int ctype; // CONTENT_TYPE_UNKNOWN, CONTENT_TYPE_URLENCODED, CONTENT_TYPE_JSON etc
+  int connection; // CONNECTION_DEFAULT, CONNECTION_CLOSE or CONNECTION_KEEPALIVE
+  int chunked; // 1 for Transfer-Encoding: chunked
+  int expect; // 1 for Expect: 100-continue
+  int encoding; // ENCODING_NONE etc chosen from Accept-Encoding
+};
+
+#if EVENTLOOP
+#define EVENT_BATCH 64 // max nr of epoll events handled in one round
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE 0 // older headers: all loops are woken for a new connection
+#endif
+#endif
+
 /* ========== globals =========================== */
 
+#if EVENTLOOP
+static volatile int conn_count=0; // open connections over all event loops
+#endif
+
 /* =============== functions =================== */
 
 int run_server(int port, dserve_global_p globalptr) {
   struct sockaddr_in clientaddr;
   int rc, sd, connsd, next; 
+#if EVENTLOOP
+  int bsd;
+#endif
   thread_data_p tdata; 
   struct common_data *common;
   long tid, maxtid, tcount, i;
+  long cachesize; // memory budget of the result cache
   size_t clientlen;
   //struct timeval timeout;
 #ifdef MULTI_THREAD
 #if _MSC_VER
   HANDLE thandle;
-  HANDLE thandlearray[MAX_THREADS];
-  DWORD threads[MAX_THREADS];
+  HANDLE *thandlearray;
+  DWORD *threads;
 #else
-  pthread_t threads[MAX_THREADS];
+  pthread_t *threads;
   pthread_attr_t attr;
   struct timespec tim, tim2;
+  int rejected;
 #endif
 #ifdef USE_OPENSSL    
   SSL_CTX *ctx; 
@@ -102,7 +193,62 @@ int run_server(int port, dserve_global_p globalptr) {
 #else 
   signal(SIGPIPE,SIG_IGN); // important for linux TCP/IP handling   
 #endif  
+  if (globalptr->conf->binary_port.used>0 && !(THREADPOOL && EVENTLOOP))
+    warnprint(BINARY_PORT_WARN,NULL);
+  if (globalptr->conf->result_cache_size.used>0)
+    cachesize=atol(globalptr->conf->result_cache_size.vals[0]);
+  else 
+    cachesize=RESULT_CACHE_SIZE;
+  if (rcache_init(globalptr,cachesize)<0) warnprint(RESULT_CACHE_WARN,NULL);
+#ifdef USE_ZLIB
+  if (globalptr->conf->compress_level.used>0)
+    globalptr->compress_level=atoi(globalptr->conf->compress_level.vals[0]);
+  else
+    globalptr->compress_level=COMPRESS_LEVEL;
+  if (globalptr->compress_level<0) globalptr->compress_level=0;
+  if (globalptr->compress_level>9) globalptr->compress_level=9;
+  if (globalptr->conf->compress_min_size.used>0)
+    globalptr->compress_min=atoi(globalptr->conf->compress_min_size.vals[0]);
+#endif
+  // threadpool size and queue limits
+  if (globalptr->conf->threads.used>0) {
+    i=atol(globalptr->conf->threads.vals[0]);
+    if (i<1 || i>MAX_POOL_THREADS) {
+      warnprint(THREADS_CONF_WARN,globalptr->conf->threads.vals[0]);
+    } else if (i!=globalptr->maxthreads && alloc_threads_data(globalptr,i)) {
+      errprint(CANNOT_ALLOC_ERR,NULL);
+      exit(ERR_EX_UNAVAILABLE);
+    }
+  }
+  if (globalptr->conf->queue_size.used>0)
+    globalptr->queue_limit=atoi(globalptr->conf->queue_size.vals[0]);
+  if (globalptr->queue_limit<1) globalptr->queue_limit=1;
+  // each connection of an event loop has at most one request queued
+  if (EVENTLOOP && globalptr->queue_limit>MAX_CONNECTIONS) 
+    globalptr->queue_limit=MAX_CONNECTIONS;
+  if (globalptr->conf->write_threads.used>0)
+    globalptr->write_threads=atoi(globalptr->conf->write_threads.vals[0]);
+  // at least one thread is kept for reads if there are several
+  if (globalptr->write_threads>globalptr->maxthreads-1) 
+    globalptr->write_threads=globalptr->maxthreads-1;
+  if (globalptr->write_threads<1) globalptr->write_threads=1;
+  if (globalptr->conf->queue_timeout.used>0)
+    globalptr->queue_timeout=atoi(globalptr->conf->queue_timeout.vals[0]);
+  if (globalptr->queue_timeout<0) globalptr->queue_timeout=0;
   tdata=&(globalptr->threads_data[0]); 
+#ifdef MULTI_THREAD
+#if _MSC_VER
+  thandlearray=(HANDLE *)malloc(sizeof(HANDLE)*globalptr->maxthreads);
+  threads=(DWORD *)malloc(sizeof(DWORD)*globalptr->maxthreads);
+  if (thandlearray==NULL || threads==NULL) {
+#else
+  threads=(pthread_t *)malloc(sizeof(pthread_t)*globalptr->maxthreads);
+  if (threads==NULL) {
+#endif
+    errprint(CANNOT_ALLOC_ERR,NULL);
+    exit(ERR_EX_UNAVAILABLE);
+  }
+#endif
 #ifdef MULTI_THREAD    
 #if _MSC_VER
 #else
@@ -130,14 +276,23 @@ int run_server(int port, dserve_global_p globalptr) {
       exit(ERR_EX_UNAVAILABLE);
     }        
     common->threads = threads;
-    common->queue = (common_task_t *)malloc(sizeof(common_task_t) * QUEUE_SIZE);
+    // a request arriving at a full queue gets 503 at once
+    common->queue_size = globalptr->queue_limit;
+    common->queue = (common_task_t *)malloc(sizeof(common_task_t) * common->queue_size);
+    // only event loops know the op of a request before it is queued
+    common->wqueue = EVENTLOOP ? (common_task_t *)malloc(sizeof(common_task_t) * common->queue_size) : NULL;
+    if (common->queue==NULL || (EVENTLOOP && common->wqueue==NULL)) {
+      errprint(CANNOT_ALLOC_ERR,NULL);
+      exit(ERR_EX_UNAVAILABLE);
+    }
     common->thread_count = 0;
-    common->queue_size = QUEUE_SIZE;
     common->head = common->tail = common->count = 0;
+    common->whead = common->wtail = common->wcount = 0;
     common->shutdown = common->started = 0;
+    common->global = globalptr;
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE); //PTHREAD_CREATE_DETACHED);
     // create threads
-    for(tid=0;tid<MAX_THREADS;tid++) {
+    for(tid=0;tid<globalptr->maxthreads;tid++) {
       // init thread data block 
       tdata[tid].isserver=1;
       tdata[tid].thread_id=tid;
@@ -164,6 +319,19 @@ int run_server(int port, dserve_global_p globalptr) {
       errprint(PORT_LISTEN_ERR, strerror(errno));
       return -1;
     }
+#if EVENTLOOP
+    // binary protocol clients connect to a separate port
+    bsd=-1;
+    if (globalptr->conf->binary_port.used>0) {
+      bsd=open_listener(atoi(globalptr->conf->binary_port.vals[0]));
+      if (bsd<0) {
+        errprint(PORT_LISTEN_ERR, strerror(errno));
+        return -1;
+      }
+    }
+    // event loops accept and read, threadpool computes and writes
+    return run_event_loops(sd,bsd,common);
+#endif
     clientlen = sizeof(clientaddr);
     // loop forever, servicing requests
     while (1) {
@@ -183,11 +351,12 @@ int run_server(int port, dserve_global_p globalptr) {
       // now we have a connection: add to queue
       next=common->tail+1;
       next=(next==common->queue_size) ? 0 : next;
+      rejected=0;
       do {
-        if(common->count==common->queue_size) { // full?
-          //fprintf(stderr, "queue full\n");
-          nanosleep(&tim , &tim2);
-          break; //continue;
+        if(common->count==common->queue_size) { // full: answered below
+          rejected=1;
+          globalptr->stats.rejected++;
+          break;
         }
         if(common->shutdown) { 
           warnprint(SHUTDOWN_WARN,NULL);
@@ -198,8 +367,10 @@ int run_server(int port, dserve_global_p globalptr) {
 #ifdef USE_OPENSSL
         common->queue[common->tail].ssl=ssl; 
 #endif
+        common->queue[common->tail].queued=now_usec();
         common->tail=next;
         common->count+=1;
+        globalptr->stats.readqueue=common->count;
         //printf("next %d\n",next);
         // broadcast
         if(pthread_cond_signal(&(common->cond)) != 0) {
@@ -212,6 +383,15 @@ int run_server(int port, dserve_global_p globalptr) {
         errprint(THREADPOOL_UNLOCK_ERR,NULL);
         exit(ERR_EX_UNAVAILABLE);
       }
+      if (rejected) {
+#ifdef USE_OPENSSL
+        // no handshake yet: the client just sees the connection closed
+        SSL_free(ssl);
+        close(connsd);
+#else
+        reject_socket(connsd);
+#endif
+      }
     }
     return 0; // never come to this
     
@@ -232,7 +412,7 @@ int run_server(int port, dserve_global_p globalptr) {
     common=(struct common_data *)malloc(sizeof(struct common_data));     
     common->shutdown=0;           
     // mark thread data blocks free
-    for(i=0;i<MAX_THREADS;i++) {
+    for(i=0;i<globalptr->maxthreads;i++) {
       tdata[i].inuse=0;      
       tdata[i].common=common;
       tdata[i].global=globalptr;
@@ -263,7 +443,7 @@ int run_server(int port, dserve_global_p globalptr) {
       // find first free thread data block
       // loop until we get a free one
       while(tid<0) {
-        for(i=0;i<MAX_THREADS;i++) {
+        for(i=0;i<globalptr->maxthreads;i++) {
           if (!tdata[i].inuse) {
             tid=i;
             break;
@@ -346,11 +526,13 @@ DWORD WINAPI handle_http(LPVOID targ) {
 #else   
 void *handle_http(void *targ) {
 #endif
-  int connsd,i,tid,itmp,len=0;    
+  int connsd,i,tid,itmp,len=0,keepalive,nreqs;    
   char *method=NULL, *uri=NULL, *version=NULL, *query=NULL;  
   char *bp=NULL, *res=NULL;
   char buf[MAXLINE];
   char header[HTTP_HEADER_SIZE];
+  struct http_headers hdrs;
+  struct body_src body;
   thread_data_p tdata;  
   struct common_data *common;    
   socklen_t alen;  
@@ -364,6 +546,20 @@ void *handle_http(void *targ) {
 #else
   void* ssl=NULL;
 #endif  
+#if _MSC_VER
+  DWORD idletime=KEEPALIVE_TIMEOUT_SECONDS*1000, sendtime;
+#else
+  struct timeval idletime, sendtime;
+#endif
+#if EVENTLOOP
+  struct conn_data *cdata=NULL;
+#endif
+#ifdef MULTI_THREAD
+#if THREADPOOL
+  common_task_t task;
+  int writing=0, expired=0;
+#endif
+#endif
 
 #if _MSC_VER
 #else
@@ -386,7 +582,7 @@ void *handle_http(void *targ) {
 #ifdef MULTI_THREAD 
 #if THREADPOOL
       pthread_mutex_lock(&(common->mutex)); 
-      while ((common->count==0) && (common->shutdown==0)) {
+      while (!task_ready(common) && (common->shutdown==0)) {
         itmp=pthread_cond_wait(&(common->cond),&(common->mutex)); // wait
         if (itmp) {
           errprint(COND_WAIT_FAIL_ERR,NULL);
@@ -400,12 +596,19 @@ void *handle_http(void *targ) {
         pthread_exit((void*) tid);
         return NULL; 
       }
+      writing=take_task(common,&task,&expired);
+      pthread_mutex_unlock(&(common->mutex)); 
+      connsd=task.conn;
+#if EVENTLOOP
+      cdata=task.cdata;
 #endif
-#endif
-      connsd=common->queue[common->head].conn;
 #ifdef USE_OPENSSL
-      ssl=common->queue[common->head].ssl;
-      if (SSL_accept(ssl)==-1) {
+      ssl=task.ssl;
+      if (expired) {
+        // no handshake for a request given up on
+        SSL_free(ssl);
+        ssl=NULL;
+      } else if (SSL_accept(ssl)==-1) {
         SSL_free(ssl);
         ssl=NULL;
         //fprintf(stderr,"ssl accept error\n");
@@ -413,12 +616,26 @@ void *handle_http(void *targ) {
       }  
       //ShowCerts(ssl);            
 #endif
-      common->head+=1;
-      common->head=(common->head == common->queue_size) ? 0 : common->head;
-      common->count-=1;
-#ifdef MULTI_THREAD
-#if THREADPOOL
-      pthread_mutex_unlock(&(common->mutex)); 
+#if EVENTLOOP
+      // request already read and parsed by an event loop
+      tdata->inuse=1;
+      if (expired) reject_conn(cdata);
+      else if (cdata->binary) serve_frames(cdata,tdata);
+      else serve_conn(cdata,tdata);
+      tdata->inuse=0;
+      end_task(common,writing);
+      continue;
+#endif
+      if (expired) {
+        // waited too long in the queue: the client may retry
+#ifdef USE_OPENSSL
+        close(connsd);
+#else
+        reject_socket(connsd);
+#endif
+        end_task(common,writing);
+        continue;
+      }
 #endif
 #endif
     }
@@ -452,76 +669,152 @@ void *handle_http(void *targ) {
 #else
     if (1) {
 #endif
-      // accepted connection: read and process
-      // read and parse request line
-      readlineb(connsd,buf,MAXLINE,ssl);
-      method=buf;
-      for(i=0,bp=buf; *bp!='\0' && i<2; bp++) {
-        if (*bp==' ') {
-          *bp='\0';
-          if (!i) uri=bp+1; else version=bp+1;
-          ++i;
+      // accepted connection: read and process requests until
+      // the client closes, stays idle too long or is not keep-alive
+#if _MSC_VER
+#else
+      idletime.tv_sec=KEEPALIVE_TIMEOUT_SECONDS;
+      idletime.tv_usec=0;
+#endif
+      setsockopt(connsd,SOL_SOCKET,SO_RCVTIMEO,(const char *)&idletime,sizeof(idletime));
+#if _MSC_VER
+      sendtime=WRITE_TIMEOUT_SECONDS*1000;
+#else
+      sendtime.tv_sec=WRITE_TIMEOUT_SECONDS;
+      sendtime.tv_usec=0;
+#endif
+      // a stalled client must not block a streaming worker forever
+      setsockopt(connsd,SOL_SOCKET,SO_SNDTIMEO,(const char *)&sendtime,sizeof(sendtime));
+      tdata->conn=connsd;
+      tdata->nonblock=0;
+#ifdef USE_OPENSSL
+      tdata->ssl=ssl;
+#endif
+      keepalive=1;
+      for(nreqs=1; keepalive; nreqs++) {
+        method=NULL;
+        uri=NULL;
+        version=NULL;
+        query=NULL;
+        res=NULL;
+        tdata->inbuf=NULL;
+        // read and parse request line
+        if (readlineb(connsd,buf,MAXLINE,ssl)<=0) {
+          len=0; // closed or idle: nothing to wait for on shutdown
+          break;
         }
-      }
-      if (strcmp(method, "GET") && strcmp(method, "POST")) {
-        //return;        
-        res=make_http_errstr(HTTP_METHOD_ERR,NULL);
-      } else if (uri==NULL || version==NULL) {
-        //return;
-        res=make_http_errstr(HTTP_REQUEST_ERR,NULL);
-      } else {
-        if (!strcmp(method, "GET")) {
-          // query follows GET
-          tdata->method=GET_METHOD_CODE;
-          for(bp=uri; *bp!='\0'; bp++) {
-            if (*bp=='?') { 
-              *bp='\0';
-              query=bp+1; 
-              break; 
-            }
+        method=buf;
+        for(i=0,bp=buf; *bp!='\0' && i<2; bp++) {
+          if (*bp==' ') {
+            *bp='\0';
+            if (!i) uri=bp+1; else version=bp+1;
+            ++i;
           }
-        } else {
-          // POST: query after empty line
-          tdata->method=POST_METHOD_CODE;
-          query=get_post_data(connsd,buf,ssl,tdata);
         }
-        // now we have query for both methods
-        if (query==NULL || *query=='\0') { 
-          res=make_http_errstr(HTTP_NOQUERY_ERR,NULL);
+        if (strcmp(method, "GET") && strcmp(method, "POST")) {
+          //return;        
+          res=make_http_errstr(HTTP_METHOD_ERR,NULL);
+          keepalive=0;
+        } else if (uri==NULL || version==NULL) {
+          //return;
+          res=make_http_errstr(HTTP_REQUEST_ERR,NULL);
+          keepalive=0;
+        } else if (read_headers(connsd,ssl,&hdrs)<0) {
+          res=make_http_errstr(HTTP_REQUEST_ERR,NULL);
+          keepalive=0;
         } else {
-          // compute result
-#ifdef MULTI_THREAD
-          if (!(common->shutdown)) {            
-            res=process_query(query,tdata);
-            //printf("res: %s\n",res);
+          keepalive=keep_alive(version,hdrs.connection) && nreqs<MAX_KEEPALIVE_REQUESTS;
+          // connections waiting in the queue get the thread instead of an idle client
+          if (keepalive && tdata->realthread==2 && common->count>0) keepalive=0;
+          tdata->keepalive=keepalive;
+          tdata->stream=!strncmp(version,"HTTP/1.1",8); // chunked encoding needs http/1.1
+          tdata->streamed=0;
+          tdata->intype=hdrs.ctype;
+          tdata->encoding=tdata->global->compress_level ? hdrs.encoding : ENCODING_NONE;
+          if (!strcmp(method, "GET")) {
+            // query follows GET
+            tdata->method=GET_METHOD_CODE;
+            for(bp=uri; *bp!='\0'; bp++) {
+              if (*bp=='?') { 
+                *bp='\0';
+                query=bp+1; 
+                break; 
+              }
+            }
+          } else {
+            tdata->method=POST_METHOD_CODE;
+            for(bp=uri; *bp!='\0' && *bp!='?'; bp++);
+            if (*bp=='?' && is_import_query(bp+1)) {
+              // op=import: query in the url, data in the body
+              query=bp+1;
+              if (hdrs.expect) writen(connsd,CONTINUE_RESPONSE,strlen(CONTINUE_RESPONSE),ssl);
+              if (get_post_data(connsd,ssl,tdata,&hdrs)==NULL) {
+                keepalive=0;
+              } else {
+                body.buf=tdata->inbuf;
+                body.base=body.pos=0;
+                body.used=body.size=strlen(tdata->inbuf);
+                body.left=body.used;
+                body.chunked=0;
+                body.state=BODY_DATA;
+                body.fill=NULL;
+                tdata->body=&body;
+              }
+            } else {
+              // POST: query after empty line
+              query=get_post_data(connsd,ssl,tdata,&hdrs);
+              if (query==NULL) keepalive=0; // body not consumed
+            }
+          }
+          // now we have query for both methods
+          if (query==NULL || *query=='\0') { 
+            res=make_http_errstr(HTTP_NOQUERY_ERR,NULL);
           } else {
-            tdata->inuse=0;
+            // compute result
+#ifdef MULTI_THREAD
+            if (!(common->shutdown)) {            
+              res=process_query(query,tdata);
+              //printf("res: %s\n",res);
+            } else {
+              tdata->inuse=0;
 #if _MSC_VER
-            ExitThread(1);
-            return 0;
+              ExitThread(1);
+              return 0;
 #else
-            pthread_exit((void*) tid);
-            return NULL;
+              pthread_exit((void*) tid);
+              return NULL;
 #endif
-          }
+            }
 #else
-          // no multithreading only
-          res=process_query(query,tdata);
+            // no multithreading only
+            res=process_query(query,tdata);
 #endif
+          }
         }
+        if (tdata->inbuf!=NULL) { free(tdata->inbuf); tdata->inbuf=NULL; }
+        tdata->body=NULL;
+        //printf("res: %s\n",res);
+        if (tdata->streamed) {
+          // result already sent in chunks: res is not to be sent
+          if (tdata->streamed!=2) keepalive=0; // sending broken off
+          if (res!=NULL) free(res);
+          tdata->streamed=0;
+          tdata->encoded=0;
+          len=CLOSE_CHECK_THRESHOLD;
+          continue;
+        }
+        // make header
+        res=response_body(tdata,res,&len);
+        write_header(header,keepalive);
+        write_header_clen(header,len); 
+        if (tdata->encoded) write_header_encoding(header,tdata->encoding);
+        // send result
+        if (writen(connsd,header,strlen(header),ssl)<0) keepalive=0;
+        else if (res!=NULL && writen(connsd,res,len,ssl)<0) keepalive=0;
+        if (res!=NULL) free(res);
+        tdata->encoded=0;
       }
-      //printf("res: %s\n",res);
-      // make header
-      if (res==NULL) len=0;
-      else len=strlen(res);
-      write_header(header);
-      write_header_clen(header,len); 
-      // send result
-      i=writen(connsd,header,strlen(header),ssl);      
-      if (res!=NULL) {
-        i=writen(connsd,res,len,ssl);
-        free(res);
-      }
+      tdata->stream=0;
 #ifdef USE_OPENSSL
       if (ssl!=NULL) SSL_free(ssl);
 #endif
@@ -595,6 +888,11 @@ void *handle_http(void *targ) {
     } else if ((tdata->realthread)==2) {
       // threadpool thread
       //fprintf(stderr,"thread %d loop ended\n",tid);
+#ifdef MULTI_THREAD
+#if THREADPOOL
+      end_task(common,writing);
+#endif
+#endif
     } else {
       // not a thread at all
 #if _MSC_VER
@@ -606,90 +904,1419 @@ void *handle_http(void *targ) {
   }  
 }
 
+#ifdef MULTI_THREAD
+#if THREADPOOL
+
+/* ============ threadpool queues =============
+
+  Requests wait for a worker in a queue of queue_size tasks. A request
+  arriving at a full queue is answered 503 at once, and a request which
+  has waited longer than queue_timeout gets 503 from the worker taking
+  it, both with Retry-After. With event loops the writing requests have
+  a queue of their own and at most write_threads workers take them, so
+  that bulk writes cannot hold up all the cheap reads.
+
+  The queues and the stats are changed under common->mutex.
+
+*/
+
+// monotonic time in microseconds for measuring queue waits
+
+static long long now_usec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (long long)ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+
+// is there a task a free worker may take: writes only while write threads are free
+
+static int task_ready(struct common_data *common) {
+  struct dserve_global *g=common->global;
+
+  return common->count>0 || (common->wcount>0 && g->stats.writing<g->write_threads);
+}
+
+/*
+  Takes the next task when task_ready. Writes go first while write 
+  threads are free: otherwise the reads, filling all the other 
+  workers, would always overtake them.
+
+  Returns 1 for a writing task, 0 for a reading one. *expired is 
+  set if the task has waited longer than queue_timeout.
+*/
+
+static int take_task(struct common_data *common, common_task_t *task, int *expired) {
+  struct dserve_global *g=common->global;
+  long long wait;
+  int write;
+
+  if (common->wcount>0 && g->stats.writing<g->write_threads) {
+    *task=common->wqueue[common->whead];
+    common->whead+=1;
+    common->whead=(common->whead == common->queue_size) ? 0 : common->whead;
+    common->wcount-=1;
+    write=1;
+  } else {
+    *task=common->queue[common->head];
+    common->head+=1;
+    common->head=(common->head == common->queue_size) ? 0 : common->head;
+    common->count-=1;
+    write=0;
+  }
+  wait=now_usec()-task->queued;
+  *expired=(g->queue_timeout>0 && wait>(long long)g->queue_timeout*1000);
+  g->stats.readqueue=common->count;
+  g->stats.writequeue=common->wcount;
+  g->stats.requests++;
+  if (*expired) g->stats.expired++;
+  g->stats.waitsum+=wait;
+  if (wait>g->stats.waitmax) g->stats.waitmax=wait;
+  g->stats.busy++;
+  if (write) g->stats.writing++;
+  return write;
+}
+
+// a worker has finished its task: a waiting write may be taken now
+
+static void end_task(struct common_data *common, int write) {
+  pthread_mutex_lock(&(common->mutex));
+  common->global->stats.busy--;
+  if (write) {
+    common->global->stats.writing--;
+    if (common->wcount>0 && pthread_cond_signal(&(common->cond)) != 0)
+      warnprint(COND_SIGNAL_FAIL_WARN,NULL);
+  }
+  pthread_mutex_unlock(&(common->mutex));
+}
+
+#ifndef USE_OPENSSL
+// https connections are closed instead: they have no handshake yet
+
+// build the 503 response of an overloaded server: returns its length
+
+static int overload_response(char *buf, int size) {
+  char body[HTTP_ERR_BUFSIZE];
+
+  snprintf(body,sizeof(body),NORMAL_ERR_FORMAT,OVERLOAD_ERR);
+  return snprintf(buf,size,OVERLOAD_RESPONSE,RETRY_AFTER_SECONDS,(int)strlen(body),body);
+}
+
+/*
+  Answers 503 to a blocking connection which gets no worker and closes
+  it. Nothing waits for a slow client: it just sees the connection
+  closed. Input already arrived is read first, since closing with
+  unread input would reset the connection and lose the response.
+*/
+
+static void reject_socket(int fd) {
+  char buf[MAXLINE];
+  int i, n;
+
+  for(i=0; i<16 && recv(fd,buf,sizeof(buf),MSG_DONTWAIT)>0; i++);
+  n=overload_response(buf,sizeof(buf));
+  send(fd,buf,n,MSG_DONTWAIT|MSG_NOSIGNAL);
+  shutdown(fd,SHUT_WR);
+  close(fd);
+}
+
+#endif
+#endif
+#endif
+
+#if EVENTLOOP
+
+/* ============ epoll event loops =============
+
+  Each event loop thread owns an epoll set with the shared non-blocking
+  listening socket and the connections it has accepted. The loop reads
+  and parses requests without blocking and pushes complete ones to the
+  threadpool task queue. A worker computes the result, writes the
+  response and either closes the connection or gives it back to the
+  loop for waiting until the client closes.
+
+  Connection fds use EPOLLONESHOT: after an event the fd is disarmed
+  until the loop or the worker owning the connection rearms it.
+
+  Connections accepted on the binary port carry frames of the binary
+  protocol (see dserve_bin.c) instead of http requests.
+
+*/
+
+static int run_event_loops(int sd, int bsd, struct common_data *common) {
+  struct event_loop *loops;
+  struct epoll_event ev;
+  pthread_attr_t attr;
+  int i;
+
+  infoprint(EVENTLOOP_INFO,NULL);
+  if (fcntl(sd,F_SETFL,fcntl(sd,F_GETFL,0)|O_NONBLOCK)<0 ||
+      (bsd>=0 && fcntl(bsd,F_SETFL,fcntl(bsd,F_GETFL,0)|O_NONBLOCK)<0)) {
+    errprint(EPOLL_ERR,strerror(errno));
+    return -1;
+  }
+  loops=(struct event_loop *)malloc(sizeof(struct event_loop) * EVENT_THREADS);
+  if (!loops) {
+    errprint(CANNOT_ALLOC_ERR,NULL);
+    return -1;
+  }
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for(i=0;i<EVENT_THREADS;i++) {
+    loops[i].listenfd=sd;
+    loops[i].binfd=bsd;
+    loops[i].head=NULL;
+    loops[i].common=common;
+    loops[i].lastsweep=time(NULL);
+    loops[i].epfd=epoll_create1(0);
+    if (loops[i].epfd<0 || pthread_mutex_init(&(loops[i].mutex),NULL)!=0) {
+      errprint(EPOLL_ERR,strerror(errno));
+      return -1;
+    }
+    // listener is level triggered: any loop may accept the new connection
+    memset(&ev,0,sizeof(ev));
+    ev.events=EPOLLIN|EPOLLEXCLUSIVE;
+    ev.data.ptr=NULL;
+    if (epoll_ctl(loops[i].epfd,EPOLL_CTL_ADD,sd,&ev)<0) {
+      errprint(EPOLL_ERR,strerror(errno));
+      return -1;
+    }
+    // binary listener is marked by the loop itself
+    ev.data.ptr=&loops[i];
+    if (bsd>=0 && epoll_ctl(loops[i].epfd,EPOLL_CTL_ADD,bsd,&ev)<0) {
+      errprint(EPOLL_ERR,strerror(errno));
+      return -1;
+    }
+    // the first loop is run in the calling thread
+    if (i>0 && pthread_create(&(loops[i].thread),&attr,event_loop_thread,&loops[i])) {
+      errprint(THREAD_CREATE_ERR,strerror(errno));
+      exit(ERR_EX_UNAVAILABLE);
+    }
+  }
+  loops[0].thread=pthread_self();
+  event_loop_thread(&loops[0]);
+  return 0;
+}
+
+static void *event_loop_thread(void *arg) {
+  struct event_loop *loop=(struct event_loop *)arg;
+  struct epoll_event events[EVENT_BATCH];
+  struct conn_data *c;
+  time_t now;
+  int i,n;
+
+  while(!(loop->common->shutdown)) {
+    n=epoll_wait(loop->epfd,events,EVENT_BATCH,1000);
+    if (n<0 && errno!=EINTR) {
+      warnprint(EPOLL_ERR,strerror(errno));
+      continue;
+    }
+    for(i=0;i<n;i++) {
+      c=(struct conn_data *)events[i].data.ptr;
+      if (c==NULL) accept_conns(loop,0);
+      else if ((void *)c==(void *)loop) accept_conns(loop,1);
+      else if (c->state==CONN_CLOSING) drain_conn(c);
+      else read_conn(c);
+    }
+    now=time(NULL);
+    if (now!=loop->lastsweep) {
+      sweep_conns(loop,now);
+      loop->lastsweep=now;
+    }
+  }
+  return NULL;
+}
+
+// accept all pending connections on the http or the binary listening socket
+
+static void accept_conns(struct event_loop *loop, int binary) {
+  struct sockaddr_storage addr;
+  struct epoll_event ev;
+  struct conn_data *c;
+  socklen_t alen;
+  int fd, opt=1;
+
+  for(;;) {
+    alen=sizeof(addr);
+    fd=accept(binary ? loop->binfd : loop->listenfd,(struct sockaddr *)&addr,&alen);
+    if (fd<0) {
+      if (errno==EINTR || errno==ECONNABORTED) continue;
+      if (errno!=EAGAIN && errno!=EWOULDBLOCK)
+        warnprint(CONN_ACCEPT_WARN,strerror(errno));
+      return;
+    }
+    if (__sync_add_and_fetch(&conn_count,1)>MAX_CONNECTIONS) {
+      __sync_sub_and_fetch(&conn_count,1);
+      warnprint(CONN_LIMIT_WARN,NULL);
+      close(fd);
+      continue;
+    }
+    c=(struct conn_data *)malloc(sizeof(struct conn_data));
+    if (c!=NULL) {
+      c->buf=malloc(CONN_BUF_SIZE);
+      if (c->buf==NULL) { free(c); c=NULL; }
+    }
+    if (c==NULL) {
+      __sync_sub_and_fetch(&conn_count,1);
+      close(fd);
+      continue;
+    }
+    fcntl(fd,F_SETFL,fcntl(fd,F_GETFL,0)|O_NONBLOCK);
+    setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,(const void *)&opt,sizeof(opt));
+    c->fd=fd;
+    c->state=CONN_READING;
+    c->loop=loop;
+    c->deadline=time(NULL)+READ_TIMEOUT_SECONDS;
+    c->bufsize=CONN_BUF_SIZE;
+    c->used=0;
+    c->nreqs=0;
+    c->binary=binary;
+    reset_request(c);
+    c->ip[0]='\0';
+    c->port=0;
+    if (addr.ss_family==AF_INET) {
+      c->port=ntohs(((struct sockaddr_in *)&addr)->sin_port);
+      inet_ntop(AF_INET,&(((struct sockaddr_in *)&addr)->sin_addr),c->ip,sizeof(c->ip));
+    } else if (addr.ss_family==AF_INET6) {
+      c->port=ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+      inet_ntop(AF_INET6,&(((struct sockaddr_in6 *)&addr)->sin6_addr),c->ip,sizeof(c->ip));
+    }
+    pthread_mutex_lock(&(loop->mutex));
+    c->prev=NULL;
+    c->next=loop->head;
+    if (loop->head!=NULL) loop->head->prev=c;
+    loop->head=c;
+    pthread_mutex_unlock(&(loop->mutex));
+    memset(&ev,0,sizeof(ev));
+    ev.events=EPOLLIN|EPOLLONESHOT;
+    ev.data.ptr=c;
+    if (epoll_ctl(loop->epfd,EPOLL_CTL_ADD,fd,&ev)<0) close_conn(c);
+  }
+}
+
+// read whatever is available and queue the request once it is complete
+
+static void read_conn(struct conn_data *c) {
+  char *nbuf;
+  int n, need;
+
+  for(;;) {
+    n=parse_request(c);
+    if (n) {
+      queue_conn(c);
+      return;
+    }
+    // keep at least one free byte for terminating the query
+    need=(c->reqlen ? c->reqlen : c->used+CONN_BUF_SIZE/2)+1;
+    if (need>c->bufsize) {
+      if (need<2*c->bufsize) need=2*c->bufsize;
+      nbuf=realloc(c->buf,need);
+      if (nbuf==NULL) {
+        close_conn(c);
+        return;
+      }
+      c->buf=nbuf;
+      c->bufsize=need;
+    }
+    n=recv(c->fd,c->buf+c->used,c->bufsize-c->used-1,0);
+    if (n>0) {
+      c->used+=n;
+    } else if (n<0 && errno==EINTR) {
+      continue;
+    } else if (n<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+      if (rearm_conn(c,EPOLLIN)<0) close_conn(c);
+      return;
+    } else {
+      // eof or error before a complete request
+      close_conn(c);
+      return;
+    }
+  }
+}
+
+// discard input after the response until the client closes
+
+static void drain_conn(struct conn_data *c) {
+  int n;
+
+  for(;;) {
+    n=recv(c->fd,c->buf,c->bufsize,0);
+    if (n>0) continue;
+    if (n<0 && errno==EINTR) continue;
+    if (n<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+      if (rearm_conn(c,EPOLLIN)<0) close_conn(c);
+      return;
+    }
+    close_conn(c);
+    return;
+  }
+}
+
+/*
+  Parses the request in c->buf in place.
+
+  Returns 1 if the request is complete, 0 if more input is needed.
+  A malformed request is complete with c->err set: the worker
+  answers it with an error string like the blocking server and
+  closes the connection.
+*/
+
+static int parse_request(struct conn_data *c) {
+  struct http_headers hdrs;
+  char *buf=c->buf, *p, *end, *line, *uri=NULL, *version=NULL;
+  int i, n, declen;
+
+  if (c->binary) return parse_frame(c);
+  if (!(c->hdrlen)) {
+    // find the empty line ending the headers
+    end=NULL;
+    for(i=0;i<c->used;i++) {
+      if (buf[i]!='\n') continue;
+      if (i+1<c->used && buf[i+1]=='\n') { end=buf+i+2; break; }
+      if (i+2<c->used && buf[i+1]=='\r' && buf[i+2]=='\n') { end=buf+i+3; break; }
+    }
+    if (end==NULL) {
+      if (c->used<MAX_HEADER_LEN) return 0;
+      return request_error(c,HTTP_HEADER_LEN_ERR,c->used);
+    }
+    c->hdrlen=end-buf;
+    // headers after the request line
+    hdrs.clen=0;
+    hdrs.ctype=CONTENT_TYPE_UNKNOWN;
+    hdrs.connection=CONNECTION_DEFAULT;
+    hdrs.chunked=0;
+    hdrs.expect=0;
+    hdrs.encoding=ENCODING_NONE;
+    for(line=(char *)memchr(buf,'\n',c->hdrlen)+1; line<end; line=p+1) {
+      p=memchr(line,'\n',end-line);
+      *p='\0';
+      parse_header_line(line,&hdrs);
+    }
+    c->intype=hdrs.ctype;
+    c->encoding=hdrs.encoding;
+    c->chunked=hdrs.chunked;
+    // request line: method uri version
+    *(char *)memchr(buf,'\n',c->hdrlen)='\0';
+    for(i=0,p=buf; *p!='\0' && i<2; p++) {
+      if (*p==' ') {
+        *p='\0';
+        if (!i) uri=p+1; else version=p+1;
+        ++i;
+      }
+    }
+    if (strcmp(buf,"GET") && strcmp(buf,"POST")) 
+      return request_error(c,HTTP_METHOD_ERR,c->hdrlen);
+    else if (uri==NULL || version==NULL) 
+      return request_error(c,HTTP_REQUEST_ERR,c->hdrlen);
+    c->keepalive=keep_alive(version,hdrs.connection) && c->nreqs<MAX_KEEPALIVE_REQUESTS;
+    c->http11=!strncmp(version,"HTTP/1.1",8);
+    // posted data for op=import is not kept whole in memory
+    if (strcmp(buf,"GET") && (p=strchr(uri,'?'))!=NULL && is_import_query(p+1)) 
+      c->streambody=1;
+    if (hdrs.clen<0 || (hdrs.clen>=MAX_MALLOC && !(c->streambody))) {
+      warnprint(CONTENT_LENGTH_BIG_WARN,NULL);
+      return request_error(c,HTTP_NOQUERY_ERR,c->hdrlen);
+    }
+    if (!strcmp(buf,"GET")) {
+      // query follows GET, a body is skipped
+      c->method=GET_METHOD_CODE;
+      for(p=uri; *p!='\0'; p++) {
+        if (*p=='?') {
+          c->qpos=(p+1)-buf;
+          break;
+        }
+      }
+      if (!(c->chunked)) c->reqlen=c->hdrlen+hdrs.clen;
+    } else if (c->streambody) {
+      // op=import: query in the url, the body is read by the worker while importing
+      c->method=POST_METHOD_CODE;
+      c->qpos=(p+1)-buf;
+      c->bodylen=hdrs.clen;
+      c->bodychunked=c->chunked;
+      c->bodyexpect=hdrs.expect;
+      c->chunked=0;
+      c->reqlen=c->hdrlen;
+    } else {
+      // POST: query after empty line
+      c->method=POST_METHOD_CODE;
+      c->qpos=c->hdrlen;
+      if (!(c->chunked)) {
+        if (hdrs.clen<=0) {
+          warnprint(CONTENT_LENGTH_MISSING_WARN,NULL);
+          return request_error(c,HTTP_NOQUERY_ERR,c->hdrlen);
+        }
+        c->reqlen=c->hdrlen+hdrs.clen;
+        c->qend=c->reqlen;
+      }
+    }
+  }
+  if (c->chunked) {
+    // total length is known only when the last chunk has arrived
+    n=scan_chunked(buf+c->hdrlen,c->used-c->hdrlen,&declen,0);
+    if (n==0 && c->used-c->hdrlen<MAX_MALLOC) return 0;
+    if (n<=0) {
+      warnprint(CHUNKED_BODY_WARN,NULL);
+      return request_error(c,HTTP_NOQUERY_ERR,c->used);
+    }
+    scan_chunked(buf+c->hdrlen,n,&declen,1);
+    c->reqlen=c->hdrlen+n;
+    if (c->method==POST_METHOD_CODE) c->qend=c->hdrlen+declen;
+    c->chunked=0;
+  }
+  if (c->used<c->reqlen) return 0;
+  if (c->qend>=0) {
+    c->savedchar=buf[c->qend];
+    buf[c->qend]='\0';
+  }
+  return 1;
+}
+
+/*
+  Binary protocol: a frame is complete when all the bytes given
+  by its length prefix have arrived. Binary connections stay open
+  until the client closes them or stays idle too long.
+*/
+
+static int parse_frame(struct conn_data *c) {
+  unsigned char *p=(unsigned char *)c->buf;
+  unsigned long len;
+
+  if (!(c->reqlen)) {
+    if (c->used<4) return 0;
+    len=p[0] | (p[1]<<8) | ((unsigned long)p[2]<<16) | ((unsigned long)p[3]<<24);
+    if (len>=MAX_MALLOC) return request_error(c,BIN_FRAME_ERR,c->used);
+    c->reqlen=4+len;
+    c->keepalive=1;
+  }
+  return c->used>=c->reqlen;
+}
+
+// mark the request complete with an error: connection is closed after the answer
+
+static int request_error(struct conn_data *c, char *err, int reqlen) {
+  c->err=err;
+  c->streambody=0;
+  c->keepalive=0;
+  c->chunked=0;
+  c->reqlen=reqlen;
+  c->qpos=-1;
+  c->qend=-1;
+  return 1;
+}
+
+/*
+  Checks a chunked body of n bytes at p.
+
+  Returns the length of the complete encoded body including trailers, 
+  0 if it is incomplete or -1 if it is malformed. The decoded length is
+  stored in *declen. If decode is set, the data is moved to the start of p.
+*/
+
+static int scan_chunked(char *p, int n, int *declen, int decode) {
+  int i=0, k, out=0;
+  long size;
+
+  for(;;) {
+    // chunk size line
+    for(k=i; k<n && p[k]!='\n'; k++);
+    if (k>=n) return 0;
+    if (!isxdigit((unsigned char)p[i])) return -1;
+    size=strtol(p+i,NULL,16);
+    if (size<0 || size>=MAX_MALLOC-out) return -1;
+    i=k+1;
+    if (!size) break;
+    // chunk data and its line end
+    if (i+size>=n) return 0;
+    if (decode) memmove(p+out,p+i,size);
+    out+=size;
+    i+=size;
+    if (p[i]=='\r') {
+      if (i+1>=n) return 0;
+      i++;
+    }
+    if (p[i]!='\n') return -1;
+    i++;
+  }
+  // trailers up to the empty line
+  for(;;) {
+    for(k=i; k<n && p[k]!='\n'; k++);
+    if (k>=n) return 0;
+    if (k==i || (k==i+1 && p[i]=='\r')) break;
+    i=k+1;
+  }
+  *declen=out;
+  return k+1;
+}
+
+// prepare for reading the next request on the connection
+
+static void reset_request(struct conn_data *c) {
+  c->hdrlen=0;
+  c->reqlen=0;
+  c->chunked=0;
+  c->method=0;
+  c->qpos=-1;
+  c->qend=-1;
+  c->intype=CONTENT_TYPE_UNKNOWN;
+  c->savedchar='\0';
+  c->err=NULL;
+  c->http11=0;
+  c->keepalive=0;
+  c->streambody=0;
+  c->bodylen=0;
+  c->bodychunked=0;
+  c->bodyexpect=0;
+  c->encoding=ENCODING_NONE;
+}
+
+// drop a served request from the buffer, keeping pipelined input after it
+
+static void consume_request(struct conn_data *c) {
+  if (c->qend>=0) c->buf[c->qend]=c->savedchar;
+  if (c->reqlen<c->used) memmove(c->buf,c->buf+c->reqlen,c->used-c->reqlen);
+  c->used-=c->reqlen;
+  reset_request(c);
+}
+
+/* 
+  Give a complete request to the threadpool: to the write queue if 
+  it changes data, otherwise to the read queue. A full queue answers
+  503 at once.
+*/
+
+static void queue_conn(struct conn_data *c) {
+  struct common_data *common=c->loop->common;
+  common_task_t *task;
+  int write;
+
+  if (c->err!=NULL) write=0;
+  else if (c->binary) write=is_write_frame(c->buf,c->reqlen);
+  else write=(c->qpos>=0 && is_write_query(c->buf+c->qpos));
+  c->state=CONN_QUEUED;
+  pthread_mutex_lock(&(common->mutex));
+  if (common->shutdown) {
+    pthread_mutex_unlock(&(common->mutex));
+    close_conn(c);
+    return;
+  }
+  if ((write ? common->wcount : common->count)==common->queue_size) {
+    common->global->stats.rejected++;
+    pthread_mutex_unlock(&(common->mutex));
+    reject_conn(c);
+    return;
+  }
+  if (write) {
+    task=&(common->wqueue[common->wtail]);
+    common->wtail+=1;
+    common->wtail=(common->wtail==common->queue_size) ? 0 : common->wtail;
+    common->wcount+=1;
+  } else {
+    task=&(common->queue[common->tail]);
+    common->tail+=1;
+    common->tail=(common->tail==common->queue_size) ? 0 : common->tail;
+    common->count+=1;
+  }
+  task->conn=c->fd;
+  task->cdata=c;
+  task->queued=now_usec();
+  common->global->stats.readqueue=common->count;
+  common->global->stats.writequeue=common->wcount;
+  if (pthread_cond_signal(&(common->cond)) != 0)
+    warnprint(COND_SIGNAL_FAIL_WARN,NULL);
+  pthread_mutex_unlock(&(common->mutex));
+}
+
+/*
+  Answer 503 to a request which is not served and close the connection:
+  a binary connection gets an error frame. Called from an event loop
+  for a full queue and from a worker for an expired task, so nothing
+  waits for a slow client. Unread input is drained first, as in
+  reject_socket, so that closing does not reset the connection
+  before the answer is read.
+*/
+
+static void reject_conn(struct conn_data *c) {
+  char buf[HTTP_HEADER_SIZE+HTTP_ERR_BUFSIZE];
+  char *res;
+  int i, n;
+
+  for(i=0; i<16 && recv(c->fd,buf,sizeof(buf),MSG_DONTWAIT)>0; i++);
+  if (c->binary) {
+    res=reject_frame(c->buf,c->reqlen,OVERLOAD_ERR,&n);
+    if (res!=NULL) {
+      send(c->fd,res,n,MSG_DONTWAIT|MSG_NOSIGNAL);
+      free(res);
+    }
+  } else {
+    n=overload_response(buf,sizeof(buf));
+    send(c->fd,buf,n,MSG_DONTWAIT|MSG_NOSIGNAL);
+  }
+  shutdown(c->fd,SHUT_WR);
+  close_conn(c);
+}
+
+/*
+  Run in a worker thread: compute and write the response.
+  Pipelined requests already in the buffer are served in order
+  before the connection is given back to the event loop.
+*/
+
+static void serve_conn(struct conn_data *c, thread_data_p tdata) {
+  char header[HTTP_HEADER_SIZE];
+  char *res, *nbuf;
+  struct body_src body;
+  int len, ok, need, unread=0;
+
+  for(;;) {
+    c->nreqs++;
+    tdata->conn=c->fd;
+    tdata->ip=c->ip;
+    tdata->port=c->port;
+    tdata->method=c->method;
+    tdata->inbuf=NULL; // query is in the connection buffer
+    tdata->intype=c->intype;
+    tdata->encoding=tdata->global->compress_level ? c->encoding : ENCODING_NONE;
+    tdata->nonblock=1;
+    tdata->keepalive=c->keepalive;
+    tdata->stream=c->http11;
+    tdata->streamed=0;
+    tdata->body=NULL;
+    if (c->streambody && c->err==NULL) {
+      // room for reading the body after the headers: the query 
+      // in the headers must not move while it is processed
+      need=c->hdrlen+IMPORT_READ_SIZE+1;
+      if (need>c->bufsize) {
+        nbuf=realloc(c->buf,need);
+        if (nbuf==NULL) {
+          close_conn(c);
+          return;
+        }
+        c->buf=nbuf;
+        c->bufsize=need;
+      }
+      body.buf=c->buf;
+      body.base=body.pos=c->hdrlen;
+      body.used=c->used;
+      body.size=c->bufsize-1;
+      body.chunked=c->bodychunked;
+      body.left=c->bodylen;
+      body.state=c->bodychunked ? BODY_CHUNK_SIZE : BODY_DATA;
+      body.fill=fill_conn;
+      body.ctx=c;
+      tdata->body=&body;
+      // the client may wait for a go-ahead before sending the body
+      if (c->bodyexpect &&
+          write_conn(c->fd,CONTINUE_RESPONSE,strlen(CONTINUE_RESPONSE),0)<0) {
+        close_conn(c);
+        return;
+      }
+    }
+    if (c->err!=NULL) {
+      res=make_http_errstr(c->err,NULL);
+    } else if (c->qpos<0 || c->buf[c->qpos]=='\0') {
+      res=make_http_errstr(HTTP_NOQUERY_ERR,NULL);
+    } else if (!(tdata->common->shutdown)) {
+      res=process_query(c->buf+c->qpos,tdata);
+    } else {
+      close_conn(c);
+      return;
+    }
+    if (tdata->body!=NULL) {
+      // the next request follows the body, if the body was read to the end
+      if (body.state!=BODY_DONE) {
+        c->keepalive=0;
+        unread=1;
+      }
+      c->used=body.used;
+      c->reqlen=body.pos;
+      tdata->body=NULL;
+    }
+    if (tdata->streamed) {
+      // result already sent in chunks
+      ok=(tdata->streamed==2) ? 0 : -1;
+      len=CLOSE_CHECK_THRESHOLD;
+      tdata->streamed=0;
+      if (res!=NULL) free(res);
+    } else {
+      res=response_body(tdata,res,&len);
+      write_header(header,c->keepalive);
+      write_header_clen(header,len);
+      if (tdata->encoded) write_header_encoding(header,tdata->encoding);
+      ok=write_conn(c->fd,header,strlen(header),len>0);
+      if (ok>=0 && len>0) ok=write_conn(c->fd,res,len,0);
+      if (res!=NULL) free(res);
+    }
+    tdata->encoded=0;
+    if (ok<0) {
+      close_conn(c);
+      return;
+    }
+    if (!(c->keepalive)) break;
+    consume_request(c);
+    if (!parse_request(c)) {
+      // wait for the next request in the event loop
+      pthread_mutex_lock(&(c->loop->mutex));
+      c->state=CONN_READING;
+      c->deadline=time(NULL)+(c->used ? READ_TIMEOUT_SECONDS : KEEPALIVE_TIMEOUT_SECONDS);
+      pthread_mutex_unlock(&(c->loop->mutex));
+      if (rearm_conn(c,EPOLLIN)<0) close_conn(c);
+      return;
+    }
+  }
+  if (shutdown(c->fd,SHUT_WR)<0 || (len<CLOSE_CHECK_THRESHOLD && !unread)) {
+    close_conn(c);
+    return;
+  }
+  // long response or unread data: let the loop wait for the client to close first
+  pthread_mutex_lock(&(c->loop->mutex));
+  c->state=CONN_CLOSING;
+  c->deadline=time(NULL)+WRITE_TIMEOUT_SECONDS;
+  pthread_mutex_unlock(&(c->loop->mutex));
+  if (rearm_conn(c,EPOLLIN)<0) close_conn(c);
+}
+
+/*
+  Run in a worker thread for a binary connection: answer all the
+  complete frames in the buffer, then give the connection back to
+  the event loop. A frame with a bad length prefix closes the
+  connection, since the following frames cannot be found.
+*/
+
+static void serve_frames(struct conn_data *c, thread_data_p tdata) {
+  char *res;
+  int len, ok;
+
+  for(;;) {
+    c->nreqs++;
+    if (c->err!=NULL || tdata->common->shutdown) {
+      close_conn(c);
+      return;
+    }
+    tdata->conn=c->fd;
+    tdata->ip=c->ip;
+    tdata->port=c->port;
+    tdata->nonblock=1;
+    tdata->keepalive=1;
+    tdata->stream=0;
+    tdata->streamed=0;
+    res=process_frame(c->buf,c->reqlen,tdata,&len);
+    // with pipelined frames waiting the responses are sent together
+    if (res==NULL) ok=-1;
+    else ok=write_conn(c->fd,res,len,c->used>c->reqlen);
+    if (res!=NULL) free(res);
+    if (ok<0) {
+      close_conn(c);
+      return;
+    }
+    consume_request(c);
+    if (!parse_request(c)) {
+      pthread_mutex_lock(&(c->loop->mutex));
+      c->state=CONN_READING;
+      c->deadline=time(NULL)+(c->used ? READ_TIMEOUT_SECONDS : KEEPALIVE_TIMEOUT_SECONDS);
+      pthread_mutex_unlock(&(c->loop->mutex));
+      if (rearm_conn(c,EPOLLIN)<0) close_conn(c);
+      return;
+    }
+  }
+}
+
+/*
+  Reads raw body data for op=import from a non-blocking socket, 
+  waiting at most READ_TIMEOUT_SECONDS for some data to arrive.
+  Returns the nr of bytes read, 0 at eof, -1 on error.
+*/
+
+static int fill_conn(struct body_src *src, char *buf, int n) {
+  struct conn_data *c=(struct conn_data *)(src->ctx);
+  struct pollfd pfd;
+  int r;
+
+  for(;;) {
+    r=recv(c->fd,buf,n,0);
+    if (r>=0) return r;
+    if (errno==EINTR) continue;
+    if (errno!=EAGAIN && errno!=EWOULDBLOCK) return -1;
+    pfd.fd=c->fd;
+    pfd.events=POLLIN;
+    if (poll(&pfd,1,READ_TIMEOUT_SECONDS*1000)<=0) return -1;
+  }
+}
+
+static int rearm_conn(struct conn_data *c, unsigned int events) {
+  struct epoll_event ev;
+
+  memset(&ev,0,sizeof(ev));
+  ev.events=events|EPOLLONESHOT;
+  ev.data.ptr=c;
+  return epoll_ctl(c->loop->epfd,EPOLL_CTL_MOD,c->fd,&ev);
+}
+
+/*
+  Writes n bytes to a non-blocking socket, waiting for it to become
+  writable at most WRITE_TIMEOUT_SECONDS at a time.
+  Set more if more data follows immediately.
+  Returns 0 on success, -1 on error.
+*/
+
+static int write_conn(int fd, char *buf, int n, int more) {
+  struct pollfd pfd;
+  int w;
+
+  while(n>0) {
+    w=send(fd,buf,n,MSG_NOSIGNAL|(more ? MSG_MORE : 0));
+    if (w>0) {
+      buf+=w;
+      n-=w;
+    } else if (w<0 && errno==EINTR) {
+      continue;
+    } else if (w<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+      pfd.fd=fd;
+      pfd.events=POLLOUT;
+      if (poll(&pfd,1,WRITE_TIMEOUT_SECONDS*1000)<=0) return -1;
+    } else {
+      warnprint(WRITEN_ERROR,NULL);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void unlink_conn(struct conn_data *c) {
+  if (c->prev!=NULL) c->prev->next=c->next;
+  else c->loop->head=c->next;
+  if (c->next!=NULL) c->next->prev=c->prev;
+}
+
+static void free_conn(struct conn_data *c) {
+  if (close(c->fd)<0)
+    warnprint("Cannot close connection: %s\n", strerror(errno));
+  free(c->buf);
+  free(c);
+  __sync_sub_and_fetch(&conn_count,1);
+}
+
+static void close_conn(struct conn_data *c) {
+  pthread_mutex_lock(&(c->loop->mutex));
+  unlink_conn(c);
+  pthread_mutex_unlock(&(c->loop->mutex));
+  free_conn(c);
+}
+
+// close connections past their deadline: queued ones belong to workers
+
+static void sweep_conns(struct event_loop *loop, time_t now) {
+  struct conn_data *c, *next, *expired=NULL;
+
+  pthread_mutex_lock(&(loop->mutex));
+  for(c=loop->head; c!=NULL; c=next) {
+    next=c->next;
+    if (c->state!=CONN_QUEUED && c->deadline<now) {
+      unlink_conn(c);
+      c->next=expired;
+      expired=c;
+    }
+  }
+  pthread_mutex_unlock(&(loop->mutex));
+  for(c=expired; c!=NULL; c=next) {
+    next=c->next;
+    free_conn(c);
+  }
+}
+
+#endif
+
 // testing with curl:
 // curl 'http://127.0.0.1:8080' -d 'op=query'
 // curl -F password=@/etc/passwd www.mypasswords.com
 // -d --data-urlencode
 
 /*
-  Reads posted data and returns the malloced query or NULL in case of error.
-
-  Sets tdata->inbuf to malloced buffer and tdata->intype to numeric value
-  corresponding to the content-type found.
+  Reads the header lines after the request line up to and including
+  the empty line. Returns 0 if ok, -1 in case of error.
 
 */
 
-
-static char* get_post_data(int connsd,char* buf,void* ssl,thread_data_p tdata) {
-  char *buffer, *tp;
-  int j,k,chk,nread;
-  int len=0,type=CONTENT_TYPE_UNKNOWN;
-  int ctypelen,clenlen;
+static int read_headers(int connsd,void* ssl,struct http_headers *hdrs) {
+  int j,k;
   char bufp[MAXLINE]; // for reading one line at a time
   
-  //printf("get_post_data called\n");
-  clenlen=strlen("Content-Length:");
-  ctypelen=strlen("Content-Type:");
+  hdrs->clen=0;
+  hdrs->ctype=CONTENT_TYPE_UNKNOWN;
+  hdrs->connection=CONNECTION_DEFAULT;
+  hdrs->chunked=0;
+  hdrs->expect=0;
+  hdrs->encoding=ENCODING_NONE;
   // start reading line by line until empty line is hit
   for(j=0;j<MAXLINES;j++) {
     k=readlineb(connsd,bufp,MAXLINE,ssl);
-    if (k<0) { warnprint(READING_FAILED_WARN,NULL); return NULL; }
+    if (k<=0) { warnprint(READING_FAILED_WARN,NULL); return -1; }
     //printf("line %d:%s",j,bufp);
-    // content length handling
-    chk=strncmp(bufp,"Content-Length:",clenlen);
-    if (chk) chk=strncmp(bufp,"content-length:",clenlen);
-    if (!chk) {  tp=bufp+clenlen; len=atoi(tp); }
-    // content type handling
-    chk=strncmp(bufp,"Content-Type:",ctypelen);
-    if (chk) chk=strncmp(bufp,"content-type:",ctypelen);
-    if (!chk) {
-      tp=bufp+ctypelen;
-      if (strstr(tp,"application/x-www-form-urlencoded")!=NULL)
-        type=CONTENT_TYPE_URLENCODED;
-      else if (strstr(tp,"application/json")!=NULL)
-        type=CONTENT_TYPE_JSON;
-    }      
     // empty line handling
-    if (!strncmp(bufp,"\r\n",2) || !strncmp(bufp,"\n",1)) {
-      break;
-    }
-  }
-  // here all the headers have been read and parsed
-  if (j>=MAXLINES) return NULL; // empty line never found
-  //printf("len %d type %d\n",len,type);
-  if (len<=0) {
-    warnprint(CONTENT_LENGTH_MISSING_WARN,NULL);
-    return NULL;
+    if (!strncmp(bufp,"\r\n",2) || !strncmp(bufp,"\n",1)) return 0;
+    parse_header_line(bufp,hdrs);
   }
-  if (len>=MAX_MALLOC) {
-    warnprint(CONTENT_LENGTH_BIG_WARN,NULL);
-    return NULL;
+  return -1; // empty line never found
+}
+
+/*
+  Recognizes a single header line: content length and type,
+  connection and transfer encoding are stored in hdrs.
+
+*/
+
+static void parse_header_line(char* line, struct http_headers *hdrs) {
+  char *tp;
+
+  if (!strncasecmp(line,"Content-Length:",15)) {
+    hdrs->clen=atoi(line+15);
+  } else if (!strncasecmp(line,"Content-Type:",13)) {
+    tp=line+13;
+    if (strstr(tp,"application/x-www-form-urlencoded")!=NULL)
+      hdrs->ctype=CONTENT_TYPE_URLENCODED;
+    else if (strstr(tp,"application/json")!=NULL)
+      hdrs->ctype=CONTENT_TYPE_JSON;
+    else if (strstr(tp,"ndjson")!=NULL)
+      hdrs->ctype=CONTENT_TYPE_NDJSON;
+    else if (strstr(tp,"text/csv")!=NULL)
+      hdrs->ctype=CONTENT_TYPE_CSV;
+  } else if (!strncasecmp(line,"Connection:",11)) {
+    for(tp=line+11; *tp==' ' || *tp=='\t'; tp++);
+    if (!strncasecmp(tp,"close",5)) hdrs->connection=CONNECTION_CLOSE;
+    else if (!strncasecmp(tp,"keep-alive",10)) hdrs->connection=CONNECTION_KEEPALIVE;
+  } else if (!strncasecmp(line,"Transfer-Encoding:",18)) {
+    if (strstr(line+18,"chunked")!=NULL) hdrs->chunked=1;
+  } else if (!strncasecmp(line,"Expect:",7)) {
+    if (strstr(line+7,"100-continue")!=NULL) hdrs->expect=1;
+  } else if (!strncasecmp(line,"Accept-Encoding:",16)) {
+#ifdef USE_ZLIB
+    hdrs->encoding=accept_encoding(line+16);
+#endif
   }
-  buffer=malloc(len+10); // add some just in case
-  if (!buffer) {
-    warnprint(CONTENT_LENGTH_BIG_WARN,NULL);
-    return NULL;
+}
+
+#ifdef USE_ZLIB
+
+/*
+  Chooses the response encoding from the list of Accept-Encoding:
+  gzip is preferred to deflate and codings with q=0 are refused.
+
+*/
+
+static int accept_encoding(char* s) {
+  int gzip=0, deflate=0;
+  int *found;
+  char *p, *q;
+
+  while (*s!='\0') {
+    while (*s==' ' || *s=='\t' || *s==',') s++;
+    found=NULL;
+    if (!strncasecmp(s,"gzip",4)) found=&gzip;
+    else if (!strncasecmp(s,"deflate",7)) found=&deflate;
+    // end of the coding with its parameters
+    for(p=s; *p!='\0' && *p!=','; p++);
+    if (found!=NULL) {
+      for(q=s; q<p && *q!=';'; q++);
+      for(; q<p && *q!='='; q++);
+      *found=(q>=p || atof(q+1)>0);
+    }
+    s=p;
   }
-  // start reading the whole data
-  nread=readn(connsd, buffer, len, ssl);
-  if (nread<len) {
-    free(buffer);
-    warnprint(READING_FAILED_WARN,NULL);
-    return NULL;
+  if (gzip) return ENCODING_GZIP;
+  if (deflate) return ENCODING_DEFLATE;
+  return ENCODING_NONE;
+}
+
+#endif
+
+/*
+  Decides if the connection stays open after the response:
+  http/1.1 is persistent by default, http/1.0 only if asked for.
+
+*/
+
+static int keep_alive(char* version, int connection) {
+  if (connection==CONNECTION_CLOSE) return 0;
+  if (connection==CONNECTION_KEEPALIVE) return 1;
+  return !strncmp(version,"HTTP/1.1",8);
+}
+
+/*
+  Reads posted data after the headers and returns the malloced query 
+  or NULL in case of error.
+
+  Sets tdata->inbuf to malloced buffer and tdata->intype to numeric value
+  corresponding to the content-type found.
+
+*/
+
+static char* get_post_data(int connsd,void* ssl,thread_data_p tdata,struct http_headers *hdrs) {
+  char *buffer;
+  int nread;
+  int len=hdrs->clen;
+  
+  //printf("len %d type %d\n",len,type);
+  if (hdrs->chunked) {
+    buffer=read_chunked_body(connsd,ssl);
+    if (buffer==NULL) return NULL;
+  } else {
+    if (len<=0) {
+      warnprint(CONTENT_LENGTH_MISSING_WARN,NULL);
+      return NULL;
+    }
+    if (len>=MAX_MALLOC) {
+      warnprint(CONTENT_LENGTH_BIG_WARN,NULL);
+      return NULL;
+    }
+    buffer=malloc(len+10); // add some just in case
+    if (!buffer) {
+      warnprint(CONTENT_LENGTH_BIG_WARN,NULL);
+      return NULL;
+    }
+    // start reading the whole data
+    nread=readn(connsd, buffer, len, ssl);
+    if (nread<len) {
+      free(buffer);
+      warnprint(READING_FAILED_WARN,NULL);
+      return NULL;
+    }
+    buffer[len]='\0';
   }
   tdata->inbuf=buffer;
-  tdata->intype=type;
+  tdata->intype=hdrs->ctype;
   //printf("query:\n%s\n",buffer);
   return buffer;
 }
 
-void write_header(char* buf) {
+/*
+  Reads a body with chunked transfer encoding: chunk size lines
+  in hex, chunks, a zero size line and optional trailers.
+  Returns the malloced and 0-terminated data or NULL in case of error.
+
+*/
+
+static char* read_chunked_body(int connsd,void* ssl) {
+  char *buffer=NULL, *nbuf, *tp;
+  char bufp[MAXLINE];
+  long n;
+  int j,len=0;
+
+  for(;;) {
+    if (readlineb(connsd,bufp,MAXLINE,ssl)<=0) goto fail;
+    if (!isxdigit((unsigned char)bufp[0])) goto fail;
+    n=strtol(bufp,&tp,16);
+    if (n<0 || n>=MAX_MALLOC-len) goto fail;
+    if (n==0) break;
+    nbuf=realloc(buffer,len+n+10);
+    if (nbuf==NULL) goto fail;
+    buffer=nbuf;
+    if (readn(connsd,buffer+len,n,ssl)<n) goto fail;
+    len+=n;
+    // line end after the chunk
+    if (readlineb(connsd,bufp,MAXLINE,ssl)<=0) goto fail;
+  }
+  // trailers up to the empty line
+  for(j=0;j<MAXLINES;j++) {
+    if (readlineb(connsd,bufp,MAXLINE,ssl)<=0) goto fail;
+    if (!strncmp(bufp,"\r\n",2) || !strncmp(bufp,"\n",1)) break;
+  }
+  if (j>=MAXLINES) goto fail;
+  if (buffer==NULL && (buffer=malloc(1))==NULL) goto fail;
+  buffer[len]='\0';
+  return buffer;
+
+fail:
+  warnprint(CHUNKED_BODY_WARN,NULL);
+  if (buffer!=NULL) free(buffer);
+  return NULL;
+}
+
+/*
+  Reads up to n bytes of the posted body for op=import into out,
+  decoding chunked transfer encoding. 
+
+  Returns the nr of bytes read, 0 at the end of the body or -1 if
+  reading fails or the body is malformed.
+*/
+
+int body_read(struct body_src *src, char *out, int n) {
+  char *line, *nl;
+  long size;
+  int k;
+
+  for(;;) {
+    if (src->state==BODY_DONE) return 0;
+    if (src->state==BODY_DATA) {
+      if (!(src->left)) {
+        src->state=src->chunked ? BODY_CHUNK_END : BODY_DONE;
+        continue;
+      }
+      if (src->pos==src->used && body_more(src)<=0) return -1;
+      k=src->used-src->pos;
+      if (k>n) k=n;
+      if (k>src->left) k=src->left;
+      memcpy(out,src->buf+src->pos,k);
+      src->pos+=k;
+      src->left-=k;
+      return k;
+    }
+    // chunk size, chunk end and trailer lines
+    line=src->buf+src->pos;
+    nl=memchr(line,'\n',src->used-src->pos);
+    if (nl==NULL) {
+      if (body_more(src)<=0) return -1;
+      continue;
+    }
+    src->pos=(nl+1)-src->buf;
+    if (src->state==BODY_CHUNK_SIZE) {
+      if (!isxdigit((unsigned char)line[0])) return -1;
+      size=strtol(line,NULL,16);
+      if (size<0) return -1;
+      src->left=size;
+      src->state=size ? BODY_DATA : BODY_TRAILER;
+    } else if (nl==line || (nl==line+1 && line[0]=='\r')) {
+      // empty line ends the chunk or the trailers
+      src->state=(src->state==BODY_CHUNK_END) ? BODY_CHUNK_SIZE : BODY_DONE;
+    } else if (src->state==BODY_CHUNK_END) {
+      return -1;
+    }
+  }
+}
+
+// read more raw body data after the unread part: returns the nr of bytes read
+
+static int body_more(struct body_src *src) {
+  int k;
+
+  if (src->fill==NULL) return 0;
+  if (src->pos>src->base) {
+    memmove(src->buf+src->base,src->buf+src->pos,src->used-src->pos);
+    src->used-=src->pos-src->base;
+    src->pos=src->base;
+  }
+  if (src->used>=src->size) return -1; // line too long
+  k=(src->fill)(src,src->buf+src->used,src->size-src->used);
+  if (k>0) src->used+=k;
+  return k;
+}
+
+void write_header(char* buf, int keepalive) {
   char *h1;
 
-  h1=HEADER_TEMPLATE;
+  h1=keepalive ? KEEPALIVE_HEADER_TEMPLATE : HEADER_TEMPLATE;
   strcpy(buf,h1);
 }
 
+// replace the content length line with chunked transfer encoding
+
+void write_header_chunked(char* buf) {
+  char *p, *q;
+
+  p=strstr(buf,"Content-Length:");
+  q=strchr(p,'\n')+1;
+  memmove(p+strlen(CHUNKED_ENCODING),q,strlen(q)+1);
+  memcpy(p,CHUNKED_ENCODING,strlen(CHUNKED_ENCODING));
+}
+
+// add the content encoding lines of a compressed response before the content type
+
+void write_header_encoding(char* buf, int encoding) {
+  char *p, *e;
+
+  e=(encoding==ENCODING_GZIP) ? GZIP_ENCODING : DEFLATE_ENCODING;
+  p=strstr(buf,"Content-Type:");
+  memmove(p+strlen(e),p,strlen(p)+1);
+  memcpy(p,e,strlen(e));
+}
+
+/*
+  Gives the body of a whole response and its length in len:
+  compressed if the client accepts it and it is big enough.
+
+*/
+
+static char* response_body(thread_data_p tdata, char* res, int* len) {
+  if (res==NULL) {
+    *len=0;
+    return NULL;
+  }
+  res=encode_result(tdata,res,tdata->encoded ? tdata->reslen : strlen(res));
+  *len=tdata->reslen;
+  return res;
+}
+
+/*
+  Compresses a whole response of len bytes if the client accepts a
+  compressed response and the response is not smaller than
+  compress_min_size. Returns the response to send: either res or a new
+  buffer replacing it, with the length in tdata->reslen. A response
+  which is compressed already (tdata->encoded) is returned as it is.
+
+*/
+
+char* encode_result(thread_data_p tdata, char* res, int len) {
+#ifdef USE_ZLIB
+  z_stream *z;
+  char *out;
+  uLong size;
+#endif
+
+  if (tdata->encoded) return res;
+  tdata->reslen=len;
+#ifdef USE_ZLIB
+  if (!(tdata->encoding) || len<tdata->global->compress_min) return res;
+  z=zstream_reset(tdata);
+  if (z==NULL) return res;
+  size=deflateBound(z,len);
+  out=malloc(size);
+  if (out==NULL) return res;
+  z->next_in=(Bytef *)res;
+  z->avail_in=len;
+  z->next_out=(Bytef *)out;
+  z->avail_out=size;
+  if (deflate(z,Z_FINISH)!=Z_STREAM_END) {
+    free(out);
+    return res;
+  }
+  free(res);
+  tdata->encoded=1;
+  tdata->reslen=size-z->avail_out;
+  return out;
+#else
+  return res;
+#endif
+}
+
+/*
+  Sends the result printed so far into tdata->buf as a chunk of a
+  chunked response and empties the buffer. The header is sent before
+  the first chunk. If final is set, the response is finished.
+
+  Returns 1 if ok, 0 if sending fails: then the connection must be closed.
+*/
+
+int stream_flush(thread_data_p tdata, int final) {
+  char header[HTTP_HEADER_SIZE];
+  int len;
+
+  len=tdata->bufptr-tdata->buf;
+  if (!(tdata->streamed)) {
+    write_header(header,tdata->keepalive);
+    write_header_chunked(header);
+#ifdef USE_ZLIB
+    // the whole stream is compressed if the first part is big enough
+    if (tdata->encoding && len>=tdata->global->compress_min && zstream_reset(tdata)!=NULL) {
+      tdata->encoded=1;
+      write_header_encoding(header,tdata->encoding);
+    }
+#endif
+    if (stream_write(tdata,header,strlen(header),1)<0) return 0;
+    tdata->streamed=1;
+  }
+#ifdef USE_ZLIB
+  if (tdata->encoded) {
+    if (!stream_deflate(tdata,tdata->buf,len,final)) return 0;
+  } else
+#endif
+  if (len>0 && !stream_chunk(tdata,tdata->buf,len,!final)) return 0;
+  tdata->bufptr=tdata->buf;
+  if (final) {
+    if (stream_write(tdata,"0\r\n\r\n",5,0)<0) return 0;
+    tdata->streamed=2;
+  }
+  return 1;
+}
+
+/*
+  Sends n bytes as a single chunk, keeping a copy for the result cache
+  if the result is being cached: the copy is what was sent.
+
+*/
+
+static int stream_chunk(thread_data_p tdata, char* buf, int n, int more) {
+  char sizeline[20];
+  int k;
+
+  if (tdata->rkeylen) rcache_capture(tdata,buf,n);
+  k=snprintf(sizeline,sizeof(sizeline),"%x\r\n",n);
+  if (stream_write(tdata,sizeline,k,1)<0 ||
+      stream_write(tdata,buf,n,1)<0 ||
+      stream_write(tdata,"\r\n",2,more)<0) return 0;
+  return 1;
+}
+
+#ifdef USE_ZLIB
+
+/*
+  Compresses n bytes of buf into the compressed stream of the response
+  and sends the output as chunks as soon as zlib gives it. If final is
+  set, the compressed stream is finished.
+
+*/
+
+static int stream_deflate(thread_data_p tdata, char* buf, int n, int final) {
+  z_stream *z=(z_stream *)(tdata->zstream);
+  char out[STREAM_CHUNK_SIZE];
+  int r, len;
+
+  z->next_in=(Bytef *)buf;
+  z->avail_in=n;
+  do {
+    z->next_out=(Bytef *)out;
+    z->avail_out=sizeof(out);
+    r=deflate(z,final ? Z_FINISH : Z_NO_FLUSH);
+    if (r==Z_STREAM_ERROR) return 0;
+    len=sizeof(out)-z->avail_out;
+    if (len>0 && !stream_chunk(tdata,out,len,1)) return 0;
+  } while (z->avail_out==0 || (final && r!=Z_STREAM_END));
+  return 1;
+}
+
+/*
+  Gives the zlib stream of the thread ready for a new response in
+  tdata->encoding, or NULL if zlib fails. The stream is kept for the
+  next responses of the thread and only reset between them.
+
+*/
+
+static z_stream* zstream_reset(thread_data_p tdata) {
+  z_stream *z=(z_stream *)(tdata->zstream);
+
+  if (z!=NULL) {
+    if (tdata->zencoding==tdata->encoding && deflateReset(z)==Z_OK) return z;
+    deflateEnd(z);
+  } else {
+    z=(z_stream *)malloc(sizeof(z_stream));
+    if (z==NULL) return NULL;
+    tdata->zstream=z;
+  }
+  z->zalloc=Z_NULL;
+  z->zfree=Z_NULL;
+  z->opaque=Z_NULL;
+  // window bits 15 give the zlib format used by deflate, +16 gzip
+  if (deflateInit2(z,tdata->global->compress_level,Z_DEFLATED,
+                   tdata->encoding==ENCODING_GZIP ? 31 : 15,8,Z_DEFAULT_STRATEGY)!=Z_OK) {
+    free(z);
+    tdata->zstream=NULL;
+    tdata->zencoding=ENCODING_NONE;
+    return NULL;
+  }
+  tdata->zencoding=tdata->encoding;
+  return z;
+}
+
+#endif
+
+static int stream_write(thread_data_p tdata, char* buf, int n, int more) {
+#if EVENTLOOP
+  if (tdata->nonblock) return write_conn(tdata->conn,buf,n,more);
+#endif
+#ifdef USE_OPENSSL
+  return writen(tdata->conn,buf,n,tdata->ssl);
+#else
+  return writen(tdata->conn,buf,n,NULL);
+#endif
+}
+
 void write_header_clen(char* buf, int clen) {
   char* p;
   int n;
@@ -123,6 +123,41 @@ int parse_query(char* query, int ql, char* params[], char* values[]) {
   return count;
 }    
 
+/* checks without changing the query if it has op=import: the data for
+   import is then posted as the body and the query is in the url
+*/
+
+int is_import_query(char* query) {
+  char* p;
+
+  for(p=query; p!=NULL; p=strchr(p,'&')) {
+    if (*p=='&') p++;
+    if (!strncmp(p,"op=import",9) && (p[9]=='&' || p[9]=='\0')) return 1;
+  }
+  return 0;
+}
+
+/* checks without changing the query if its op changes the data: these
+   are queued separately from the reads by the server
+*/
+
+int is_write_query(char* query) {
+  static char* ops[]={"insert","update","delete","create","drop","import",NULL};
+  char* p;
+  int i,l;
+
+  for(p=query; p!=NULL; p=strchr(p,'&')) {
+    if (*p=='&') p++;
+    if (strncmp(p,"op=",3)) continue;
+    for(i=0;ops[i]!=NULL;i++) {
+      l=strlen(ops[i]);
+      if (!strncmp(p+3,ops[i],l) && (p[3+l]=='&' || p[3+l]=='\0')) return 1;
+    }
+    return 0;
+  }
+  return 0;
+}
+
 /* urldecode used by query parser 
 */
 
@@ -771,6 +806,14 @@ int add_conf_key_val(dserve_conf_p conf, char* key, char* val) {
   else if (!strcmp(key,CONF_READ_TOKENS)) return add_slval(&(conf->read_tokens),val);
   else if (!strcmp(key,CONF_KEY_FILE)) return add_slval(&(conf->key_file),val);
   else if (!strcmp(key,CONF_CERT_FILE)) return add_slval(&(conf->cert_file),val);
+  else if (!strcmp(key,CONF_BINARY_PORT)) return add_slval(&(conf->binary_port),val);
+  else if (!strcmp(key,CONF_RESULT_CACHE_SIZE)) return add_slval(&(conf->result_cache_size),val);
+  else if (!strcmp(key,CONF_COMPRESS_LEVEL)) return add_slval(&(conf->compress_level),val);
+  else if (!strcmp(key,CONF_COMPRESS_MIN_SIZE)) return add_slval(&(conf->compress_min_size),val);
+  else if (!strcmp(key,CONF_THREADS)) return add_slval(&(conf->threads),val);
+  else if (!strcmp(key,CONF_QUEUE_SIZE)) return add_slval(&(conf->queue_size),val);
+  else if (!strcmp(key,CONF_WRITE_THREADS)) return add_slval(&(conf->write_threads),val);
+  else if (!strcmp(key,CONF_QUEUE_TIMEOUT)) return add_slval(&(conf->queue_timeout),val);
   else {errprint(CONF_VAL_ERR,key); return -1;}       
 }
 
@@ -814,6 +857,14 @@ void print_conf(dserve_conf_p conf) {
   print_conf_slval(&(conf->read_tokens),CONF_READ_TOKENS);
   print_conf_slval(&(conf->key_file),CONF_KEY_FILE);
   print_conf_slval(&(conf->cert_file),CONF_CERT_FILE);
+  print_conf_slval(&(conf->binary_port),CONF_BINARY_PORT);
+  print_conf_slval(&(conf->result_cache_size),CONF_RESULT_CACHE_SIZE);
+  print_conf_slval(&(conf->compress_level),CONF_COMPRESS_LEVEL);
+  print_conf_slval(&(conf->compress_min_size),CONF_COMPRESS_MIN_SIZE);
+  print_conf_slval(&(conf->threads),CONF_THREADS);
+  print_conf_slval(&(conf->queue_size),CONF_QUEUE_SIZE);
+  print_conf_slval(&(conf->write_threads),CONF_WRITE_THREADS);
+  print_conf_slval(&(conf->queue_timeout),CONF_QUEUE_TIMEOUT);
 }
 
 void print_conf_slval(struct sized_strlst *lst, char* key) {
@@ -1144,6 +1195,7 @@ void clear_detach_final(int signal) {
   
   for(i=0;(i < globalptr->maxthreads) && (i<1000); i++) {
     //printf("detaching thread %d database\n",i);
+    op_clear_db_cache(&(globalptr->threads_data[i]));
     if (globalptr->threads_data[i].db!=NULL) {
       wg_detach_database(globalptr->threads_data[i].db);
       globalptr->threads_data[i].db=NULL;
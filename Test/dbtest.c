@@ -66,6 +66,9 @@ extern "C" {
 #include "../Db/dbquery.h"
 #include "../Db/dbcompare.h"
 #include "../Db/dblog.h"
+#include "../Db/dblock.h"
+#include "../Db/dbdump.h"
+#include "../Db/dbcdc.h"
 #include "../Db/dbschema.h"
 #include "../Db/dbjson.h"
 #include "dbtest.h"
@@ -88,17 +91,31 @@ static gint wg_check_datatype_writeread(void* db, int printlevel);
 static gint wg_check_backlinking(void* db, int printlevel);
 static gint wg_check_parse_encode(void* db, int printlevel);
 static gint wg_check_compare(void* db, int printlevel);
+static gint wg_check_tinystr(void* db, int printlevel);
 static gint wg_check_query_param(void* db, int printlevel);
 static gint wg_check_strhash(void* db, int printlevel);
+static gint wg_check_strhash_growth(void* db, int printlevel);
 static gint wg_test_index1(void *db, int magnitude, int printlevel);
 static gint wg_test_index2(void *db, int printlevel);
 static gint wg_test_index3(void *db, int magnitude, int printlevel);
+static gint wg_test_index4(void *db, int magnitude, int printlevel);
+static gint wg_test_index5(void *db, int magnitude, int printlevel);
 static gint wg_check_childdb(void* db, int printlevel);
 static gint wg_check_schema(void* db, int printlevel);
 static gint wg_check_json_parsing(void* db, int printlevel);
 static gint wg_check_idxhash(void* db, int printlevel);
 static gint wg_test_query(void *db, int magnitude, int printlevel);
 static gint wg_check_log(void* db, int printlevel);
+static gint wg_check_checkpoint(void* db, int printlevel);
+static gint wg_check_replica(void* db, int printlevel);
+static gint wg_check_snapshot(void* db, int printlevel);
+static gint wg_check_delta_dump(void* db, int printlevel);
+static gint wg_check_chunked_dump(void* db, int printlevel);
+static gint wg_check_mapped_dump(void* db, int printlevel);
+static gint wg_check_transaction(void* db, int printlevel);
+static gint wg_check_atomic(void* db, int printlevel);
+static gint wg_check_cdc(void* db, int printlevel);
+static gint wg_check_epoch(void* db, int printlevel);
 
 static void wg_show_db_area_header(void* db, void* area_header);
 static void wg_show_bucket_freeobjects(void* db, gint freelist);
@@ -121,6 +138,9 @@ static int validate_index(void *db, void *rec, int rows, int column,
   int printlevel);
 static int validate_mc_index(void *db, void *rec, size_t rows, gint index_id,
   gint *columns, size_t col_count, int printlevel);
+static int validate_bnode(void *db, gint offset, gint column, gint level,
+  int printlevel);
+static int validate_btree_index(void *db, int column, int printlevel);
 #ifdef USE_CHILD_DB
 static int childdb_mkindex(void *db, int cnt);
 static int childdb_ckindex(void *db, int cnt, int printlevel);
@@ -160,6 +180,7 @@ int wg_run_tests(int tests, int printlevel) {
     if (OK_TO_CONTINUE(tmp)) tmp=wg_check_parse_encode(db,printlevel);
     if (OK_TO_CONTINUE(tmp)) tmp=wg_check_backlinking(db,printlevel);
     if (OK_TO_CONTINUE(tmp)) tmp=wg_check_compare(db,printlevel);
+    if (OK_TO_CONTINUE(tmp)) tmp=wg_check_tinystr(db,printlevel);
     if (OK_TO_CONTINUE(tmp)) tmp=wg_check_query_param(db,printlevel);
     if (OK_TO_CONTINUE(tmp)) tmp=wg_check_db(db);
     if (OK_TO_CONTINUE(tmp)) tmp=wg_check_strhash(db,printlevel);
@@ -176,6 +197,55 @@ int wg_run_tests(int tests, int printlevel) {
       wg_delete_local_database(db);
     }
 
+    if (OK_TO_CONTINUE(tmp)) {
+      db = wg_attach_local_database(800000);
+      tmp=wg_check_transaction(db,printlevel);
+      if (OK_TO_CONTINUE(tmp)) tmp=wg_check_atomic(db,printlevel);
+      wg_delete_local_database(db);
+    }
+
+    if (OK_TO_CONTINUE(tmp)) {
+      db = wg_attach_local_database(800000);
+      tmp=wg_check_cdc(db,printlevel);
+      wg_delete_local_database(db);
+    }
+
+    if (OK_TO_CONTINUE(tmp)) {
+      db = wg_attach_local_database(800000);
+      tmp=wg_check_epoch(db,printlevel);
+      wg_delete_local_database(db);
+    }
+
+    if (OK_TO_CONTINUE(tmp)) {
+      db = wg_attach_local_database(800000);
+      tmp=wg_check_strhash_growth(db,printlevel);
+      wg_delete_local_database(db);
+    }
+
+    if (OK_TO_CONTINUE(tmp)) {
+      db = wg_attach_local_database(800000);
+      tmp=wg_check_snapshot(db,printlevel);
+      wg_delete_local_database(db);
+    }
+
+    if (OK_TO_CONTINUE(tmp)) {
+      db = wg_attach_local_database(800000);
+      tmp=wg_check_delta_dump(db,printlevel);
+      wg_delete_local_database(db);
+    }
+
+    if (OK_TO_CONTINUE(tmp)) {
+      db = wg_attach_local_database(4000000);
+      tmp=wg_check_chunked_dump(db,printlevel);
+      wg_delete_local_database(db);
+    }
+
+    if (OK_TO_CONTINUE(tmp)) {
+      db = wg_attach_local_database(800000);
+      tmp=wg_check_mapped_dump(db,printlevel);
+      wg_delete_local_database(db);
+    }
+
     if (OK_TO_CONTINUE(tmp)) {
       printf("\n***** Quick tests passed ******\n");
     } else {
@@ -195,6 +265,18 @@ int wg_run_tests(int tests, int printlevel) {
       wg_delete_local_database(db);
     }
 
+    if(OK_TO_CONTINUE(tmp)) {
+      db = wg_attach_local_database(20000000);
+      tmp = wg_test_index4(db, 50, printlevel);
+      wg_delete_local_database(db);
+    }
+
+    if(OK_TO_CONTINUE(tmp)) {
+      db = wg_attach_local_database(20000000);
+      tmp = wg_test_index5(db, 50, printlevel);
+      wg_delete_local_database(db);
+    }
+
     if (!OK_TO_CONTINUE(tmp)) {
       printf("\n***** Index test failed ******\n");
       return tmp;
@@ -220,6 +302,16 @@ int wg_run_tests(int tests, int printlevel) {
     db = wg_attach_local_database(800000);
     tmp = wg_check_log(db, printlevel);
     wg_delete_local_database(db);
+    if(tmp == 0) {
+      db = wg_attach_local_database(800000);
+      tmp = wg_check_checkpoint(db, printlevel);
+      wg_delete_local_database(db);
+    }
+    if(tmp == 0) {
+      db = wg_attach_local_database(800000);
+      tmp = wg_check_replica(db, printlevel);
+      wg_delete_local_database(db);
+    }
 
     if (!OK_TO_CONTINUE(tmp)) {
       printf("\n***** Log test failed ******\n");
@@ -1490,7 +1582,7 @@ static gint wg_check_parse_encode(void* db, int printlevel) {
 
 static gint wg_check_compare(void* db, int printlevel) {
   int i, j;
-  gint testdata[28];
+  gint testdata[28], keydata[13];
   void *rec1, *rec2, *rec3;
 
   testdata[0] = wg_encode_null(db, 0);
@@ -1594,6 +1686,50 @@ static gint wg_check_compare(void* db, int printlevel) {
           return 1;
         }
       }
+
+      /* key prefixes may tie, but must not contradict the order */
+      if(wg_compare_key(db, testdata[i]) > wg_compare_key(db, testdata[j])) {
+        if(printlevel) {
+          printf("value1: ");
+          wg_debug_print_value(db, testdata[i]);
+          printf(" value2: ");
+          wg_debug_print_value(db, testdata[j]);
+          printf("\nkey of value1 should not be greater than value2\n");
+        }
+        return 1;
+      }
+    }
+  }
+
+  /* Key prefixes of values that differ near the ends of the range */
+  keydata[0] = wg_encode_int(db, -((gint) 1 << (sizeof(gint)*8 - 3)));
+  keydata[1] = wg_encode_int(db, -1);
+  keydata[2] = wg_encode_int(db, 0);
+  keydata[3] = wg_encode_int(db, ((gint) 1 << (sizeof(gint)*8 - 3)));
+  keydata[4] = wg_encode_double(db, -1.0e300);
+  keydata[5] = wg_encode_double(db, -1.5);
+  keydata[6] = wg_encode_double(db, -0.0);
+  keydata[7] = wg_encode_double(db, 0.0);
+  keydata[8] = wg_encode_double(db, 1.0e-300);
+  keydata[9] = wg_encode_double(db, 2.5);
+  keydata[10] = wg_encode_str(db, "long string prefix 1", NULL);
+  keydata[11] = wg_encode_str(db, "long string prefix 2", NULL);
+  keydata[12] = wg_encode_str(db, "long\377", NULL);
+
+  for(i=0; i<12; i++) {
+    gint cr = WG_COMPARE(db, keydata[i], keydata[i+1]);
+    wg_uint ka = wg_compare_key(db, keydata[i]);
+    wg_uint kb = wg_compare_key(db, keydata[i+1]);
+    if(ka > kb || (ka < kb && cr != WG_LESSTHAN) ||\
+      (cr == WG_EQUAL && ka != kb)) {
+      if(printlevel) {
+        printf("value1: ");
+        wg_debug_print_value(db, keydata[i]);
+        printf(" value2: ");
+        wg_debug_print_value(db, keydata[i+1]);
+        printf("\nkey prefixes are not ordered like the values\n");
+      }
+      return 1;
     }
   }
 
@@ -1602,6 +1738,152 @@ static gint wg_check_compare(void* db, int printlevel) {
   return 0;
 }
 
+/* ------------------------ test tiny strings ------------------------------*/
+
+static gint wg_check_tinystr(void* db, int printlevel) {
+  char *strdata[] = { "", "EE", "LV", "SKU-0", "abcdefg", "abcdefgh", NULL };
+  gint enc[6], freelist, encp, index_id, list;
+  char buf[100], *dec, *dec2;
+  void *rec[20];
+  int i, j, p=printlevel;
+
+  if(p>1)
+    printf("********* testing tiny strings ************\n");
+
+  /* strings that fit the encoded value must not use the shortstr area */
+  freelist = dbmemsegh(db)->shortstr_area_header.freelist;
+  for(i=0; strdata[i]; i++) {
+    int len = strlen(strdata[i]);
+    enc[i] = wg_encode_str(db, strdata[i], NULL);
+    if(istinystr(enc[i]) != fits_tinystr(len)) {
+      if(p)
+        printf("check_tinystr: \"%s\" encoded %s a tiny string\n",
+          strdata[i], (fits_tinystr(len) ? "as not" : "as"));
+      return 1;
+    }
+    if(fits_tinystr(len) &&
+      dbmemsegh(db)->shortstr_area_header.freelist != freelist) {
+      if(p)
+        printf("check_tinystr: \"%s\" was allocated\n", strdata[i]);
+      return 1;
+    }
+    if(wg_get_encoded_type(db, enc[i]) != WG_STRTYPE ||\
+      wg_decode_str_len(db, enc[i]) != len ||\
+      wg_decode_str_lang(db, enc[i]) != NULL ||\
+      strcmp(wg_decode_str(db, enc[i]), strdata[i])) {
+      if(p)
+        printf("check_tinystr: \"%s\" decoded incorrectly\n", strdata[i]);
+      return 1;
+    }
+    if(wg_decode_str_copy(db, enc[i], buf, 100) != len ||\
+      strcmp(buf, strdata[i])) {
+      if(p)
+        printf("check_tinystr: \"%s\" copied incorrectly\n", strdata[i]);
+      return 1;
+    }
+  }
+  if(wg_encode_str(db, "EE", NULL) != enc[1]) {
+    if(p)
+      printf("check_tinystr: equal strings had different encoding\n");
+    return 1;
+  }
+
+  /* decoded values of the tiny strings stay valid for a while */
+  dec = wg_decode_str(db, enc[1]);
+  dec2 = wg_decode_str(db, enc[2]);
+  if(dec == dec2 || strcmp(dec, "EE") || strcmp(dec2, "LV")) {
+    if(p)
+      printf("check_tinystr: decoding overwrote an earlier value\n");
+    return 1;
+  }
+
+  /* the handle keeps a limited number of them, the rest are reused */
+  for(i=0; i<40000; i++) {
+    buf[0] = (char) (1 + i%255);
+    buf[1] = (char) (1 + i/255);
+    buf[2] = 0;
+    dec2 = wg_decode_str(db, wg_encode_str(db, buf, NULL));
+    if(!dec2 || strcmp(dec2, buf)) {
+      if(p)
+        printf("check_tinystr: string %d decoded incorrectly\n", i);
+      return 1;
+    }
+  }
+  if(strcmp(dec, "EE")) {
+    if(p)
+      printf("check_tinystr: decoding overwrote a kept value\n");
+    return 1;
+  }
+
+  /* ordering is the same as with strcmp() */
+  for(i=0; strdata[i]; i++) {
+    for(j=0; strdata[j]; j++) {
+      int cmp = strcmp(strdata[i], strdata[j]);
+      gint expected = (cmp < 0 ? WG_LESSTHAN :\
+        (cmp > 0 ? WG_GREATER : WG_EQUAL));
+      if(WG_COMPARE(db, enc[i], enc[j]) != expected) {
+        if(p)
+          printf("check_tinystr: \"%s\" and \"%s\" compared incorrectly\n",
+            strdata[i], strdata[j]);
+        return 1;
+      }
+    }
+  }
+
+  /* the lang of a string may be tiny */
+  encp = wg_encode_str(db, "a string with a lang", "et");
+  dec = wg_decode_str_lang(db, encp);
+  if(!dec || strcmp(dec, "et") || wg_decode_str_lang_len(db, encp) != 2) {
+    if(p)
+      printf("check_tinystr: lang of a string decoded incorrectly\n");
+    return 1;
+  }
+
+  /* hash index lookup with a tiny query parameter */
+  for(i=0; i<20; i++) {
+    rec[i] = wg_create_record(db, 2);
+    wg_set_field(db, rec[i], 0, wg_encode_int(db, i));
+    wg_set_field(db, rec[i], 1, enc[i%4]);
+  }
+  if(wg_create_index(db, 1, WG_INDEX_TYPE_HASH, NULL, 0) ||\
+    (index_id = wg_column_to_index_id(db, 1, WG_INDEX_TYPE_HASH,
+    NULL, 0)) == -1) {
+    if(p)
+      printf("check_tinystr: failed to create the hash index\n");
+    return 1;
+  }
+  encp = wg_encode_query_param_str(db, "EE", NULL);
+  if(!istinystr(encp)) {
+    if(p)
+      printf("check_tinystr: query parameter was not a tiny string\n");
+    return 1;
+  }
+  list = wg_search_hash(db, index_id, &encp, 1);
+  for(i=0; list; i++) {
+    gcell *cell = (gcell *) offsettoptr(db, list);
+    if(wg_get_field(db, offsettoptr(db, cell->car), 1) != enc[1]) {
+      if(p)
+        printf("check_tinystr: hash index returned a wrong record\n");
+      return 1;
+    }
+    list = cell->cdr;
+  }
+  wg_free_query_param(db, encp);
+  wg_drop_index(db, index_id);
+  if(i != 5) {
+    if(p)
+      printf("check_tinystr: hash index found %d records, expected 5\n", i);
+    return 1;
+  }
+  for(i=0; i<20; i++) {
+    wg_delete_record(db, rec[i]);
+  }
+
+  if(p>1)
+    printf("********* check_tinystr: no errors ************\n");
+  return 0;
+}
+
 /* -------------------- test query parameter encoding --------------------*/
 
 static gint wg_check_query_param(void* db, int printlevel) {
@@ -1843,11 +2125,10 @@ static gint wg_check_query_param(void* db, int printlevel) {
       wg_free_query_param(db, encp);
       return 1;
     }
-    tmp = decode_shortstr_offset(encp);
-    if(tmp > 0 && tmp < dbmemsegh(db)->free) {
+    if(!istinystr(encp)) {
       if(printlevel) {
         printf("check_query_param: encoded empty string parameter (%d) "\
-          "had an invalid offset\n",
+          "had bad encoding (should be encoded as tinystr)\n",
           (int) encp);
       }
       wg_free_query_param(db, encp);
@@ -2301,22 +2582,96 @@ static gint wg_check_strhash(void* db, int printlevel) {
 }
 
 
+/**
+ * Test growing the strhash array. The strings must stay interned
+ * while the chains are moved to the new array.
+ */
+static gint wg_check_strhash_growth(void* db, int printlevel) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  int p=printlevel;
+  int i, count;
+  char buf[100];
+  char* lang;
+  gint initial, lock, enc;
+  void* rec;
+
+  if (p>1) printf("********* testing strhash growth ********** \n");
+
+  initial=(dbh->strhash_area_header).arraylength;
+  count=(int) dbh->strhash_growth.limit+initial/4;
+  rec=wg_create_record(db,count);
+  if (!rec) {
+    if (p) printf("check_strhash_growth: record creation failed\n");
+    return 1;
+  }
+  for (i=0;i<count;i++) {
+    snprintf(buf,100,"strhash growth %d 0123456789abcdef",i);
+    lang=(i%3 ? NULL : "en");
+    enc=wg_encode_str(db,buf,lang);
+    if (enc==WG_ILLEGAL || wg_set_field(db,rec,i,enc)) {
+      if (p) printf("check_strhash_growth: failed to store string %d\n",i);
+      return 1;
+    }
+  }
+  if ((dbh->strhash_area_header).arraylength<=initial ||\
+    dbh->strhash_growth.count!=count) {
+    if (p) printf("check_strhash_growth: strhash array did not grow\n");
+    return 1;
+  }
+  for (i=0;i<count;i++) {
+    snprintf(buf,100,"strhash growth %d 0123456789abcdef",i);
+    lang=(i%3 ? NULL : "en");
+    if (!longstr_in_hash(db,buf,lang,WG_STRTYPE,strlen(buf)+1) ||\
+      wg_encode_str(db,buf,lang)!=wg_get_field(db,rec,i)) {
+      if (p) printf("check_strhash_growth: string %d lost from strhash\n",i);
+      return 1;
+    }
+  }
+
+  /* strings of an aborted transaction are removed */
+  lock=wg_start_write(db);
+  if (!lock) {
+    if (p) printf("check_strhash_growth: failed to get write lock\n");
+    return 1;
+  }
+  for (i=0;i<100;i++) {
+    snprintf(buf,100,"strhash rollback %d 0123456789abcdef",i);
+    wg_set_field(db,rec,i,wg_encode_str(db,buf,NULL));
+  }
+  wg_abort_write(db,lock);
+  for (i=0;i<100;i++) {
+    snprintf(buf,100,"strhash rollback %d 0123456789abcdef",i);
+    if (longstr_in_hash(db,buf,NULL,WG_STRTYPE,strlen(buf)+1)) {
+      if (p) printf("check_strhash_growth: rolled back string in strhash\n");
+      return 1;
+    }
+  }
+  if (dbh->strhash_growth.count!=count) {
+    if (p) printf("check_strhash_growth: wrong string count after rollback\n");
+    return 1;
+  }
+
+  for (i=0;i<count;i++)
+    wg_set_field(db,rec,i,wg_encode_null(db,0));
+  if (dbh->strhash_growth.count!=0 || dbh->strhash_growth.oldstart) {
+    if (p) printf("check_strhash_growth: strings left in strhash\n");
+    return 1;
+  }
+
+  if (p>1) printf("********* strhash growth ok ********** \n");
+  return 0;
+}
+
 
 static gint longstr_in_hash(void* db, char* data, char* extrastr, gint type, gint length) {
-  db_memsegment_header* dbh = dbmemsegh(db);
   gint old=0;
-  int hash;
-  gint hasharrel;
+  wg_uint hash;
 
   if (0) {
   } else {
     // find hash, check if exists
     hash=wg_hash_typedstr(db,data,extrastr,type,length);
-    //hasharrel=((gint*)(offsettoptr(db,((db->strhash_area_header).arraystart))))[hash];
-    hasharrel=dbfetch(db,((dbh->strhash_area_header).arraystart)+(sizeof(gint)*hash));
-    //printf("hash %d ((dbh->strhash_area_header).arraystart)+(sizeof(gint)*hash) %d hasharrel %d\n",
-    //       hash,((dbh->strhash_area_header).arraystart)+(sizeof(gint)*hash), hasharrel);
-    if (hasharrel) old=wg_find_strhash_bucket(db,data,extrastr,type,length,hasharrel);
+    old=wg_find_strhash_bucket(db,data,extrastr,type,length,hash);
     //printf("old %d \n",old);
     if (old) {
       //printf("str found in hash\n");
@@ -2345,6 +2700,10 @@ static void wg_show_strhash(void* db) {
   printf("offset %d\n", (int) (dbh->strhash_area_header).offset);
   printf("arraystart %d\n", (int) (dbh->strhash_area_header).arraystart);
   printf("arraylength %d\n", (int) (dbh->strhash_area_header).arraylength);
+  printf("strings %d\n", (int) dbh->strhash_growth.count);
+  if (dbh->strhash_growth.oldstart)
+    printf("moving from old array, %d of %d elements moved\n",
+      (int) dbh->strhash_growth.moved, (int) dbh->strhash_growth.oldlength);
   printf("nonempty hash buckets:\n");
   for(i=0;i<(dbh->strhash_area_header).arraylength;i++) {
     hashchain=dbfetch(db,(dbh->strhash_area_header).arraystart+(sizeof(gint)*i));
@@ -3161,74 +3520,285 @@ static gint wg_test_index3(void *db, int magnitude, int printlevel) {
   return 0;
 }
 
-
-/** Validate a T-tree index
- *  1. validates a set of rows starting from *rec.
- *  2. checks tree balance
- *  3. checks tree min/max values
- *  returns 0 if no errors found
- *  returns -1 if value was not indexed
- *  returns -2 if there was another error
+/** Test T-tree index with mixed types and long strings
+ *  The strings share their first bytes, so that the key prefixes
+ *  in the T-tree nodes tie and the values need to be compared.
  */
-static int validate_index(void *db, void *rec, int rows, int column,
-  int printlevel) {
-  gint index_id = wg_column_to_index_id(db, column,
-    WG_INDEX_TYPE_TTREE, NULL, 0);
-  gint tnode_offset;
-  wg_index_header *hdr;
+static gint wg_test_index4(void *db, int magnitude, int printlevel) {
+  const int dbsize = 20*magnitude, rand_updates = 10;
+  int i, j;
+  void *start = NULL, *rec = NULL;
+  char strbuf[40];
+  long int rnd;
+  gint enc;
 
-  if(index_id == -1)
-    return -2;
+#ifdef _WIN32
+  srand(7265398);
+#else
+  srandom(7265398);
+#endif
 
-  /* Check if all values are indexed */
-  while(rec && rows) {
-    if(wg_get_record_len(db, rec) > column) {
-      gint val = wg_get_field(db, rec, column);
-      if(wg_search_ttree_index(db, index_id, val) < 1) {
-        if(printlevel) {
-          printf("missing: %d\n", (int) val);
-        }
+  if(wg_create_index(db, 0, WG_INDEX_TYPE_TTREE, NULL, 0)) {
+    if(printlevel)
+      fprintf(stderr, "index creation failed, aborting.\n");
+    return -3;
+  }
+
+  for(j=0; j<=rand_updates; j++) {
+    for(i=0; i<dbsize; i++) {
+      if(!j) {
+        rec = wg_create_record(db, 1);
+        if(!i)
+          start = rec;
+      } else {
+        rec = (i ? wg_get_next_record(db, rec) : start);
+      }
+#ifdef _WIN32
+      rnd = rand();
+#else
+      rnd = random();
+#endif
+      switch(rnd % 4) {
+        case 0:
+          snprintf(strbuf, 40, "shared prefix %ld", (rnd >> 2) % 500);
+          enc = wg_encode_str(db, strbuf, NULL);
+          break;
+        case 1:
+          snprintf(strbuf, 40, "%ld", (rnd >> 2) % 500);
+          enc = wg_encode_str(db, strbuf, NULL);
+          break;
+        case 2:
+          enc = wg_encode_double(db, ((rnd >> 2) % 1000 - 500) / 8.0);
+          break;
+        default:
+          enc = wg_encode_int(db, (rnd >> 2) % 1000 - 500);
+          break;
+      }
+      if(wg_set_field(db, rec, 0, enc)) {
+        if(printlevel)
+          fprintf(stderr, "insert error, aborting.\n");
         return -1;
       }
     }
-    rec = wg_get_next_record(db, rec);
-    rows--;
+    if(validate_index(db, start, dbsize, 0, printlevel)) {
+      if(printlevel)
+        fprintf(stderr, "index validation failed, loop %d.\n", j);
+      return -2;
+    }
   }
 
-  hdr = (wg_index_header *) offsettoptr(db, index_id);
+  if(printlevel > 1)
+    printf("------- mixed type index test: no errors found --------\n");
+  return 0;
+}
 
-  if(((struct wg_tnode *)(offsettoptr(db,
-    TTREE_ROOT_NODE(hdr))))->parent_offset != 0) {
-    if(printlevel)
-      printf("root node parent offset is not 0\n");
-    return -2;
-  }
-#ifdef TTREE_CHAINED_NODES
-  if(TTREE_MIN_NODE(hdr) == 0) {
-    if(printlevel)
-      printf("min node offset is 0\n");
-    return -2;
-  }
-  if(TTREE_MAX_NODE(hdr) == 0) {
-    if(printlevel)
-      printf("max node offset is 0\n");
-    return -2;
-  }
-#endif
+/** Test B+tree index
+ *  Random updates with mixed types and duplicate values, range
+ *  queries against a full scan and deleting the records, so that
+ *  the nodes are split, emptied and freed.
+ */
+static gint wg_test_index5(void *db, int magnitude, int printlevel) {
+  const int dbsize = 40*magnitude, rand_updates = 6;
+  int i, j;
+  void *start = NULL, *rec = NULL;
+  char strbuf[40];
+  long int rnd;
+  gint enc;
 
-#ifdef TTREE_CHAINED_NODES
-  tnode_offset = TTREE_MIN_NODE(hdr);
+#ifdef _WIN32
+  srand(1290833);
 #else
-  tnode_offset = wg_ttree_find_lub_node(db, TTREE_ROOT_NODE(hdr));
+  srandom(1290833);
 #endif
-  while(tnode_offset) {
-    int diff;
-    gint minval, maxval;
-    struct wg_tnode *node = (struct wg_tnode *) offsettoptr(db, tnode_offset);
 
-    /* Check index tree balance */
-    diff = node->left_subtree_height - node->right_subtree_height;
-    if(diff < -1 || diff > 1)
+  if(wg_create_index(db, 0, WG_INDEX_TYPE_BTREE, NULL, 0)) {
+    if(printlevel)
+      fprintf(stderr, "index creation failed, aborting.\n");
+    return -3;
+  }
+
+  for(j=0; j<=rand_updates; j++) {
+    for(i=0; i<dbsize; i++) {
+      if(!j) {
+        rec = wg_create_record(db, 2);
+        if(!i)
+          start = rec;
+      } else {
+        rec = (i ? wg_get_next_record(db, rec) : start);
+      }
+#ifdef _WIN32
+      rnd = rand();
+#else
+      rnd = random();
+#endif
+      switch(rnd % 3) {
+        case 0:
+          snprintf(strbuf, 40, "shared prefix %ld", (rnd >> 2) % 50);
+          enc = wg_encode_str(db, strbuf, NULL);
+          break;
+        case 1:
+          enc = wg_encode_double(db, ((rnd >> 2) % 100 - 50) / 8.0);
+          break;
+        default:
+          enc = wg_encode_int(db, (rnd >> 2) % 100 - 50);
+          break;
+      }
+      if(wg_set_field(db, rec, 0, enc) ||\
+        wg_set_field(db, rec, 1, wg_encode_int(db, (rnd >> 4) % 200))) {
+        if(printlevel)
+          fprintf(stderr, "insert error, aborting.\n");
+        return -1;
+      }
+    }
+    if(!j && wg_create_index(db, 1, WG_INDEX_TYPE_BTREE, NULL, 0)) {
+      if(printlevel)
+        fprintf(stderr, "index creation failed, aborting.\n");
+      return -3;
+    }
+    if(validate_btree_index(db, 0, printlevel) ||\
+      validate_btree_index(db, 1, printlevel)) {
+      if(printlevel)
+        fprintf(stderr, "index validation failed, loop %d.\n", j);
+      return -2;
+    }
+  }
+
+  /* Range queries on the integer column */
+  for(j=0; j<20; j++) {
+    wg_query *query;
+    wg_query_arg arglist[2];
+    gint lo = j * 10 - 5, hi = j * 10 + j;
+    int expected = 0, found = 0;
+
+    arglist[0].column = 1;
+    arglist[0].cond = (j & 1 ? WG_COND_GREATER : WG_COND_GTEQUAL);
+    arglist[0].value = wg_encode_query_param_int(db, lo);
+    arglist[1].column = 1;
+    arglist[1].cond = (j & 2 ? WG_COND_LESSTHAN : WG_COND_LTEQUAL);
+    arglist[1].value = wg_encode_query_param_int(db, hi);
+
+    for(rec = wg_get_first_record(db); rec; rec = wg_get_next_record(db, rec)) {
+      gint val = wg_decode_int(db, wg_get_field(db, rec, 1));
+      if((j & 1 ? val > lo : val >= lo) && (j & 2 ? val < hi : val <= hi))
+        expected++;
+    }
+    query = wg_make_query(db, NULL, 0, arglist, 2);
+    if(!query) {
+      if(printlevel)
+        fprintf(stderr, "failed to build query %d.\n", j);
+      return -2;
+    }
+    while((rec = wg_fetch(db, query)))
+      found++;
+    wg_free_query(db, query);
+    if(found != expected) {
+      if(printlevel)
+        fprintf(stderr, "query %d returned %d rows, expected %d.\n",
+          j, found, expected);
+      return -2;
+    }
+  }
+
+  /* Delete every other record and then the rest */
+  for(j=0; j<2; j++) {
+    rec = wg_get_first_record(db);
+    i = 0;
+    while(rec) {
+      void *next = wg_get_next_record(db, rec);
+      if(j || (i++ & 1)) {
+        if(wg_delete_record(db, rec)) {
+          if(printlevel)
+            fprintf(stderr, "delete error, aborting.\n");
+          return -1;
+        }
+      }
+      rec = next;
+    }
+    if(validate_btree_index(db, 0, printlevel) ||\
+      validate_btree_index(db, 1, printlevel)) {
+      if(printlevel)
+        fprintf(stderr, "index validation failed after delete %d.\n", j);
+      return -2;
+    }
+  }
+
+  if(printlevel > 1)
+    printf("------- B+tree index test: no errors found --------\n");
+  return 0;
+}
+
+
+/** Validate a T-tree index
+ *  1. validates a set of rows starting from *rec.
+ *  2. checks tree balance
+ *  3. checks tree min/max values
+ *  4. checks the key prefixes, if they are used
+ *  returns 0 if no errors found
+ *  returns -1 if value was not indexed
+ *  returns -2 if there was another error
+ */
+static int validate_index(void *db, void *rec, int rows, int column,
+  int printlevel) {
+  gint index_id = wg_column_to_index_id(db, column,
+    WG_INDEX_TYPE_TTREE, NULL, 0);
+  gint tnode_offset;
+  wg_index_header *hdr;
+#ifdef TTREE_KEY_PREFIX
+  int i;
+#endif
+
+  if(index_id == -1)
+    return -2;
+
+  /* Check if all values are indexed */
+  while(rec && rows) {
+    if(wg_get_record_len(db, rec) > column) {
+      gint val = wg_get_field(db, rec, column);
+      if(wg_search_ttree_index(db, index_id, val) < 1) {
+        if(printlevel) {
+          printf("missing: %d\n", (int) val);
+        }
+        return -1;
+      }
+    }
+    rec = wg_get_next_record(db, rec);
+    rows--;
+  }
+
+  hdr = (wg_index_header *) offsettoptr(db, index_id);
+
+  if(((struct wg_tnode *)(offsettoptr(db,
+    TTREE_ROOT_NODE(hdr))))->parent_offset != 0) {
+    if(printlevel)
+      printf("root node parent offset is not 0\n");
+    return -2;
+  }
+#ifdef TTREE_CHAINED_NODES
+  if(TTREE_MIN_NODE(hdr) == 0) {
+    if(printlevel)
+      printf("min node offset is 0\n");
+    return -2;
+  }
+  if(TTREE_MAX_NODE(hdr) == 0) {
+    if(printlevel)
+      printf("max node offset is 0\n");
+    return -2;
+  }
+#endif
+
+#ifdef TTREE_CHAINED_NODES
+  tnode_offset = TTREE_MIN_NODE(hdr);
+#else
+  tnode_offset = wg_ttree_find_lub_node(db, TTREE_ROOT_NODE(hdr));
+#endif
+  while(tnode_offset) {
+    int diff;
+    gint minval, maxval;
+    struct wg_tnode *node = (struct wg_tnode *) offsettoptr(db, tnode_offset);
+
+    /* Check index tree balance */
+    diff = node->left_subtree_height - node->right_subtree_height;
+    if(diff < -1 || diff > 1)
       return -2;
 
     /* Check min/max values */
@@ -3254,12 +3824,149 @@ static int validate_index(void *db, void *rec, int rows, int column,
       return -2;
     }
 
+#ifdef TTREE_KEY_PREFIX
+    /* Check that the key prefixes follow the values */
+    for(i=0; i<node->number_of_elements; i++) {
+      gint val = wg_get_field(db,
+        offsettoptr(db, node->array_of_values[i]), column);
+      if(node->array_of_keys[i] != wg_compare_key(db, val)) {
+        if(printlevel) {
+          printf("key prefix invalid: %d slot: %d\n",
+            (int) tnode_offset, i);
+        }
+        return -2;
+      }
+    }
+#endif
+
     tnode_offset = TNODE_SUCCESSOR(db, node);
   }
 
   return 0;
 }
 
+/** Validate the subtree of a B+tree node
+ *  returns the number of rows in the leaves of the subtree.
+ *  returns -1 if there was an error.
+ */
+static int validate_bnode(void *db, gint offset, gint column, gint level,
+  int printlevel) {
+  struct wg_bnode *node = (struct wg_bnode *) offsettoptr(db, offset);
+  int i, rows = 0;
+
+  if(node->level != level) {
+    if(printlevel)
+      printf("node %d level is %d, should be %d\n",
+        (int) offset, (int) node->level, (int) level);
+    return -1;
+  }
+  for(i=0; i<node->number_of_elements; i++) {
+    gint val = wg_get_field(db,
+      offsettoptr(db, node->array_of_rows[i]), column);
+    if(node->array_of_keys[i] != wg_compare_key(db, val)) {
+      if(printlevel)
+        printf("key prefix invalid: %d slot: %d\n", (int) offset, i);
+      return -1;
+    }
+    if(level) {
+      struct wg_bnode *child = \
+        (struct wg_bnode *) offsettoptr(db, node->array_of_children[i]);
+      int cnt;
+      if(!child->number_of_elements ||\
+        child->array_of_rows[0] != node->array_of_rows[i]) {
+        if(printlevel)
+          printf("node %d slot %d does not match the child\n",
+            (int) offset, i);
+        return -1;
+      }
+      cnt = validate_bnode(db, node->array_of_children[i], column,
+        level - 1, printlevel);
+      if(cnt < 0)
+        return -1;
+      rows += cnt;
+    }
+  }
+  return (level ? rows : node->number_of_elements);
+}
+
+/** Validate a B+tree index
+ *  1. checks that all records are indexed and the rows are in order
+ *  2. checks the leaf chain and the internal nodes
+ *  returns 0 if no errors found
+ *  returns -1 if value was not indexed
+ *  returns -2 if there was another error
+ */
+static int validate_btree_index(void *db, int column, int printlevel) {
+  gint index_id = wg_column_to_index_id(db, column,
+    WG_INDEX_TYPE_BTREE, NULL, 0);
+  wg_index_header *hdr;
+  struct wg_bnode *root, *node;
+  gint offset, prev = 0, prevval = 0;
+  int rows = 0, indexed = 0, i;
+  void *rec;
+
+  if(index_id == -1)
+    return -2;
+  hdr = (wg_index_header *) offsettoptr(db, index_id);
+
+  for(rec = wg_get_first_record(db); rec; rec = wg_get_next_record(db, rec)) {
+    if(wg_get_record_len(db, rec) > column) {
+      gint val = wg_get_field(db, rec, column);
+      gint row = wg_search_btree_index(db, index_id, val);
+      if(!row || WG_COMPARE(db, val, wg_get_field(db,
+        offsettoptr(db, row), column)) != WG_EQUAL) {
+        if(printlevel)
+          printf("missing: %d\n", (int) val);
+        return -1;
+      }
+      rows++;
+    }
+  }
+
+  root = (struct wg_bnode *) offsettoptr(db, BTREE_ROOT_NODE(hdr));
+  if(validate_bnode(db, BTREE_ROOT_NODE(hdr), column, root->level,
+    printlevel) != rows) {
+    if(printlevel)
+      printf("B+tree structure is invalid\n");
+    return -2;
+  }
+
+  /* Walk the leaves */
+  offset = BTREE_MIN_NODE(hdr);
+  while(offset) {
+    node = (struct wg_bnode *) offsettoptr(db, offset);
+    if(node->prev_offset != prev || node->level) {
+      if(printlevel)
+        printf("leaf chain invalid at %d\n", (int) offset);
+      return -2;
+    }
+    if(!node->number_of_elements && offset != BTREE_ROOT_NODE(hdr)) {
+      if(printlevel)
+        printf("empty leaf %d\n", (int) offset);
+      return -2;
+    }
+    for(i=0; i<node->number_of_elements; i++) {
+      gint val = wg_get_field(db,
+        offsettoptr(db, node->array_of_rows[i]), column);
+      if(indexed && WG_COMPARE(db, prevval, val) == WG_GREATER) {
+        if(printlevel)
+          printf("leaf %d slot %d is out of order\n", (int) offset, i);
+        return -2;
+      }
+      prevval = val;
+      indexed++;
+    }
+    prev = offset;
+    offset = node->next_offset;
+  }
+  if(prev != BTREE_MAX_NODE(hdr) || indexed != rows) {
+    if(printlevel)
+      printf("leaf chain has %d rows, should be %d\n", indexed, rows);
+    return -2;
+  }
+  return 0;
+}
+
 /** Validate a multi-column index
  *  validates a set of rows starting from *rec.
  *  uses the index_id provided (to facilitate separate testing of
@@ -3447,7 +4154,7 @@ static gint wg_check_childdb(void* db, int printlevel) {
   rec1 = (void *) wg_create_raw_record(db, 3);
   rec2 = (void *) wg_create_raw_record(db, 3);
 
-  str1 = wg_encode_str(db, "hello", NULL);
+  str1 = wg_encode_str(db, "hello there", NULL);
   wg_set_new_field(db, rec1, 0, str1);
   wg_set_new_field(db, rec1, 1, wg_encode_str(db, "world", NULL));
   wg_set_new_field(db, rec1, 2, wg_encode_double(db, 1.234));
@@ -3473,6 +4180,23 @@ static gint wg_check_childdb(void* db, int printlevel) {
     return 1;
   }
 
+#ifdef USETINYSTR
+  /* Tiny strings are inline and do not refer to the parent db */
+  tmp = wg_encode_external_data(foo, db, str2);
+  if(!istinystr(str2) || tmp != str2) {
+    if(printlevel)
+      printf("Tiny string was translated as external data\n");
+    wg_delete_local_database(foo);
+    return 1;
+  }
+  if(wg_set_new_field(foo, foorec1, 2, tmp)) {
+    if(printlevel)
+      printf("Storing a tiny string failed, should have succeeded\n");
+    wg_delete_local_database(foo);
+    return 1;
+  }
+#endif
+
   /* Test indexes */
   if(printlevel>1) {
     printf("Testing child database index.\n");
@@ -3551,7 +4275,7 @@ static gint wg_check_childdb(void* db, int printlevel) {
   foorec3 = (void *) wg_create_raw_record(foo, 3);
   foorec4 = (void *) wg_create_raw_record(foo, 3);
 
-  wg_set_new_field(foo, foorec3, 0, wg_encode_str(foo, "hello", NULL));
+  wg_set_new_field(foo, foorec3, 0, wg_encode_str(foo, "hello there", NULL));
   wg_set_new_field(foo, foorec3, 1, wg_encode_str(foo, "world", NULL));
   wg_set_new_field(foo, foorec3, 2, wg_encode_double(foo, 1.234));
 
@@ -4795,62 +5519,570 @@ static gint wg_test_query(void *db, int magnitude, int printlevel) {
   return 0;
 }
 
-/* ------------------------- log testing ------------------------ */
+/* --------------------- transaction testing -------------------- */
 
-#ifndef _WIN32
-#define LOG_TESTFILE  "/tmp/wgdb.logtest"
-#else
-#define LOG_TESTFILE  "c:\\windows\\temp\\wgdb.logtest"
-#endif
+#define TRAN_TESTSTR1 "a long string that is stored in the string hash"
+#define TRAN_TESTSTR2 "another long string, created inside a transaction"
 
-static gint wg_check_log(void* db, int printlevel) {
-#if defined(USE_DBLOG)
-  db_memsegment_header* dbh = dbmemsegh(db);
-  db_handle_logdata *ld = ((db_handle *) db)->logdata;
-  void *clonedb;
-  void *rec1, *rec2;
-  gint tmp, str1, str2;
-  char logfn[100];
-  int i, err, pid;
-  int fd;
+/**
+ * Test write transaction commit and rollback.
+ * Expects an empty database.
+ */
+static gint wg_check_transaction(void* db, int printlevel) {
+  void *rec1, *rec2, *rec3;
+  gint lock, val;
+  int p = printlevel;
 
-  if(printlevel>1) {
-    printf("********* testing journal logging ********** \n");
+  if(p>1)
+    printf("********* testing write transactions ************\n");
+
+  if(wg_create_index(db, 0, WG_INDEX_TYPE_TTREE, NULL, 0)) {
+    if(p) printf("check_transaction: index creation failed\n");
+    return 1;
   }
 
-  /* Set up the temporary log. We don't use the standard method as
-   * that might interfere with real database logs. Also, normally
-   * local databases are not logged.
-   */
-#ifndef _WIN32
-  pid = getpid();
-#else
-  pid = _getpid();
-#endif
-  snprintf(logfn, 99, "%s.%d", LOG_TESTFILE, pid);
-  logfn[99] = '\0';
-#ifdef _WIN32
-  if(_sopen_s(&fd, logfn, _O_CREAT|_O_APPEND|_O_BINARY|_O_RDWR, _SH_DENYNO,
-    _S_IREAD|_S_IWRITE)) {
-#else
-  if((fd = open(logfn, O_CREAT|O_APPEND|O_RDWR,
-    S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH)) == -1) {
-#endif
-    if(printlevel)
-      printf("Failed to open the test journal\n");
+  rec1 = wg_create_record(db, 2);
+  rec2 = wg_create_record(db, 2);
+  if(!rec1 || !rec2) {
+    if(p) printf("check_transaction: record creation failed\n");
     return 1;
   }
+  wg_set_field(db, rec1, 0, wg_encode_int(db, 1));
+  wg_set_field(db, rec1, 1, wg_encode_str(db, TRAN_TESTSTR1, NULL));
+  wg_set_field(db, rec2, 0, wg_encode_int(db, 2));
+  wg_set_field(db, rec2, 1, wg_encode_str(db, TRAN_TESTSTR1, NULL));
 
-#ifndef _WIN32
-  if(write(fd, WG_JOURNAL_MAGIC, WG_JOURNAL_MAGIC_BYTES) != \
-                                          WG_JOURNAL_MAGIC_BYTES) {
-    if(printlevel)
-      printf("Failed to initialize the test journal\n");
-    close(fd);
+  /* Modify, create and delete, then roll back */
+  lock = wg_start_write(db);
+  if(!lock) {
+    if(p) printf("check_transaction: failed to start transaction\n");
     return 1;
   }
-#else
-  if(_write(fd, WG_JOURNAL_MAGIC, WG_JOURNAL_MAGIC_BYTES) != \
+  wg_set_field(db, rec1, 0, wg_encode_int(db, 10));
+  wg_set_field(db, rec1, 1, wg_encode_str(db, TRAN_TESTSTR2, NULL));
+  rec3 = wg_create_record(db, 2);
+  if(!rec3) {
+    if(p) printf("check_transaction: record creation failed\n");
+    return 1;
+  }
+  wg_set_field(db, rec3, 0, wg_encode_int(db, 3));
+  wg_set_field(db, rec3, 1, wg_encode_str(db, TRAN_TESTSTR2, NULL));
+  if(wg_delete_record(db, rec2)) {
+    if(p) printf("check_transaction: record deletion failed\n");
+    return 1;
+  }
+  if(check_db_rows(db, 2, p)) {
+    if(p) printf("check_transaction: rows not updated inside transaction\n");
+    return 1;
+  }
+  if(!wg_abort_write(db, lock)) {
+    if(p) printf("check_transaction: rollback failed\n");
+    return 1;
+  }
+
+  if(check_db_rows(db, 2, p)) {
+    if(p) printf("check_transaction: row count not restored\n");
+    return 1;
+  }
+  val = 1;
+  if(check_matching_rows(db, 0, WG_COND_EQUAL, &val, WG_INTTYPE, 1, p)) {
+    if(p) printf("check_transaction: field value not restored\n");
+    return 1;
+  }
+  val = 2;
+  if(check_matching_rows(db, 0, WG_COND_EQUAL, &val, WG_INTTYPE, 1, p)) {
+    if(p) printf("check_transaction: deleted record not restored\n");
+    return 1;
+  }
+  val = 10;
+  if(check_matching_rows(db, 0, WG_COND_EQUAL, &val, WG_INTTYPE, 0, p)) {
+    if(p) printf("check_transaction: index not rolled back\n");
+    return 1;
+  }
+  if(strcmp(wg_decode_str(db, wg_get_field(db, rec1, 1)), TRAN_TESTSTR1)) {
+    if(p) printf("check_transaction: string field not restored\n");
+    return 1;
+  }
+  if(longstr_in_hash(db, TRAN_TESTSTR2, NULL, WG_STRTYPE,
+    strlen(TRAN_TESTSTR2)+1)) {
+    if(p) printf("check_transaction: string created in transaction "\
+      "was not freed\n");
+    return 1;
+  }
+
+  /* Same operations, committed */
+  lock = wg_start_write(db);
+  if(!lock) {
+    if(p) printf("check_transaction: failed to start transaction\n");
+    return 1;
+  }
+  wg_set_field(db, rec1, 0, wg_encode_int(db, 10));
+  wg_set_field(db, rec1, 1, wg_encode_str(db, TRAN_TESTSTR2, NULL));
+  wg_delete_record(db, rec2);
+  if(!wg_end_write(db, lock)) {
+    if(p) printf("check_transaction: commit failed\n");
+    return 1;
+  }
+
+  if(check_db_rows(db, 1, p)) {
+    if(p) printf("check_transaction: committed delete lost\n");
+    return 1;
+  }
+  val = 10;
+  if(check_matching_rows(db, 0, WG_COND_EQUAL, &val, WG_INTTYPE, 1, p)) {
+    if(p) printf("check_transaction: committed update lost\n");
+    return 1;
+  }
+  if(longstr_in_hash(db, TRAN_TESTSTR1, NULL, WG_STRTYPE,
+    strlen(TRAN_TESTSTR1)+1)) {
+    if(p) printf("check_transaction: unreferenced string was not freed\n");
+    return 1;
+  }
+  if(wg_check_db(db)) {
+    if(p) printf("check_transaction: storage inconsistent after "\
+      "transactions\n");
+    return 1;
+  }
+
+  if(p>1)
+    printf("********* write transactions ok ************\n");
+  return 0;
+}
+
+/**
+ * Test atomic field operations. Expects an index on column 0
+ * (created by wg_check_transaction()).
+ */
+static gint wg_check_atomic(void* db, int printlevel) {
+  void *rec, *rec2;
+  gint lock, prev, big;
+  double dprev;
+  int i, p = printlevel;
+
+  if(p>1)
+    printf("********* testing atomic field operations ************\n");
+
+  rec = wg_create_record(db, 3);
+  rec2 = wg_create_record(db, 4);
+  if(!rec || !rec2) {
+    if(p) printf("check_atomic: record creation failed\n");
+    return 1;
+  }
+  wg_set_field(db, rec, 0, wg_encode_int(db, 5));
+  wg_set_field(db, rec, 1, wg_encode_int(db, 1));
+  wg_set_field(db, rec, 2, wg_encode_double(db, 1.5));
+
+  /* small ints */
+  if(wg_fetch_op_int_atomic_field(db, rec, 1, WG_ATOMIC_ADD, 10, &prev) ||\
+    prev != 1 || wg_decode_int(db, wg_get_field(db, rec, 1)) != 11) {
+    if(p) printf("check_atomic: int add failed\n");
+    return 1;
+  }
+  if(wg_fetch_op_int_atomic_field(db, rec, 1, WG_ATOMIC_MIN, 3, &prev) ||\
+    prev != 11 || wg_decode_int(db, wg_get_field(db, rec, 1)) != 3) {
+    if(p) printf("check_atomic: int min failed\n");
+    return 1;
+  }
+  if(wg_fetch_op_int_atomic_field(db, rec, 1, WG_ATOMIC_MAX, 7, NULL) ||\
+    wg_decode_int(db, wg_get_field(db, rec, 1)) != 7) {
+    if(p) printf("check_atomic: int max failed\n");
+    return 1;
+  }
+
+  /* widening to a full-width int. Under a read lock, the storage
+   * is allocated in place, without locks the write lock is taken. */
+  big = ((gint) 1) << (sizeof(gint)*8 - 3);
+  lock = wg_start_read(db);
+  if(!lock) {
+    if(p) printf("check_atomic: failed to get read lock\n");
+    return 1;
+  }
+  i = wg_fetch_op_int_atomic_field(db, rec, 1, WG_ATOMIC_ADD, big, NULL);
+  wg_end_read(db, lock);
+  if(i) {
+    if(p) printf("check_atomic: widening with read lock failed\n");
+    return 1;
+  }
+  wg_set_field(db, rec2, 0, wg_encode_int(db, 1));
+  if(wg_fetch_op_int_atomic_field(db, rec2, 0, WG_ATOMIC_ADD, big, NULL) ||\
+    wg_decode_int(db, wg_get_field(db, rec2, 0)) != big + 1) {
+    if(p) printf("check_atomic: widening without lock failed\n");
+    return 1;
+  }
+  for(i=0; i<10; i++) {
+    if(wg_add_int_atomic_field(db, rec, 1, -1)) {
+      if(p) printf("check_atomic: full-width int add failed\n");
+      return 1;
+    }
+  }
+  if(wg_decode_int(db, wg_get_field(db, rec, 1)) != big - 3) {
+    if(p) printf("check_atomic: full-width int has wrong value\n");
+    return 1;
+  }
+
+  /* doubles */
+  if(wg_fetch_op_double_atomic_field(db, rec, 2, WG_ATOMIC_ADD, 2.25,
+    &dprev) || dprev != 1.5 ||\
+    wg_decode_double(db, wg_get_field(db, rec, 2)) != 3.75) {
+    if(p) printf("check_atomic: double add failed\n");
+    return 1;
+  }
+  if(wg_fetch_op_double_atomic_field(db, rec, 2, WG_ATOMIC_MAX, 10.0, NULL) ||\
+    wg_decode_double(db, wg_get_field(db, rec, 2)) != 10.0) {
+    if(p) printf("check_atomic: double max failed\n");
+    return 1;
+  }
+  if(wg_fetch_op_double_atomic_field(db, rec, 1, WG_ATOMIC_ADD, 1.0, NULL)\
+    != -11) {
+    if(p) printf("check_atomic: double op on int field did not fail\n");
+    return 1;
+  }
+
+  /* indexed field. The write lock cannot be taken under a read lock. */
+  lock = wg_start_read(db);
+  if(!lock) {
+    if(p) printf("check_atomic: failed to get read lock\n");
+    return 1;
+  }
+  i = wg_fetch_op_int_atomic_field(db, rec, 0, WG_ATOMIC_ADD, 1, NULL);
+  wg_end_read(db, lock);
+  if(i != -13) {
+    if(p) printf("check_atomic: indexed field updated under read lock\n");
+    return 1;
+  }
+  i = wg_fetch_op_int_atomic_field(db, rec, 0, WG_ATOMIC_ADD, 1, NULL);
+  prev = 6;
+  if(i || check_matching_rows(db, 0, WG_COND_EQUAL, &prev, WG_INTTYPE, 1, p)) {
+    if(p) printf("check_atomic: indexed field update failed\n");
+    return 1;
+  }
+
+  /* two adjacent fields. Pairs starting at field 1 and 2 have
+   * different alignment, so both code paths get tested. */
+  for(i=1; i<4; i++)
+    wg_set_field(db, rec2, i, wg_encode_int(db, i));
+  if(wg_update_atomic_field_pair(db, rec2, 1, wg_encode_int(db, 10),
+    wg_encode_int(db, 20), wg_encode_int(db, 1), wg_encode_int(db, 2)) ||\
+    wg_decode_int(db, wg_get_field(db, rec2, 1)) != 10 ||\
+    wg_decode_int(db, wg_get_field(db, rec2, 2)) != 20) {
+    if(p) printf("check_atomic: field pair update failed\n");
+    return 1;
+  }
+  if(wg_update_atomic_field_pair(db, rec2, 2, wg_encode_int(db, 30),
+    wg_encode_int(db, 40), wg_encode_int(db, 20), wg_encode_int(db, 3)) ||\
+    wg_decode_int(db, wg_get_field(db, rec2, 2)) != 30 ||\
+    wg_decode_int(db, wg_get_field(db, rec2, 3)) != 40) {
+    if(p) printf("check_atomic: field pair update failed\n");
+    return 1;
+  }
+  if(wg_update_atomic_field_pair(db, rec2, 2, wg_encode_int(db, 50),
+    wg_encode_int(db, 60), wg_encode_int(db, 30), wg_encode_int(db, 3))\
+    != -15 || wg_decode_int(db, wg_get_field(db, rec2, 2)) != 30 ||\
+    wg_decode_int(db, wg_get_field(db, rec2, 3)) != 40) {
+    if(p) printf("check_atomic: field pair changed with wrong values\n");
+    return 1;
+  }
+
+  if(p>1)
+    printf("********* atomic field operations ok ************\n");
+  return 0;
+}
+
+/**
+ * Test the change data capture ring.
+ */
+static gint wg_check_cdc(void* db, int printlevel) {
+  void *rec, *rec2;
+  wg_cdc_event ev[8];
+  gint sub1, sub2, lock, n;
+  int i, p = printlevel;
+
+  if(p>1)
+    printf("********* testing change data capture ************\n");
+
+  if(wg_cdc_enable(db, 40)) {
+    if(p) printf("check_cdc: failed to enable capturing\n");
+    return 1;
+  }
+  sub1 = wg_cdc_subscribe(db);
+  sub2 = wg_cdc_subscribe(db);
+  if(sub1 < 0 || sub2 < 0 || sub1 == sub2) {
+    if(p) printf("check_cdc: failed to subscribe\n");
+    return 1;
+  }
+
+  /* changes outside transactions */
+  rec = wg_create_record(db, 3);
+  rec2 = wg_create_record(db, 2);
+  if(!rec || !rec2) {
+    if(p) printf("check_cdc: record creation failed\n");
+    return 1;
+  }
+  wg_set_field(db, rec, 1, wg_encode_int(db, 5));
+  wg_set_field(db, rec, 1, wg_encode_int(db, 6));
+  n = wg_cdc_read(db, sub1, ev, 8);
+  if(n != 4 || ev[0].op != WG_CDC_CREATE ||\
+    ev[0].record != wg_encode_record(db, rec) || ev[0].column != 3 ||\
+    ev[1].op != WG_CDC_CREATE || ev[1].column != 2 ||\
+    ev[3].op != WG_CDC_SET || ev[3].record != ev[0].record ||\
+    ev[3].column != 1 || ev[3].oldval != wg_encode_int(db, 5) ||\
+    ev[3].newval != wg_encode_int(db, 6) || ev[3].seq != ev[0].seq + 3) {
+    if(p) printf("check_cdc: wrong events for direct changes\n");
+    return 1;
+  }
+  if(wg_cdc_pending(db, sub1) != 0 || wg_cdc_pending(db, sub2) != 4 ||\
+    wg_cdc_backlog(db) != 4) {
+    if(p) printf("check_cdc: wrong number of pending events\n");
+    return 1;
+  }
+
+  /* transactions */
+  lock = wg_start_write(db);
+  if(!lock) {
+    if(p) printf("check_cdc: failed to get write lock\n");
+    return 1;
+  }
+  wg_set_field(db, rec, 2, wg_encode_int(db, 7));
+  wg_delete_record(db, rec2);
+  if(wg_cdc_pending(db, sub1) != 0) {
+    if(p) printf("check_cdc: events published before commit\n");
+    return 1;
+  }
+  wg_abort_write(db, lock);
+  if(wg_cdc_pending(db, sub1) != 0) {
+    if(p) printf("check_cdc: aborted transaction was published\n");
+    return 1;
+  }
+  lock = wg_start_write(db);
+  wg_set_field(db, rec, 2, wg_encode_int(db, 8));
+  wg_delete_record(db, rec2);
+  wg_end_write(db, lock);
+  n = wg_cdc_read(db, sub1, ev, 8);
+  if(n != 2 || ev[0].op != WG_CDC_SET || ev[0].column != 2 ||\
+    ev[0].newval != wg_encode_int(db, 8) || ev[1].op != WG_CDC_DELETE ||\
+    ev[1].record != wg_encode_record(db, rec2)) {
+    if(p) printf("check_cdc: wrong events for a transaction\n");
+    return 1;
+  }
+
+  /* atomic updates without the lock cannot be captured */
+  if(wg_set_atomic_field(db, rec, 0, wg_encode_int(db, 1)) != -14) {
+    if(p) printf("check_cdc: atomic update was not refused\n");
+    return 1;
+  }
+  lock = wg_start_read(db);
+  if(wg_fetch_op_int_atomic_field(db, rec, 1, WG_ATOMIC_ADD, 1,
+    NULL) != -14) {
+    if(p) printf("check_cdc: atomic add under read lock was not refused\n");
+    return 1;
+  }
+  wg_end_read(db, lock);
+
+  /* without locks, the atomic add takes the write lock itself */
+  if(wg_fetch_op_int_atomic_field(db, rec, 1, WG_ATOMIC_ADD, 1, NULL) ||\
+    wg_decode_int(db, wg_get_field(db, rec, 1)) != 7 ||\
+    wg_cdc_read(db, sub1, ev, 8) != 1 || ev[0].op != WG_CDC_SET ||\
+    ev[0].newval != wg_encode_int(db, 7)) {
+    if(p) printf("check_cdc: atomic add was not captured\n");
+    return 1;
+  }
+
+  /* slow subscriber loses the events */
+  for(i=0; i<64; i++) {
+    wg_set_field(db, rec, 0, wg_encode_int(db, i));
+    if(wg_cdc_read(db, sub1, ev, 8) != 1) {
+      if(p) printf("check_cdc: event was not published\n");
+      return 1;
+    }
+  }
+  if(wg_cdc_backlog(db) != 71) {
+    if(p) printf("check_cdc: wrong backlog\n");
+    return 1;
+  }
+  if(wg_cdc_read(db, sub2, ev, 8) != WG_CDC_OVERFLOW ||\
+    wg_cdc_pending(db, sub2) != 0) {
+    if(p) printf("check_cdc: overflow was not detected\n");
+    return 1;
+  }
+  wg_set_field(db, rec, 0, wg_encode_int(db, 100));
+  if(wg_cdc_read(db, sub2, ev, 8) != 1 ||\
+    ev[0].newval != wg_encode_int(db, 100)) {
+    if(p) printf("check_cdc: subscriber did not recover from overflow\n");
+    return 1;
+  }
+
+  /* disabling and unsubscribing */
+  wg_cdc_unsubscribe(db, sub2);
+  if(wg_cdc_subscribe(db) != sub2) {
+    if(p) printf("check_cdc: subscriber slot was not released\n");
+    return 1;
+  }
+  wg_cdc_enable(db, 0);
+  wg_set_field(db, rec, 0, wg_encode_int(db, 101));
+  if(wg_cdc_backlog(db) != 1) {
+    if(p) printf("check_cdc: changes captured while disabled\n");
+    return 1;
+  }
+
+  if(p>1)
+    printf("********* change data capture ok ************\n");
+  return 0;
+}
+
+/**
+ * Test that the write epoch follows the data modifications.
+ */
+static gint wg_check_epoch(void* db, int printlevel) {
+  void *rec;
+  gint epoch, lock;
+  wg_int prev;
+  int p = printlevel;
+
+  if(p>1)
+    printf("********* testing write epoch ************\n");
+
+  epoch = wg_database_epoch(db);
+  rec = wg_create_record(db, 3);
+  if(!rec || wg_database_epoch(db) == epoch) {
+    if(p) printf("check_epoch: epoch not changed by record creation\n");
+    return 1;
+  }
+  epoch = wg_database_epoch(db);
+  wg_set_field(db, rec, 0, wg_encode_int(db, 1));
+  if(wg_database_epoch(db) == epoch) {
+    if(p) printf("check_epoch: epoch not changed by wg_set_field\n");
+    return 1;
+  }
+
+  /* reading does not change it */
+  epoch = wg_database_epoch(db);
+  if(wg_decode_int(db, wg_get_field(db, rec, 0)) != 1 ||\
+    wg_find_record_int(db, 0, WG_COND_EQUAL, 1, NULL) != rec ||\
+    wg_database_epoch(db) != epoch) {
+    if(p) printf("check_epoch: epoch changed by reading\n");
+    return 1;
+  }
+
+  /* lock-free updates */
+  if(wg_set_atomic_field(db, rec, 1, wg_encode_int(db, 5)) ||\
+    wg_database_epoch(db) == epoch) {
+    if(p) printf("check_epoch: epoch not changed by an atomic update\n");
+    return 1;
+  }
+  epoch = wg_database_epoch(db);
+  if(wg_fetch_op_int_atomic_field(db, rec, 1, WG_ATOMIC_MAX, 2, &prev) ||\
+    prev != 5 || wg_database_epoch(db) != epoch) {
+    if(p) printf("check_epoch: epoch changed by an atomic no-op\n");
+    return 1;
+  }
+
+  /* committed changes */
+  lock = wg_start_write(db);
+  if(!lock) {
+    if(p) printf("check_epoch: failed to get write lock\n");
+    return 1;
+  }
+  wg_set_field(db, rec, 2, wg_encode_int(db, 6));
+  wg_set_field(db, rec, 2, wg_encode_int(db, 8));
+  wg_end_write(db, lock);
+  if(wg_database_epoch(db) == epoch) {
+    if(p) printf("check_epoch: epoch not changed by a commit\n");
+    return 1;
+  }
+  epoch = wg_database_epoch(db);
+  lock = wg_start_write(db);
+  if(!lock) {
+    if(p) printf("check_epoch: failed to get write lock\n");
+    return 1;
+  }
+  wg_end_write(db, lock);
+  if(wg_database_epoch(db) != epoch) {
+    if(p) printf("check_epoch: epoch changed by an empty transaction\n");
+    return 1;
+  }
+
+  /* rolled back changes */
+  lock = wg_start_write(db);
+  if(!lock) {
+    if(p) printf("check_epoch: failed to get write lock\n");
+    return 1;
+  }
+  wg_set_field(db, rec, 2, wg_encode_int(db, 7));
+  epoch = wg_database_epoch(db);
+  wg_abort_write(db, lock);
+  if(wg_decode_int(db, wg_get_field(db, rec, 2)) != 8 || wg_database_epoch(db) == epoch) {
+    if(p) printf("check_epoch: epoch not changed by a rollback\n");
+    return 1;
+  }
+
+  epoch = wg_database_epoch(db);
+  if(wg_delete_record(db, rec) || wg_database_epoch(db) == epoch) {
+    if(p) printf("check_epoch: epoch not changed by record deletion\n");
+    return 1;
+  }
+
+  if(p>1)
+    printf("********* write epoch ok ************\n");
+  return 0;
+}
+
+/* ------------------------- log testing ------------------------ */
+
+#ifndef _WIN32
+#define LOG_TESTFILE  "/tmp/wgdb.logtest"
+#else
+#define LOG_TESTFILE  "c:\\windows\\temp\\wgdb.logtest"
+#endif
+
+static gint wg_check_log(void* db, int printlevel) {
+#if defined(USE_DBLOG)
+  db_memsegment_header* dbh = dbmemsegh(db);
+  db_handle_logdata *ld = ((db_handle *) db)->logdata;
+  void *clonedb;
+  void *rec1, *rec2;
+  gint tmp, str1, str2, str3;
+  char logfn[100];
+  int i, err, pid;
+  int fd;
+
+  err = 0;
+  if(printlevel>1) {
+    printf("********* testing journal logging ********** \n");
+  }
+
+  /* Set up the temporary log. We don't use the standard method as
+   * that might interfere with real database logs. Also, normally
+   * local databases are not logged.
+   */
+#ifndef _WIN32
+  pid = getpid();
+#else
+  pid = _getpid();
+#endif
+  snprintf(logfn, 99, "%s.%d", LOG_TESTFILE, pid);
+  logfn[99] = '\0';
+#ifdef _WIN32
+  if(_sopen_s(&fd, logfn, _O_CREAT|_O_APPEND|_O_BINARY|_O_RDWR, _SH_DENYNO,
+    _S_IREAD|_S_IWRITE)) {
+#else
+  if((fd = open(logfn, O_CREAT|O_APPEND|O_RDWR,
+    S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH)) == -1) {
+#endif
+    if(printlevel)
+      printf("Failed to open the test journal\n");
+    return 1;
+  }
+
+#ifndef _WIN32
+  if(write(fd, WG_JOURNAL_MAGIC, WG_JOURNAL_MAGIC_BYTES) != \
+                                          WG_JOURNAL_MAGIC_BYTES) {
+    if(printlevel)
+      printf("Failed to initialize the test journal\n");
+    close(fd);
+    return 1;
+  }
+#else
+  if(_write(fd, WG_JOURNAL_MAGIC, WG_JOURNAL_MAGIC_BYTES) != \
                                           WG_JOURNAL_MAGIC_BYTES) {
     if(printlevel)
       printf("Failed to initialize the test journal\n");
@@ -4863,14 +6095,22 @@ static gint wg_check_log(void* db, int printlevel) {
   ld->serial = dbh->logging.serial;
   dbh->logging.active = 1;
 
+  /* The first part of the operations is synced one by one. */
+  if(wg_log_sync_mode(db, WG_JOURNAL_SYNC_COMMIT, 0)) {
+    if(printlevel)
+      printf("Failed to set the journal sync mode\n");
+    err = 1;
+  }
+
   /* Do various operations in the database:
-   * Encode short/long strings, doubles, ints
+   * Encode tiny/short/long strings, doubles, ints
    * Create records (also with different meta bits)
    * Delete records
    * Set fields
    */
   str1 = wg_encode_str(db, "0000000001000000000200000000030000000004", NULL);
   str2 = wg_encode_str(db, "00000000010000000002", NULL);
+  str3 = wg_encode_str(db, "EE", NULL);
   tmp = wg_encode_double(db, -6543.3412);
   rec1 = wg_create_record(db, 7);
   wg_set_field(db, rec1, 4, str1);
@@ -4884,10 +6124,23 @@ static gint wg_check_log(void* db, int printlevel) {
   rec2 = wg_create_record(db, 6);
   wg_set_field(db, rec2, 1, str1);
   wg_set_field(db, rec2, 3, str2);
+  wg_set_field(db, rec2, 4, str3);
   wg_set_field(db, rec2, 5, tmp);
 
   wg_delete_record(db, rec1);
 
+  /* Rest of the operations go through the journal buffer */
+#ifdef WG_JOURNAL_BGSYNC
+  tmp = wg_log_sync_mode(db, WG_JOURNAL_SYNC_INTERVAL, 10);
+#else
+  tmp = wg_log_sync_mode(db, WG_JOURNAL_SYNC_NONE, 0);
+#endif
+  if(tmp) {
+    if(printlevel)
+      printf("Failed to set the journal sync mode\n");
+    err = 1;
+  }
+
   rec1 = wg_create_record(db, 10);
   for(i=0; i<10; i++)
     wg_set_field(db, rec1, i, wg_encode_int(db, (~((gint) 0))-i));
@@ -4895,6 +6148,13 @@ static gint wg_check_log(void* db, int printlevel) {
   rec1 = wg_create_object(db, 1, 0, 0);
   rec1 = wg_create_array(db, 4, 1, 0);
 
+  wg_log_sync_mode(db, WG_JOURNAL_SYNC_NONE, 0);
+  if(wg_log_flush(db)) {
+    if(printlevel)
+      printf("Failed to flush the journal\n");
+    err = 1;
+  }
+
 #ifndef _WIN32
   close(ld->fd);
 #else
@@ -4924,8 +6184,6 @@ static gint wg_check_log(void* db, int printlevel) {
     return 1;
   }
 
-  err = 0;
-
   /* Compare the databases */
   rec1 = wg_get_first_record(db);
   rec2 = wg_get_first_record(clonedb);
@@ -5037,6 +6295,629 @@ done:
 #endif
 }
 
+/* Add records with increasing integer values in a write transaction */
+static gint add_checkpoint_rows(void *db, int count, int *next) {
+  void *rec;
+  gint lock;
+  int i;
+
+  lock = wg_start_write(db);
+  if(!lock)
+    return 1;
+  for(i=0; i<count; i++) {
+    rec = wg_create_record(db, 1);
+    if(!rec) {
+      wg_abort_write(db, lock);
+      return 1;
+    }
+    wg_set_field(db, rec, 0, wg_encode_int(db, (*next)++));
+  }
+  return (wg_end_write(db, lock) ? 0 : 1);
+}
+
+static gint sum_checkpoint_rows(void *db) {
+  void *rec = wg_get_first_record(db);
+  gint sum = 0;
+  while(rec) {
+    sum += wg_decode_int(db, wg_get_field(db, rec, 0));
+    rec = wg_get_next_record(db, rec);
+  }
+  return sum;
+}
+
+static gint wg_check_checkpoint(void* db, int printlevel) {
+#if defined(USE_DBLOG)
+  db_memsegment_header* dbh = dbmemsegh(db);
+  char journal_fn[WG_JOURNAL_FN_BUFSIZE];
+  char chk_fn[WG_CHECKPOINT_FN_BUFSIZE];
+  void *clonedb, *rec;
+  int p = printlevel, next = 1, err = 1;
+
+  if(p>1)
+    printf("********* testing checkpoints ************\n");
+
+  /* Use a key that does not belong to any real database, so that
+   * the standard journal and checkpoint names can be tested.
+   */
+#ifndef _WIN32
+  dbh->key = -((gint) getpid());
+#else
+  dbh->key = -((gint) _getpid());
+#endif
+  wg_journal_filename(db, journal_fn, WG_JOURNAL_FN_BUFSIZE);
+  wg_checkpoint_filename(db, chk_fn, WG_CHECKPOINT_FN_BUFSIZE);
+  remove(journal_fn);
+
+  if(wg_start_logging(db)) {
+    if(p) printf("check_checkpoint: failed to start logging\n");
+    return 1;
+  }
+  if(add_checkpoint_rows(db, 5, &next)) {
+    if(p) printf("check_checkpoint: failed to add rows\n");
+    goto done;
+  }
+  if(wg_checkpoint(db)) {
+    if(p) printf("check_checkpoint: checkpoint failed\n");
+    goto done;
+  }
+  if(wg_journal_checkpoint(db, journal_fn) != 1) {
+    if(p) printf("check_checkpoint: journal not restarted at checkpoint\n");
+    goto done;
+  }
+
+  /* Crossing the limit should cause an automatic checkpoint */
+  wg_checkpoint_limit(db, 1);
+  if(add_checkpoint_rows(db, 3, &next)) {
+    if(p) printf("check_checkpoint: failed to add rows\n");
+    goto done;
+  }
+  wg_checkpoint_limit(db, 0);
+  if(wg_journal_checkpoint(db, journal_fn) != 2) {
+    if(p) printf("check_checkpoint: automatic checkpoint not taken\n");
+    goto done;
+  }
+
+  /* Entries written outside a transaction stay in the buffer. The ones
+   * added after the checkpoint should not be lost with the older ones.
+   */
+  rec = wg_create_record(db, 1);
+  if(!rec || wg_set_field(db, rec, 0, wg_encode_int(db, next++))) {
+    if(p) printf("check_checkpoint: failed to add rows\n");
+    goto done;
+  }
+  if(wg_checkpoint(db)) {
+    if(p) printf("check_checkpoint: checkpoint failed\n");
+    goto done;
+  }
+  rec = wg_create_record(db, 1);
+  if(!rec || wg_set_field(db, rec, 0, wg_encode_int(db, next++))) {
+    if(p) printf("check_checkpoint: failed to add rows\n");
+    goto done;
+  }
+
+  /* These are only in the journal */
+  if(add_checkpoint_rows(db, 4, &next)) {
+    if(p) printf("check_checkpoint: failed to add rows\n");
+    goto done;
+  }
+  if(wg_journal_checkpoint(db, journal_fn) != 3) {
+    if(p) printf("check_checkpoint: unexpected checkpoint was taken\n");
+    goto done;
+  }
+
+  clonedb = wg_attach_local_database(800000);
+  if(!clonedb) {
+    if(p) printf("check_checkpoint: failed to create a second database\n");
+    goto done;
+  }
+  dbmemsegh(clonedb)->key = dbh->key;
+  if(wg_restore_checkpoint(clonedb)) {
+    if(p) printf("check_checkpoint: recovery failed\n");
+  } else if(check_db_rows(clonedb, next - 1, p) ||\
+    sum_checkpoint_rows(clonedb) != sum_checkpoint_rows(db)) {
+    if(p) printf("check_checkpoint: recovered database differs\n");
+  } else {
+    err = 0;
+  }
+  wg_delete_local_database(clonedb);
+
+done:
+  wg_stop_logging(db);
+  wg_log_remove_backups(db);
+  remove(journal_fn);
+  remove(chk_fn);
+  if(!err && p>1)
+    printf("********* checkpoints ok ************\n");
+  return err;
+#else
+  printf("logging disabled, skipping checks\n");
+  return 77;
+#endif
+}
+
+/* Follow the journal of a database with another one, across a
+ * journal restart, then promote the replica.
+ */
+static gint wg_check_replica(void* db, int printlevel) {
+#if defined(WG_JOURNAL_REPLICA)
+  db_memsegment_header* dbh = dbmemsegh(db);
+  char journal_fn[2][WG_JOURNAL_FN_BUFSIZE];
+  char chk_fn[2][WG_CHECKPOINT_FN_BUFSIZE];
+  void *replica, *rec;
+  int p = printlevel, next = 1, i, err = 1;
+
+  if(p>1)
+    printf("********* testing replicas ************\n");
+
+  replica = wg_attach_local_database(800000);
+  if(!replica) {
+    if(p) printf("check_replica: failed to create a second database\n");
+    return 1;
+  }
+  dbh->key = -((gint) getpid());
+  dbmemsegh(replica)->key = dbh->key - 1;
+  wg_journal_filename(db, journal_fn[0], WG_JOURNAL_FN_BUFSIZE);
+  wg_checkpoint_filename(db, chk_fn[0], WG_CHECKPOINT_FN_BUFSIZE);
+  wg_journal_filename(replica, journal_fn[1], WG_JOURNAL_FN_BUFSIZE);
+  wg_checkpoint_filename(replica, chk_fn[1], WG_CHECKPOINT_FN_BUFSIZE);
+  for(i=0; i<2; i++)
+    remove(journal_fn[i]);
+
+  /* The replica starts from the checkpoint and the journal after it */
+  if(wg_start_logging(db) || add_checkpoint_rows(db, 5, &next) ||\
+    wg_checkpoint(db) || add_checkpoint_rows(db, 3, &next)) {
+    if(p) printf("check_replica: failed to set up the primary\n");
+    goto done;
+  }
+  if(wg_replica_start(replica, dbh->key)) {
+    if(p) printf("check_replica: failed to start the replica\n");
+    goto done;
+  }
+  if(check_db_rows(replica, next - 1, p) ||\
+    sum_checkpoint_rows(replica) != sum_checkpoint_rows(db)) {
+    if(p) printf("check_replica: replica was not loaded correctly\n");
+    goto done;
+  }
+
+  /* New entries are seen as the lag until they are applied */
+  rec = wg_get_first_record(db);
+  wg_delete_record(db, rec);
+  if(add_checkpoint_rows(db, 4, &next) || wg_log_flush(db)) {
+    if(p) printf("check_replica: failed to add rows\n");
+    goto done;
+  }
+  if(wg_replica_lag(replica) <= 0) {
+    if(p) printf("check_replica: replication lag not detected\n");
+    goto done;
+  }
+  if(wg_replica_poll(replica) || wg_replica_lag(replica) != 0) {
+    if(p) printf("check_replica: failed to apply the journal\n");
+    goto done;
+  }
+  if(check_db_rows(replica, next - 2, p) ||\
+    sum_checkpoint_rows(replica) != sum_checkpoint_rows(db)) {
+    if(p) printf("check_replica: replica differs from the primary\n");
+    goto done;
+  }
+
+  /* Continue with the new journal after a checkpoint */
+  if(add_checkpoint_rows(db, 2, &next) || wg_checkpoint(db) ||\
+    add_checkpoint_rows(db, 6, &next)) {
+    if(p) printf("check_replica: failed to add rows\n");
+    goto done;
+  }
+  if(wg_replica_poll(replica) || wg_replica_lag(replica) != 0) {
+    if(p) printf("check_replica: failed to follow the new journal\n");
+    goto done;
+  }
+  if(check_db_rows(replica, next - 2, p) ||\
+    sum_checkpoint_rows(replica) != sum_checkpoint_rows(db)) {
+    if(p) printf("check_replica: replica differs after journal restart\n");
+    goto done;
+  }
+
+  /* The promoted replica has a journal of its own */
+  if(wg_replica_promote(replica)) {
+    if(p) printf("check_replica: promotion failed\n");
+    goto done;
+  }
+  if(!dbmemsegh(replica)->logging.active || wg_replica_lag(replica) != -1 ||\
+    wg_journal_checkpoint(replica, journal_fn[1]) <= 0) {
+    if(p) printf("check_replica: promoted replica is not logging\n");
+    goto done;
+  }
+  if(add_checkpoint_rows(replica, 1, &next) ||\
+    check_db_rows(replica, next - 2, p)) {
+    if(p) printf("check_replica: failed to write to the promoted replica\n");
+    goto done;
+  }
+  err = 0;
+
+done:
+  wg_stop_logging(db);
+  wg_stop_logging(replica);
+  wg_log_remove_backups(db);
+  wg_log_remove_backups(replica);
+  wg_delete_local_database(replica);
+  for(i=0; i<2; i++) {
+    remove(journal_fn[i]);
+    remove(chk_fn[i]);
+  }
+  if(!err && p>1)
+    printf("********* replicas ok ************\n");
+  return err;
+#else
+  printf("replication not supported, skipping checks\n");
+  return 77;
+#endif
+}
+
+#ifndef _WIN32
+#define SNAPSHOT_TESTFILE  "/tmp/wgdb.snaptest"
+#else
+#define SNAPSHOT_TESTFILE  "c:\\windows\\temp\\wgdb.snaptest"
+#endif
+
+/* Take snapshots of a local database, both by forking and by writing
+ * the memory without a lock (as is done for shared memory), and
+ * import them.
+ */
+static gint wg_check_snapshot(void* db, int printlevel) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  char fn[100];
+  void *clonedb;
+  gint minsize, maxsize;
+  int p = printlevel, next = 1, i, pid;
+
+  if(p>1)
+    printf("********* testing snapshots ************\n");
+
+#ifndef _WIN32
+  pid = getpid();
+#else
+  pid = _getpid();
+#endif
+  snprintf(fn, 99, "%s.%d", SNAPSHOT_TESTFILE, pid);
+  fn[99] = '\0';
+
+  clonedb = wg_attach_local_database(800000);
+  if(!clonedb) {
+    if(p) printf("check_snapshot: failed to create a second database\n");
+    return 1;
+  }
+
+  for(i=0; i<2; i++) {
+    if(add_checkpoint_rows(db, 10, &next)) {
+      if(p) printf("check_snapshot: failed to add rows\n");
+      break;
+    }
+    /* a non-zero key makes the database look like shared memory */
+    dbh->key = (i ? 1 : 0);
+    if(wg_snapshot(db, fn)) {
+      if(p) printf("check_snapshot: snapshot %d failed\n", i);
+      break;
+    }
+    dbh->key = 0;
+    if(add_checkpoint_rows(db, 1, &next)) {
+      if(p) printf("check_snapshot: failed to add rows\n");
+      break;
+    }
+    if(wg_check_dump(clonedb, fn, &minsize, &maxsize) ||\
+      wg_import_dump(clonedb, fn)) {
+      if(p) printf("check_snapshot: snapshot %d could not be imported\n", i);
+      break;
+    }
+    dbmemsegh(clonedb)->key = 0;
+    /* the row added after the snapshot must not be included */
+    if(check_db_rows(clonedb, next - 2, p) ||\
+      sum_checkpoint_rows(clonedb) != sum_checkpoint_rows(db) - (next - 1)) {
+      if(p) printf("check_snapshot: snapshot %d has wrong contents\n", i);
+      break;
+    }
+  }
+  dbh->key = 0;
+  wg_delete_local_database(clonedb);
+  remove(fn);
+  if(i < 2)
+    return 1;
+
+  if(p>1)
+    printf("********* snapshots ok ************\n");
+  return 0;
+}
+
+/* Dump a database, then two deltas on top of it and import them */
+static gint wg_check_delta_dump(void* db, int printlevel) {
+  char fn[3][100];
+  char *deltas[2];
+  void *clonedb, *rec;
+  wg_delta_header hdr;
+  FILE *f;
+  int p = printlevel, next = 1, i, pid, err = 1;
+
+  if(p>1)
+    printf("********* testing delta dumps ************\n");
+
+#ifndef _WIN32
+  pid = getpid();
+#else
+  pid = _getpid();
+#endif
+  for(i=0; i<3; i++) {
+    snprintf(fn[i], 99, "%s.%d.%d", SNAPSHOT_TESTFILE, pid, i);
+    fn[i][99] = '\0';
+  }
+  deltas[0] = fn[1];
+  deltas[1] = fn[2];
+
+  clonedb = wg_attach_local_database(800000);
+  if(!clonedb) {
+    if(p) printf("check_delta_dump: failed to create a second database\n");
+    return 1;
+  }
+
+  if(add_checkpoint_rows(db, 500, &next) || wg_dump(db, fn[0])) {
+    if(p) printf("check_delta_dump: failed to create the dump\n");
+    goto done;
+  }
+  rec = wg_get_first_record(db);
+  wg_set_field(db, rec, 0, wg_encode_int(db, -1000));
+  if(add_checkpoint_rows(db, 5, &next) || wg_dump_delta(db, fn[0], fn[1])) {
+    if(p) printf("check_delta_dump: failed to create the first delta\n");
+    goto done;
+  }
+  if(add_checkpoint_rows(db, 3, &next) || wg_dump_delta(db, fn[1], fn[2])) {
+    if(p) printf("check_delta_dump: failed to create the second delta\n");
+    goto done;
+  }
+
+  /* only a few pages should have changed */
+#ifdef _WIN32
+  if(fopen_s(&f, fn[2], "rb")) {
+#else
+  if(!(f = fopen(fn[2], "rb"))) {
+#endif
+    if(p) printf("check_delta_dump: failed to open the delta file\n");
+    goto done;
+  }
+  i = (int) fread(&hdr, sizeof(wg_delta_header), 1, f);
+  fclose(f);
+  if(i != 1 || hdr.changed < 1 || hdr.changed >= hdr.pages) {
+    if(p) printf("check_delta_dump: unexpected number of changed pages\n");
+    goto done;
+  }
+
+  /* the deltas need to be applied in order */
+  if(wg_import_dump_deltas(clonedb, fn[0], &deltas[1], 1) != -1) {
+    if(p) printf("check_delta_dump: delta applied to wrong image\n");
+    goto done;
+  }
+  if(wg_import_dump_deltas(clonedb, fn[0], deltas, 2)) {
+    if(p) printf("check_delta_dump: failed to import the deltas\n");
+    goto done;
+  }
+  if(check_db_rows(clonedb, next - 1, p) ||\
+    sum_checkpoint_rows(clonedb) != sum_checkpoint_rows(db)) {
+    if(p) printf("check_delta_dump: imported database differs\n");
+    goto done;
+  }
+  err = 0;
+
+done:
+  wg_delete_local_database(clonedb);
+  for(i=0; i<3; i++)
+    remove(fn[i]);
+  if(!err && p>1)
+    printf("********* delta dumps ok ************\n");
+  return err;
+}
+
+/* Write the database in the chunked formats, then verify and import it */
+static gint wg_check_chunked_dump(void* db, int printlevel) {
+  char fn[2][100];
+  char *deltas[1];
+  void *clonedb;
+  gint minsize, maxsize;
+  long len[3];
+  FILE *f;
+  int p = printlevel, next = 1, i, pid, err = 1;
+
+  if(p>1)
+    printf("********* testing chunked dumps ************\n");
+
+#ifndef _WIN32
+  pid = getpid();
+#else
+  pid = _getpid();
+#endif
+  for(i=0; i<2; i++) {
+    snprintf(fn[i], 99, "%s.%d.%d", SNAPSHOT_TESTFILE, pid, i);
+    fn[i][99] = '\0';
+  }
+  deltas[0] = fn[1];
+
+  clonedb = wg_attach_local_database(4000000);
+  if(!clonedb) {
+    if(p) printf("check_chunked_dump: failed to create a second database\n");
+    return 1;
+  }
+  /* spans several chunks */
+  if(add_checkpoint_rows(db, 40000, &next)) {
+    if(p) printf("check_chunked_dump: failed to add rows\n");
+    goto done;
+  }
+
+  for(i=WG_DUMP_FORMAT_RAW; i<=WG_DUMP_FORMAT_LZ; i++) {
+    if(wg_dump_format(db, i, 2) || wg_dump(db, fn[0])) {
+      if(p) printf("check_chunked_dump: dump in format %d failed\n", i);
+      goto done;
+    }
+#ifdef _WIN32
+    if(fopen_s(&f, fn[0], "rb")) {
+#else
+    if(!(f = fopen(fn[0], "rb"))) {
+#endif
+      if(p) printf("check_chunked_dump: failed to open the dump\n");
+      goto done;
+    }
+    fseek(f, 0, SEEK_END);
+    len[i] = ftell(f);
+    fclose(f);
+    if(wg_check_dump(clonedb, fn[0], &minsize, &maxsize) ||\
+      wg_import_dump(clonedb, fn[0])) {
+      if(p) printf("check_chunked_dump: failed to import format %d\n", i);
+      goto done;
+    }
+    if(check_db_rows(clonedb, next - 1, p) ||\
+      sum_checkpoint_rows(clonedb) != sum_checkpoint_rows(db)) {
+      if(p) printf("check_chunked_dump: format %d imported wrong data\n", i);
+      goto done;
+    }
+  }
+  if(len[WG_DUMP_FORMAT_LZ] >= len[WG_DUMP_FORMAT_RAW] / 2) {
+    if(p) printf("check_chunked_dump: dump was not compressed\n");
+    goto done;
+  }
+
+  /* deltas can be based on the compressed dump */
+  if(add_checkpoint_rows(db, 10, &next) || wg_dump_delta(db, fn[0], fn[1]) ||\
+    wg_import_dump_deltas(clonedb, fn[0], deltas, 1) ||\
+    check_db_rows(clonedb, next - 1, p)) {
+    if(p) printf("check_chunked_dump: delta of compressed dump failed\n");
+    goto done;
+  }
+
+  /* corrupt a chunk */
+#ifdef _WIN32
+  if(fopen_s(&f, fn[0], "r+b")) {
+#else
+  if(!(f = fopen(fn[0], "r+b"))) {
+#endif
+    if(p) printf("check_chunked_dump: failed to open the dump\n");
+    goto done;
+  }
+  fseek(f, -10, SEEK_END);
+  i = fgetc(f);
+  fseek(f, -10, SEEK_END);
+  fputc(i ^ 0x55, f);
+  fclose(f);
+  if(wg_check_dump(clonedb, fn[0], &minsize, &maxsize) != -3) {
+    if(p) printf("check_chunked_dump: corrupt dump was not detected\n");
+    goto done;
+  }
+  err = 0;
+
+done:
+  wg_dump_format(db, WG_DUMP_FORMAT_RAW, 0);
+  wg_delete_local_database(clonedb);
+  for(i=0; i<2; i++)
+    remove(fn[i]);
+  if(!err && p>1)
+    printf("********* chunked dumps ok ************\n");
+  return err;
+}
+
+/* Use a dump file as a database, with private and shared mappings */
+static gint wg_check_mapped_dump(void* db, int printlevel) {
+  char fn[100];
+  void *mapdb;
+  gint minsize, maxsize, sum;
+  int p = printlevel, next = 1, more, pid, err = 1;
+
+  if(p>1)
+    printf("********* testing mapped dumps ************\n");
+
+#ifndef _WIN32
+  pid = getpid();
+#else
+  pid = _getpid();
+#endif
+  snprintf(fn, 99, "%s.%d.map", SNAPSHOT_TESTFILE, pid);
+  fn[99] = '\0';
+
+  if(add_checkpoint_rows(db, 1000, &next) || wg_dump(db, fn)) {
+    if(p) printf("check_mapped_dump: failed to create the dump\n");
+    goto done;
+  }
+  sum = sum_checkpoint_rows(db);
+
+  /* changes to a private mapping are not written to the file */
+  mapdb = wg_attach_mapped_dump(fn, 0, WG_DUMP_MAP_PRIVATE);
+  if(!mapdb) {
+    if(p) printf("check_mapped_dump: failed to map the dump\n");
+    goto done;
+  }
+  more = next;
+  if(check_db_rows(mapdb, next - 1, p) || sum_checkpoint_rows(mapdb) != sum) {
+    if(p) printf("check_mapped_dump: mapped database differs\n");
+    wg_delete_local_database(mapdb);
+    goto done;
+  }
+  if(add_checkpoint_rows(mapdb, 100, &more) ||\
+    check_db_rows(mapdb, more - 1, p)) {
+    if(p) printf("check_mapped_dump: failed to modify the mapped database\n");
+    wg_delete_local_database(mapdb);
+    goto done;
+  }
+  wg_delete_local_database(mapdb);
+  if(wg_check_dump(db, fn, &minsize, &maxsize)) {
+    if(p) printf("check_mapped_dump: private mapping changed the dump\n");
+    goto done;
+  }
+
+#ifndef _WIN32
+  /* a shared mapping updates the file, which is a valid dump again
+   * when the database is released */
+  mapdb = wg_attach_mapped_dump(fn, 2*maxsize, WG_DUMP_MAP_SHARED);
+  if(!mapdb) {
+    if(p) printf("check_mapped_dump: failed to map the dump\n");
+    goto done;
+  }
+  if(add_checkpoint_rows(mapdb, 100, &next)) {
+    if(p) printf("check_mapped_dump: failed to modify the mapped database\n");
+    wg_delete_local_database(mapdb);
+    goto done;
+  }
+  sum = sum_checkpoint_rows(mapdb);
+  wg_delete_local_database(mapdb);
+  if(wg_check_dump(db, fn, &minsize, &maxsize) ||\
+    maxsize != 2*dbmemsegh(db)->size) {
+    if(p) printf("check_mapped_dump: shared mapping left an invalid dump\n");
+    goto done;
+  }
+  mapdb = wg_attach_mapped_dump(fn, 0, WG_DUMP_MAP_PRIVATE);
+  if(!mapdb || check_db_rows(mapdb, next - 1, p) ||\
+    sum_checkpoint_rows(mapdb) != sum) {
+    if(p) printf("check_mapped_dump: changes were not written to the dump\n");
+    if(mapdb) wg_delete_local_database(mapdb);
+    goto done;
+  }
+  wg_delete_local_database(mapdb);
+#endif
+
+  /* compressed dumps need to be imported */
+  if(wg_dump_format(db, WG_DUMP_FORMAT_LZ, 1) || wg_dump(db, fn)) {
+    if(p) printf("check_mapped_dump: failed to create the dump\n");
+    goto done;
+  }
+  if(p>1)
+    printf("check_mapped_dump: mapping a compressed dump, expect an error\n");
+  mapdb = wg_attach_mapped_dump(fn, 0, WG_DUMP_MAP_PRIVATE);
+  if(mapdb) {
+    if(p) printf("check_mapped_dump: compressed dump was mapped\n");
+    wg_delete_local_database(mapdb);
+    goto done;
+  }
+  err = 0;
+
+done:
+  wg_dump_format(db, WG_DUMP_FORMAT_RAW, 0);
+  remove(fn);
+  if(!err && p>1)
+    printf("********* mapped dumps ok ************\n");
+  return err;
+}
+
 /* ------------------ bulk testdata generation ---------------- */
 
 /* Asc/desc/mix integer data functions originally written by Enar Reilent.
@@ -5213,7 +7094,8 @@ void wg_debug_print_value(void *db, gint data) {
         }
         */
       } else {
-        snprintf(buf, buflen, "shortstr: len %d str \"%s\"",
+        snprintf(buf, buflen, "%s: len %d str \"%s\"",
+          (istinystr(enc) ? "tinystr" : "shortstr"),
           (int) wg_decode_str_len(db,enc),
           wg_decode_str(db,enc));
       }
@@ -9,14 +9,15 @@ if [ config-gcc.h -nt config.h ]; then
   echo "Warning: config.h is older than config-gcc.h, consider updating it"
 fi
 gcc  -O2 -Wall -march=pentium4 -o Main/wgdb Main/wgdb.c Db/dbmem.c \
-  Db/dballoc.c Db/dbdata.c Db/dblock.c Db/dbindex.c Db/dbdump.c  \
-  Db/dblog.c Db/dbhash.c Db/dbcompare.c Db/dbquery.c Db/dbutil.c Db/dbmpool.c \
-  Db/dbjson.c Db/dbschema.c json/yajl_all.c -lm
+  Db/dballoc.c Db/dbdata.c Db/dblock.c Db/dbindex.c Db/dbdump.c Db/dbcompress.c \
+  Db/dbcdc.c Db/dblog.c Db/dbhash.c Db/dbcompare.c Db/dbquery.c Db/dbutil.c \
+  Db/dbmpool.c Db/dbjson.c Db/dbschema.c json/yajl_all.c -lm -lpthread
 gcc  -O2 -Wall -march=pentium4 -o Main/indextool  Main/indextool.c Db/dbmem.c \
-  Db/dballoc.c Db/dbdata.c Db/dblock.c Db/dbindex.c Db/dblog.c \
+  Db/dballoc.c Db/dbdata.c Db/dblock.c Db/dbindex.c Db/dbdump.c Db/dbcompress.c \
+  Db/dbcdc.c Db/dblog.c \
   Db/dbhash.c Db/dbcompare.c Db/dbquery.c Db/dbutil.c Db/dbmpool.c \
-  Db/dbjson.c Db/dbschema.c json/yajl_all.c -lm
+  Db/dbjson.c Db/dbschema.c json/yajl_all.c -lm -lpthread
 gcc  -O2 -Wall -march=pentium4 -o Main/selftest Main/selftest.c Db/dbmem.c \
-  Db/dballoc.c Db/dbdata.c Db/dblock.c Db/dbindex.c Test/dbtest.c Db/dbdump.c \
-  Db/dblog.c Db/dbhash.c Db/dbcompare.c Db/dbquery.c Db/dbutil.c Db/dbmpool.c \
-  Db/dbjson.c Db/dbschema.c json/yajl_all.c -lm
+  Db/dballoc.c Db/dbdata.c Db/dblock.c Db/dbindex.c Test/dbtest.c Db/dbdump.c Db/dbcompress.c \
+  Db/dbcdc.c Db/dblog.c Db/dbhash.c Db/dbcompare.c Db/dbquery.c Db/dbutil.c \
+  Db/dbmpool.c Db/dbjson.c Db/dbschema.c json/yajl_all.c -lm -lpthread
@@ -63,6 +63,9 @@
 /* Use chained T-tree index nodes */
 #define TTREE_CHAINED_NODES 1
 
+/* Use key prefixes in T-tree nodes */
+#define TTREE_KEY_PREFIX 1
+
 /* Use single-compare T-tree mode */
 #define TTREE_SINGLE_COMPARE 1
 
@@ -91,4 +94,4 @@
 #define VERSION_MINOR 7
 
 /* Package revision number */
-#define VERSION_REV 0
+#define VERSION_REV 1